@@ -3,7 +3,7 @@
 
 /*
  * ============================================================================
- * WinRM Remote Batch Executor for Linux (C言語版 - 標準ライブラリのみ)
+ * WinRM Remote Batch Executor for Linux (C言語版 - 外部ライブラリ不要)
  * ============================================================================
  *
  * 【概要】
@@ -11,12 +11,12 @@
  * プロトコルを使用してリモート接続し、バッチファイルを実行するツールです。
  *
  * 【特徴】
- * - 標準ライブラリのみ使用（外部ライブラリ不要）
+ * - 外部ライブラリ不要（libc・Linuxのシステムコール・GCC付属のヘッダーのみ使用）
  * - NTLM v2認証を自前実装（MD4, MD5, HMAC-MD5を含む）
  * - IT制限環境でも動作可能（pip/yum等のパッケージ管理不要）
  * - Windows側の設定変更不要（デフォルトのNTLM認証を使用）
  *
- * 【なぜ標準ライブラリのみで実装するのか】
+ * 【なぜ外部ライブラリを使わずに実装するのか】
  * 企業のIT制限環境では、外部ライブラリのインストールが禁止されていることが多い。
  * このプログラムは、そのような環境でも確実に動作するよう設計されている。
  *
@@ -63,23 +63,40 @@
 
 /* ============================================================================
  * インクルードファイル
- * すべて標準ライブラリのみを使用（外部依存なし）
+ * libc・POSIX/Linux API（mlock・Unixドメインソケット・getrandomのシステムコール等）と
+ * GCC付属の immintrin.h のみを使用（外部ライブラリなし）
  * ============================================================================ */
 
 #include <stdio.h>      /* 標準入出力: printf, fprintf, fopen等 */
 #include <stdlib.h>     /* 標準ユーティリティ: malloc, free, getenv, atoi等 */
 #include <string.h>     /* 文字列操作: strcpy, strcat, strlen, memcpy等 */
+#include <strings.h>    /* 大文字小文字を区別しない比較: strncasecmp */
+#include <ctype.h>      /* 文字種判定: isxdigit（リモートで計算したハッシュ値） */
 #include <stdbool.h>    /* ブール型: true, false */
 #include <stdint.h>     /* 固定幅整数型: uint8_t, uint16_t, uint32_t, uint64_t */
 #include <time.h>       /* 時間関連: time, srand */
-#include <unistd.h>     /* POSIX API: close, usleep, read, write */
+#include <unistd.h>     /* POSIX API: close, read, write */
 #include <sys/socket.h> /* ソケットAPI: socket, connect, send, recv */
 #include <sys/time.h>   /* 時間構造体: gettimeofday, timeval */
 #include <netinet/in.h> /* インターネットアドレス: sockaddr_in, htons */
+#include <netinet/tcp.h> /* TCPオプション: TCP_NODELAY */
 #include <netdb.h>      /* ネットワークデータベース: gethostbyname, hostent */
 #include <errno.h>      /* エラー番号: errno */
 #include <fcntl.h>      /* ファイル制御: open, O_RDONLY等 */
 #include <signal.h>     /* シグナル処理: signal, SIGPIPE */
+#include <poll.h>       /* I/O多重化: poll（プール接続の健全性チェック） */
+#include <sys/epoll.h>  /* I/O多重化: epoll（ファンアウト実行のイベントループ） */
+#include <sys/resource.h> /* リソース制限: setrlimit（同時接続数に応じたFD上限） */
+#include <sys/stat.h>   /* ディレクトリ作成: mkdir（認証方式キャッシュ） */
+#include <sys/mman.h>   /* メモリロック: mmap, mlock（資格情報の保護） */
+#include <sys/un.h>     /* Unixドメインソケット: sockaddr_un（常駐モード） */
+#include <sys/wait.h>   /* 子プロセス回収: waitpid（常駐モードのジョブ・標準入力の転送） */
+#include <sys/uio.h>    /* 分散I/O: struct iovec（SOAPテンプレートの断片） */
+#include <sys/syscall.h> /* システムコール番号: SYS_getrandom（MessageID・CommandIdのUUID生成） */
+#if defined(__x86_64__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#include <immintrin.h>  /* SIMD組み込み関数: SSE4.1 / AVX2（Base64変換。実行時にCPUを判定） */
+#endif
 
 /* ============================================================================
  * 設定セクション（ユーザー編集エリア）
@@ -119,11 +136,94 @@ static const char *ENVIRONMENTS[] = {"TST1T", "TST2T", NULL};
  * バッチ処理が長時間かかる場合は増やしてください */
 #define TIMEOUT 300
 
+/* --- 出力取得のロングポーリング時間 ---
+ * Receiveリクエスト1回あたり、サーバーが出力を待って保持する最大秒数
+ * （WS-Man OperationTimeout）。出力が出ればすぐに応答が返り、
+ * 出なければこの秒数後に w:TimedOut が返ってクライアントは即座に再送する */
+#define RECEIVE_TIMEOUT 20
+
 /* --- デバッグモード ---
  * 1: 送受信するSOAP XMLを表示（トラブルシューティング用）
  * 0: 通常モード（本番運用時はこちら） */
 #define DEBUG 0
 
+/* --- コネクションプール設定 ---
+ * 認証済みkeep-alive接続を (ホスト, ポート, ユーザー, ドメイン) ごとにプールし、
+ * 連続するリクエストで使い回す。環境変数 WINRM_POOL_MAX_PER_HOST /
+ * WINRM_POOL_IDLE_TIMEOUT で上書き可能 */
+#define POOL_MAX_PER_HOST 4     /* 同一ホスト・ユーザーあたりの最大接続数 */
+#define POOL_IDLE_TIMEOUT 60    /* 未使用の接続を閉じるまでの秒数（1以上） */
+
+/* --- ファンアウト実行設定 ---
+ * --hosts / --hosts-file で複数ホストを指定した場合の同時実行数。
+ * 環境変数 WINRM_PARALLEL または --parallel N で上書き可能 */
+#define FANOUT_PARALLEL 10
+
+/* --- 出力の保持設定 ---
+ * コマンド出力（stdout/stderrそれぞれ）をメモリに保持する上限（バイト）。
+ * 超えた分は一時ファイル（$TMPDIR、未設定時は /tmp）へ退避するため、
+ * 出力サイズ自体に上限はない。環境変数 WINRM_OUTPUT_MEMORY_LIMIT で上書き可能 */
+#define OUTPUT_MEMORY_LIMIT (8 * 1024 * 1024)
+
+/* --- 認証方式キャッシュ設定 ---
+ * ホストごとに成功した認証方式（直接NTLM / Negotiate）を記録し、
+ * 次回から最初にその方式で接続する（失敗時の再接続を省く）。
+ * 1: $XDG_CACHE_HOME/winrm_exec/auth_mechs にも保存して次回起動時に使用
+ * 0: プロセス内（メモリ上）のみ。環境変数 WINRM_AUTH_CACHE=0/1 で上書き可能 */
+#define AUTH_CACHE_ENABLED 1
+#define AUTH_CACHE_TTL (7 * 24 * 3600)   /* 記録の有効期間（秒） */
+
+/* --- スクリプト実行設定 ---
+ * --script で複数のコマンドを1つのシェルで順に実行する際、コマンドが失敗
+ * （終了コード0以外）した時点で残りを実行せずに中断するか。
+ * 1: 中断、0: 最後まで実行。環境変数 WINRM_STOP_ON_ERROR または --stop-on-error で上書き可能 */
+#define SCRIPT_STOP_ON_ERROR 0
+
+/* --script の各行を1回のCommand（1つのcmd.exe）にまとめて実行するか。
+ * 短いコマンドが多い場合、コマンドごとの Command/Receive の往復を省ける。
+ * 1: まとめる、0: 1行ずつ実行。環境変数 WINRM_SCRIPT_BUNDLE または --bundle で上書き可能 */
+#define SCRIPT_BUNDLE 0
+#define BUNDLE_MAX_LENGTH 8000       /* 1回にまとめるコマンドラインの最大長（cmd.exeの上限 8191文字以内） */
+
+/* --- 常駐モード設定（--daemon） ---
+ * 認証済み接続とシェルを事前に作成して保持し、ローカルのUnixドメインソケット経由で
+ * 受け付けたジョブをそのシェルで実行する。ジョブあたりの待ち時間はほぼCommand 1往復になる。
+ * 環境変数 WINRM_DAEMON_SHELLS / WINRM_DAEMON_KEEPALIVE / WINRM_DAEMON_SHELL_MAX_AGE /
+ * WINRM_DAEMON_SOCKET で上書き可能 */
+#define DAEMON_WARM_SHELLS 2         /* 事前に作成しておくシェル数 */
+#define DAEMON_KEEPALIVE 30          /* 未使用のシェル・接続の生存確認間隔（秒） */
+#define DAEMON_SHELL_MAX_AGE 1800    /* シェルを作り直すまでの秒数（サーバーのIdleTimeout 2時間より短く） */
+#define DAEMON_SOCKET ""             /* 待ち受けソケット（空: $XDG_RUNTIME_DIR または /tmp に自動決定） */
+
+/* --- 常駐モードの事前作成・削除 ---
+ * ジョブの到着時刻を記録し、過去の同じ時刻（毎時・毎日）に到着があれば、その少し前に
+ * シェルを作成しておく。ジョブが来ない間は待機シェルを削除し、サーバーの
+ * MaxShellsPerUser を消費しない。環境変数 WINRM_DAEMON_IDLE_TIMEOUT /
+ * WINRM_DAEMON_PREWARM_LEAD で上書き可能 */
+#define DAEMON_IDLE_TIMEOUT 600      /* 最後のジョブからシェルを削除するまでの秒数（0: 常に保持） */
+#define DAEMON_PREWARM_LEAD 300      /* 到着が見込まれる時刻の何秒前からシェルを用意するか */
+
+/* --- 標準入力の転送設定（--stdin） ---
+ * 1回のSendで送るデータの最大バイト数。Base64で4/3倍になっても、エンベロープ全体が
+ * MaxEnvelopeSize（153600バイト。サーバー側の既定の受信上限 150KB）に収まる大きさにする。
+ * 応答を待たずに送るSendの数は PIPELINE_MAX_DEPTH まで */
+#define SEND_CHUNK_SIZE (96 * 1024)
+
+/* --- ファイル転送設定（--upload） ---
+ * 1つのファイルを何パートに分けて並列に送るか（パートごとに別の接続・シェルを使う）。
+ * 各パートは UPLOAD_MIN_PART バイト以上になるように、小さいファイルでは減らす。
+ * 環境変数 WINRM_UPLOAD_PARALLEL または --upload-parallel N で上書き可能 */
+#define UPLOAD_PARALLEL 1
+#define UPLOAD_MAX_PARALLEL 16
+#define UPLOAD_MIN_PART (16 * 1024 * 1024)
+
+/* --- ファイル転送設定（--download） ---
+ * 受信した内容はこのサイズまでまとめてからローカルのファイルへ書き込む（小さな書き込みを
+ * Receiveの応答ごとに繰り返さない）。出力が途絶えてから DOWNLOAD_IDLE_TIMEOUT 秒で中断する
+ * （TIMEOUT と違い、転送全体の時間は制限しない） */
+#define DOWNLOAD_WRITE_SIZE (1024 * 1024)
+#define DOWNLOAD_IDLE_TIMEOUT 300
+
 /* ============================================================================ */
 
 /* ============================================================================
@@ -146,6 +246,12 @@ static const char *ENVIRONMENTS[] = {"TST1T", "TST2T", NULL};
 #define MAX_URL_SIZE 512        /* URL文字列用バッファ */
 #define MAX_UUID_SIZE 64        /* UUID文字列用バッファ */
 #define MAX_ENVELOPE_SIZE 8192  /* SOAP XMLエンベロープ用バッファ（8KB） */
+#define MAX_COMMAND_SIZE 8192   /* 1コマンドラインの最大長（cmd.exeの上限 8191文字 + NUL） */
+#define MAX_PATH_SIZE 1024      /* ファイル転送のパス用バッファ */
+#define POOL_MAX_CONNS 64       /* プール全体で保持できる接続数の上限 */
+#define WHEEL_SLOTS 512         /* タイマーホイールのスロット数 */
+#define WHEEL_TICK_MS 100       /* タイマーホイールの1ティック（ミリ秒） */
+#define ENGINE_MAX_EVENTS 256   /* epoll_wait 1回で処理するイベント数 */
 
 /* ============================================================================
  * NTLM認証プロトコル定数
@@ -216,6 +322,25 @@ static char g_domain[256];      /* ドメイン名（ローカル認証時は空
 static int g_port;              /* WinRMポート番号 */
 static char g_batch_path[512];  /* 実行するバッチファイルのパス */
 static char g_env_folder[64];   /* 選択された環境フォルダ名 */
+static int g_pool_max_per_host; /* ホストごとの最大プール接続数 */
+static int g_pool_idle_timeout; /* プール接続のアイドルタイムアウト（秒） */
+static int g_parallel;          /* ファンアウト実行の同時実行数 */
+static bool g_stream;           /* 出力を受信しだい書き出すか（--stream） */
+static int g_stream_fd[2];      /* ストリーミング出力先（[0]: stdout, [1]: stderr） */
+static size_t g_output_memory_limit; /* 出力をメモリに保持する上限（バイト） */
+static bool g_auth_cache_enabled;    /* 認証方式キャッシュをファイルに保存するか */
+static bool g_stop_on_error;         /* スクリプト実行で最初の失敗時に中断するか */
+static bool g_script_bundle;         /* スクリプトの各行を1回のCommandにまとめるか（--bundle） */
+static int g_daemon_shells;          /* 常駐モードで事前に作成しておくシェル数 */
+static int g_daemon_keepalive;       /* 常駐モードの生存確認間隔（秒） */
+static int g_daemon_shell_max_age;   /* 常駐モードでシェルを作り直すまでの秒数 */
+static char g_daemon_socket[108];    /* 常駐モードの待ち受けソケット（空: 自動決定） */
+static int g_daemon_idle_timeout;    /* 常駐モードで待機シェルを削除するまでの秒数 */
+static int g_daemon_prewarm_lead;    /* 常駐モードで到着見込みの何秒前にシェルを用意するか */
+static bool g_use_daemon;            /* 常駐プロセス経由で実行するか（--use-daemon） */
+static int g_job_fd = -1;            /* 常駐モードのジョブ: 出力の転送先（クライアント接続） */
+static int g_stdin_fd = -1;          /* リモートコマンドの標準入力へ転送する入力（--stdin、-1: なし） */
+static int g_upload_parallel;        /* ファイル転送で並列に送るパート数の上限 */
 
 /* ============================================================================
  * ログ出力関数
@@ -244,6 +369,65 @@ static void log_error(const char *msg) {
     fprintf(stderr, "%s[ERROR]%s %s\n", COLOR_RED, COLOR_RESET, msg);
 }
 
+/* ============================================================================
+ * 伸長可能バッファ
+ * ============================================================================
+ * HTTPレスポンスやコマンド出力のように、事前にサイズが分からないデータを保持する。
+ * data は常にNUL終端される（文字列関数でそのまま検索できる）。
+ * ============================================================================ */
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} buf_t;
+
+/* buf_reserve - 末尾にextraバイト（+NUL）を書き込める容量を確保 */
+static bool buf_reserve(buf_t *b, size_t extra) {
+    if (b->len + extra + 1 <= b->cap) return true;
+    size_t cap = b->cap ? b->cap : 1024;
+    while (cap < b->len + extra + 1) cap *= 2;
+    char *p = realloc(b->data, cap);
+    if (!p) return false;
+    b->data = p;
+    b->cap = cap;
+    return true;
+}
+
+/* buf_append - データを末尾に追加 */
+static bool buf_append(buf_t *b, const void *data, size_t len) {
+    if (!buf_reserve(b, len)) return false;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+    return true;
+}
+
+/* buf_clear - 内容を空にする（確保済みの領域は再利用する） */
+static void buf_clear(buf_t *b) {
+    b->len = 0;
+    if (b->data) b->data[0] = '\0';
+}
+
+/* buf_consume - 先頭からnバイトを取り除く */
+static void buf_consume(buf_t *b, size_t n) {
+    if (n >= b->len) {
+        buf_clear(b);
+        return;
+    }
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+    b->data[b->len] = '\0';
+}
+
+/* buf_free - バッファを解放 */
+static void buf_free(buf_t *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
 /* ============================================================================
  * MD4ハッシュアルゴリズム実装
  * ============================================================================
@@ -289,104 +473,164 @@ static uint32_t md4_rotate_left(uint32_t x, int n) {
 }
 
 /*
- * md4_hash - MD4ハッシュを計算
+ * md_ctx_t - MD4/MD5共通のハッシュコンテキスト
+ *
+ * データを任意の断片に分けて *_update() に渡せるため、署名対象の
+ * シーケンス番号とメッセージのように離れた場所にあるデータを
+ * 連結用のバッファへコピーせずにハッシュできる。ヒープは使用しない。
+ */
+typedef struct {
+    uint32_t state[4];   /* A, B, C, D */
+    uint64_t count;      /* これまでに渡されたバイト数 */
+    uint8_t block[64];   /* 64バイトに満たない未処理の端数 */
+} md_ctx_t;
+
+typedef void (*md_transform_fn)(uint32_t state[4], const uint8_t block[64]);
+
+/* md_init - 初期値を設定（MD4とMD5で共通） */
+static void md_init(md_ctx_t *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+
+/* md_update - データを追加（64バイトそろうごとにブロック変換） */
+static void md_update(md_ctx_t *ctx, const void *data, size_t len, md_transform_fn transform) {
+    const uint8_t *p = data;
+    size_t used = ctx->count % 64;
+    ctx->count += len;
+
+    if (used > 0) {
+        size_t fill = 64 - used;
+        if (len < fill) {
+            memcpy(ctx->block + used, p, len);
+            return;
+        }
+        memcpy(ctx->block + used, p, fill);
+        transform(ctx->state, ctx->block);
+        p += fill;
+        len -= fill;
+    }
+
+    /* 入力バッファ上のブロックはコピーせずに直接変換する */
+    for (; len >= 64; p += 64, len -= 64) {
+        transform(ctx->state, p);
+    }
+    memcpy(ctx->block, p, len);
+}
+
+/*
+ * md_final - パディングを追加してハッシュ値を出力
+ *
+ * パディング: 0x80 + 0x00... + ビット長（64ビットリトルエンディアン）で
+ * 全体を64バイトの倍数にする。
+ */
+static void md_final(md_ctx_t *ctx, uint8_t *output, md_transform_fn transform) {
+    uint64_t bits_len = ctx->count * 8;
+    size_t used = ctx->count % 64;
+    uint8_t pad[72] = {0x80};
+    size_t pad_len = (used < 56 ? 56 : 120) - used;
+
+    memcpy(pad + pad_len, &bits_len, 8);
+    md_update(ctx, pad, pad_len + 8, transform);
+    memcpy(output, ctx->state, 16);
+}
+
+/*
+ * md4_transform - 64バイトブロック1つ分の変換（3ラウンド×16ステップ）
+ */
+static void md4_transform(uint32_t state[4], const uint8_t block[64]) {
+    uint32_t M[16];
+    memcpy(M, block, 64);
+    uint32_t A = state[0], B = state[1], C = state[2], D = state[3];
+
+    /* Round 1 */
+    A = md4_rotate_left(A + md4_F(B, C, D) + M[0], 3);
+    D = md4_rotate_left(D + md4_F(A, B, C) + M[1], 7);
+    C = md4_rotate_left(C + md4_F(D, A, B) + M[2], 11);
+    B = md4_rotate_left(B + md4_F(C, D, A) + M[3], 19);
+    A = md4_rotate_left(A + md4_F(B, C, D) + M[4], 3);
+    D = md4_rotate_left(D + md4_F(A, B, C) + M[5], 7);
+    C = md4_rotate_left(C + md4_F(D, A, B) + M[6], 11);
+    B = md4_rotate_left(B + md4_F(C, D, A) + M[7], 19);
+    A = md4_rotate_left(A + md4_F(B, C, D) + M[8], 3);
+    D = md4_rotate_left(D + md4_F(A, B, C) + M[9], 7);
+    C = md4_rotate_left(C + md4_F(D, A, B) + M[10], 11);
+    B = md4_rotate_left(B + md4_F(C, D, A) + M[11], 19);
+    A = md4_rotate_left(A + md4_F(B, C, D) + M[12], 3);
+    D = md4_rotate_left(D + md4_F(A, B, C) + M[13], 7);
+    C = md4_rotate_left(C + md4_F(D, A, B) + M[14], 11);
+    B = md4_rotate_left(B + md4_F(C, D, A) + M[15], 19);
+
+    /* Round 2 */
+    A = md4_rotate_left(A + md4_G(B, C, D) + M[0] + 0x5a827999, 3);
+    D = md4_rotate_left(D + md4_G(A, B, C) + M[4] + 0x5a827999, 5);
+    C = md4_rotate_left(C + md4_G(D, A, B) + M[8] + 0x5a827999, 9);
+    B = md4_rotate_left(B + md4_G(C, D, A) + M[12] + 0x5a827999, 13);
+    A = md4_rotate_left(A + md4_G(B, C, D) + M[1] + 0x5a827999, 3);
+    D = md4_rotate_left(D + md4_G(A, B, C) + M[5] + 0x5a827999, 5);
+    C = md4_rotate_left(C + md4_G(D, A, B) + M[9] + 0x5a827999, 9);
+    B = md4_rotate_left(B + md4_G(C, D, A) + M[13] + 0x5a827999, 13);
+    A = md4_rotate_left(A + md4_G(B, C, D) + M[2] + 0x5a827999, 3);
+    D = md4_rotate_left(D + md4_G(A, B, C) + M[6] + 0x5a827999, 5);
+    C = md4_rotate_left(C + md4_G(D, A, B) + M[10] + 0x5a827999, 9);
+    B = md4_rotate_left(B + md4_G(C, D, A) + M[14] + 0x5a827999, 13);
+    A = md4_rotate_left(A + md4_G(B, C, D) + M[3] + 0x5a827999, 3);
+    D = md4_rotate_left(D + md4_G(A, B, C) + M[7] + 0x5a827999, 5);
+    C = md4_rotate_left(C + md4_G(D, A, B) + M[11] + 0x5a827999, 9);
+    B = md4_rotate_left(B + md4_G(C, D, A) + M[15] + 0x5a827999, 13);
+
+    /* Round 3 */
+    A = md4_rotate_left(A + md4_H(B, C, D) + M[0] + 0x6ed9eba1, 3);
+    D = md4_rotate_left(D + md4_H(A, B, C) + M[8] + 0x6ed9eba1, 9);
+    C = md4_rotate_left(C + md4_H(D, A, B) + M[4] + 0x6ed9eba1, 11);
+    B = md4_rotate_left(B + md4_H(C, D, A) + M[12] + 0x6ed9eba1, 15);
+    A = md4_rotate_left(A + md4_H(B, C, D) + M[2] + 0x6ed9eba1, 3);
+    D = md4_rotate_left(D + md4_H(A, B, C) + M[10] + 0x6ed9eba1, 9);
+    C = md4_rotate_left(C + md4_H(D, A, B) + M[6] + 0x6ed9eba1, 11);
+    B = md4_rotate_left(B + md4_H(C, D, A) + M[14] + 0x6ed9eba1, 15);
+    A = md4_rotate_left(A + md4_H(B, C, D) + M[1] + 0x6ed9eba1, 3);
+    D = md4_rotate_left(D + md4_H(A, B, C) + M[9] + 0x6ed9eba1, 9);
+    C = md4_rotate_left(C + md4_H(D, A, B) + M[5] + 0x6ed9eba1, 11);
+    B = md4_rotate_left(B + md4_H(C, D, A) + M[13] + 0x6ed9eba1, 15);
+    A = md4_rotate_left(A + md4_H(B, C, D) + M[3] + 0x6ed9eba1, 3);
+    D = md4_rotate_left(D + md4_H(A, B, C) + M[11] + 0x6ed9eba1, 9);
+    C = md4_rotate_left(C + md4_H(D, A, B) + M[7] + 0x6ed9eba1, 11);
+    B = md4_rotate_left(B + md4_H(C, D, A) + M[15] + 0x6ed9eba1, 15);
+
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+}
+
+/* md4_init / md4_update / md4_final - MD4のストリーミングAPI */
+static void md4_init(md_ctx_t *ctx) {
+    md_init(ctx);
+}
+
+static void md4_update(md_ctx_t *ctx, const void *data, size_t len) {
+    md_update(ctx, data, len, md4_transform);
+}
+
+static void md4_final(md_ctx_t *ctx, uint8_t *output) {
+    md_final(ctx, output, md4_transform);
+}
+
+/*
+ * md4_hash - MD4ハッシュを計算（一括）
  *
  * @input:  ハッシュ対象のデータ
  * @len:    データの長さ（バイト）
  * @output: ハッシュ値の出力先（16バイト以上必要）
- *
- * 処理の流れ:
- * 1. メッセージのパディング（512ビットの倍数に調整）
- * 2. 64バイトブロックごとに処理
- * 3. 各ブロックで3ラウンド×16ステップの変換
- * 4. 最終的な状態を出力
  */
 static void md4_hash(const uint8_t *input, size_t len, uint8_t *output) {
-    uint32_t a0 = 0x67452301;
-    uint32_t b0 = 0xefcdab89;
-    uint32_t c0 = 0x98badcfe;
-    uint32_t d0 = 0x10325476;
-
-    /* パディング */
-    size_t new_len = ((len + 8) / 64 + 1) * 64;
-    uint8_t *msg = calloc(new_len, 1);
-    memcpy(msg, input, len);
-    msg[len] = 0x80;
-
-    uint64_t bits_len = len * 8;
-    memcpy(msg + new_len - 8, &bits_len, 8);
-
-    /* 各ブロックを処理 */
-    for (size_t offset = 0; offset < new_len; offset += 64) {
-        uint32_t *M = (uint32_t *)(msg + offset);
-        uint32_t A = a0, B = b0, C = c0, D = d0;
-
-        /* Round 1 */
-        A = md4_rotate_left(A + md4_F(B, C, D) + M[0], 3);
-        D = md4_rotate_left(D + md4_F(A, B, C) + M[1], 7);
-        C = md4_rotate_left(C + md4_F(D, A, B) + M[2], 11);
-        B = md4_rotate_left(B + md4_F(C, D, A) + M[3], 19);
-        A = md4_rotate_left(A + md4_F(B, C, D) + M[4], 3);
-        D = md4_rotate_left(D + md4_F(A, B, C) + M[5], 7);
-        C = md4_rotate_left(C + md4_F(D, A, B) + M[6], 11);
-        B = md4_rotate_left(B + md4_F(C, D, A) + M[7], 19);
-        A = md4_rotate_left(A + md4_F(B, C, D) + M[8], 3);
-        D = md4_rotate_left(D + md4_F(A, B, C) + M[9], 7);
-        C = md4_rotate_left(C + md4_F(D, A, B) + M[10], 11);
-        B = md4_rotate_left(B + md4_F(C, D, A) + M[11], 19);
-        A = md4_rotate_left(A + md4_F(B, C, D) + M[12], 3);
-        D = md4_rotate_left(D + md4_F(A, B, C) + M[13], 7);
-        C = md4_rotate_left(C + md4_F(D, A, B) + M[14], 11);
-        B = md4_rotate_left(B + md4_F(C, D, A) + M[15], 19);
-
-        /* Round 2 */
-        A = md4_rotate_left(A + md4_G(B, C, D) + M[0] + 0x5a827999, 3);
-        D = md4_rotate_left(D + md4_G(A, B, C) + M[4] + 0x5a827999, 5);
-        C = md4_rotate_left(C + md4_G(D, A, B) + M[8] + 0x5a827999, 9);
-        B = md4_rotate_left(B + md4_G(C, D, A) + M[12] + 0x5a827999, 13);
-        A = md4_rotate_left(A + md4_G(B, C, D) + M[1] + 0x5a827999, 3);
-        D = md4_rotate_left(D + md4_G(A, B, C) + M[5] + 0x5a827999, 5);
-        C = md4_rotate_left(C + md4_G(D, A, B) + M[9] + 0x5a827999, 9);
-        B = md4_rotate_left(B + md4_G(C, D, A) + M[13] + 0x5a827999, 13);
-        A = md4_rotate_left(A + md4_G(B, C, D) + M[2] + 0x5a827999, 3);
-        D = md4_rotate_left(D + md4_G(A, B, C) + M[6] + 0x5a827999, 5);
-        C = md4_rotate_left(C + md4_G(D, A, B) + M[10] + 0x5a827999, 9);
-        B = md4_rotate_left(B + md4_G(C, D, A) + M[14] + 0x5a827999, 13);
-        A = md4_rotate_left(A + md4_G(B, C, D) + M[3] + 0x5a827999, 3);
-        D = md4_rotate_left(D + md4_G(A, B, C) + M[7] + 0x5a827999, 5);
-        C = md4_rotate_left(C + md4_G(D, A, B) + M[11] + 0x5a827999, 9);
-        B = md4_rotate_left(B + md4_G(C, D, A) + M[15] + 0x5a827999, 13);
-
-        /* Round 3 */
-        A = md4_rotate_left(A + md4_H(B, C, D) + M[0] + 0x6ed9eba1, 3);
-        D = md4_rotate_left(D + md4_H(A, B, C) + M[8] + 0x6ed9eba1, 9);
-        C = md4_rotate_left(C + md4_H(D, A, B) + M[4] + 0x6ed9eba1, 11);
-        B = md4_rotate_left(B + md4_H(C, D, A) + M[12] + 0x6ed9eba1, 15);
-        A = md4_rotate_left(A + md4_H(B, C, D) + M[2] + 0x6ed9eba1, 3);
-        D = md4_rotate_left(D + md4_H(A, B, C) + M[10] + 0x6ed9eba1, 9);
-        C = md4_rotate_left(C + md4_H(D, A, B) + M[6] + 0x6ed9eba1, 11);
-        B = md4_rotate_left(B + md4_H(C, D, A) + M[14] + 0x6ed9eba1, 15);
-        A = md4_rotate_left(A + md4_H(B, C, D) + M[1] + 0x6ed9eba1, 3);
-        D = md4_rotate_left(D + md4_H(A, B, C) + M[9] + 0x6ed9eba1, 9);
-        C = md4_rotate_left(C + md4_H(D, A, B) + M[5] + 0x6ed9eba1, 11);
-        B = md4_rotate_left(B + md4_H(C, D, A) + M[13] + 0x6ed9eba1, 15);
-        A = md4_rotate_left(A + md4_H(B, C, D) + M[3] + 0x6ed9eba1, 3);
-        D = md4_rotate_left(D + md4_H(A, B, C) + M[11] + 0x6ed9eba1, 9);
-        C = md4_rotate_left(C + md4_H(D, A, B) + M[7] + 0x6ed9eba1, 11);
-        B = md4_rotate_left(B + md4_H(C, D, A) + M[15] + 0x6ed9eba1, 15);
-
-        a0 += A;
-        b0 += B;
-        c0 += C;
-        d0 += D;
-    }
-
-    free(msg);
-
-    memcpy(output, &a0, 4);
-    memcpy(output + 4, &b0, 4);
-    memcpy(output + 8, &c0, 4);
-    memcpy(output + 12, &d0, 4);
+    md_ctx_t ctx;
+    md4_init(&ctx);
+    md4_update(&ctx, input, len);
+    md4_final(&ctx, output);
 }
 
 /* ============================================================================
@@ -434,64 +678,66 @@ static const uint32_t md5_s[] = {
 };
 
 /*
- * md5_hash - MD5ハッシュを計算
+ * md5_transform - 64バイトブロック1つ分の変換（4ラウンド×16ステップ）
+ */
+static void md5_transform(uint32_t state[4], const uint8_t block[64]) {
+    uint32_t M[16];
+    memcpy(M, block, 64);
+    uint32_t A = state[0], B = state[1], C = state[2], D = state[3];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t F, g;
+        if (i < 16) {
+            F = (B & C) | (~B & D);
+            g = i;
+        } else if (i < 32) {
+            F = (D & B) | (~D & C);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            F = B ^ C ^ D;
+            g = (3 * i + 5) % 16;
+        } else {
+            F = C ^ (B | ~D);
+            g = (7 * i) % 16;
+        }
+        F = F + A + md5_k[i] + M[g];
+        A = D;
+        D = C;
+        C = B;
+        B = B + md4_rotate_left(F, md5_s[i]);
+    }
+
+    state[0] += A;
+    state[1] += B;
+    state[2] += C;
+    state[3] += D;
+}
+
+/* md5_init / md5_update / md5_final - MD5のストリーミングAPI */
+static void md5_init(md_ctx_t *ctx) {
+    md_init(ctx);
+}
+
+static void md5_update(md_ctx_t *ctx, const void *data, size_t len) {
+    md_update(ctx, data, len, md5_transform);
+}
+
+static void md5_final(md_ctx_t *ctx, uint8_t *output) {
+    md_final(ctx, output, md5_transform);
+}
+
+/*
+ * md5_hash - MD5ハッシュを計算（一括）
  *
  * @input:  ハッシュ対象のデータ
  * @len:    データの長さ（バイト）
  * @output: ハッシュ値の出力先（16バイト以上必要）
  */
 static void md5_hash(const uint8_t *input, size_t len, uint8_t *output) {
-    uint32_t a0 = 0x67452301;
-    uint32_t b0 = 0xefcdab89;
-    uint32_t c0 = 0x98badcfe;
-    uint32_t d0 = 0x10325476;
-
-    size_t new_len = ((len + 8) / 64 + 1) * 64;
-    uint8_t *msg = calloc(new_len, 1);
-    memcpy(msg, input, len);
-    msg[len] = 0x80;
-
-    uint64_t bits_len = len * 8;
-    memcpy(msg + new_len - 8, &bits_len, 8);
-
-    for (size_t offset = 0; offset < new_len; offset += 64) {
-        uint32_t *M = (uint32_t *)(msg + offset);
-        uint32_t A = a0, B = b0, C = c0, D = d0;
-
-        for (int i = 0; i < 64; i++) {
-            uint32_t F, g;
-            if (i < 16) {
-                F = (B & C) | (~B & D);
-                g = i;
-            } else if (i < 32) {
-                F = (D & B) | (~D & C);
-                g = (5 * i + 1) % 16;
-            } else if (i < 48) {
-                F = B ^ C ^ D;
-                g = (3 * i + 5) % 16;
-            } else {
-                F = C ^ (B | ~D);
-                g = (7 * i) % 16;
-            }
-            F = F + A + md5_k[i] + M[g];
-            A = D;
-            D = C;
-            C = B;
-            B = B + md4_rotate_left(F, md5_s[i]);
-        }
-
-        a0 += A;
-        b0 += B;
-        c0 += C;
-        d0 += D;
-    }
-
-    free(msg);
-
-    memcpy(output, &a0, 4);
-    memcpy(output + 4, &b0, 4);
-    memcpy(output + 8, &c0, 4);
-    memcpy(output + 12, &d0, 4);
+    md_ctx_t ctx;
+    md5_init(&ctx);
+    md5_update(&ctx, input, len);
+    md5_final(&ctx, output);
 }
 
 /* ============================================================================
@@ -516,19 +762,25 @@ static void md5_hash(const uint8_t *input, size_t len, uint8_t *output) {
  * ============================================================================ */
 
 /*
- * hmac_md5 - HMAC-MD5を計算
+ * hmac_md5_ctx_t - HMAC-MD5のストリーミングコンテキスト
  *
- * @key:      秘密鍵
- * @key_len:  秘密鍵の長さ
- * @data:     認証対象のデータ
- * @data_len: データの長さ
- * @output:   HMAC値の出力先（16バイト）
+ * 内側のハッシュには (K' XOR ipad) を先に流し込んでおき、データは
+ * hmac_md5_update() で断片ごとに追加する。鍵パッドとデータを連結した
+ * コピーは作らない。
  */
-static void hmac_md5(const uint8_t *key, size_t key_len,
-                     const uint8_t *data, size_t data_len,
-                     uint8_t *output) {
+typedef struct {
+    md_ctx_t inner;          /* H((K' XOR ipad) || m) */
+    uint8_t o_key_pad[64];   /* K' XOR opad */
+} hmac_md5_ctx_t;
+
+/*
+ * hmac_md5_init - 鍵を設定
+ *
+ * @key:     秘密鍵
+ * @key_len: 秘密鍵の長さ
+ */
+static void hmac_md5_init(hmac_md5_ctx_t *ctx, const uint8_t *key, size_t key_len) {
     uint8_t k[64] = {0};
-    uint8_t o_key_pad[64];
     uint8_t i_key_pad[64];
 
     if (key_len > 64) {
@@ -538,27 +790,98 @@ static void hmac_md5(const uint8_t *key, size_t key_len,
     }
 
     for (int i = 0; i < 64; i++) {
-        o_key_pad[i] = k[i] ^ 0x5c;
+        ctx->o_key_pad[i] = k[i] ^ 0x5c;
         i_key_pad[i] = k[i] ^ 0x36;
     }
 
-    uint8_t *inner = malloc(64 + data_len);
-    memcpy(inner, i_key_pad, 64);
-    memcpy(inner + 64, data, data_len);
+    md5_init(&ctx->inner);
+    md5_update(&ctx->inner, i_key_pad, 64);
+}
+
+/* hmac_md5_update - 認証対象のデータを追加 */
+static void hmac_md5_update(hmac_md5_ctx_t *ctx, const void *data, size_t len) {
+    md5_update(&ctx->inner, data, len);
+}
 
+/* hmac_md5_final - HMAC値（16バイト）を出力 */
+static void hmac_md5_final(hmac_md5_ctx_t *ctx, uint8_t *output) {
     uint8_t inner_hash[16];
-    md5_hash(inner, 64 + data_len, inner_hash);
-    free(inner);
+    md5_final(&ctx->inner, inner_hash);
+
+    md_ctx_t outer;
+    md5_init(&outer);
+    md5_update(&outer, ctx->o_key_pad, 64);
+    md5_update(&outer, inner_hash, 16);
+    md5_final(&outer, output);
+}
+
+/*
+ * hmac_md5 - HMAC-MD5を計算（一括）
+ *
+ * @key:      秘密鍵
+ * @key_len:  秘密鍵の長さ
+ * @data:     認証対象のデータ
+ * @data_len: データの長さ
+ * @output:   HMAC値の出力先（16バイト）
+ */
+static void hmac_md5(const uint8_t *key, size_t key_len,
+                     const uint8_t *data, size_t data_len,
+                     uint8_t *output) {
+    hmac_md5_ctx_t ctx;
+    hmac_md5_init(&ctx, key, key_len);
+    hmac_md5_update(&ctx, data, data_len);
+    hmac_md5_final(&ctx, output);
+}
+
+/*
+ * rc4_state_t - RC4のストリーム状態
+ *
+ * RC4はストリーム暗号で、暗号化と復号が同じ操作。状態を保持しておけば、
+ * データを任意の大きさに区切って順に処理しても一括処理と同じ結果になる。
+ */
+typedef struct {
+    uint8_t S[256];
+    uint8_t i, j;
+} rc4_state_t;
 
-    uint8_t outer[64 + 16];
-    memcpy(outer, o_key_pad, 64);
-    memcpy(outer + 64, inner_hash, 16);
+/* rc4_init - KSA (Key-Scheduling Algorithm) */
+static void rc4_init(rc4_state_t *st, const uint8_t *key, size_t key_len) {
+    for (int i = 0; i < 256; i++) {
+        st->S[i] = (uint8_t)i;
+    }
+
+    uint8_t j = 0;
+    for (int i = 0; i < 256; i++) {
+        j = (uint8_t)(j + st->S[i] + key[i % key_len]);
+        uint8_t tmp = st->S[i];
+        st->S[i] = st->S[j];
+        st->S[j] = tmp;
+    }
+    st->i = 0;
+    st->j = 0;
+}
 
-    md5_hash(outer, 80, output);
+/*
+ * rc4_apply - PRGA (Pseudo-Random Generation Algorithm)
+ *
+ * @output: 出力先（dataと同じでもよい = その場で暗号化/復号）
+ */
+static void rc4_apply(rc4_state_t *st, const uint8_t *data, size_t len, uint8_t *output) {
+    uint8_t i = st->i, j = st->j;
+    for (size_t k = 0; k < len; k++) {
+        i = (uint8_t)(i + 1);
+        j = (uint8_t)(j + st->S[i]);
+        uint8_t tmp = st->S[i];
+        st->S[i] = st->S[j];
+        st->S[j] = tmp;
+        output[k] = data[k] ^ st->S[(uint8_t)(st->S[i] + st->S[j])];
+    }
+    st->i = i;
+    st->j = j;
 }
 
 /*
- * rc4_crypt - RC4暗号化/復号
+ * rc4_crypt - RC4暗号化/復号（1回限りの鍵で一括処理）
  *
  * @key:      暗号化キー
  * @key_len:  キーの長さ
@@ -566,39 +889,14 @@ static void hmac_md5(const uint8_t *key, size_t key_len,
  * @data_len: データの長さ
  * @output:   出力先（入力と同じサイズ）
  *
- * RC4はストリーム暗号で、暗号化と復号が同じ操作。
  * NTLM KEY_EXCHでセッションキーの暗号化に使用。
  */
 static void rc4_crypt(const uint8_t *key, size_t key_len,
                       const uint8_t *data, size_t data_len,
                       uint8_t *output) {
-    uint8_t S[256];
-    size_t i, j;
-
-    /* KSA (Key-Scheduling Algorithm) */
-    for (i = 0; i < 256; i++) {
-        S[i] = (uint8_t)i;
-    }
-
-    j = 0;
-    for (i = 0; i < 256; i++) {
-        j = (j + S[i] + key[i % key_len]) & 0xff;
-        uint8_t tmp = S[i];
-        S[i] = S[j];
-        S[j] = tmp;
-    }
-
-    /* PRGA (Pseudo-Random Generation Algorithm) */
-    i = 0;
-    j = 0;
-    for (size_t k = 0; k < data_len; k++) {
-        i = (i + 1) & 0xff;
-        j = (j + S[i]) & 0xff;
-        uint8_t tmp = S[i];
-        S[i] = S[j];
-        S[j] = tmp;
-        output[k] = data[k] ^ S[(S[i] + S[j]) & 0xff];
-    }
+    rc4_state_t st;
+    rc4_init(&st, key, key_len);
+    rc4_apply(&st, data, data_len, output);
 }
 
 /* ============================================================================
@@ -606,66 +904,79 @@ static void rc4_crypt(const uint8_t *key, size_t key_len,
  * ============================================================================
  *
  * AllowUnencrypted=FalseのWinRM HTTP接続で必要。
- * NTLM認証完了後、SOAPメッセージを暗号化して送信する。
+ * NTLM認証完了後、SOAPメッセージを暗号化して送信し、
+ * サーバーから暗号化されて返るレスポンスを復号・検証する。
+ *
+ * 送信（クライアント→サーバー）と受信（サーバー→クライアント）で
+ * 別々のキー・RC4状態・シーケンス番号を使用する。
  *
  * MS-NLMP Section 3.4.4: セッションセキュリティ
  * ============================================================================ */
 
-/* NTLM セッション状態 */
+/* 一方向（送信または受信）のセッション状態 */
 typedef struct {
-    uint8_t signing_key[16];   /* ClientSigningKey */
-    uint8_t sealing_key[16];   /* ClientSealingKey */
-    uint8_t rc4_state[256];    /* RC4状態 */
-    size_t rc4_i, rc4_j;       /* RC4インデックス */
+    uint8_t signing_key[16];   /* SigningKey */
+    uint8_t sealing_key[16];   /* SealingKey */
+    rc4_state_t rc4;           /* SealingKeyで初期化したRC4状態（接続中は継続） */
     uint32_t seq_num;          /* シーケンス番号 */
+} ntlm_direction_t;
+
+/* NTLM セッション状態 */
+typedef struct {
+    ntlm_direction_t client;   /* クライアント→サーバー（送信時の暗号化・署名） */
+    ntlm_direction_t server;   /* サーバー→クライアント（受信時の復号・検証） */
 } ntlm_session_t;
 
-/* マジック定数 (MS-NLMP 3.4.4.2) */
-static const char SIGN_MAGIC[] = "session key to client-to-server signing key magic constant\0";
-static const char SEAL_MAGIC[] = "session key to client-to-server sealing key magic constant\0";
+/* マジック定数 (MS-NLMP 3.4.4.2)。終端のNUL 1バイトまでを含めてハッシュする */
+static const char CLIENT_SIGN_MAGIC[] = "session key to client-to-server signing key magic constant";
+static const char CLIENT_SEAL_MAGIC[] = "session key to client-to-server sealing key magic constant";
+static const char SERVER_SIGN_MAGIC[] = "session key to server-to-client signing key magic constant";
+static const char SERVER_SEAL_MAGIC[] = "session key to server-to-client sealing key magic constant";
+
+/*
+ * ntlm_key_from_magic - MD5(ExportedSessionKey || Magic) でキーを派生
+ */
+static void ntlm_key_from_magic(const uint8_t *exported_session_key, const char *magic,
+                                size_t magic_size, uint8_t *key) {
+    md_ctx_t ctx;
+    md5_init(&ctx);
+    md5_update(&ctx, exported_session_key, 16);
+    md5_update(&ctx, magic, magic_size);
+    md5_final(&ctx, key);
+}
 
 /*
- * ntlm_derive_keys - SigningKey と SealingKey を派生
+ * ntlm_derive_keys - 送信・受信それぞれの SigningKey と SealingKey を派生
  *
- * MS-NLMP 3.4.4.2:
- * SigningKey = HMAC_MD5(ExportedSessionKey, SignMagic)
- * SealingKey = HMAC_MD5(ExportedSessionKey, SealMagic)
+ * MS-NLMP 3.4.5.2 / 3.4.5.3（拡張セッションセキュリティ、128ビットキー）:
+ * SigningKey = MD5(ExportedSessionKey || SignMagic)
+ * SealingKey = MD5(ExportedSessionKey || SealMagic)
  */
 static void ntlm_derive_keys(const uint8_t *exported_session_key, ntlm_session_t *session) {
-    /* SigningKey */
-    hmac_md5(exported_session_key, 16, (const uint8_t *)SIGN_MAGIC, sizeof(SIGN_MAGIC), session->signing_key);
-
-    /* SealingKey */
-    hmac_md5(exported_session_key, 16, (const uint8_t *)SEAL_MAGIC, sizeof(SEAL_MAGIC), session->sealing_key);
-
-    /* RC4状態を初期化 */
-    for (int i = 0; i < 256; i++) {
-        session->rc4_state[i] = (uint8_t)i;
-    }
-    size_t j = 0;
-    for (int i = 0; i < 256; i++) {
-        j = (j + session->rc4_state[i] + session->sealing_key[i % 16]) & 0xff;
-        uint8_t tmp = session->rc4_state[i];
-        session->rc4_state[i] = session->rc4_state[j];
-        session->rc4_state[j] = tmp;
-    }
-    session->rc4_i = 0;
-    session->rc4_j = 0;
-    session->seq_num = 0;
+    ntlm_key_from_magic(exported_session_key, CLIENT_SIGN_MAGIC, sizeof(CLIENT_SIGN_MAGIC),
+                        session->client.signing_key);
+    ntlm_key_from_magic(exported_session_key, CLIENT_SEAL_MAGIC, sizeof(CLIENT_SEAL_MAGIC),
+                        session->client.sealing_key);
+    ntlm_key_from_magic(exported_session_key, SERVER_SIGN_MAGIC, sizeof(SERVER_SIGN_MAGIC),
+                        session->server.signing_key);
+    ntlm_key_from_magic(exported_session_key, SERVER_SEAL_MAGIC, sizeof(SERVER_SEAL_MAGIC),
+                        session->server.sealing_key);
+
+    rc4_init(&session->client.rc4, session->client.sealing_key, 16);
+    rc4_init(&session->server.rc4, session->server.sealing_key, 16);
+    session->client.seq_num = 0;
+    session->server.seq_num = 0;
 }
 
 /*
- * ntlm_rc4_stream - RC4ストリームで暗号化（状態を維持）
+ * ntlm_mac_init - 署名のチェックサム計算を開始
+ *
+ * チェックサム = HMAC_MD5(SigningKey, SeqNum || Message) の先頭8バイト。
+ * SeqNumを先に流し込み、Messageは呼び出し側が断片ごとに hmac_md5_update() で追加する。
  */
-static void ntlm_rc4_stream(ntlm_session_t *session, const uint8_t *data, size_t len, uint8_t *output) {
-    for (size_t k = 0; k < len; k++) {
-        session->rc4_i = (session->rc4_i + 1) & 0xff;
-        session->rc4_j = (session->rc4_j + session->rc4_state[session->rc4_i]) & 0xff;
-        uint8_t tmp = session->rc4_state[session->rc4_i];
-        session->rc4_state[session->rc4_i] = session->rc4_state[session->rc4_j];
-        session->rc4_state[session->rc4_j] = tmp;
-        output[k] = data[k] ^ session->rc4_state[(session->rc4_state[session->rc4_i] + session->rc4_state[session->rc4_j]) & 0xff];
-    }
+static void ntlm_mac_init(hmac_md5_ctx_t *mac, const ntlm_direction_t *dir) {
+    hmac_md5_init(mac, dir->signing_key, 16);
+    hmac_md5_update(mac, &dir->seq_num, 4);
 }
 
 /*
@@ -674,39 +985,66 @@ static void ntlm_rc4_stream(ntlm_session_t *session, const uint8_t *data, size_t
  * MS-NLMP 3.4.4.2.1: SEAL()
  *
  * @session:    NTLMセッション状態
- * @message:    暗号化するメッセージ
- * @msg_len:    メッセージ長
- * @sealed:     暗号化されたメッセージの出力先
+ * @message:    暗号化するメッセージ（断片の並び。連結したものを1つのメッセージとして扱う）
+ * @count:      断片の数
+ * @sealed:     暗号化されたメッセージの出力先（断片の合計長）
  * @signature:  署名の出力先（16バイト）
  */
-static void ntlm_seal_message(ntlm_session_t *session, const uint8_t *message, size_t msg_len,
-                               uint8_t *sealed, uint8_t *signature) {
-    /* 1. シーケンス番号 + メッセージのHMAC-MD5を計算 */
-    size_t hmac_input_len = 4 + msg_len;
-    uint8_t *hmac_input = malloc(hmac_input_len);
-    memcpy(hmac_input, &session->seq_num, 4);
-    memcpy(hmac_input + 4, message, msg_len);
-
-    uint8_t hmac_output[16];
-    hmac_md5(session->signing_key, 16, hmac_input, hmac_input_len, hmac_output);
-    free(hmac_input);
+static void ntlm_seal_message(ntlm_session_t *session, const struct iovec *message, int count,
+                              uint8_t *sealed, uint8_t *signature) {
+    ntlm_direction_t *dir = &session->client;
+
+    /* 1. シーケンス番号 + メッセージのHMAC-MD5を計算（コピーせずに順に流し込む） */
+    hmac_md5_ctx_t mac;
+    uint8_t checksum[16];
+    ntlm_mac_init(&mac, dir);
+    for (int i = 0; i < count; i++) {
+        hmac_md5_update(&mac, message[i].iov_base, message[i].iov_len);
+    }
+    hmac_md5_final(&mac, checksum);
 
-    /* 2. メッセージをRC4で暗号化 */
-    ntlm_rc4_stream(session, message, msg_len, sealed);
+    /* 2. メッセージをRC4で暗号化（キーストリームは断片をまたいで続く） */
+    for (int i = 0; i < count; i++) {
+        rc4_apply(&dir->rc4, message[i].iov_base, message[i].iov_len, sealed);
+        sealed += message[i].iov_len;
+    }
 
     /* 3. 署名を構築: Version(4) + Checksum(8) + SeqNum(4) */
-    /*    Checksum部分もRC4で暗号化 */
-    uint8_t checksum_encrypted[8];
-    ntlm_rc4_stream(session, hmac_output, 8, checksum_encrypted);
-
-    /* NTLMSSP_MESSAGE_SIGNATURE構造体 */
+    /*    Checksum部分もRC4で暗号化（メッセージに続くキーストリームを使用） */
     uint32_t version = 0x00000001;
     memcpy(signature, &version, 4);
-    memcpy(signature + 4, checksum_encrypted, 8);
-    memcpy(signature + 12, &session->seq_num, 4);
+    rc4_apply(&dir->rc4, checksum, 8, signature + 4);
+    memcpy(signature + 12, &dir->seq_num, 4);
 
     /* シーケンス番号をインクリメント */
-    session->seq_num++;
+    dir->seq_num++;
+}
+
+/*
+ * ntlm_verify_signature - 復号済みメッセージの署名を検証
+ *
+ * MS-NLMP 3.4.4.2.1 の逆操作。メッセージ本体の復号（rc4_apply）を
+ * 先に済ませてから呼ぶこと（チェックサムはその後のキーストリームで暗号化されている）。
+ *
+ * @mac:       ntlm_mac_init() で開始し、復号済みメッセージをすべて追加したコンテキスト
+ * @signature: 受信した署名（16バイト）
+ * @return:    チェックサムとシーケンス番号が一致すればtrue
+ */
+static bool ntlm_verify_signature(ntlm_session_t *session, hmac_md5_ctx_t *mac,
+                                  const uint8_t *signature) {
+    ntlm_direction_t *dir = &session->server;
+
+    uint8_t checksum[8], expected[16];
+    rc4_apply(&dir->rc4, signature + 4, 8, checksum);
+    hmac_md5_final(mac, expected);
+
+    uint32_t version, seq_num;
+    memcpy(&version, signature, 4);
+    memcpy(&seq_num, signature + 12, 4);
+
+    bool ok = version == 1 && seq_num == dir->seq_num && memcmp(checksum, expected, 8) == 0;
+    dir->seq_num++;
+    return ok;
 }
 
 /* ============================================================================
@@ -733,62 +1071,317 @@ static void ntlm_seal_message(ntlm_session_t *session, const uint8_t *message, s
 static const char base64_chars[] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
+/* 逆引き表（文字 → 6ビット値。0xff: Base64の文字ではない = 読み飛ばす） */
+static const uint8_t base64_values[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+    0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+    0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+/*
+ * 【SIMD版】
+ * x86_64では、実行時にCPUを判定してSSE4.1（16文字単位）またはAVX2（32文字単位）で
+ * 変換する（W. Muła / D. Lemire の方式。表引きをpshufbで並列に行う）。
+ * Receiveの出力やアップロードのように大きなデータで、1バイトずつの変換より桁違いに速い。
+ * 改行・パディング等のBase64以外の文字を含むブロックは、1文字ずつの処理で読み飛ばす。
+ *
+ * target属性の関数で組み込み関数を使えるのは GCC 4.9 以降（および clang）。
+ * GCC 4.8（RHEL 7 / CentOS 7 標準）は -mavx2 等を付けないと immintrin.h の
+ * 定義が見えないため、SIMD版を組み込まず1文字ずつの変換だけでビルドする。
+ */
+#if defined(__x86_64__) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define BASE64_X86 1
+#endif
+
+#ifdef BASE64_X86
+static int g_base64_simd = -1;   /* 使用するSIMD（-1: 未判定、0: なし、1: SSE4.1、2: AVX2） */
+
+static int base64_simd_level(void) {
+    if (g_base64_simd < 0) {
+        __builtin_cpu_init();
+        g_base64_simd = __builtin_cpu_supports("avx2") ? 2 :
+                        __builtin_cpu_supports("sse4.1") ? 1 : 0;
+    }
+    return g_base64_simd;
+}
+
+/*
+ * base64_encode_sse - 12バイトを16文字に変換（入力は16バイト読める必要がある）
+ */
+__attribute__((target("sse4.1")))
+static void base64_encode_sse(const uint8_t *in, char *out) {
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    /* 3バイトずつを32ビットの各レーンへ並べ替え、6ビットずつの4つの値に分ける */
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                                 _mm_set1_epi32(0x04000040));
+    __m128i t1 = _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                                 _mm_set1_epi32(0x01000010));
+    __m128i idx = _mm_or_si128(t0, t1);
+    /* 値の範囲（A-Z / a-z / 0-9 / + / /）ごとのオフセットを加算して文字にする */
+    __m128i range = _mm_subs_epu8(idx, _mm_set1_epi8(51));
+    range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), idx),
+                                              _mm_set1_epi8(13)));
+    __m128i offset = _mm_shuffle_epi8(
+        _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0),
+        range);
+    _mm_storeu_si128((__m128i *)out, _mm_add_epi8(idx, offset));
+}
+
+/*
+ * base64_encode_avx2 - 24バイトを32文字に変換（入力は28バイト読める必要がある）
+ */
+__attribute__((target("avx2")))
+static void base64_encode_avx2(const uint8_t *in, char *out) {
+    __m256i v = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+        _mm_loadu_si128((const __m128i *)(in + 12)), 1);
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00)),
+                                    _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0)),
+                                    _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t0, t1);
+    __m256i range = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    range = _mm256_or_si256(range, _mm256_and_si256(_mm256_cmpgt_epi8(_mm256_set1_epi8(26), idx),
+                                                    _mm256_set1_epi8(13)));
+    __m256i offset = _mm256_shuffle_epi8(_mm256_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0), range);
+    _mm256_storeu_si256((__m256i *)out, _mm256_add_epi8(idx, offset));
+}
+
+/*
+ * base64_decode_sse - 16文字を12バイトに変換（出力先は16バイト書ける必要がある）
+ *
+ * @return: Base64の文字以外を含む場合false（何も書き出さない）
+ */
+__attribute__((target("sse4.1")))
+static bool base64_decode_sse(const uint8_t *in, uint8_t *out) {
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+    __m128i hi = _mm_and_si128(_mm_srli_epi32(v, 4), _mm_set1_epi8(0x0f));
+    __m128i lo = _mm_and_si128(v, _mm_set1_epi8(0x0f));
+    /* 上位・下位4ビットの表引きの積が0でなければ不正な文字 */
+    __m128i lo_class = _mm_shuffle_epi8(_mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a), lo);
+    __m128i hi_class = _mm_shuffle_epi8(_mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10), hi);
+    if (!_mm_testz_si128(lo_class, hi_class)) return false;
+
+    __m128i roll = _mm_shuffle_epi8(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                                  0, 0, 0, 0, 0, 0, 0, 0),
+                                    _mm_add_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/')), hi));
+    v = _mm_add_epi8(v, roll);
+    /* 6ビット×4 → 24ビットに詰めて、各レーンの3バイトを前に寄せる */
+    v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+    v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+    v = _mm_shuffle_epi8(v, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                                          -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *)out, v);
+    return true;
+}
+
+/*
+ * base64_decode_avx2 - 32文字を24バイトに変換（出力先は32バイト書ける必要がある）
+ *
+ * @return: Base64の文字以外を含む場合false（何も書き出さない）
+ */
+__attribute__((target("avx2")))
+static bool base64_decode_avx2(const uint8_t *in, uint8_t *out) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)in);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), _mm256_set1_epi8(0x0f));
+    __m256i lo = _mm256_and_si256(v, _mm256_set1_epi8(0x0f));
+    __m256i lo_class = _mm256_shuffle_epi8(_mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a),
+        lo);
+    __m256i hi_class = _mm256_shuffle_epi8(_mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10),
+        hi);
+    if (!_mm256_testz_si256(lo_class, hi_class)) return false;
+
+    __m256i roll = _mm256_shuffle_epi8(_mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0),
+        _mm256_add_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')), hi));
+    v = _mm256_add_epi8(v, roll);
+    v = _mm256_maddubs_epi16(v, _mm256_set1_epi32(0x01400140));
+    v = _mm256_madd_epi16(v, _mm256_set1_epi32(0x00011000));
+    v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    /* 各レーンの12バイトを連続させる */
+    v = _mm256_permutevar8x32_epi32(v, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm256_storeu_si256((__m256i *)out, v);
+    return true;
+}
+#endif
+
 /*
  * base64_encode - バイナリデータをBase64文字列にエンコード
  *
  * @input:  エンコード対象のバイナリデータ
  * @len:    データの長さ
- * @output: 出力先バッファ（入力の約1.4倍のサイズが必要）
+ * @output: 出力先バッファ（4 * ((len + 2) / 3) + 1 バイト必要）
  * @return: 出力された文字数
  */
 static size_t base64_encode(const uint8_t *input, size_t len, char *output) {
-    size_t out_len = 0;
+    size_t i = 0, out_len = 0;
 
-    for (size_t i = 0; i < len; i += 3) {
-        uint32_t octet_a = i < len ? input[i] : 0;
-        uint32_t octet_b = i + 1 < len ? input[i + 1] : 0;
-        uint32_t octet_c = i + 2 < len ? input[i + 2] : 0;
+#ifdef BASE64_X86
+    int level = base64_simd_level();
+    if (level >= 2) {
+        for (; i + 28 <= len; i += 24, out_len += 32) {
+            base64_encode_avx2(input + i, output + out_len);
+        }
+    }
+    if (level >= 1) {
+        for (; i + 16 <= len; i += 12, out_len += 16) {
+            base64_encode_sse(input + i, output + out_len);
+        }
+    }
+#endif
 
-        uint32_t triple = (octet_a << 16) | (octet_b << 8) | octet_c;
+    /* 3バイト単位（分岐なし） */
+    for (; i + 3 <= len; i += 3) {
+        uint32_t triple = ((uint32_t)input[i] << 16) | ((uint32_t)input[i + 1] << 8) | input[i + 2];
+        output[out_len++] = base64_chars[(triple >> 18) & 0x3f];
+        output[out_len++] = base64_chars[(triple >> 12) & 0x3f];
+        output[out_len++] = base64_chars[(triple >> 6) & 0x3f];
+        output[out_len++] = base64_chars[triple & 0x3f];
+    }
 
+    /* 残り1〜2バイトはパディング付き */
+    if (i < len) {
+        uint32_t triple = (uint32_t)input[i] << 16;
+        if (i + 1 < len) triple |= (uint32_t)input[i + 1] << 8;
         output[out_len++] = base64_chars[(triple >> 18) & 0x3f];
         output[out_len++] = base64_chars[(triple >> 12) & 0x3f];
         output[out_len++] = i + 1 < len ? base64_chars[(triple >> 6) & 0x3f] : '=';
-        output[out_len++] = i + 2 < len ? base64_chars[triple & 0x3f] : '=';
+        output[out_len++] = '=';
     }
 
     output[out_len] = '\0';
     return out_len;
 }
 
+/*
+ * base64_stream_t - 分割して届くBase64文字列のデコード状態
+ *
+ * ゼロ初期化した状態から使用する。チャンクの境界が4文字の区切りと
+ * 一致しなくても、未出力のビットを持ち越して続きからデコードできる。
+ */
+typedef struct {
+    uint32_t acc;   /* 未出力のビット（下位 bits ビットが有効） */
+    int bits;       /* 有効ビット数（0〜7。0なら4文字の区切り） */
+} base64_stream_t;
+
+/* base64_decode_update() の出力先に必要なサイズ（SIMDの書き出し幅の余裕を含む） */
+#define BASE64_DECODE_SIZE(len) ((len) / 4 * 3 + 16)
+
+/*
+ * base64_decode_update - Base64文字列の続きをデコード
+ *
+ * @st:     デコード状態
+ * @input:  Base64文字列（NUL終端でなくてよい）
+ * @len:    文字数
+ * @output: 出力先（BASE64_DECODE_SIZE(len) バイト必要）
+ * @return: デコードされたバイト数
+ *
+ * Base64の文字以外（改行・'='等）は読み飛ばす。
+ */
+static size_t base64_decode_update(base64_stream_t *st, const char *input, size_t len,
+                                   uint8_t *output) {
+    const uint8_t *in = (const uint8_t *)input, *end = in + len;
+    uint8_t *out = output;
+#ifdef BASE64_X86
+    int level = base64_simd_level();
+#endif
+
+    while (in < end) {
+        if (st->bits == 0) {
+#ifdef BASE64_X86
+            if (level >= 2 && end - in >= 32 && base64_decode_avx2(in, out)) {
+                in += 32;
+                out += 24;
+                continue;
+            }
+            if (level >= 1 && end - in >= 16 && base64_decode_sse(in, out)) {
+                in += 16;
+                out += 12;
+                continue;
+            }
+#endif
+            /* 4文字単位（すべてBase64の文字の場合） */
+            if (end - in >= 4) {
+                uint8_t a = base64_values[in[0]], b = base64_values[in[1]];
+                uint8_t c = base64_values[in[2]], d = base64_values[in[3]];
+                if (!((a | b | c | d) & 0x80)) {
+                    uint32_t quad = ((uint32_t)a << 18) | ((uint32_t)b << 12) | ((uint32_t)c << 6) | d;
+                    out[0] = quad >> 16;
+                    out[1] = quad >> 8;
+                    out[2] = quad;
+                    in += 4;
+                    out += 3;
+                    continue;
+                }
+            }
+        }
+
+        /* 1文字ずつ（読み飛ばす文字を含む区間・チャンクの境界） */
+        uint8_t value = base64_values[*in++];
+        if (value & 0x80) continue;
+        st->acc = (st->acc << 6) | value;
+        st->bits += 6;
+        if (st->bits >= 8) {
+            st->bits -= 8;
+            *out++ = (st->acc >> st->bits) & 0xff;
+        }
+    }
+    return out - output;
+}
+
 /*
  * base64_decode - Base64文字列をバイナリデータにデコード
  *
  * @input:       デコード対象のBase64文字列
+ * @len:         文字数
  * @output:      出力先バッファ
- * @output_size: 出力バッファのサイズ
+ * @output_size: 出力バッファのサイズ（超える分は切り捨て）
  * @return:      デコードされたバイト数
  */
-static size_t base64_decode(const char *input, uint8_t *output, size_t output_size) {
-    size_t input_len = strlen(input);
+static size_t base64_decode(const char *input, size_t len, uint8_t *output, size_t output_size) {
+    base64_stream_t st = {0};
+    uint8_t block[BASE64_DECODE_SIZE(1024)];
     size_t output_len = 0;
-    unsigned int buffer = 0;
-    int bits = 0;
-
-    for (size_t i = 0; i < input_len && output_len < output_size; i++) {
-        char c = input[i];
-        if (c == '=' || c == '\n' || c == '\r') continue;
 
-        const char *p = strchr(base64_chars, c);
-        if (!p) continue;
-
-        buffer = (buffer << 6) | (p - base64_chars);
-        bits += 6;
-
-        if (bits >= 8) {
-            bits -= 8;
-            output[output_len++] = (buffer >> bits) & 0xff;
-        }
+    for (size_t off = 0; off < len && output_len < output_size; off += 1024) {
+        size_t n = base64_decode_update(&st, input + off, len - off < 1024 ? len - off : 1024, block);
+        if (n > output_size - output_len) n = output_size - output_len;
+        memcpy(output + output_len, block, n);
+        output_len += n;
     }
     return output_len;
 }
@@ -880,6 +1473,17 @@ static size_t utf8_to_utf16le(const char *utf8, uint8_t *utf16, size_t utf16_siz
  * - クライアントチャレンジにより、サーバー側のなりすましを防止
  * ============================================================================ */
 
+/*
+ * secure_wipe - 機密データをゼロクリア（最適化で消去されない）
+ *
+ * explicit_bzero は glibc 2.25 以降にしかないため（RHEL 7 は 2.17）、
+ * volatile ポインタ経由で1バイトずつ書き込む。
+ */
+static void secure_wipe(void *data, size_t len) {
+    volatile unsigned char *p = data;
+    while (len--) *p++ = 0;
+}
+
 /*
  * ntlm_hash - NTハッシュを生成（パスワードのMD4ハッシュ）
  *
@@ -892,12 +1496,13 @@ static void ntlm_hash(const char *password, uint8_t *hash) {
     uint8_t utf16_pass[512];
     size_t utf16_len = utf8_to_utf16le(password, utf16_pass, sizeof(utf16_pass));
     md4_hash(utf16_pass, utf16_len, hash);
+    secure_wipe(utf16_pass, sizeof(utf16_pass));
 }
 
 /*
  * ntlmv2_hash - NTLMv2ハッシュを生成
  *
- * @password: パスワード（UTF-8）
+ * @nt_hash:  NTハッシュ（16バイト）
  * @user:     ユーザー名（UTF-8）
  * @domain:   ドメイン名（UTF-8）
  * @hash:     出力先（16バイト）
@@ -906,11 +1511,8 @@ static void ntlm_hash(const char *password, uint8_t *hash) {
  *
  * 注: MS-NLMP仕様ではユーザー名のみ大文字化、ドメインはそのまま
  */
-static void ntlmv2_hash(const char *password, const char *user, const char *domain,
+static void ntlmv2_hash(const uint8_t *nt_hash, const char *user, const char *domain,
                         uint8_t *hash) {
-    uint8_t nt_hash[16];
-    ntlm_hash(password, nt_hash);
-
     /*
      * NTLMv2Hash = HMAC-MD5(NT_Hash, UNICODE(Uppercase(User) + Domain))
      *
@@ -936,6 +1538,84 @@ static void ntlmv2_hash(const char *password, const char *user, const char *doma
     hmac_md5(nt_hash, 16, utf16_ud, utf16_len, hash);
 }
 
+/*
+ * NTLM資格情報
+ *
+ * NTハッシュ・NTLMv2ハッシュはパスワード・ユーザー名・ドメインだけで決まるため、
+ * 起動時に一度だけ導出してすべてのType 3で使い回す（ハンドシェイクごとの
+ * UTF-16変換・MD4・HMAC-MD5を省略）。Type 3に載せるUTF-16LEのユーザー名・
+ * ドメインも同時に用意しておく。
+ *
+ * パスワード相当の値なので専用ページに置いてmlockし（スワップアウト防止）、
+ * コアダンプからも除外する。終了時（atexit）にゼロクリアして解放する。
+ */
+typedef struct {
+    uint8_t nt_hash[16];          /* MD4(UTF-16LE(Password)) */
+    uint8_t ntlmv2_hash[16];      /* HMAC-MD5(NT_Hash, UTF-16LE(User.upper() + Domain)) */
+    uint8_t user_utf16[256];      /* Type 3のUserNameフィールド */
+    size_t user_utf16_len;
+    uint8_t domain_utf16[256];    /* Type 3のDomainNameフィールド */
+    size_t domain_utf16_len;
+} ntlm_credential_t;
+
+static ntlm_credential_t *g_cred;   /* 導出済み資格情報（ntlm_credential_init後に有効） */
+static size_t g_cred_map_size;      /* g_credのマッピングサイズ */
+static bool g_cred_locked;          /* mlockに成功したか */
+
+/*
+ * ntlm_credential_wipe - 資格情報をゼロクリアして解放（atexitで登録）
+ */
+static void ntlm_credential_wipe(void) {
+    if (!g_cred) return;
+
+    secure_wipe(g_cred, sizeof(*g_cred));
+    if (g_cred_locked) munlock(g_cred, g_cred_map_size);
+    munmap(g_cred, g_cred_map_size);
+    g_cred = NULL;
+    g_cred_locked = false;
+}
+
+/*
+ * ntlm_credential_init - 資格情報を導出してロック済みメモリに保持
+ *
+ * @user:     ユーザー名（UTF-8）
+ * @password: パスワード（UTF-8）
+ * @domain:   ドメイン名（UTF-8）
+ * @return:   成功時true
+ *
+ * mlockに失敗した場合（RLIMIT_MEMLOCK等）は警告のみで続行する。
+ */
+static bool ntlm_credential_init(const char *user, const char *password, const char *domain) {
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = page > 0 ? (size_t)page : 4096;
+    while (size < sizeof(ntlm_credential_t)) size *= 2;
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        log_error("資格情報用のメモリを確保できません");
+        return false;
+    }
+    g_cred = mem;
+    g_cred_map_size = size;
+
+    /* ハッシュを書き込む前にロックしておく */
+    g_cred_locked = (mlock(mem, size) == 0);
+    if (!g_cred_locked) {
+        log_warn("資格情報のメモリをロックできません（スワップアウトされる可能性があります）");
+    }
+#ifdef MADV_DONTDUMP
+    madvise(mem, size, MADV_DONTDUMP);
+#endif
+
+    ntlm_hash(password, g_cred->nt_hash);
+    ntlmv2_hash(g_cred->nt_hash, user, domain, g_cred->ntlmv2_hash);
+    g_cred->user_utf16_len = utf8_to_utf16le(user, g_cred->user_utf16,
+                                             sizeof(g_cred->user_utf16));
+    g_cred->domain_utf16_len = utf8_to_utf16le(domain, g_cred->domain_utf16,
+                                               sizeof(g_cred->domain_utf16));
+    return true;
+}
+
 /*
  * ntlm_create_type1 - Type 1メッセージ（Negotiate）を生成
  *
@@ -1021,9 +1701,7 @@ static bool ntlm_parse_type2(const uint8_t *buffer, size_t len,
 /*
  * ntlm_create_type3 - Type 3メッセージ（Authenticate）を生成
  *
- * @user:            ユーザー名
- * @password:        パスワード
- * @domain:          ドメイン名
+ * @cred:            導出済み資格情報（NTLMv2ハッシュ、UTF-16LEのユーザー名・ドメイン）
  * @challenge:       サーバーから受信したチャレンジ（8バイト）
  * @target_info:     サーバーから受信したTargetInfo
  * @target_info_len: TargetInfoの長さ
@@ -1047,16 +1725,14 @@ static bool ntlm_parse_type2(const uint8_t *buffer, size_t len,
  * - NTProofStr (16バイト): HMAC-MD5(NTLMv2Hash, ServerChallenge + Blob)
  * - Blob: タイムスタンプ、クライアントチャレンジ、TargetInfo等
  */
-static size_t ntlm_create_type3(const char *user, const char *password,
-                                const char *domain, const uint8_t *challenge,
+static size_t ntlm_create_type3(const ntlm_credential_t *cred, const uint8_t *challenge,
                                 const uint8_t *target_info, size_t target_info_len,
                                 uint32_t server_flags,
                                 const uint8_t *type1_msg, size_t type1_len,
                                 const uint8_t *type2_msg, size_t type2_len,
                                 uint8_t *buffer, size_t buffer_size,
                                 uint8_t *exported_session_key_out) {
-    uint8_t ntlmv2_h[16];
-    ntlmv2_hash(password, user, domain, ntlmv2_h);
+    const uint8_t *ntlmv2_h = cred->ntlmv2_hash;
 
     /* クライアントチャレンジ（ランダム8バイト） */
     uint8_t client_challenge[8];
@@ -1169,13 +1845,12 @@ static size_t ntlm_create_type3(const char *user, const char *password,
     free(new_target_info);
 
     /* NTProofStr = HMAC-MD5(NTLMv2Hash, ServerChallenge + Blob) */
-    size_t concat_len = 8 + blob_len;
-    uint8_t *concat = malloc(concat_len);
-    memcpy(concat, challenge, 8);
-    memcpy(concat + 8, blob, blob_len);
-
+    hmac_md5_ctx_t proof;
     uint8_t nt_proof_str[16];
-    hmac_md5(ntlmv2_h, 16, concat, concat_len, nt_proof_str);
+    hmac_md5_init(&proof, ntlmv2_h, 16);
+    hmac_md5_update(&proof, challenge, 8);
+    hmac_md5_update(&proof, blob, blob_len);
+    hmac_md5_final(&proof, nt_proof_str);
 
     if (DEBUG) {
         char dbg[128];
@@ -1183,8 +1858,6 @@ static size_t ntlm_create_type3(const char *user, const char *password,
         log_info(dbg);
     }
 
-    free(concat);
-
     /* NTLMv2 Response = NTProofStr + Blob */
     size_t nt_response_len = 16 + blob_len;
     uint8_t *nt_response = malloc(nt_response_len);
@@ -1229,10 +1902,11 @@ static size_t ntlm_create_type3(const char *user, const char *password,
         memcpy(exported_session_key, session_base_key, 16);
     }
 
-    /* UTF-16LEに変換 */
-    uint8_t domain_utf16[256], user_utf16[256];
-    size_t domain_len = utf8_to_utf16le(domain, domain_utf16, sizeof(domain_utf16));
-    size_t user_len = utf8_to_utf16le(user, user_utf16, sizeof(user_utf16));
+    /* UTF-16LEのユーザー名・ドメインは資格情報に導出済み */
+    const uint8_t *domain_utf16 = cred->domain_utf16;
+    const uint8_t *user_utf16 = cred->user_utf16;
+    size_t domain_len = cred->domain_utf16_len;
+    size_t user_len = cred->user_utf16_len;
 
     /* Type 3メッセージ構築（88バイトヘッダ、MICはオフセット72-87） */
     size_t offset = 88;  /* ヘッダサイズ */
@@ -1328,16 +2002,13 @@ static size_t ntlm_create_type3(const char *user, const char *password,
      * MIC = HMAC-MD5(ExportedSessionKey, Type1 || Type2 || Type3_with_zero_MIC)
      */
     if (type1_msg && type2_msg && type1_len > 0 && type2_len > 0) {
-        size_t total_len = type1_len + type2_len + offset;
-        uint8_t *mic_data = malloc(total_len);
-
-        memcpy(mic_data, type1_msg, type1_len);
-        memcpy(mic_data + type1_len, type2_msg, type2_len);
-        memcpy(mic_data + type1_len + type2_len, buffer, offset);
-
+        hmac_md5_ctx_t mac;
         uint8_t mic[16];
-        hmac_md5(exported_session_key, 16, mic_data, total_len, mic);
-        free(mic_data);
+        hmac_md5_init(&mac, exported_session_key, 16);
+        hmac_md5_update(&mac, type1_msg, type1_len);
+        hmac_md5_update(&mac, type2_msg, type2_len);
+        hmac_md5_update(&mac, buffer, offset);
+        hmac_md5_final(&mac, mic);
 
         memcpy(buffer + 72, mic, 16);
 
@@ -1639,19 +2310,89 @@ static size_t spnego_create_neg_token_resp(const uint8_t *ntlm_type3, size_t ntl
  * ============================================================================ */
 
 /*
- * connect_to_host - サーバーへのTCPソケット接続を確立
+ * resolve_host - ホスト名をIPv4アドレスに解決
  *
  * @host: ホスト名またはIPアドレス
  * @port: ポート番号
- * @return: ソケットファイルディスクリプタ（エラー時は-1）
+ * @addr: 接続先アドレスの出力先
+ * @return: 成功時true
+ */
+static bool resolve_host(const char *host, int port, struct sockaddr_in *addr) {
+    struct hostent *he = gethostbyname(host);
+    if (!he || he->h_addrtype != AF_INET) {
+        return false;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    memcpy(&addr->sin_addr, he->h_addr, he->h_length);
+    return true;
+}
+
+/*
+ * iov_advance - 送信済みのバイト数だけ断片の並びを進める
+ *
+ * @iov:   断片の並び（途中まで送った断片は先頭位置と長さを書き換える）
+ * @count: 断片の数
+ * @pos:   未送信の最初の断片（更新される）
+ * @sent:  送信できたバイト数
+ */
+static void iov_advance(struct iovec *iov, int count, int *pos, size_t sent) {
+    while (*pos < count && iov[*pos].iov_len <= sent) {
+        sent -= iov[*pos].iov_len;
+        (*pos)++;
+    }
+    if (*pos < count && sent > 0) {
+        iov[*pos].iov_base = (char *)iov[*pos].iov_base + sent;
+        iov[*pos].iov_len -= sent;
+    }
+}
+
+/*
+ * send_iov - 断片の並びを送信（ブロッキングソケット。部分送信なら残りを送り直す）
+ *
+ * @iov:    断片の並び（送信に合わせて書き換える）
+ * @return: すべて送信できればtrue
+ */
+static bool send_iov(int sock, struct iovec *iov, int count) {
+    int pos = 0;
+    while (pos < count) {
+        struct msghdr msg = { .msg_iov = iov + pos, .msg_iovlen = count - pos };
+        ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        iov_advance(iov, count, &pos, sent);
+    }
+    return true;
+}
+
+/*
+ * set_tcp_nodelay - Nagleアルゴリズムを無効化
+ *
+ * リクエストは1回の sendmsg() でまとめて書き出すので、小さな書き込みを溜める
+ * 必要はない。逆にNagleが有効だと、パイプライン送信した小さなSOAPが前の
+ * セグメントの遅延ACK待ちで止まり、1往復あたり数十msの遅延になる。
+ */
+static void set_tcp_nodelay(int sock) {
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/*
+ * connect_to_host - サーバーへのTCPソケット接続を確立
+ *
+ * @host: ホスト名またはIPアドレス
+ * @port: ポート番号
+ * @return: ソケットファイルディスクリプタ（エラー時は-1）
  */
 static int connect_to_host(const char *host, int port) {
-    struct hostent *he;
     struct sockaddr_in server_addr;
     int sock;
 
-    he = gethostbyname(host);
-    if (!he) {
+    if (!resolve_host(host, port, &server_addr)) {
         log_error("ホスト名の解決に失敗しました");
         return -1;
     }
@@ -1668,14 +2409,10 @@ static int connect_to_host(const char *host, int port) {
     tv.tv_usec = 0;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr, he->h_addr, he->h_length);
+    set_tcp_nodelay(sock);
 
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        char msg[256];
+        char msg[320];
         snprintf(msg, sizeof(msg), "接続に失敗しました: %s:%d", host, port);
         log_error(msg);
         close(sock);
@@ -1685,284 +2422,949 @@ static int connect_to_host(const char *host, int port) {
     return sock;
 }
 
+/* ============================================================================
+ * HTTPレスポンスパーサ（インクリメンタル）
+ * ============================================================================
+ *
+ * 受信したバイト列を届いた順に http_parser_feed() へ渡すと、
+ * ステータス行・ヘッダを1行ずつ（各行1回だけ）解析し、本文は on_body
+ * コールバックへ届いたそばから渡す。
+ *
+ * - 本文の終端は Content-Length / Transfer-Encoding: chunked / 切断 のいずれか
+ * - 受信済みバッファ全体を再走査しないため、受信量に対して線形時間で動作する
+ * - 本文を1つの配列にまとめる必要がないので、大きなReceive応答や
+ *   復号処理へ順次流し込める
+ *
+ * ブロッキング受信（recv_http_response）とイベントループの両方から使用する。
+ * ============================================================================ */
+
+typedef enum {
+    HP_HEAD,             /* ステータス行・ヘッダ受信中 */
+    HP_BODY,             /* Content-Length分の本文 */
+    HP_BODY_UNTIL_CLOSE, /* 切断までが本文（長さ指定なし） */
+    HP_CHUNK_SIZE,       /* チャンクサイズ（16進数） */
+    HP_CHUNK_EXT,        /* チャンク拡張（行末まで読み飛ばす） */
+    HP_CHUNK_DATA,       /* チャンクデータ */
+    HP_CHUNK_DATA_END,   /* チャンクデータ直後のCRLF */
+    HP_TRAILER,          /* 最終チャンク後のトレーラ */
+    HP_DONE,             /* レスポンス完了 */
+    HP_ERROR             /* 不正なレスポンス */
+} http_parse_state_t;
+
 /*
- * recv_http_response - HTTPレスポンスを受信・解析
+ * http_body_cb - 本文の断片を受け取るコールバック
  *
- * @sock:        ソケットファイルディスクリプタ
- * @buffer:      受信データ格納バッファ
- * @buffer_size: バッファサイズ
- * @http_code:   HTTPステータスコード出力先
- * @auth_header: WWW-AuthenticateヘッダのNTLM部分出力先
- * @return:      受信したバイト数
+ * チャンク形式の場合もチャンク境界は取り除かれ、本文のバイト列だけが渡される。
+ */
+typedef bool (*http_body_cb)(const char *data, size_t len, void *ctx);
+
+typedef struct {
+    http_parse_state_t state;
+    buf_t head;              /* 受信したステータス行・ヘッダ（DEBUG表示にも使用） */
+    size_t line_start;       /* head 内で未解析の行の先頭 */
+    int http_code;           /* ステータスコード（ステータス行受信前は0） */
+    bool http11;             /* HTTP/1.1 か */
+    bool conn_close;         /* Connection: close か */
+    bool chunked;            /* Transfer-Encoding: chunked か */
+    bool has_length;         /* Content-Length があったか */
+    bool encrypted;          /* 本文が multipart/encrypted（NTLMで暗号化）か */
+    size_t content_length;
+    size_t remaining;        /* 本文・現在のチャンクの残りバイト数 */
+    bool chunk_digits;       /* チャンクサイズの数字を1桁以上読んだか */
+    size_t trailer_line_len; /* トレーラの現在行の長さ */
+    char auth_scheme[16];    /* auth_token の認証方式（"Negotiate" / "NTLM"） */
+    buf_t auth_token;        /* WWW-Authenticate のトークン（Negotiate優先） */
+    http_body_cb on_body;
+    void *ctx;
+} http_parser_t;
+
+/*
+ * http_parser_reset - 次のレスポンスの解析に備えて初期化
  *
- * 処理内容:
- * 1. ヘッダ終端（\r\n\r\n）まで受信
- * 2. HTTPステータスコードを抽出
- * 3. WWW-AuthenticateヘッダからNTLMチャレンジを抽出
- * 4. Content-Lengthに基づいて本文を受信
+ * 確保済みのバッファは再利用する。同じ接続で何度も使い回せる。
  */
-static size_t recv_http_response(int sock, char *buffer, size_t buffer_size,
-                                 int *http_code, char *auth_header) {
-    size_t total = 0;
-    size_t header_end = 0;
-    bool headers_done = false;
-    size_t content_length = 0;
+static void http_parser_reset(http_parser_t *p, http_body_cb on_body, void *ctx) {
+    buf_clear(&p->head);
+    buf_clear(&p->auth_token);
+    p->state = HP_HEAD;
+    p->line_start = 0;
+    p->http_code = 0;
+    p->http11 = false;
+    p->conn_close = false;
+    p->chunked = false;
+    p->has_length = false;
+    p->encrypted = false;
+    p->content_length = 0;
+    p->remaining = 0;
+    p->chunk_digits = false;
+    p->trailer_line_len = 0;
+    p->auth_scheme[0] = '\0';
+    p->on_body = on_body;
+    p->ctx = ctx;
+}
 
-    *http_code = 0;
-    auth_header[0] = '\0';
+/* http_parser_free - パーサが確保したバッファを解放 */
+static void http_parser_free(http_parser_t *p) {
+    buf_free(&p->head);
+    buf_free(&p->auth_token);
+}
 
-    while (total < buffer_size - 1) {
-        ssize_t n = recv(sock, buffer + total, buffer_size - 1 - total, 0);
-        if (n <= 0) break;
-        total += n;
-        buffer[total] = '\0';
+/*
+ * http_parse_auth - WWW-Authenticate ヘッダの値を解析
+ *
+ * "Negotiate <token>" / "NTLM <token>" のトークンを取り出す。
+ * 複数のヘッダがある場合はトークン付きのNegotiateを優先する。
+ */
+static void http_parse_auth(http_parser_t *p, const char *value, size_t len) {
+    static const char *const schemes[] = {"Negotiate", "NTLM"};
 
-        if (!headers_done) {
-            char *end = strstr(buffer, "\r\n\r\n");
-            if (end) {
-                headers_done = true;
-                header_end = end - buffer + 4;
+    for (int i = 0; i < 2; i++) {
+        size_t slen = strlen(schemes[i]);
+        if (len <= slen || strncasecmp(value, schemes[i], slen) != 0 || value[slen] != ' ') {
+            continue;
+        }
+        /* すでにNegotiateのトークンがあればNTLMでは上書きしない */
+        if (i == 1 && strcmp(p->auth_scheme, "Negotiate") == 0) return;
+
+        size_t start = slen;
+        size_t end = len;
+        while (start < end && value[start] == ' ') start++;
+        const char *comma = memchr(value + start, ',', end - start);
+        if (comma) end = comma - value;
+        while (end > start && value[end - 1] == ' ') end--;
+        if (end == start) return;
+
+        buf_clear(&p->auth_token);
+        buf_append(&p->auth_token, value + start, end - start);
+        snprintf(p->auth_scheme, sizeof(p->auth_scheme), "%s", schemes[i]);
+        return;
+    }
+}
 
-                /* HTTPステータスコード取得 */
-                if (sscanf(buffer, "HTTP/%*s %d", http_code) != 1) {
-                    *http_code = 0;
-                }
+/*
+ * http_parse_header_line - ステータス行またはヘッダ1行を解析
+ *
+ * @line: 行の先頭（CRLFは含まない）
+ * @len:  行の長さ
+ */
+static void http_parse_header_line(http_parser_t *p, const char *line, size_t len) {
+    if (p->http_code == 0) {
+        /* ステータス行: HTTP/1.1 200 OK */
+        if (len < 12 || strncmp(line, "HTTP/1.", 7) != 0) {
+            p->state = HP_ERROR;
+            return;
+        }
+        p->http11 = line[7] == '1';
+        p->http_code = atoi(line + 9);
+        if (p->http_code <= 0) p->state = HP_ERROR;
+        return;
+    }
 
-                /* WWW-Authenticateヘッダ取得（Negotiate優先、次にNTLM） */
-                char *auth = strcasestr(buffer, "WWW-Authenticate:");
-                if (auth) {
-                    char *token_start = NULL;
-
-                    /* まずNegotiateを探す */
-                    char *negotiate = strcasestr(auth, "Negotiate");
-                    if (negotiate) {
-                        token_start = negotiate + 9;  /* "Negotiate"の長さ */
-                    } else {
-                        /* NTLMを探す */
-                        char *ntlm = strcasestr(auth, "NTLM");
-                        if (ntlm) {
-                            token_start = ntlm + 4;  /* "NTLM"の長さ */
-                        }
-                    }
+    const char *colon = memchr(line, ':', len);
+    if (!colon) return;
+    size_t name_len = colon - line;
+    const char *value = colon + 1;
+    size_t value_len = len - name_len - 1;
+    while (value_len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        value_len--;
+    }
 
-                    if (token_start) {
-                        /* スペースをスキップ */
-                        while (*token_start == ' ') token_start++;
-
-                        /* 改行までがBase64データ */
-                        char *end_auth = strstr(token_start, "\r\n");
-                        if (!end_auth) end_auth = strstr(token_start, "\n");
-
-                        if (end_auth && end_auth > token_start) {
-                            size_t len = end_auth - token_start;
-                            /* カンマがあれば、そこまでがトークンデータ */
-                            char *comma = strchr(token_start, ',');
-                            if (comma && comma < end_auth) {
-                                len = comma - token_start;
-                            }
-                            /* 末尾のスペースを除去 */
-                            while (len > 0 && token_start[len - 1] == ' ') len--;
-
-                            if (len > 0 && len < 4096) {
-                                strncpy(auth_header, token_start, len);
-                                auth_header[len] = '\0';
-                            }
-                        }
-                    }
-                }
+#define HEADER_IS(name) (name_len == sizeof(name) - 1 && strncasecmp(line, name, name_len) == 0)
+    if (HEADER_IS("Content-Length")) {
+        p->content_length = strtoull(value, NULL, 10);
+        p->has_length = true;
+    } else if (HEADER_IS("Transfer-Encoding")) {
+        if (memmem(value, value_len, "chunked", 7)) p->chunked = true;
+    } else if (HEADER_IS("Content-Type")) {
+        if (memmem(value, value_len, "multipart/encrypted", 19)) p->encrypted = true;
+    } else if (HEADER_IS("Connection")) {
+        if (value_len >= 5 && strncasecmp(value, "close", 5) == 0) p->conn_close = true;
+    } else if (HEADER_IS("WWW-Authenticate")) {
+        http_parse_auth(p, value, value_len);
+    }
+#undef HEADER_IS
+}
 
-                /* Content-Length取得 */
-                char *cl = strcasestr(buffer, "Content-Length:");
-                if (cl) {
-                    sscanf(cl + 15, "%zu", &content_length);
-                }
+/* http_parser_end_of_head - ヘッダ終端: 本文の受信方法を決める */
+static void http_parser_end_of_head(http_parser_t *p) {
+    if (p->http_code >= 100 && p->http_code < 200) {
+        /* 100 Continue 等の中間応答: 続く本来のレスポンスを解析し直す */
+        http_parser_reset(p, p->on_body, p->ctx);
+        return;
+    }
+    if (p->http_code == 204 || p->http_code == 304) {
+        p->state = HP_DONE;
+    } else if (p->chunked) {
+        p->state = HP_CHUNK_SIZE;
+        p->remaining = 0;
+        p->chunk_digits = false;
+    } else if (p->has_length) {
+        p->remaining = p->content_length;
+        p->state = p->remaining > 0 ? HP_BODY : HP_DONE;
+    } else {
+        p->state = HP_BODY_UNTIL_CLOSE;
+    }
+}
+
+/* http_parser_emit - 本文の断片をコールバックへ渡す */
+static void http_parser_emit(http_parser_t *p, const char *data, size_t len) {
+    if (len > 0 && p->on_body && !p->on_body(data, len, p->ctx)) {
+        p->state = HP_ERROR;
+    }
+}
+
+/* http_parser_end_of_chunk_size - チャンクサイズ行の終端 */
+static void http_parser_end_of_chunk_size(http_parser_t *p) {
+    if (!p->chunk_digits) {
+        p->state = HP_ERROR;
+    } else if (p->remaining == 0) {
+        p->state = HP_TRAILER;
+        p->trailer_line_len = 0;
+    } else {
+        p->state = HP_CHUNK_DATA;
+    }
+}
+
+/*
+ * http_parser_feed - 受信データを解析
+ *
+ * @data:   受信したバイト列
+ * @len:    バイト数
+ * @return: 消費したバイト数（レスポンスが完了した時点で止まる）
+ *
+ * 呼び出し後に p->state が HP_DONE ならレスポンス完了、HP_ERROR なら不正な応答。
+ */
+static size_t http_parser_feed(http_parser_t *p, const char *data, size_t len) {
+    size_t i = 0;
+
+    while (i < len && p->state != HP_DONE && p->state != HP_ERROR) {
+        switch (p->state) {
+        case HP_HEAD: {
+            /* 改行までを head に追加し、そろった行だけを解析する */
+            const char *nl = memchr(data + i, '\n', len - i);
+            size_t take = nl ? (size_t)(nl - (data + i)) + 1 : len - i;
+            if (p->head.len + take > MAX_BUFFER_SIZE || !buf_append(&p->head, data + i, take)) {
+                p->state = HP_ERROR;
+                break;
+            }
+            i += take;
+            if (!nl) break;
+
+            const char *line = p->head.data + p->line_start;
+            size_t line_len = p->head.len - p->line_start - 1;
+            if (line_len > 0 && line[line_len - 1] == '\r') line_len--;
+            p->line_start = p->head.len;
+
+            if (line_len == 0 && p->http_code != 0) {
+                http_parser_end_of_head(p);
+            } else if (line_len > 0) {
+                http_parse_header_line(p, line, line_len);
+            }
+            break;
+        }
 
-                /* 本文を十分受信したか確認（Content-Length: 0の場合も含む） */
-                if (total >= header_end + content_length) {
+        case HP_BODY:
+        case HP_CHUNK_DATA: {
+            size_t take = len - i < p->remaining ? len - i : p->remaining;
+            http_parser_emit(p, data + i, take);
+            i += take;
+            p->remaining -= take;
+            if (p->remaining == 0 && p->state != HP_ERROR) {
+                p->state = p->state == HP_BODY ? HP_DONE : HP_CHUNK_DATA_END;
+            }
+            break;
+        }
+
+        case HP_BODY_UNTIL_CLOSE:
+            http_parser_emit(p, data + i, len - i);
+            i = len;
+            break;
+
+        case HP_CHUNK_SIZE: {
+            char c = data[i++];
+            int digit = c >= '0' && c <= '9' ? c - '0'
+                      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit >= 0) {
+                if (p->remaining > (SIZE_MAX >> 4)) {
+                    p->state = HP_ERROR;
                     break;
                 }
+                p->remaining = (p->remaining << 4) | (size_t)digit;
+                p->chunk_digits = true;
+            } else if (c == ';' || c == ' ' || c == '\t') {
+                p->state = HP_CHUNK_EXT;
+            } else if (c == '\n') {
+                http_parser_end_of_chunk_size(p);
+            } else if (c != '\r') {
+                p->state = HP_ERROR;
             }
-        } else {
-            if (total >= header_end + content_length) {
-                break;
+            break;
+        }
+
+        case HP_CHUNK_EXT:
+            if (data[i++] == '\n') http_parser_end_of_chunk_size(p);
+            break;
+
+        case HP_CHUNK_DATA_END: {
+            char c = data[i++];
+            if (c == '\n') {
+                p->state = HP_CHUNK_SIZE;
+                p->chunk_digits = false;
+            } else if (c != '\r') {
+                p->state = HP_ERROR;
             }
+            break;
         }
-    }
 
-    return total;
+        case HP_TRAILER: {
+            char c = data[i++];
+            if (c == '\n') {
+                if (p->trailer_line_len == 0) p->state = HP_DONE;
+                p->trailer_line_len = 0;
+            } else if (c != '\r') {
+                p->trailer_line_len++;
+            }
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+    return i;
 }
 
 /*
- * send_http_with_ntlm - Negotiate (SPNEGO/NTLM) 認証を行いHTTP POSTリクエストを送信
+ * http_parser_finish - 接続が閉じられたことを通知
  *
- * @host:          接続先ホスト
- * @port:          接続先ポート
- * @body:          リクエスト本文（SOAP XML）
- * @response:      レスポンス本文格納バッファ
- * @response_size: バッファサイズ
- * @return:        成功時true
+ * @return: レスポンスが完了していればtrue（長さ指定のない本文は切断で完了する）
+ */
+static bool http_parser_finish(http_parser_t *p) {
+    if (p->state == HP_BODY_UNTIL_CLOSE) p->state = HP_DONE;
+    return p->state == HP_DONE;
+}
+
+/*
+ * http_parser_keep_alive - レスポンス後も接続を再利用できるか
  *
- * 処理フロー:
- * 1. まず直接NTLMで認証を試行
- * 2. 失敗した場合、SPNEGO/Negotiateで認証を試行
+ * HTTP/1.1で Connection: close がなく、本文の終端が切断以外で判定できた場合のみ。
  */
-static bool send_http_with_ntlm(const char *host, int port, const char *body,
-                                char *response, size_t response_size) {
-    int sock;
-    char request[MAX_BUFFER_SIZE];
-    char recv_buffer[MAX_BUFFER_SIZE];
-    int http_code;
-    char auth_header[4096];
-    bool use_spnego = false;
+static bool http_parser_keep_alive(const http_parser_t *p) {
+    return p->state == HP_DONE && p->http11 && !p->conn_close &&
+           (p->chunked || p->has_length || p->http_code == 204 || p->http_code == 304);
+}
 
-    /* NTLM Type 1メッセージを生成 */
-    uint8_t type1[64];
-    size_t type1_len = ntlm_create_type1(type1, sizeof(type1));
+/* ============================================================================
+ * 暗号化レスポンスの復号（multipart/encrypted）
+ * ============================================================================
+ *
+ * AllowUnencrypted=false のサーバーは、レスポンスも送信時と同じ
+ * multipart/encrypted 形式で暗号化して返す（seal_request() 参照）。
+ *
+ * ntlm_unseal_body() を http_parser_t の本文コールバックとして使い、
+ * 届いた本文を順に処理する:
+ * 1. パートの見出し行から平文長（OriginalContent の Length）を取得
+ * 2. 署名長（4バイト）と署名（16バイト）を読み取る
+ * 3. 暗号化データを出力バッファへ追加し、追加した範囲をその場でRC4復号して
+ *    署名のHMAC-MD5へ順に流し込む
+ * 4. パートの終端で署名（チェックサム・シーケンス番号）を検証
+ *
+ * 本文全体を別の配列へコピーしてから復号することはしない。
+ * 認証済みの接続では、暗号化されていない本文は受け付けない（経路上で差し込まれた
+ * 署名なしのSOAPを、ExitCodeやStreamとして扱わないように）。サーバーが暗号化せずに
+ * 返すエラー（401・400・503等。SOAP Faultの500は暗号化される）の本文のみそのまま出力する。
+ * 認証前（ハンドシェイク中）のレスポンスはそのまま出力する。
+ * ============================================================================ */
 
-    /*
-     * Step 1: まず直接NTLMで試行
-     * 重要: NTLM認証は接続ベースなので、Type 2を受信した接続を維持する
-     */
-    sock = connect_to_host(host, port);
-    if (sock < 0) return false;
+typedef enum {
+    UNSEAL_PART_HEADER,  /* パートの見出し行 */
+    UNSEAL_SIG_LEN,      /* 署名長（4バイトLE） */
+    UNSEAL_SIGNATURE,    /* 署名（16バイト） */
+    UNSEAL_DATA,         /* 暗号化データ */
+    UNSEAL_DONE          /* 終端の境界を受信した */
+} unseal_state_t;
 
-    char type1_b64[256];
-    base64_encode(type1, type1_len, type1_b64);
+typedef struct {
+    ntlm_session_t *ntlm;        /* 復号・検証に使うセッション（NULL: 平文のみ） */
+    const http_parser_t *http;   /* Content-Type の判定に使うパーサ */
+    buf_t *out;                  /* 復号した本文の格納先 */
+    unseal_state_t state;
+    char line[256];              /* 見出し行（長すぎる部分は切り捨て） */
+    size_t line_len;
+    size_t plain_len;            /* 現在のパートの平文長 */
+    bool has_plain_len;
+    uint8_t sig[16];             /* 署名長・署名の受信バッファ */
+    size_t sig_got;
+    hmac_md5_ctx_t mac;          /* 現在のパートのチェックサム計算 */
+    size_t remaining;            /* 現在のパートの残りバイト数 */
+    int parts;                   /* 復号・検証したパート数 */
+} ntlm_unseal_t;
+
+/* ntlm_unseal_reset - 次のレスポンスに備えて初期化 */
+static void ntlm_unseal_reset(ntlm_unseal_t *u, ntlm_session_t *ntlm,
+                              const http_parser_t *http, buf_t *out) {
+    memset(u, 0, sizeof(*u));
+    u->ntlm = ntlm;
+    u->http = http;
+    u->out = out;
+}
 
-    snprintf(request, sizeof(request),
-             "POST /wsman HTTP/1.1\r\n"
-             "Host: %s:%d\r\n"
-             "Authorization: NTLM %s\r\n"
-             "Content-Type: application/soap+xml;charset=UTF-8\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: keep-alive\r\n"
-             "\r\n%s",
-             host, port, type1_b64, strlen(body), body);
+/* ntlm_unseal_header_line - パートの見出し行を1行処理 */
+static bool ntlm_unseal_header_line(ntlm_unseal_t *u) {
+    char *line = u->line;
+    size_t len = u->line_len;
+    if (len > 0 && line[len - 1] == '\r') len--;
+    line[len] = '\0';
 
-    if (DEBUG) {
-        log_info("NTLM Type 1メッセージ送信中（直接NTLM）...");
+    if (len >= 4 && strncmp(line, "--", 2) == 0 && strcmp(line + len - 2, "--") == 0) {
+        u->state = UNSEAL_DONE;
+        return true;
     }
 
-    ssize_t sent = send(sock, request, strlen(request), MSG_NOSIGNAL);
-    if (sent < 0) {
-        log_error("Type 1メッセージの送信に失敗しました");
-        close(sock);
-        return false;
+    char *length = strstr(line, "Length=");
+    if (length) {
+        u->plain_len = strtoull(length + 7, NULL, 10);
+        u->has_plain_len = true;
     }
 
-    recv_http_response(sock, recv_buffer, sizeof(recv_buffer), &http_code, auth_header);
-
-    /* 直接NTLMでチャレンジを受信できなかった場合、SPNEGOを試行 */
-    if (http_code == 401 && auth_header[0] == '\0') {
-        close(sock);  /* 直接NTLMが失敗したので接続を閉じる */
-
-        if (DEBUG) {
-            log_info("直接NTLMは利用不可、SPNEGOで再試行...");
+    if (strcasestr(line, "application/octet-stream")) {
+        if (!u->has_plain_len) {
+            log_error("暗号化レスポンスに平文長（OriginalContent）がありません");
+            return false;
         }
-        use_spnego = true;
+        u->state = UNSEAL_SIG_LEN;
+        u->sig_got = 0;
+    }
+    return true;
+}
 
-        /* 新しい接続でSPNEGOを試行 */
-        sock = connect_to_host(host, port);
-        if (sock < 0) return false;
+/* ntlm_unseal_end_of_part - パートの暗号化データをすべて復号した: 署名を検証 */
+static bool ntlm_unseal_end_of_part(ntlm_unseal_t *u) {
+    if (!ntlm_verify_signature(u->ntlm, &u->mac, u->sig)) {
+        log_error("暗号化レスポンスの署名検証に失敗しました（改ざん、またはシーケンス番号の不一致）");
+        return false;
+    }
+    u->parts++;
+    u->state = UNSEAL_PART_HEADER;
+    u->has_plain_len = false;
+    return true;
+}
 
-        /* SPNEGOでラップ */
-        uint8_t spnego_init[4096];
-        size_t spnego_init_len = spnego_create_neg_token_init(type1, type1_len,
-                                                              spnego_init, sizeof(spnego_init));
+/*
+ * ntlm_unseal_plain_allowed - 暗号化されていない本文を受け付けてよいか
+ *
+ * @return: 認証前、またはサーバーが暗号化しないエラー応答（400以上、500を除く）ならtrue
+ */
+static bool ntlm_unseal_plain_allowed(const ntlm_unseal_t *u) {
+    int code = u->http->http_code;
+    if (!u->ntlm || (code >= 400 && code != 500)) return true;
+
+    char msg[96];
+    snprintf(msg, sizeof(msg), "暗号化されていないレスポンスを拒否しました (HTTP %d)", code);
+    log_error(msg);
+    return false;
+}
 
-        char spnego_init_b64[8192];
-        base64_encode(spnego_init, spnego_init_len, spnego_init_b64);
+/*
+ * ntlm_unseal_body - http_parser_t の本文コールバック（ctx: ntlm_unseal_t）
+ *
+ * @return: 不正な形式・署名の不一致の場合false（レスポンスはエラーになる）
+ */
+static bool ntlm_unseal_body(const char *data, size_t len, void *ctx) {
+    ntlm_unseal_t *u = ctx;
 
-        snprintf(request, sizeof(request),
-                 "POST /wsman HTTP/1.1\r\n"
-                 "Host: %s:%d\r\n"
-                 "Authorization: Negotiate %s\r\n"
-                 "Content-Type: application/soap+xml;charset=UTF-8\r\n"
-                 "Content-Length: %zu\r\n"
-                 "Connection: keep-alive\r\n"
-                 "\r\n%s",
-                 host, port, spnego_init_b64, strlen(body), body);
+    if (!u->http->encrypted) {
+        return ntlm_unseal_plain_allowed(u) && buf_append(u->out, data, len);
+    }
+    if (!u->ntlm) {
+        log_error("認証前に暗号化レスポンスを受信しました");
+        return false;
+    }
 
-        if (DEBUG) {
-            log_info("SPNEGO/NTLM Type 1メッセージ送信中...");
+    size_t i = 0;
+    while (i < len) {
+        switch (u->state) {
+        case UNSEAL_PART_HEADER: {
+            char c = data[i++];
+            if (c == '\n') {
+                if (!ntlm_unseal_header_line(u)) return false;
+                u->line_len = 0;
+            } else if (u->line_len < sizeof(u->line) - 1) {
+                u->line[u->line_len++] = c;
+            }
+            break;
         }
 
-        sent = send(sock, request, strlen(request), MSG_NOSIGNAL);
-        if (sent < 0) {
-            log_error("Type 1メッセージの送信に失敗しました");
-            close(sock);
-            return false;
+        case UNSEAL_SIG_LEN:
+        case UNSEAL_SIGNATURE: {
+            size_t need = (u->state == UNSEAL_SIG_LEN ? 4 : 16) - u->sig_got;
+            size_t take = len - i < need ? len - i : need;
+            memcpy(u->sig + u->sig_got, data + i, take);
+            u->sig_got += take;
+            i += take;
+            if (u->sig_got < (u->state == UNSEAL_SIG_LEN ? 4u : 16u)) break;
+
+            if (u->state == UNSEAL_SIG_LEN) {
+                uint32_t sig_len;
+                memcpy(&sig_len, u->sig, 4);
+                if (sig_len != 16) {
+                    log_error("暗号化レスポンスの署名長が不正です");
+                    return false;
+                }
+                u->state = UNSEAL_SIGNATURE;
+                u->sig_got = 0;
+                break;
+            }
+            ntlm_mac_init(&u->mac, &u->ntlm->server);
+            u->remaining = u->plain_len;
+            u->state = UNSEAL_DATA;
+            if (u->remaining == 0 && !ntlm_unseal_end_of_part(u)) return false;
+            break;
         }
 
-        recv_http_response(sock, recv_buffer, sizeof(recv_buffer), &http_code, auth_header);
+        case UNSEAL_DATA: {
+            /* 出力バッファへ追加し、追加した範囲だけをその場で復号する */
+            size_t take = len - i < u->remaining ? len - i : u->remaining;
+            if (!buf_append(u->out, data + i, take)) return false;
+            uint8_t *p = (uint8_t *)u->out->data + u->out->len - take;
+            rc4_apply(&u->ntlm->server.rc4, p, take, p);
+            hmac_md5_update(&u->mac, p, take);
+            i += take;
+            u->remaining -= take;
+            if (u->remaining == 0 && !ntlm_unseal_end_of_part(u)) return false;
+            break;
+        }
 
-        if (DEBUG) {
-            log_info("Type 2レスポンスヘッダー:");
-            /* ヘッダー部分のみ出力 */
-            char *header_end = strstr(recv_buffer, "\r\n\r\n");
-            if (header_end) {
-                char header_copy[2048];
-                size_t header_len = header_end - recv_buffer;
-                if (header_len >= sizeof(header_copy)) header_len = sizeof(header_copy) - 1;
-                memcpy(header_copy, recv_buffer, header_len);
-                header_copy[header_len] = '\0';
-                fprintf(stderr, "%s\n", header_copy);
-            }
+        case UNSEAL_DONE:
+            i = len;
+            break;
         }
-        /* この接続は維持する（Type 3送信用） */
     }
+    return true;
+}
 
-    if (http_code != 401 || auth_header[0] == '\0') {
-        close(sock);
-        char err_msg[256];
-        snprintf(err_msg, sizeof(err_msg),
-                 "認証のチャレンジ応答を受信できませんでした (HTTP %d)", http_code);
-        log_error(err_msg);
-        if (http_code == 0) {
-            log_error("サーバーからの応答がありません。接続先とポートを確認してください");
-        } else if (http_code == 401 && auth_header[0] == '\0') {
-            log_error("401応答に認証チャレンジが含まれていません");
-        }
+/*
+ * ntlm_unseal_complete - レスポンス受信完了時に、復号が最後まで済んだか確認
+ */
+static bool ntlm_unseal_complete(const ntlm_unseal_t *u) {
+    if (!u->http->encrypted) return ntlm_unseal_plain_allowed(u);
+    if (u->parts == 0 || (u->state != UNSEAL_PART_HEADER && u->state != UNSEAL_DONE)) {
+        log_error("暗号化レスポンスが途中で終わっています");
         return false;
     }
+    return true;
+}
 
-    /* Step 2: Type 2メッセージを解析（接続は維持したまま） */
-    uint8_t type2_raw[4096];
-    size_t type2_raw_len = base64_decode(auth_header, type2_raw, sizeof(type2_raw));
-
-    uint8_t type2[2048];
-    size_t type2_len;
+/*
+ * recv_http_response - HTTPレスポンスを受信・解析
+ *
+ * @sock:        ソケットファイルディスクリプタ
+ * @ntlm:        暗号化レスポンスの復号に使うセッション（NULL: 認証ハンドシェイク中）
+ * @body:        本文の格納先（クリアしてから受信、ヘッダは含まない・サイズ上限なし）
+ * @http_code:   HTTPステータスコード出力先（応答なし・不正な応答の場合0）
+ * @auth_header: WWW-Authenticateヘッダのトークン出力先（4096バイト）
+ * @keep_alive:  接続を再利用可能かの出力先（NULL可）
+ * @ahead:       先読みバッファ（前回の受信で余ったバイト。今回余った分もここへ残す）
+ * @return:      受信したバイト数
+ *
+ * 受信したデータを http_parser_feed() へ順に渡し、レスポンスが完了するか
+ * 接続が閉じられるまで受信する。本文は ntlm_unseal_body() で（暗号化されて
+ * いれば復号・検証して）body に集める。
+ * リクエストをパイプライン送信している場合、1回のrecvに次のレスポンスの先頭が
+ * 含まれることがあるため、このレスポンスで消費しなかった分は ahead に残す。
+ */
+static size_t recv_http_response(int sock, ntlm_session_t *ntlm, buf_t *body,
+                                 int *http_code, char *auth_header, bool *keep_alive,
+                                 buf_t *ahead) {
+    http_parser_t parser = {0};
+    ntlm_unseal_t unseal;
+    char block[16384];
+    size_t total = 0;
 
-    if (use_spnego) {
-        /* SPNEGOからNTLMを抽出 */
-        type2_len = spnego_parse_neg_token_resp(type2_raw, type2_raw_len, type2, sizeof(type2));
-        if (type2_len == 0) {
-            log_error("SPNEGOレスポンスからNTLMメッセージを抽出できませんでした");
-            close(sock);
-            return false;
+    *http_code = 0;
+    auth_header[0] = '\0';
+    if (keep_alive) *keep_alive = false;
+    buf_clear(body);
+    if (!buf_reserve(body, 0)) return 0;
+
+    ntlm_unseal_reset(&unseal, ntlm, &parser, body);
+    http_parser_reset(&parser, ntlm_unseal_body, &unseal);
+    if (ahead->len > 0) {
+        total += ahead->len;
+        buf_consume(ahead, http_parser_feed(&parser, ahead->data, ahead->len));
+    }
+    while (parser.state != HP_DONE && parser.state != HP_ERROR) {
+        ssize_t n = recv(sock, block, sizeof(block), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            http_parser_finish(&parser);
+            break;
+        }
+        total += n;
+        size_t used = http_parser_feed(&parser, block, n);
+        if (used < (size_t)n && !buf_append(ahead, block + used, n - used)) {
+            parser.state = HP_ERROR;
         }
-    } else {
-        /* 直接NTLMの場合はそのまま使用 */
-        memcpy(type2, type2_raw, type2_raw_len);
-        type2_len = type2_raw_len;
     }
 
-    uint8_t challenge[8];
-    uint32_t flags;
-    uint8_t target_info[1024];
-    size_t target_info_len = 0;
+    if (DEBUG && parser.head.len > 0) {
+        log_info("レスポンスヘッダー:");
+        fprintf(stderr, "%.*s", (int)parser.head.len, parser.head.data);
+    }
 
-    if (!ntlm_parse_type2(type2, type2_len, challenge, &flags, target_info, &target_info_len)) {
-        log_error("Type 2メッセージの解析に失敗しました");
-        close(sock);
-        return false;
+    /* 本文を最後まで読めなかった応答・復号できなかった応答は不完全として扱う（接続も再利用しない） */
+    if (parser.state == HP_DONE && ntlm_unseal_complete(&unseal)) {
+        *http_code = parser.http_code;
+        if (parser.auth_token.len > 0 && parser.auth_token.len < 4096) {
+            memcpy(auth_header, parser.auth_token.data, parser.auth_token.len + 1);
+        }
+        if (keep_alive) *keep_alive = http_parser_keep_alive(&parser);
     }
 
-    if (DEBUG) {
-        log_info("Type 2メッセージ受信・解析成功");
-        char flag_msg[256];
-        snprintf(flag_msg, sizeof(flag_msg), "サーバーフラグ: 0x%08X", flags);
-        log_info(flag_msg);
+    http_parser_free(&parser);
+    return total;
+}
+
+/* ============================================================================
+ * 認証方式キャッシュ
+ * ============================================================================
+ *
+ * ホストごとに、チャレンジを返した認証方式（直接NTLM / Negotiate(SPNEGO)）を記録する。
+ * Negotiateしか受け付けないホストへ毎回直接NTLMを送ると、
+ * 「401（チャレンジなし）→ 切断 → 再接続」の1往復が毎回無駄になるため、
+ * 2回目以降は最初から記録した方式で接続する。
+ *
+ * - メモリ上の表は、プロセス内の全リクエスト・全ファンアウトセッションで共有
+ * - AUTH_CACHE_ENABLED が1の場合は $XDG_CACHE_HOME/winrm_exec/auth_mechs
+ *   （未設定時は ~/.cache/winrm_exec/auth_mechs）にも保存し、次回の起動で使用する
+ * - 記録した方式でチャレンジが返らなければ、もう一方の方式で再試行して記録を更新する
+ *
+ * ファイル形式（1行1ホスト）: <ホスト> <ポート> <ntlm|negotiate> <記録時刻(UNIX時間)>
+ * ============================================================================ */
+
+typedef struct {
+    char host[256];
+    int port;
+    bool use_spnego;      /* true: Negotiate(SPNEGO), false: 直接NTLM */
+    time_t updated;       /* 記録した時刻 */
+} auth_cache_entry_t;
+
+static auth_cache_entry_t *g_auth_cache;
+static size_t g_auth_cache_count;
+static size_t g_auth_cache_cap;
+static bool g_auth_cache_loaded;   /* ファイルを読み込み済みか */
+static bool g_auth_cache_dirty;    /* ファイルへ書き戻す変更があるか */
+
+/*
+ * auth_cache_path - キャッシュファイルのパスを取得
+ *
+ * @dir_only: trueならディレクトリのパスを返す
+ * @return:   パスを決められない場合（HOME未設定等）false
+ */
+static bool auth_cache_path(char *path, size_t size, bool dir_only) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+
+    if (xdg && xdg[0] == '/') {
+        n = snprintf(path, size, "%s/winrm_exec%s", xdg, dir_only ? "" : "/auth_mechs");
+    } else if (home && home[0]) {
+        n = snprintf(path, size, "%s/.cache/winrm_exec%s", home, dir_only ? "" : "/auth_mechs");
+    } else {
+        return false;
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+/* auth_cache_find - メモリ上の表からホストを検索 */
+static auth_cache_entry_t *auth_cache_find(const char *host, int port) {
+    for (size_t i = 0; i < g_auth_cache_count; i++) {
+        if (g_auth_cache[i].port == port && strcmp(g_auth_cache[i].host, host) == 0) {
+            return &g_auth_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/* auth_cache_add - 表にエントリを追加 */
+static auth_cache_entry_t *auth_cache_add(const char *host, int port) {
+    if (g_auth_cache_count == g_auth_cache_cap) {
+        size_t cap = g_auth_cache_cap ? g_auth_cache_cap * 2 : 16;
+        auth_cache_entry_t *p = realloc(g_auth_cache, cap * sizeof(*p));
+        if (!p) return NULL;
+        g_auth_cache = p;
+        g_auth_cache_cap = cap;
+    }
+    auth_cache_entry_t *e = &g_auth_cache[g_auth_cache_count++];
+    memset(e, 0, sizeof(*e));
+    snprintf(e->host, sizeof(e->host), "%s", host);
+    e->port = port;
+    return e;
+}
+
+/* auth_cache_load - キャッシュファイルを読み込む（初回の参照時に1回だけ） */
+static void auth_cache_load(void) {
+    g_auth_cache_loaded = true;
+    if (!g_auth_cache_enabled) return;
+
+    char path[512];
+    if (!auth_cache_path(path, sizeof(path), false)) return;
+    FILE *fp = fopen(path, "r");
+    if (!fp) return;
+
+    char line[512];
+    time_t now = time(NULL);
+    while (fgets(line, sizeof(line), fp)) {
+        char host[256], mech[16];
+        int port;
+        long long updated;
+        if (sscanf(line, "%255s %d %15s %lld", host, &port, mech, &updated) != 4) continue;
+        if (now - (time_t)updated > AUTH_CACHE_TTL) continue;   /* 古い記録は捨てる */
+        if (auth_cache_find(host, port)) continue;
+
+        auth_cache_entry_t *e = auth_cache_add(host, port);
+        if (!e) break;
+        e->use_spnego = strcmp(mech, "negotiate") == 0;
+        e->updated = (time_t)updated;
+    }
+    fclose(fp);
+}
+
+/*
+ * auth_cache_lookup - ホストで使う認証方式を取得
+ *
+ * @return: Negotiate(SPNEGO)で接続すべきならtrue（記録がなければ直接NTLM = false）
+ */
+static bool auth_cache_lookup(const char *host, int port) {
+    if (!g_auth_cache_loaded) auth_cache_load();
+    auth_cache_entry_t *e = auth_cache_find(host, port);
+    return e ? e->use_spnego : false;
+}
+
+/*
+ * auth_cache_store - 認証に成功した方式を記録
+ *
+ * ファイルへの書き戻しは auth_cache_flush()（終了時）でまとめて行う。
+ */
+static void auth_cache_store(const char *host, int port, bool use_spnego) {
+    if (!g_auth_cache_loaded) auth_cache_load();
+    auth_cache_entry_t *e = auth_cache_find(host, port);
+    time_t now = time(NULL);
+
+    if (!e) {
+        e = auth_cache_add(host, port);
+        if (!e) return;
+    } else if (e->use_spnego == use_spnego && now - e->updated < AUTH_CACHE_TTL / 2) {
+        return;   /* 変更なし（記録時刻の更新も不要） */
+    }
+    e->use_spnego = use_spnego;
+    e->updated = now;
+    g_auth_cache_dirty = true;
+}
+
+/*
+ * auth_cache_flush - 変更があればキャッシュファイルへ書き戻す（atexitで登録）
+ *
+ * 一時ファイルへ書いてからrenameするため、同時に実行中の他のプロセスが
+ * 書きかけのファイルを読むことはない（最後に書いたプロセスの内容が残る）。
+ */
+static void auth_cache_flush(void) {
+    if (!g_auth_cache_enabled || !g_auth_cache_dirty) return;
+    g_auth_cache_dirty = false;
+
+    char dir[512], path[512], tmp[560];
+    if (!auth_cache_path(dir, sizeof(dir), true) || !auth_cache_path(path, sizeof(path), false)) {
+        return;
+    }
+
+    /* $XDG_CACHE_HOME（~/.cache）自体がなければ作成する */
+    char *slash = strrchr(dir, '/');
+    if (slash && slash != dir) {
+        *slash = '\0';
+        mkdir(dir, 0700);
+        *slash = '/';
+    }
+    mkdir(dir, 0700);
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    FILE *fp = fdopen(fd, "w");
+    if (!fp) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+
+    for (size_t i = 0; i < g_auth_cache_count; i++) {
+        auth_cache_entry_t *e = &g_auth_cache[i];
+        fprintf(fp, "%s %d %s %lld\n", e->host, e->port,
+                e->use_spnego ? "negotiate" : "ntlm", (long long)e->updated);
+    }
+    if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+    }
+}
+
+/* ============================================================================
+ * WinRMコネクション（認証済みkeep-alive接続）
+ * ============================================================================
+ *
+ * 【なぜ接続を維持するのか】
+ * NTLM認証は「接続」に対して成立する。リクエストごとに新しいソケットを開くと、
+ * そのたびにTCP接続 + Type 1/2/3のハンドシェイク（3往復）が必要になり、
+ * Receiveのポーリングを含めると1回のバッチ実行で数百往復になる。
+ *
+ * そこで、一度認証を完了したソケットとNTLMセッション状態
+ * （シーケンス番号・RC4ストリーム状態）をwinrm_conn_tに保持し、
+ * Create / Command / Receive / Delete のすべてで使い回す。
+ *
+ * 【再認証の条件】
+ * - サーバーが接続を閉じた（送信失敗、または応答なしで切断）
+ * - サーバーが401を返した（認証コンテキストの失効）
+ * この場合のみ接続を張り直して再認証し、リクエストを1回だけ再送する。
+ * ============================================================================ */
+
+typedef struct {
+    char host[256];           /* 接続先ホスト */
+    int port;                 /* 接続先ポート */
+    char user[256];           /* 認証ユーザー（プールのキー） */
+    char domain[256];         /* 認証ドメイン（プールのキー） */
+    int sock;                 /* ソケット（-1: 未接続） */
+    bool authenticated;       /* Type 3まで完了しているか */
+    bool use_spnego;          /* Negotiate(SPNEGO)でラップしたか */
+    ntlm_session_t ntlm;      /* Signing/Sealing状態（接続ごと） */
+    buf_t ahead;              /* 受信済みで未処理のバイト（パイプライン送信した次の応答の先頭） */
+    bool allocated;           /* プールのスロットを使用中か */
+    bool in_use;              /* チェックアウト中か */
+    uint64_t last_used_ms;    /* 最後にチェックインした時刻（単調時計） */
+} winrm_conn_t;
+
+/* 認証済み接続のプール */
+static winrm_conn_t g_pool[POOL_MAX_CONNS];
+
+/*
+ * conn_init - コネクションを初期化（まだ接続はしない）
+ */
+static void conn_init(winrm_conn_t *conn, const char *host, int port,
+                      const char *user, const char *domain) {
+    memset(conn, 0, sizeof(*conn));
+    snprintf(conn->host, sizeof(conn->host), "%s", host);
+    snprintf(conn->user, sizeof(conn->user), "%s", user);
+    snprintf(conn->domain, sizeof(conn->domain), "%s", domain);
+    conn->port = port;
+    conn->sock = -1;
+}
+
+/*
+ * conn_close - ソケットを閉じ、認証状態を破棄
+ */
+static void conn_close(winrm_conn_t *conn) {
+    if (conn->sock >= 0) {
+        close(conn->sock);
+    }
+    conn->sock = -1;
+    conn->authenticated = false;
+    memset(&conn->ntlm, 0, sizeof(conn->ntlm));
+    buf_free(&conn->ahead);
+}
+
+/*
+ * build_auth_request - 認証ヘッダ付きの空POSTリクエストを組み立てる
+ *
+ * @return: リクエスト長
+ */
+static size_t build_auth_request(char *request, size_t size, const char *host, int port,
+                                 const char *scheme, const char *token) {
+    int len = snprintf(request, size,
+                       "POST /wsman HTTP/1.1\r\n"
+                       "Host: %s:%d\r\n"
+                       "Authorization: %s %s\r\n"
+                       "Content-Type: application/soap+xml;charset=UTF-8\r\n"
+                       "Content-Length: 0\r\n"
+                       "Connection: keep-alive\r\n"
+                       "\r\n",
+                       host, port, scheme, token);
+    return len < 0 ? 0 : ((size_t)len < size ? (size_t)len : size - 1);
+}
+
+/*
+ * ntlm_negotiate_token - Type 1メッセージを生成し、認証ヘッダ用のBase64トークンにする
+ *
+ * @use_spnego: trueならSPNEGO(NegTokenInit)でラップする
+ * @type1:      生成したType 1の出力先（MIC計算用に保持する。64バイト）
+ * @type1_len:  Type 1の長さ出力先
+ * @token_b64:  Base64トークンの出力先
+ */
+static void ntlm_negotiate_token(bool use_spnego, uint8_t *type1, size_t *type1_len,
+                                 char *token_b64) {
+    *type1_len = ntlm_create_type1(type1, 64);
+
+    if (use_spnego) {
+        uint8_t spnego_init[4096];
+        size_t spnego_init_len = spnego_create_neg_token_init(type1, *type1_len,
+                                                              spnego_init, sizeof(spnego_init));
+        base64_encode(spnego_init, spnego_init_len, token_b64);
+    } else {
+        base64_encode(type1, *type1_len, token_b64);
+    }
+}
+
+/*
+ * ntlm_authenticate_token - Type 2チャレンジからType 3トークンを生成
+ *
+ * @auth_header: WWW-Authenticateのトークン部分（Base64）
+ * @use_spnego:  SPNEGOでラップされているか
+ * @type1:       送信済みのType 1（MIC計算用）
+ * @type1_len:   Type 1の長さ
+ * @cred:        導出済み資格情報
+ * @ntlm:        Signing/Sealingキーの出力先
+ * @auth_b64:    Type 3のBase64トークン出力先（16384バイト）
+ * @return:      成功時true
+ */
+static bool ntlm_authenticate_token(const char *auth_header, bool use_spnego,
+                                    const uint8_t *type1, size_t type1_len,
+                                    const ntlm_credential_t *cred,
+                                    ntlm_session_t *ntlm, char *auth_b64) {
+    /* Type 2メッセージを解析 */
+    uint8_t type2_raw[4096];
+    size_t type2_raw_len = base64_decode(auth_header, strlen(auth_header),
+                                         type2_raw, sizeof(type2_raw));
+
+    uint8_t type2[2048];
+    size_t type2_len;
+
+    if (use_spnego) {
+        /* SPNEGOからNTLMを抽出 */
+        type2_len = spnego_parse_neg_token_resp(type2_raw, type2_raw_len, type2, sizeof(type2));
+        if (type2_len == 0) {
+            log_error("SPNEGOレスポンスからNTLMメッセージを抽出できませんでした");
+            return false;
+        }
+    } else {
+        /* 直接NTLMの場合はそのまま使用 */
+        if (type2_raw_len > sizeof(type2)) type2_raw_len = sizeof(type2);
+        memcpy(type2, type2_raw, type2_raw_len);
+        type2_len = type2_raw_len;
+    }
+
+    uint8_t challenge[8];
+    uint32_t flags;
+    uint8_t target_info[1024];
+    size_t target_info_len = 0;
+
+    if (!ntlm_parse_type2(type2, type2_len, challenge, &flags, target_info, &target_info_len)) {
+        log_error("Type 2メッセージの解析に失敗しました");
+        return false;
+    }
+
+    if (DEBUG) {
+        log_info("Type 2メッセージ受信・解析成功");
+        char flag_msg[256];
+        snprintf(flag_msg, sizeof(flag_msg), "サーバーフラグ: 0x%08X", flags);
+        log_info(flag_msg);
         if (flags & NTLMSSP_NEGOTIATE_KEY_EXCH) {
             log_info("  - KEY_EXCH: 有効");
         }
@@ -1986,14 +3388,10 @@ static bool send_http_with_ntlm(const char *host, int port, const char *body,
         log_info(ti_msg);
     }
 
-    /*
-     * Step 3: Type 3メッセージを送信
-     * 重要: Type 2を受信した同じ接続（sock）を使用する
-     */
+    /* Type 3メッセージを生成 */
     uint8_t type3[4096];
     uint8_t exported_session_key[16];
-    size_t type3_len = ntlm_create_type3(g_user, g_pass, g_domain,
-                                          challenge, target_info, target_info_len,
+    size_t type3_len = ntlm_create_type3(cred, challenge, target_info, target_info_len,
                                           flags,
                                           type1, type1_len,
                                           type2, type2_len,
@@ -2025,70 +3423,152 @@ static bool send_http_with_ntlm(const char *host, int port, const char *body,
         }
     }
 
-    char auth_b64[16384];
-
     /* NTLMセッションを初期化してSigning/Sealingキーを派生 */
-    ntlm_session_t ntlm_session;
-    ntlm_derive_keys(exported_session_key, &ntlm_session);
+    ntlm_derive_keys(exported_session_key, ntlm);
 
     if (DEBUG) {
         log_info("NTLM Signing/Sealingキー派生完了");
     }
 
-    /* ===== ステップ1: Type 3のみで認証を確立 ===== */
     if (use_spnego) {
         /* SPNEGOでラップ */
         uint8_t spnego_auth[8192];
         size_t spnego_auth_len = spnego_create_neg_token_resp(type3, type3_len,
                                                               spnego_auth, sizeof(spnego_auth));
         base64_encode(spnego_auth, spnego_auth_len, auth_b64);
-
-        snprintf(request, sizeof(request),
-                 "POST /wsman HTTP/1.1\r\n"
-                 "Host: %s:%d\r\n"
-                 "Authorization: Negotiate %s\r\n"
-                 "Content-Type: application/soap+xml;charset=UTF-8\r\n"
-                 "Content-Length: 0\r\n"
-                 "Connection: keep-alive\r\n"
-                 "\r\n",
-                 host, port, auth_b64);
     } else {
         /* 直接NTLM */
         base64_encode(type3, type3_len, auth_b64);
+    }
+    return true;
+}
+
+/*
+ * send_auth_request - 認証ヘッダ付きの空POSTを送信
+ *
+ * @scheme: "NTLM" または "Negotiate"
+ * @token:  Base64エンコード済みトークン
+ *
+ * ハンドシェイク中は本文を送らない（本文は認証後に暗号化して送る）。
+ */
+static bool send_auth_request(winrm_conn_t *conn, const char *scheme, const char *token) {
+    char request[MAX_BUFFER_SIZE];
+    size_t len = build_auth_request(request, sizeof(request), conn->host, conn->port, scheme, token);
+
+    struct iovec iov = { request, len };
+    if (!send_iov(conn->sock, &iov, 1)) {
+        char err_msg[128];
+        snprintf(err_msg, sizeof(err_msg), "認証メッセージの送信に失敗しました: %s", strerror(errno));
+        log_error(err_msg);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * conn_handshake - 接続を確立し、Negotiate (SPNEGO/NTLM) 認証を完了する
+ *
+ * @conn:   対象のコネクション
+ * @rx:     ハンドシェイク中の受信バッファ（呼び出し元が解放）
+ * @return: 成功時true（conn->sockは認証済みのまま維持される）
+ *
+ * 処理フロー:
+ * 1. まず直接NTLMでType 1を送信
+ * 2. チャレンジが返らなければ、接続を張り直してSPNEGO/Negotiateで再試行
+ * 3. Type 2を解析し、同じ接続でType 3を送信
+ * 4. Signing/Sealingキーを派生してconn->ntlmに保持
+ */
+static bool conn_handshake(winrm_conn_t *conn, buf_t *rx) {
+    int http_code;
+    char auth_header[4096];
+
+    conn_close(conn);
+
+    uint8_t type1[64];
+    size_t type1_len;
+    char type1_b64[8192];
+
+    /*
+     * Step 1: Type 1を送信してチャレンジ（Type 2）を受信
+     * 前回チャレンジが返った方式（認証方式キャッシュ）から試し、記録がなければ直接NTLM。
+     * チャレンジが返らなければ接続を張り直してもう一方の方式で再試行する。
+     * 重要: NTLM認証は接続ベースなので、Type 2を受信した接続を維持する
+     */
+    conn->use_spnego = auth_cache_lookup(conn->host, conn->port);
+    for (int attempt = 0; attempt < 2; attempt++) {
+        /* NTLM Type 1メッセージを生成（SPNEGOの場合はNegTokenInitでラップ） */
+        ntlm_negotiate_token(conn->use_spnego, type1, &type1_len, type1_b64);
+
+        conn->sock = connect_to_host(conn->host, conn->port);
+        if (conn->sock < 0) return false;
+
+        if (DEBUG) {
+            log_info(conn->use_spnego ? "SPNEGO/NTLM Type 1メッセージ送信中..."
+                                      : "NTLM Type 1メッセージ送信中（直接NTLM）...");
+        }
+
+        if (!send_auth_request(conn, conn->use_spnego ? "Negotiate" : "NTLM", type1_b64)) {
+            conn_close(conn);
+            return false;
+        }
+
+        recv_http_response(conn->sock, NULL, rx, &http_code, auth_header, NULL, &conn->ahead);
+
+        /* チャレンジを受信した（またはチャレンジ以外のエラー）: この接続のまま進む */
+        if (http_code != 401 || auth_header[0] != '\0') break;
+
+        /* この方式ではチャレンジが返らない: 接続を閉じてもう一方の方式で再試行 */
+        conn_close(conn);
+        if (attempt == 0) {
+            if (DEBUG) {
+                log_info(conn->use_spnego ? "Negotiateは利用不可、直接NTLMで再試行..."
+                                          : "直接NTLMは利用不可、SPNEGOで再試行...");
+            }
+            conn->use_spnego = !conn->use_spnego;
+        }
+    }
+
+    if (http_code != 401 || auth_header[0] == '\0') {
+        conn_close(conn);
+        char err_msg[256];
+        snprintf(err_msg, sizeof(err_msg),
+                 "認証のチャレンジ応答を受信できませんでした (HTTP %d)", http_code);
+        log_error(err_msg);
+        if (http_code == 0) {
+            log_error("サーバーからの応答がありません。接続先とポートを確認してください");
+        } else if (http_code == 401 && auth_header[0] == '\0') {
+            log_error("401応答に認証チャレンジが含まれていません");
+        }
+        return false;
+    }
 
-        snprintf(request, sizeof(request),
-                 "POST /wsman HTTP/1.1\r\n"
-                 "Host: %s:%d\r\n"
-                 "Authorization: NTLM %s\r\n"
-                 "Content-Type: application/soap+xml;charset=UTF-8\r\n"
-                 "Content-Length: 0\r\n"
-                 "Connection: keep-alive\r\n"
-                 "\r\n",
-                 host, port, auth_b64);
+    /*
+     * Step 2-3: Type 2メッセージを解析してType 3を生成
+     * 重要: Type 2を受信した同じ接続（conn->sock）を使用する
+     */
+    char auth_b64[16384];
+    if (!ntlm_authenticate_token(auth_header, conn->use_spnego, type1, type1_len,
+                                 g_cred, &conn->ntlm, auth_b64)) {
+        conn_close(conn);
+        return false;
     }
 
     if (DEBUG) {
         log_info("Type 3メッセージ送信中...");
     }
 
-    sent = send(sock, request, strlen(request), MSG_NOSIGNAL);
-    if (sent < 0) {
-        log_error("Type 3メッセージの送信に失敗しました");
-        char err_msg[128];
-        snprintf(err_msg, sizeof(err_msg), "  送信エラー: %s", strerror(errno));
-        log_error(err_msg);
-        close(sock);
+    if (!send_auth_request(conn, conn->use_spnego ? "Negotiate" : "NTLM", auth_b64)) {
+        conn_close(conn);
         return false;
     }
 
     if (DEBUG) {
-        char sent_msg[64];
-        snprintf(sent_msg, sizeof(sent_msg), "  送信バイト数: %zd", sent);
-        log_info(sent_msg);
         log_info("認証レスポンス待機中...");
     }
 
-    ssize_t recv_len = recv_http_response(sock, recv_buffer, sizeof(recv_buffer), &http_code, auth_header);
+    bool keep_alive;
+    ssize_t recv_len = recv_http_response(conn->sock, NULL, rx, &http_code, auth_header, &keep_alive,
+                                          &conn->ahead);
 
     if (DEBUG) {
         char recv_msg[64];
@@ -2098,17 +3578,6 @@ static bool send_http_with_ntlm(const char *host, int port, const char *body,
         snprintf(msg, sizeof(msg), "Type 3認証レスポンス HTTPステータス: %d", http_code);
         log_info(msg);
 
-        /* レスポンスヘッダーを出力 */
-        log_info("Type 3後のレスポンスヘッダー:");
-        char *header_end = strstr(recv_buffer, "\r\n\r\n");
-        if (header_end) {
-            char header_copy[2048];
-            size_t header_len = header_end - recv_buffer;
-            if (header_len >= sizeof(header_copy)) header_len = sizeof(header_copy) - 1;
-            memcpy(header_copy, recv_buffer, header_len);
-            header_copy[header_len] = '\0';
-            fprintf(stderr, "%s\n", header_copy);
-        }
     }
 
     if (http_code == 401) {
@@ -2116,428 +3585,1807 @@ static bool send_http_with_ntlm(const char *host, int port, const char *body,
         log_error("ユーザー名とパスワードを確認してください");
 
         /* 401エラー時のレスポンスボディを表示 */
-        if (DEBUG) {
-            char *body_start_err = strstr(recv_buffer, "\r\n\r\n");
-            if (body_start_err) {
-                body_start_err += 4;
-                log_info("401レスポンスボディ:");
-                fprintf(stderr, "%s\n", body_start_err);
-            }
+        if (DEBUG && rx->len > 0) {
+            log_info("401レスポンスボディ:");
+            fprintf(stderr, "%s\n", rx->data);
         }
-        close(sock);
+        conn_close(conn);
+        return false;
+    }
+
+    if (http_code == 0 || !keep_alive) {
+        log_error("認証後にサーバーが接続を閉じました");
+        conn_close(conn);
         return false;
     }
 
     /* 認証成功後、サーバーがWWW-Authenticateヘッダーを返す場合は継続認証トークンを確認 */
     if (DEBUG && strlen(auth_header) > 0) {
         char auth_msg[256];
-        snprintf(auth_msg, sizeof(auth_msg), "  認証継続トークン: %s", auth_header);
+        snprintf(auth_msg, sizeof(auth_msg), "  認証継続トークン: %.200s", auth_header);
         log_info(auth_msg);
     }
 
-    /* ===== ステップ2: 暗号化SOAPリクエストを送信 ===== */
-    if (DEBUG) {
-        log_info("暗号化SOAPリクエスト送信開始...");
-    }
-
-    /* SOAPボディを暗号化 */
-    size_t body_len = strlen(body);
-    uint8_t *sealed_body = malloc(body_len);
-    uint8_t signature[16];
-    ntlm_seal_message(&ntlm_session, (const uint8_t *)body, body_len, sealed_body, signature);
+    conn->authenticated = true;
+    auth_cache_store(conn->host, conn->port, conn->use_spnego);
 
     if (DEBUG) {
-        log_info("SOAPボディ暗号化完了");
-        char sig_msg[64];
-        snprintf(sig_msg, sizeof(sig_msg), "  署名: %02X%02X%02X%02X...",
-                 signature[0], signature[1], signature[2], signature[3]);
-        log_info(sig_msg);
+        char msg[128];
+        snprintf(msg, sizeof(msg), "認証済み接続を確立しました（ソケットFD: %d）", conn->sock);
+        log_info(msg);
     }
 
-    /* multipart/encrypted形式のボディを構築 */
-    char boundary[] = "Encrypted Boundary";
-    char encrypted_body[MAX_BUFFER_SIZE];
-    size_t enc_body_len;
+    return true;
+}
 
-    /* ヘッダーパート + データパート */
-    int header_part_len = snprintf(encrypted_body, sizeof(encrypted_body),
-        "--%s\r\n"
-        "Content-Type: application/HTTP-SPNEGO-session-encrypted\r\n"
-        "OriginalContent: type=application/soap+xml;charset=UTF-8;Length=%zu\r\n"
-        "--%s\r\n"
-        "Content-Type: application/octet-stream\r\n"
-        "\r\n",
-        boundary, body_len, boundary);
+/*
+ * conn_authenticate - 接続を確立して認証を完了する（conn_handshakeのラッパー）
+ */
+static bool conn_authenticate(winrm_conn_t *conn) {
+    buf_t rx = {0};
+    bool ok = conn_handshake(conn, &rx);
+    buf_free(&rx);
+    return ok;
+}
 
-    /* 署名(16バイト) + 暗号化データ */
-    memcpy(encrypted_body + header_part_len, signature, 16);
-    memcpy(encrypted_body + header_part_len + 16, sealed_body, body_len);
-    free(sealed_body);
+/* ============================================================================
+ * コネクションプール
+ * ============================================================================
+ *
+ * 認証済み接続を (ホスト, ポート, ユーザー, ドメイン) をキーとして保持する。
+ * - チェックアウト時: 同じキーのアイドル接続があれば健全性を確認して再利用
+ * - チェックイン時: 再利用可能な接続はアイドル状態でプールに戻す
+ * - アイドルタイムアウトを過ぎた接続は次回のチェックアウト時に閉じる
+ * これにより、同じサーバーへ連続してコマンドを実行しても
+ * TCP接続とNTLMハンドシェイクのコストは接続ごとに1回で済む。
+ * ============================================================================ */
 
-    /* 終端 */
-    enc_body_len = header_part_len + 16 + body_len;
-    enc_body_len += snprintf(encrypted_body + enc_body_len,
-                              sizeof(encrypted_body) - enc_body_len,
-                              "\r\n--%s--\r\n", boundary);
+/*
+ * now_ms - 単調時計の現在時刻（ミリ秒）
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    /* 暗号化SOAPリクエスト送信 */
-    snprintf(request, sizeof(request),
-             "POST /wsman HTTP/1.1\r\n"
-             "Host: %s:%d\r\n"
-             "Content-Type: multipart/encrypted;protocol=\"application/HTTP-SPNEGO-session-encrypted\";boundary=\"%s\"\r\n"
-             "Content-Length: %zu\r\n"
-             "Connection: keep-alive\r\n"
-             "\r\n",
-             host, port, boundary, enc_body_len);
+/*
+ * pool_release_slot - 接続を閉じてスロットを空ける
+ */
+static void pool_release_slot(winrm_conn_t *conn) {
+    conn_close(conn);
+    conn->allocated = false;
+    conn->in_use = false;
+}
 
-    /* ヘッダーと暗号化ボディを結合 */
-    size_t request_header_len = strlen(request);
-    memcpy(request + request_header_len, encrypted_body, enc_body_len);
-    size_t total_request_len = request_header_len + enc_body_len;
+/*
+ * sock_is_idle - 応答待ちのないソケットに何も届いていないか確認
+ *
+ * @return: サーバーが閉じておらず、読み残しもなければtrue
+ */
+static bool sock_is_idle(int sock) {
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    int ret = poll(&pfd, 1, 0);
+    if (ret < 0) return false;
+    if (ret == 0) return true;  /* 何も届いていない = 正常なアイドル状態 */
+    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) return false;
+
+    char peek;
+    ssize_t n = recv(sock, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    /* n == 0: サーバーが閉じた / n > 0: 読み残しがある → いずれも再利用不可 */
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-    if (DEBUG) {
-        log_info("暗号化SOAPリクエスト送信中...");
-        char sock_msg[64];
-        snprintf(sock_msg, sizeof(sock_msg), "  ソケットFD: %d", sock);
-        log_info(sock_msg);
-        snprintf(sock_msg, sizeof(sock_msg), "  リクエスト長: %zu", total_request_len);
-        log_info(sock_msg);
-    }
+/*
+ * conn_is_healthy - アイドル接続がまだ使えるか確認
+ *
+ * アイドル中の接続にデータが届いている場合、サーバーが切断した（EOF）か
+ * 想定外のデータが残っているため再利用できない。
+ */
+static bool conn_is_healthy(winrm_conn_t *conn) {
+    if (conn->sock < 0 || !conn->authenticated || conn->ahead.len > 0) return false;
+    return sock_is_idle(conn->sock);
+}
 
-    sent = send(sock, request, total_request_len, MSG_NOSIGNAL);
-    if (sent < 0) {
-        log_error("暗号化SOAPリクエストの送信に失敗しました");
-        char err_msg[128];
-        snprintf(err_msg, sizeof(err_msg), "  送信エラー: %s", strerror(errno));
-        log_error(err_msg);
-        close(sock);
-        return false;
-    }
-
-    if (DEBUG) {
-        char sent_msg[64];
-        snprintf(sent_msg, sizeof(sent_msg), "  送信バイト数: %zd", sent);
-        log_info(sent_msg);
-        log_info("SOAPレスポンス待機中...");
+/*
+ * pool_reap_idle - アイドルタイムアウトを過ぎた接続を閉じる
+ */
+static void pool_reap_idle(void) {
+    uint64_t now = now_ms();
+    for (int i = 0; i < POOL_MAX_CONNS; i++) {
+        winrm_conn_t *conn = &g_pool[i];
+        if (conn->allocated && !conn->in_use &&
+            now - conn->last_used_ms >= (uint64_t)g_pool_idle_timeout * 1000) {
+            if (DEBUG) {
+                char msg[320];
+                snprintf(msg, sizeof(msg), "アイドル接続を閉じます: %.255s:%d", conn->host, conn->port);
+                log_info(msg);
+            }
+            pool_release_slot(conn);
+        }
     }
+}
 
-    recv_len = recv_http_response(sock, recv_buffer, sizeof(recv_buffer), &http_code, auth_header);
-    close(sock);
+/*
+ * pool_checkout - 接続をプールから取り出す
+ *
+ * @return: 接続（未認証の場合は最初のリクエスト時に認証される）
+ *          ホストあたりの上限に達している場合・空きがない場合はNULL
+ */
+static winrm_conn_t *pool_checkout(const char *host, int port,
+                                   const char *user, const char *domain) {
+    winrm_conn_t *free_slot = NULL;
+    int host_conns = 0;
 
-    if (DEBUG) {
-        char recv_msg[64];
-        snprintf(recv_msg, sizeof(recv_msg), "  受信バイト数: %zd", recv_len);
-        log_info(recv_msg);
-        char msg[64];
-        snprintf(msg, sizeof(msg), "SOAPレスポンス HTTPステータス: %d", http_code);
-        log_info(msg);
+    pool_reap_idle();
 
-        /* レスポンスヘッダーを出力 */
-        log_info("SOAPレスポンスヘッダー:");
-        char *header_end = strstr(recv_buffer, "\r\n\r\n");
-        if (header_end) {
-            char header_copy[2048];
-            size_t header_len = header_end - recv_buffer;
-            if (header_len >= sizeof(header_copy)) header_len = sizeof(header_copy) - 1;
-            memcpy(header_copy, recv_buffer, header_len);
-            header_copy[header_len] = '\0';
-            fprintf(stderr, "%s\n", header_copy);
+    for (int i = 0; i < POOL_MAX_CONNS; i++) {
+        winrm_conn_t *conn = &g_pool[i];
+        if (!conn->allocated) {
+            if (!free_slot) free_slot = conn;
+            continue;
         }
+        if (conn->port != port || strcmp(conn->host, host) != 0 ||
+            strcmp(conn->user, user) != 0 || strcmp(conn->domain, domain) != 0) {
+            continue;
+        }
+        if (!conn->in_use) {
+            if (conn_is_healthy(conn)) {
+                conn->in_use = true;
+                if (DEBUG) {
+                    char msg[64];
+                    snprintf(msg, sizeof(msg), "プールの認証済み接続を再利用（FD: %d）", conn->sock);
+                    log_info(msg);
+                }
+                return conn;
+            }
+            /* 切断済みの接続は破棄してスロットを再利用する */
+            pool_release_slot(conn);
+            if (!free_slot) free_slot = conn;
+            continue;
+        }
+        host_conns++;
     }
 
-    if (http_code == 401) {
-        log_error("暗号化リクエストで認証エラー (HTTP 401)");
-        close(sock);
-        return false;
-    } else if (http_code == 500) {
-        log_error("サーバー内部エラーが発生しました (HTTP 500)");
-        return false;
-    } else if (http_code != 200) {
-        char msg[64];
-        snprintf(msg, sizeof(msg), "予期しないHTTPステータスコード: %d", http_code);
-        log_warn(msg);
-    }
-
-    /* レスポンス本文を抽出 */
-    char *body_start = strstr(recv_buffer, "\r\n\r\n");
-    if (body_start) {
-        body_start += 4;
-        strncpy(response, body_start, response_size - 1);
-        response[response_size - 1] = '\0';
+    if (host_conns >= g_pool_max_per_host) {
+        log_error("ホストあたりの最大接続数に達しています（WINRM_POOL_MAX_PER_HOST）");
+        return NULL;
     }
-
-    if (DEBUG) {
-        log_info("受信XML:");
-        fprintf(stderr, "%s\n", response);
+    if (!free_slot) {
+        log_error("コネクションプールに空きがありません");
+        return NULL;
     }
 
-    return true;
+    conn_init(free_slot, host, port, user, domain);
+    free_slot->allocated = true;
+    free_slot->in_use = true;
+    return free_slot;
 }
 
-/* ============================================================================
- * ユーティリティ関数
- * ============================================================================ */
-
 /*
- * generate_uuid - UUIDを生成
+ * pool_checkin - 接続をプールに戻す
  *
- * @uuid: 出力バッファ
- * @size: バッファサイズ
- *
- * WinRMのSOAPメッセージには各リクエストにユニークなMessageIDが必要。
- * Linuxの /proc/sys/kernel/random/uuid を使用（利用可能な場合）。
+ * @reusable: falseの場合（切断・エラー時）は接続を閉じてスロットを空ける
  */
-static void generate_uuid(char *uuid, size_t size) {
-    FILE *fp = fopen("/proc/sys/kernel/random/uuid", "r");
-    if (fp) {
-        if (fgets(uuid, size, fp)) {
-            char *newline = strchr(uuid, '\n');
-            if (newline) *newline = '\0';
-        }
-        fclose(fp);
-    } else {
-        snprintf(uuid, size, "%08lx-%04x-4%03x-%04x-%012lx",
-                 (unsigned long)time(NULL), rand() & 0xffff,
-                 rand() & 0x0fff, rand() & 0xffff, (unsigned long)time(NULL));
+static void pool_checkin(winrm_conn_t *conn, bool reusable) {
+    if (!reusable || !conn->authenticated) {
+        pool_release_slot(conn);
+        return;
     }
+    conn->in_use = false;
+    conn->last_used_ms = now_ms();
 }
 
 /*
- * xml_escape - XML特殊文字をエスケープ
- *
- * @src:      入力文字列
- * @dst:      出力バッファ
- * @dst_size: バッファサイズ
- *
- * SOAPメッセージに含めるコマンド文字列内の特殊文字を
- * XMLエンティティに変換（例: & → &amp;）
+ * pool_shutdown - プール内のすべての接続を閉じる（プログラム終了時）
  */
-static void xml_escape(const char *src, char *dst, size_t dst_size) {
-    size_t j = 0;
-    for (size_t i = 0; src[i] && j < dst_size - 6; i++) {
-        switch (src[i]) {
-            case '&':  j += snprintf(dst + j, dst_size - j, "&amp;"); break;
-            case '<':  j += snprintf(dst + j, dst_size - j, "&lt;"); break;
-            case '>':  j += snprintf(dst + j, dst_size - j, "&gt;"); break;
-            case '"':  j += snprintf(dst + j, dst_size - j, "&quot;"); break;
-            case '\'': j += snprintf(dst + j, dst_size - j, "&apos;"); break;
-            default:   dst[j++] = src[i]; break;
+static void pool_shutdown(void) {
+    for (int i = 0; i < POOL_MAX_CONNS; i++) {
+        if (g_pool[i].allocated) {
+            pool_release_slot(&g_pool[i]);
         }
     }
-    dst[j] = '\0';
 }
 
 /*
- * str_replace - 文字列内のすべての出現箇所を置換
- *
- * @str:     置換対象の文字列（直接変更される）
- * @old:     検索文字列
- * @new_str: 置換文字列
+ * sealed_request_t - 暗号化したSOAPリクエスト（送信する断片の並び）
  *
- * 【重要】whileループを使用しているため、{ENV}が複数箇所にあっても
- * すべて置換される。
+ * HTTPヘッダ・multipartの見出し・署名・暗号文・終端を別々の断片のまま
+ * sendmsg() でまとめて送る（1つのバッファへ連結コピーしない）。
+ * iov は構造体自身を指すため、seal_request() の後は構造体を移動しないこと。
  *
- * 例: "C:\\{ENV}\\sub\\{ENV}\\test.bat" → "C:\\TST1T\\sub\\TST1T\\test.bat"
+ * multipart/encrypted形式（WinRMサーバー・pywinrmと同じ。各パートのヘッダ行はタブで始まる）:
+ *   --Encrypted Boundary
+ *   \tContent-Type: application/HTTP-SPNEGO-session-encrypted
+ *   \tOriginalContent: type=application/soap+xml;charset=UTF-8;Length=<平文長>
+ *   --Encrypted Boundary
+ *   \tContent-Type: application/octet-stream
+ *   <署名長 4バイトLE = 16><署名16バイト><暗号化データ>--Encrypted Boundary--
  */
-static void str_replace(char *str, const char *old, const char *new_str) {
-    char buffer[MAX_BUFFER_SIZE];
-    char *pos;
+#define SEALED_REQUEST_IOV 5
 
-    while ((pos = strstr(str, old)) != NULL) {
-        size_t prefix_len = pos - str;
-        strncpy(buffer, str, prefix_len);
-        buffer[prefix_len] = '\0';
-        strcat(buffer, new_str);
-        strcat(buffer, pos + strlen(old));
-        strcpy(str, buffer);
-    }
+typedef struct {
+    char http_header[768];      /* HTTPリクエストヘッダ */
+    char preamble[256];         /* multipartの見出し（2パート分） */
+    uint8_t signature[4 + 16];  /* 署名長(4バイトLE) + 署名 */
+    uint8_t *sealed;            /* 暗号化した本文（malloc） */
+    char trailer[64];           /* 終端の境界 */
+    struct iovec iov[SEALED_REQUEST_IOV];
+    size_t len;                 /* リクエスト全体の長さ */
+} sealed_request_t;
+
+/* sealed_request_free - 暗号文のバッファを解放 */
+static void sealed_request_free(sealed_request_t *req) {
+    free(req->sealed);
+    req->sealed = NULL;
 }
 
 /*
- * extract_xml_value - XMLから指定タグの値を抽出
- *
- * @xml:        XML文字列
- * @tag:        抽出するタグ名（例: "rsp:ShellId"）
- * @value:      値の出力バッファ
- * @value_size: バッファサイズ
- * @return:     成功時true
+ * seal_request - SOAPボディを暗号化し、送信する断片を用意する
  *
- * 単純な文字列検索で実装（完全なXMLパーサーは使用しない）。
- * WinRMレスポンスからShellIdやCommandId等を抽出するために使用。
+ * @req:   出力先（sealed_request_free() で解放）
+ * @ntlm:  Signing/Sealing状態（シーケンス番号・RC4状態が進む）
+ * @host:  Hostヘッダ用ホスト
+ * @port:  Hostヘッダ用ポート
+ * @body:  SOAP XML（平文。断片の並び）
+ * @count: 断片の数
+ * @return: 成功時true（メモリ確保失敗時false）
  */
-static bool extract_xml_value(const char *xml, const char *tag, char *value, size_t value_size) {
-    char open_tag[128], close_tag[128];
-    snprintf(open_tag, sizeof(open_tag), "<%s>", tag);
-    snprintf(close_tag, sizeof(close_tag), "</%s>", tag);
+static bool seal_request(sealed_request_t *req, ntlm_session_t *ntlm, const char *host, int port,
+                         const struct iovec *body, int count) {
+    const char *boundary = "Encrypted Boundary";
+    size_t body_len = 0;
+    for (int i = 0; i < count; i++) {
+        body_len += body[i].iov_len;
+    }
+
+    req->sealed = malloc(body_len ? body_len : 1);
+    if (!req->sealed) return false;
+
+    /* ヘッダーパート + データパートの見出し */
+    int preamble_len = snprintf(req->preamble, sizeof(req->preamble),
+        "--%s\r\n"
+        "\tContent-Type: application/HTTP-SPNEGO-session-encrypted\r\n"
+        "\tOriginalContent: type=application/soap+xml;charset=UTF-8;Length=%zu\r\n"
+        "--%s\r\n"
+        "\tContent-Type: application/octet-stream\r\n",
+        boundary, body_len, boundary);
+    int trailer_len = snprintf(req->trailer, sizeof(req->trailer), "--%s--\r\n", boundary);
 
-    const char *start = strstr(xml, open_tag);
-    if (!start) return false;
+    size_t enc_body_len = preamble_len + sizeof(req->signature) + body_len + trailer_len;
+    int http_header_len = snprintf(req->http_header, sizeof(req->http_header),
+             "POST /wsman HTTP/1.1\r\n"
+             "Host: %s:%d\r\n"
+             "Content-Type: multipart/encrypted;protocol=\"application/HTTP-SPNEGO-session-encrypted\";boundary=\"%s\"\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: keep-alive\r\n"
+             "\r\n",
+             host, port, boundary, enc_body_len);
 
-    start += strlen(open_tag);
-    const char *end = strstr(start, close_tag);
-    if (!end) return false;
+    /* 署名長(4バイト) + 署名(16バイト) + 暗号化データ */
+    uint32_t signature_len = 16;
+    memcpy(req->signature, &signature_len, 4);
+    ntlm_seal_message(ntlm, body, count, req->sealed, req->signature + 4);
 
-    size_t len = end - start;
-    if (len >= value_size) len = value_size - 1;
+    if (DEBUG) {
+        log_info("SOAPボディ暗号化完了");
+        char sig_msg[64];
+        snprintf(sig_msg, sizeof(sig_msg), "  署名: %02X%02X%02X%02X...",
+                 req->signature[4], req->signature[5], req->signature[6], req->signature[7]);
+        log_info(sig_msg);
+    }
 
-    strncpy(value, start, len);
-    value[len] = '\0';
+    req->iov[0] = (struct iovec){ req->http_header, http_header_len };
+    req->iov[1] = (struct iovec){ req->preamble, preamble_len };
+    req->iov[2] = (struct iovec){ req->signature, sizeof(req->signature) };
+    req->iov[3] = (struct iovec){ req->sealed, body_len };
+    req->iov[4] = (struct iovec){ req->trailer, trailer_len };
+    req->len = http_header_len + enc_body_len;
     return true;
 }
 
-/* ============================================================================
- * WinRM操作
- * ============================================================================
- *
- * 【WinRM (Windows Remote Management) とは】
- * Microsoftが開発したリモート管理プロトコル。
- * WS-Management（Web Services for Management）仕様に基づく。
- *
- * 【WinRMセッションの流れ】
- * 1. Create: リモートシェル（cmd.exe）を作成
- *    → ShellIdを取得
- *
- * 2. Command: シェル上でコマンドを実行
- *    → CommandIdを取得
- *
- * 3. Receive: コマンドの出力（stdout/stderr）を取得
- *    → 出力はBase64エンコードされて返される
- *    → CommandState/Doneになるまでポーリング
- *
- * 4. Delete: シェルを削除（リソース解放）
- *
- * 【SOAPメッセージ形式】
- * <?xml version="1.0" encoding="UTF-8"?>
- * <s:Envelope xmlns:s="..." xmlns:a="..." ...>
- *   <s:Header>
- *     <a:Action>...</a:Action>
- *     <w:ResourceURI>...</w:ResourceURI>
- *     ...
- *   </s:Header>
- *   <s:Body>
- *     ... 操作固有のXML ...
- *   </s:Body>
- * </s:Envelope>
- * ============================================================================ */
-
 /*
- * send_soap_request - SOAPリクエストを送信
+ * conn_post_sealed - 認証済み接続へ暗号化SOAPリクエストを送信する（応答は待たない）
  *
- * @soap_envelope: 送信するSOAP XMLエンベロープ
- * @response:      レスポンス格納バッファ
- * @response_size: バッファサイズ
- * @return:        成功時true
+ * @conn:   認証済みコネクション
+ * @body:   リクエスト本文（SOAP XML。断片の並び）
+ * @count:  断片の数
+ * @return: 送信できればtrue
+ *
+ * 応答は conn_recv_sealed() で送信順に受け取る。
  */
-static bool send_soap_request(const char *soap_envelope, char *response, size_t response_size) {
+static bool conn_post_sealed(winrm_conn_t *conn, const struct iovec *body, int count) {
+    sealed_request_t req;
+    if (!seal_request(&req, &conn->ntlm, conn->host, conn->port, body, count)) {
+        log_error("メモリ確保に失敗しました");
+        return false;
+    }
+
     if (DEBUG) {
-        log_info("送信XML:");
-        fprintf(stderr, "%s\n\n", soap_envelope);
-        char msg[512];
-        snprintf(msg, sizeof(msg), "接続先: http://%s:%d/wsman", g_host, g_port);
-        log_info(msg);
-        snprintf(msg, sizeof(msg), "ユーザー: %s", g_user);
-        log_info(msg);
+        log_info("暗号化SOAPリクエスト送信中...");
+        char sock_msg[64];
+        snprintf(sock_msg, sizeof(sock_msg), "  ソケットFD: %d", conn->sock);
+        log_info(sock_msg);
+        snprintf(sock_msg, sizeof(sock_msg), "  リクエスト長: %zu", req.len);
+        log_info(sock_msg);
+    }
+
+    bool sent = send_iov(conn->sock, req.iov, SEALED_REQUEST_IOV);
+    sealed_request_free(&req);
+    if (!sent) {
+        if (DEBUG) {
+            char err_msg[128];
+            snprintf(err_msg, sizeof(err_msg), "  送信エラー: %s", strerror(errno));
+            log_info(err_msg);
+        }
+        return false;
     }
 
-    return send_http_with_ntlm(g_host, g_port, soap_envelope, response, response_size);
+    if (DEBUG) {
+        char sent_msg[64];
+        snprintf(sent_msg, sizeof(sent_msg), "  送信バイト数: %zu", req.len);
+        log_info(sent_msg);
+    }
+    return true;
 }
 
 /*
- * create_shell - リモートシェル（cmd.exe）を作成
+ * conn_recv_sealed - 送信済みリクエストのうち最も古いものの応答を受信する
  *
- * @shell_id:      ShellIdの出力バッファ
- * @shell_id_size: バッファサイズ
- * @return:        成功時true
- *
- * WS-Transfer Createアクションを使用してリモートシェルを作成。
- * 成功すると、後続のコマンド実行に使用するShellIdが返される。
+ * @conn:        認証済みコネクション
+ * @rx:          レスポンス本文の格納先
+ * @http_code:   HTTPステータスコード出力先（応答なしの場合0）
+ * @keep_alive:  応答後も接続を再利用できるかの出力先
+ * @return:      受信したバイト数（応答なし切断の場合0）
  */
-static bool create_shell(char *shell_id, size_t shell_id_size) {
-    char url[MAX_URL_SIZE];
-    char uuid[MAX_UUID_SIZE];
-    char envelope[MAX_ENVELOPE_SIZE];
-    char response[MAX_BUFFER_SIZE];
-
-    snprintf(url, sizeof(url), "http://%s:%d/wsman", g_host, g_port);
-    generate_uuid(uuid, sizeof(uuid));
+static size_t conn_recv_sealed(winrm_conn_t *conn, buf_t *rx, int *http_code, bool *keep_alive) {
+    char auth_header[4096];
 
-    snprintf(envelope, sizeof(envelope),
-        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
-        "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
-        "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\"\n"
-        "            xmlns:rsp=\"http://schemas.microsoft.com/wbem/wsman/1/windows/shell\">\n"
-        "  <s:Header>\n"
-        "    <a:To>%s</a:To>\n"
-        "    <a:ReplyTo>\n"
-        "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
-        "    </a:ReplyTo>\n"
-        "    <a:Action s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/09/transfer/Create</a:Action>\n"
-        "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
-        "    <a:MessageID>uuid:%s</a:MessageID>\n"
-        "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
-        "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
-        "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
-        "    <w:OptionSet>\n"
-        "      <w:Option Name=\"WINRS_NOPROFILE\">FALSE</w:Option>\n"
-        "      <w:Option Name=\"WINRS_CODEPAGE\">65001</w:Option>\n"
-        "    </w:OptionSet>\n"
-        "  </s:Header>\n"
-        "  <s:Body>\n"
-        "    <rsp:Shell>\n"
-        "      <rsp:InputStreams>stdin</rsp:InputStreams>\n"
-        "      <rsp:OutputStreams>stdout stderr</rsp:OutputStreams>\n"
-        "    </rsp:Shell>\n"
-        "  </s:Body>\n"
-        "</s:Envelope>",
-        url, uuid, TIMEOUT);
+    if (DEBUG) {
+        log_info("SOAPレスポンス待機中...");
+    }
 
-    log_info("シェル作成中...");
+    size_t recv_len = recv_http_response(conn->sock, &conn->ntlm, rx, http_code, auth_header,
+                                         keep_alive, &conn->ahead);
 
-    if (!send_soap_request(envelope, response, sizeof(response))) {
-        log_error("シェル作成に失敗しました");
-        return false;
+    if (DEBUG) {
+        char recv_msg[64];
+        snprintf(recv_msg, sizeof(recv_msg), "  受信バイト数: %zu", recv_len);
+        log_info(recv_msg);
+        char msg[64];
+        snprintf(msg, sizeof(msg), "SOAPレスポンス HTTPステータス: %d", *http_code);
+        log_info(msg);
     }
 
-    if (!extract_xml_value(response, "rsp:ShellId", shell_id, shell_id_size)) {
-        log_error("ShellIDの取得に失敗しました");
-        return false;
-    }
+    return recv_len;
+}
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "シェル作成成功: %s", shell_id);
-    log_success(msg);
+/*
+ * write_all - データをすべて書き込む（部分書き込み・EINTRを再試行）
+ *
+ * @return: 成功時true
+ */
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
 
+/*
+ * read_all - 指定バイト数をすべて読み込む（EINTRを再試行）
+ *
+ * @return: 成功時true（途中で切断・タイムアウトした場合false）
+ */
+static bool read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
     return true;
 }
 
 /*
- * run_command - シェル上でコマンドを実行
+ * 常駐モードのジョブ転送フレーム（Unixドメインソケット上）
  *
- * @shell_id:        対象のShellId
- * @command:         実行するコマンド文字列
- * @command_id:      CommandIdの出力バッファ
- * @command_id_size: バッファサイズ
- * @return:          成功時true
+ *   <種別 1バイト><ペイロード長 4バイトLE><ペイロード>
  *
- * WinRS Commandアクションを使用してコマンドを実行。
- * 成功すると、出力取得に使用するCommandIdが返される。
+ * クライアント → 常駐プロセス:
+ *   'H' 接続先・資格情報の識別（"HOST\nPORT\nUSER\nDOMAIN"。常駐プロセスの設定と一致が必要）
+ *   'C' 実行するコマンドライン（1フレーム1コマンド、送信順に同じシェルで実行）
+ *   'R' 実行開始（ペイロード1バイト: bit0 = 失敗したコマンドで中断）
+ *   'S' 状態の問い合わせ（接続直後に単独で送る。応答は状態のテキスト1フレーム）
+ * 常駐プロセス → クライアント:
+ *   'O' / 'E' stdout / stderr の出力（受信しだい転送）
+ *   'X' 1コマンドの終了コード（4バイトLE）
+ *   'F' エラーメッセージ（ジョブを中断）
+ *   'D' ジョブ完了（4バイトLE: 最初に失敗したコマンドの終了コード、すべて成功なら0）
  */
-static bool run_command(const char *shell_id, const char *command,
-                        char *command_id, size_t command_id_size) {
-    char url[MAX_URL_SIZE];
-    char uuid[MAX_UUID_SIZE];
-    char envelope[MAX_ENVELOPE_SIZE];
-    char command_escaped[1024];
-    char response[MAX_BUFFER_SIZE];
+#define FRAME_MAX_PAYLOAD (1024 * 1024)
 
-    snprintf(url, sizeof(url), "http://%s:%d/wsman", g_host, g_port);
-    generate_uuid(uuid, sizeof(uuid));
-    xml_escape(command, command_escaped, sizeof(command_escaped));
+/* frame_write - フレームを1つ送信 */
+static bool frame_write(int fd, char type, const void *data, uint32_t len) {
+    uint8_t header[5] = { (uint8_t)type, len & 0xFF, (len >> 8) & 0xFF,
+                          (len >> 16) & 0xFF, (len >> 24) & 0xFF };
+    return write_all(fd, header, sizeof(header)) && (len == 0 || write_all(fd, data, len));
+}
 
-    snprintf(envelope, sizeof(envelope),
-        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
+/* frame_write_int - 4バイト整数のフレームを送信（'X' / 'D'） */
+static bool frame_write_int(int fd, char type, int value) {
+    uint32_t v = (uint32_t)value;
+    uint8_t payload[4] = { v & 0xFF, (v >> 8) & 0xFF, (v >> 16) & 0xFF, (v >> 24) & 0xFF };
+    return frame_write(fd, type, payload, sizeof(payload));
+}
+
+/*
+ * frame_read - フレームを1つ受信
+ *
+ * @payload: ペイロードの格納先（NUL終端される）
+ * @return:  成功時true（切断・タイムアウト・長すぎるフレームはfalse）
+ */
+static bool frame_read(int fd, char *type, buf_t *payload) {
+    uint8_t header[5];
+    if (!read_all(fd, header, sizeof(header))) return false;
+    uint32_t len = header[1] | (header[2] << 8) | (header[3] << 16) | ((uint32_t)header[4] << 24);
+    if (len > FRAME_MAX_PAYLOAD) return false;
+
+    buf_clear(payload);
+    if (!buf_reserve(payload, len)) return false;
+    if (!read_all(fd, payload->data, len)) return false;
+    payload->len = len;
+    payload->data[len] = '\0';
+    *type = (char)header[0];
+    return true;
+}
+
+/* frame_int - 'X' / 'D' フレームの整数を取り出す */
+static int frame_int(const buf_t *payload) {
+    if (payload->len < 4) return 0;
+    const uint8_t *p = (const uint8_t *)payload->data;
+    return (int)(p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+/*
+ * capture_t - コマンド出力の蓄積先（サイズ上限なし・バイナリセーフ）
+ *
+ * g_output_memory_limit バイトまではメモリ（buf_t）に保持し、超えた時点で
+ * 内容を一時ファイルへ移して以降はファイルに追記する。一時ファイルは作成直後に
+ * unlinkするため、異常終了しても残らない。ゼロ初期化した状態で使用できる。
+ */
+typedef struct {
+    buf_t mem;        /* メモリ上の出力（退避前） */
+    bool spilled;     /* 一時ファイルへ退避済みか */
+    int spill_fd;     /* 退避先の一時ファイル */
+    size_t total;     /* 出力の総バイト数 */
+} capture_t;
+
+/* capture_spill - メモリ上の出力を一時ファイルへ移す */
+static bool capture_spill(capture_t *c) {
+    const char *dir = getenv("TMPDIR");
+    char path[512];
+    snprintf(path, sizeof(path), "%s/winrm_exec.XXXXXX", dir && dir[0] ? dir : "/tmp");
+
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+        char err_msg[640];
+        snprintf(err_msg, sizeof(err_msg), "一時ファイルを作成できません: %s: %s",
+                 path, strerror(errno));
+        log_error(err_msg);
+        return false;
+    }
+    unlink(path);
+
+    if (!write_all(fd, c->mem.data, c->mem.len)) {
+        close(fd);
+        return false;
+    }
+    buf_free(&c->mem);
+    c->spilled = true;
+    c->spill_fd = fd;
+    return true;
+}
+
+/*
+ * capture_append - 出力を追加
+ *
+ * @return: 成功時true（一時ファイルの作成・書き込みに失敗した場合false）
+ */
+static bool capture_append(capture_t *c, const void *data, size_t len) {
+    if (!c->spilled && c->mem.len + len > g_output_memory_limit) {
+        if (!capture_spill(c)) return false;
+    }
+    bool ok = c->spilled ? write_all(c->spill_fd, data, len)
+                         : buf_append(&c->mem, data, len);
+    if (ok) c->total += len;
+    return ok;
+}
+
+/*
+ * capture_replay - 蓄積した出力を先頭からブロック単位で渡す
+ *
+ * @sink: ブロックごとに呼ばれる関数（行の途中で区切られることがある）
+ */
+static void capture_replay(capture_t *c,
+                           void (*sink)(const char *data, size_t len, void *ctx), void *ctx) {
+    if (!c->spilled) {
+        if (c->mem.len > 0) sink(c->mem.data, c->mem.len, ctx);
+        return;
+    }
+
+    char block[MAX_BUFFER_SIZE];
+    off_t off = 0;
+    for (;;) {
+        ssize_t n = pread(c->spill_fd, block, sizeof(block), off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sink(block, n, ctx);
+        off += n;
+    }
+}
+
+/* capture_sink_fd - capture_replay用: ファイルディスクリプタへそのまま書き出す */
+static void capture_sink_fd(const char *data, size_t len, void *ctx) {
+    write_all(*(int *)ctx, data, len);
+}
+
+/* capture_free - 蓄積した出力を破棄 */
+static void capture_free(capture_t *c) {
+    buf_free(&c->mem);
+    if (c->spilled) close(c->spill_fd);
+    c->spilled = false;
+    c->total = 0;
+}
+
+/* ============================================================================
+ * XMLトークナイザ
+ * ============================================================================
+ *
+ * SOAPレスポンスから値を取り出すための、メモリ確保を行わないプル型のトークナイザ。
+ *
+ * - 開始タグ・終了タグ・文字データを先頭から順に1回だけ返す（空要素タグ <a/> は
+ *   開始タグの直後に終了タグを返す）。コメント・処理命令・DOCTYPEは読み飛ばす
+ * - 要素は名前空間URIで判定する。サーバーによって接頭辞が s: / env: / rsp: / p: 等と
+ *   異なっても、xmlns 宣言から解決した名前空間とローカル名で比較する
+ * - 入力が途中で終わっている場合は XML_MORE を返す。受信した続きをバッファに追加して
+ *   xml_reader_feed() し、呼び直せば続きから再開する（位置はオフセットで保持するため、
+ *   バッファが再確保されても構わない）
+ * - 実体参照（&amp; &lt; &#x41; 等）は xml_text_copy() / xml_attr_copy() で展開する
+ * ============================================================================ */
+
+/* 判定に使う名前空間 */
+enum {
+    XML_NS_UNKNOWN,      /* 未宣言・その他 */
+    XML_NS_SOAP,         /* SOAP 1.2 エンベロープ */
+    XML_NS_ADDRESSING,   /* WS-Addressing */
+    XML_NS_WSMAN,        /* WS-Management */
+    XML_NS_SHELL,        /* WinRS（rsp:） */
+    XML_NS_WSMANFAULT,   /* WSManFault の詳細 */
+};
+
+static const char *const xml_ns_uris[] = {
+    [XML_NS_SOAP] = "http://www.w3.org/2003/05/soap-envelope",
+    [XML_NS_ADDRESSING] = "http://schemas.xmlsoap.org/ws/2004/08/addressing",
+    [XML_NS_WSMAN] = "http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd",
+    [XML_NS_SHELL] = "http://schemas.microsoft.com/wbem/wsman/1/windows/shell",
+    [XML_NS_WSMANFAULT] = "http://schemas.microsoft.com/wbem/wsman/1/wsmanfault",
+};
+
+typedef enum {
+    XML_START,   /* 開始タグ */
+    XML_END,     /* 終了タグ */
+    XML_TEXT,    /* 文字データ（実体参照は未展開。CDATAセクションは cdata=true） */
+    XML_MORE,    /* 入力が途中で終わっている */
+    XML_EOF,     /* 入力の終わり */
+    XML_ERROR,   /* 不正な形式 */
+} xml_token_t;
+
+#define XML_MAX_BINDINGS 32     /* 同時に有効な xmlns 宣言の最大数 */
+#define XML_MAX_PREFIX 16       /* 接頭辞の最大長（NULを含む） */
+
+typedef struct {
+    char prefix[XML_MAX_PREFIX];  /* 接頭辞（空: 既定の名前空間） */
+    int ns;                       /* 解決した名前空間 */
+    int depth;                    /* 宣言した要素の深さ */
+} xml_binding_t;
+
+typedef struct {
+    const char *data;      /* 入力（xml_reader_feed() で更新） */
+    size_t len;
+    bool final;            /* 入力がこれで全部か */
+    size_t pos;            /* 次に読む位置 */
+    int depth;             /* 現在の要素の深さ（ルート要素の中で1） */
+    int nbind;
+    xml_binding_t bind[XML_MAX_BINDINGS];
+    bool empty_end;        /* 空要素タグの終了タグを次に返す */
+    /* 現在のトークン（位置は data の先頭からのオフセット） */
+    int ns;                /* 要素の名前空間 */
+    size_t name_off, name_len;   /* 要素のローカル名 */
+    size_t attr_off, attr_len;   /* 開始タグの属性部分 */
+    size_t text_off, text_len;   /* 文字データ */
+    bool cdata;
+} xml_reader_t;
+
+typedef struct {
+    const char *name, *value;
+    size_t name_len, value_len;
+} xml_attr_t;
+
+static bool xml_is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* xml_reader_init - 読み取りを開始 */
+static void xml_reader_init(xml_reader_t *r, const char *data, size_t len, bool final) {
+    memset(r, 0, sizeof(*r));
+    r->data = data;
+    r->len = len;
+    r->final = final;
+}
+
+/* xml_reader_feed - 入力の続きを追加した（data は再確保後の先頭、len は全体の長さ） */
+static void xml_reader_feed(xml_reader_t *r, const char *data, size_t len, bool final) {
+    r->data = data;
+    r->len = len;
+    r->final = final;
+}
+
+/*
+ * xml_attr_next - 属性を1つ読む
+ *
+ * @return: 次の属性の位置（属性がもうなければNULL）
+ */
+static const char *xml_attr_next(const char *p, const char *end, xml_attr_t *a) {
+    while (p < end && xml_is_space(*p)) p++;
+    a->name = p;
+    while (p < end && *p != '=' && *p != '/' && !xml_is_space(*p)) p++;
+    a->name_len = p - a->name;
+    while (p < end && xml_is_space(*p)) p++;
+    if (a->name_len == 0 || p >= end || *p != '=') return NULL;
+    p++;
+    while (p < end && xml_is_space(*p)) p++;
+    if (p >= end || (*p != '"' && *p != '\'')) return NULL;
+    char quote = *p++;
+    a->value = p;
+    p = memchr(p, quote, end - p);
+    if (!p) return NULL;
+    a->value_len = p - a->value;
+    return p + 1;
+}
+
+/* xml_resolve - 接頭辞から名前空間を解決（内側の宣言が優先） */
+static int xml_resolve(const xml_reader_t *r, const char *prefix, size_t prefix_len) {
+    for (int i = r->nbind - 1; i >= 0; i--) {
+        if (strlen(r->bind[i].prefix) == prefix_len &&
+            memcmp(r->bind[i].prefix, prefix, prefix_len) == 0) {
+            return r->bind[i].ns;
+        }
+    }
+    return XML_NS_UNKNOWN;
+}
+
+/* xml_declare - 開始タグの xmlns / xmlns:PREFIX 宣言を登録 */
+static void xml_declare(xml_reader_t *r, const char *attrs, const char *end) {
+    xml_attr_t a;
+    while ((attrs = xml_attr_next(attrs, end, &a)) != NULL) {
+        if (a.name_len < 5 || memcmp(a.name, "xmlns", 5) != 0) continue;
+        if (a.name_len > 5 && a.name[5] != ':') continue;
+        const char *prefix = a.name_len > 5 ? a.name + 6 : "";
+        size_t prefix_len = a.name_len > 5 ? a.name_len - 6 : 0;
+        if (prefix_len >= XML_MAX_PREFIX || r->nbind == XML_MAX_BINDINGS) continue;
+
+        xml_binding_t *b = &r->bind[r->nbind++];
+        memcpy(b->prefix, prefix, prefix_len);
+        b->prefix[prefix_len] = '\0';
+        b->depth = r->depth;
+        b->ns = XML_NS_UNKNOWN;
+        for (size_t i = 1; i < sizeof(xml_ns_uris) / sizeof(xml_ns_uris[0]); i++) {
+            if (strlen(xml_ns_uris[i]) == a.value_len &&
+                memcmp(xml_ns_uris[i], a.value, a.value_len) == 0) {
+                b->ns = i;
+            }
+        }
+    }
+}
+
+/* xml_set_name - 要素名（接頭辞:ローカル名）を現在のトークンに設定 */
+static void xml_set_name(xml_reader_t *r, size_t off, size_t end) {
+    size_t name_end = off;
+    while (name_end < end && !xml_is_space(r->data[name_end]) && r->data[name_end] != '/') {
+        name_end++;
+    }
+    const char *name = r->data + off;
+    const char *colon = memchr(name, ':', name_end - off);
+    if (colon) {
+        r->ns = xml_resolve(r, name, colon - name);
+        r->name_off = colon + 1 - r->data;
+    } else {
+        r->ns = xml_resolve(r, "", 0);
+        r->name_off = off;
+    }
+    r->name_len = name_end - r->name_off;
+}
+
+/* xml_pop - 要素を閉じる（その要素で宣言した名前空間を外す） */
+static void xml_pop(xml_reader_t *r) {
+    while (r->nbind > 0 && r->bind[r->nbind - 1].depth >= r->depth) r->nbind--;
+    if (r->depth > 0) r->depth--;
+}
+
+/*
+ * xml_skip_to - 区切り文字列の直後まで読み飛ばす
+ *
+ * @return: 見つかった場合true（見つからなければ pos は変えない）
+ */
+static bool xml_skip_to(xml_reader_t *r, size_t from, const char *delim) {
+    size_t delim_len = strlen(delim);
+    const char *hit = from <= r->len ? memmem(r->data + from, r->len - from, delim, delim_len) : NULL;
+    if (!hit) return false;
+    r->pos = hit - r->data + delim_len;
+    return true;
+}
+
+/*
+ * xml_next - 次のトークンを読む
+ */
+static xml_token_t xml_next(xml_reader_t *r) {
+    xml_token_t incomplete = r->final ? XML_ERROR : XML_MORE;
+
+    if (r->empty_end) {
+        r->empty_end = false;
+        xml_pop(r);
+        return XML_END;
+    }
+
+    for (;;) {
+        if (r->pos >= r->len) return r->final ? XML_EOF : XML_MORE;
+        const char *p = r->data + r->pos;
+        size_t avail = r->len - r->pos;
+
+        /* 文字データ（次の '<' まで） */
+        if (*p != '<') {
+            const char *lt = memchr(p, '<', avail);
+            if (!lt && !r->final) return XML_MORE;
+            r->text_off = r->pos;
+            r->text_len = lt ? (size_t)(lt - p) : avail;
+            r->cdata = false;
+            r->pos += r->text_len;
+            return XML_TEXT;
+        }
+
+        if (avail < 2) return incomplete;
+        if (p[1] == '?') {                          /* <?xml ...?> */
+            if (!xml_skip_to(r, r->pos + 2, "?>")) return incomplete;
+            continue;
+        }
+        if (p[1] == '!') {
+            if (avail < 9 && !r->final) return XML_MORE;
+            if (avail >= 4 && memcmp(p, "<!--", 4) == 0) {
+                if (!xml_skip_to(r, r->pos + 4, "-->")) return incomplete;
+                continue;
+            }
+            if (avail >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+                const char *close = memmem(p + 9, avail - 9, "]]>", 3);
+                if (!close) return incomplete;
+                r->text_off = r->pos + 9;
+                r->text_len = close - (p + 9);
+                r->cdata = true;
+                r->pos = close + 3 - r->data;
+                return XML_TEXT;
+            }
+            if (!xml_skip_to(r, r->pos + 2, ">")) return incomplete;    /* <!DOCTYPE ...> */
+            continue;
+        }
+
+        /* タグの終わり（属性値の中の '>' は除く） */
+        size_t gt = r->pos + 1;
+        char quote = 0;
+        for (; gt < r->len; gt++) {
+            char c = r->data[gt];
+            if (quote) {
+                if (c == quote) quote = 0;
+            } else if (c == '"' || c == '\'') {
+                quote = c;
+            } else if (c == '>') {
+                break;
+            }
+        }
+        if (gt >= r->len) return incomplete;
+
+        if (p[1] == '/') {
+            xml_set_name(r, r->pos + 2, gt);
+            r->pos = gt + 1;
+            xml_pop(r);
+            return XML_END;
+        }
+
+        bool empty = r->data[gt - 1] == '/';
+        size_t tag_end = empty ? gt - 1 : gt;
+        size_t name_end = r->pos + 1;
+        while (name_end < tag_end && !xml_is_space(r->data[name_end])) name_end++;
+
+        r->depth++;
+        xml_declare(r, r->data + name_end, r->data + tag_end);
+        xml_set_name(r, r->pos + 1, tag_end);
+        r->attr_off = name_end;
+        r->attr_len = tag_end - name_end;
+        r->pos = gt + 1;
+        r->empty_end = empty;
+        return XML_START;
+    }
+}
+
+/* xml_is - 現在の要素が指定の名前空間・ローカル名か */
+static bool xml_is(const xml_reader_t *r, int ns, const char *local) {
+    return r->ns == ns && r->name_len == strlen(local) &&
+           memcmp(r->data + r->name_off, local, r->name_len) == 0;
+}
+
+/*
+ * xml_attr - 開始タグの属性値を取得（接頭辞のない属性名で検索）
+ *
+ * @return: 値の先頭（実体参照は未展開。属性がなければNULL）
+ */
+static const char *xml_attr(const xml_reader_t *r, const char *name, size_t *len) {
+    const char *p = r->data + r->attr_off, *end = p + r->attr_len;
+    size_t name_len = strlen(name);
+    xml_attr_t a;
+    while ((p = xml_attr_next(p, end, &a)) != NULL) {
+        if (a.name_len == name_len && memcmp(a.name, name, name_len) == 0) {
+            *len = a.value_len;
+            return a.value;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * xml_unescape - 実体参照を展開してコピー
+ *
+ * @return: 出力した長さ（dst は常にNUL終端。収まらない分は切り捨て）
+ */
+static size_t xml_unescape(const char *src, size_t len, char *dst, size_t size) {
+    static const struct { const char *name; char c; } entities[] = {
+        { "lt;", '<' }, { "gt;", '>' }, { "amp;", '&' }, { "quot;", '"' }, { "apos;", '\'' },
+    };
+    size_t out = 0;
+    if (size == 0) return 0;
+
+    for (size_t i = 0; i < len && out < size - 1; ) {
+        if (src[i] != '&') {
+            dst[out++] = src[i++];
+            continue;
+        }
+        const char *semi = memchr(src + i, ';', len - i);
+        size_t ref_len = semi ? (size_t)(semi - (src + i)) + 1 : 0;
+        bool done = false;
+        if (ref_len > 2 && src[i + 1] == '#') {
+            /* 文字参照 &#N; / &#xN; → UTF-8 */
+            bool hex = src[i + 2] == 'x' || src[i + 2] == 'X';
+            uint32_t cp = (uint32_t)strtoul(src + i + (hex ? 3 : 2), NULL, hex ? 16 : 10);
+            char utf8[4];
+            size_t n = cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+            if (n == 1) {
+                utf8[0] = cp;
+            } else {
+                for (size_t k = n - 1; k > 0; k--) {
+                    utf8[k] = 0x80 | (cp & 0x3f);
+                    cp >>= 6;
+                }
+                utf8[0] = (0xf00 >> n) | cp;
+            }
+            if (out + n < size) {
+                memcpy(dst + out, utf8, n);
+                out += n;
+            }
+            done = true;
+        } else {
+            for (size_t k = 0; k < sizeof(entities) / sizeof(entities[0]); k++) {
+                if (ref_len == strlen(entities[k].name) + 1 &&
+                    memcmp(src + i + 1, entities[k].name, ref_len - 1) == 0) {
+                    dst[out++] = entities[k].c;
+                    done = true;
+                    break;
+                }
+            }
+        }
+        if (done) {
+            i += ref_len;
+        } else {
+            dst[out++] = src[i++];    /* 不明な参照はそのまま */
+        }
+    }
+    dst[out] = '\0';
+    return out;
+}
+
+/* xml_attr_copy - 属性値を実体参照を展開してコピー（属性がなければfalse） */
+static bool xml_attr_copy(const xml_reader_t *r, const char *name, char *dst, size_t size) {
+    size_t len;
+    const char *value = xml_attr(r, name, &len);
+    if (!value) return false;
+    xml_unescape(value, len, dst, size);
+    return true;
+}
+
+/*
+ * xml_read_text - 開始タグの直後から対応する終了タグまでの文字データを取得
+ *
+ * 子要素の中の文字データは含めない。前後の空白は除く。
+ * @return: 終了タグまで読めた場合true（入力が途中で終わっていればfalse）
+ */
+static bool xml_read_text(xml_reader_t *r, char *dst, size_t size) {
+    int depth = r->depth;
+    size_t out = 0;
+    if (size > 0) dst[0] = '\0';
+
+    for (;;) {
+        xml_token_t t = xml_next(r);
+        if (t == XML_END && r->depth < depth) break;
+        if (t == XML_TEXT && r->depth == depth && out + 1 < size) {
+            const char *text = r->data + r->text_off;
+            if (r->cdata) {
+                size_t n = r->text_len < size - 1 - out ? r->text_len : size - 1 - out;
+                memcpy(dst + out, text, n);
+                dst[out + n] = '\0';
+                out += n;
+            } else {
+                out += xml_unescape(text, r->text_len, dst + out, size - out);
+            }
+        } else if (t == XML_MORE || t == XML_EOF || t == XML_ERROR) {
+            return false;
+        }
+    }
+
+    /* 前後の空白を除去 */
+    size_t start = 0;
+    while (start < out && xml_is_space(dst[start])) start++;
+    while (out > start && xml_is_space(dst[out - 1])) out--;
+    memmove(dst, dst + start, out - start);
+    if (size > 0) dst[out - start] = '\0';
+    return true;
+}
+
+/*
+ * soap_find_text - 指定した要素の最初の出現の文字データを取得
+ *
+ * @xml:    SOAPレスポンス
+ * @len:    レスポンス長
+ * @ns:     要素の名前空間（XML_NS_*）
+ * @local:  要素のローカル名（例: "ShellId"）
+ * @value:  値の出力バッファ
+ * @size:   バッファサイズ
+ * @return: 見つかった場合true
+ *
+ * WinRMレスポンスからShellIdやCommandId等を取り出すために使用（1回の走査）。
+ */
+static bool soap_find_text(const char *xml, size_t len, int ns, const char *local,
+                           char *value, size_t size) {
+    xml_reader_t r;
+    xml_reader_init(&r, xml, len, true);
+    for (;;) {
+        xml_token_t t = xml_next(&r);
+        if (t == XML_START && xml_is(&r, ns, local)) {
+            return xml_read_text(&r, value, size) && value[0] != '\0';
+        }
+        if (t == XML_EOF || t == XML_ERROR) return false;
+    }
+}
+
+/*
+ * soap_fault_t - SOAP Faultの内容
+ */
+typedef struct {
+    char subcode[64];   /* 最も内側の s:Subcode/s:Value のローカル名（例: TimedOut） */
+    char reason[256];   /* s:Reason/s:Text（なければ f:Message） */
+    char code[16];      /* f:WSManFault の Code 属性（例: 2150858793） */
+} soap_fault_t;
+
+/*
+ * soap_fault_parse - レスポンスがSOAP Faultなら内容を取り出す
+ *
+ * @return: Faultの場合true
+ */
+static bool soap_fault_parse(const char *xml, size_t len, soap_fault_t *fault) {
+    xml_reader_t r;
+    bool found = false;
+    int subcode_depth = -1;
+    char message[256] = "";
+
+    memset(fault, 0, sizeof(*fault));
+    xml_reader_init(&r, xml, len, true);
+    for (;;) {
+        xml_token_t t = xml_next(&r);
+        if (t == XML_EOF || t == XML_ERROR) break;
+        if (t != XML_START) continue;
+
+        if (xml_is(&r, XML_NS_SOAP, "Fault")) {
+            found = true;
+        } else if (!found) {
+            continue;
+        } else if (xml_is(&r, XML_NS_SOAP, "Subcode")) {
+            subcode_depth = r.depth;
+        } else if (xml_is(&r, XML_NS_SOAP, "Value") && r.depth == subcode_depth + 1) {
+            /* QName（w:TimedOut）のローカル名 */
+            char value[sizeof(fault->subcode)];
+            if (xml_read_text(&r, value, sizeof(value))) {
+                const char *colon = strchr(value, ':');
+                snprintf(fault->subcode, sizeof(fault->subcode), "%s", colon ? colon + 1 : value);
+            }
+        } else if (xml_is(&r, XML_NS_SOAP, "Text") && fault->reason[0] == '\0') {
+            xml_read_text(&r, fault->reason, sizeof(fault->reason));
+        } else if (xml_is(&r, XML_NS_WSMANFAULT, "WSManFault")) {
+            xml_attr_copy(&r, "Code", fault->code, sizeof(fault->code));
+        } else if (xml_is(&r, XML_NS_WSMANFAULT, "Message") && message[0] == '\0') {
+            xml_read_text(&r, message, sizeof(message));
+        }
+    }
+    if (fault->reason[0] == '\0') {
+        snprintf(fault->reason, sizeof(fault->reason), "%s", message);
+    }
+    return found;
+}
+
+/*
+ * stream_chunk_cb - デコード済み出力チャンクを受け取るコールバック
+ *
+ * @stream: 0 = stdout, 1 = stderr
+ * @data:   デコード済みデータ（data[len] はNUL）
+ * @len:    データ長
+ * @ctx:    呼び出し元のコンテキスト
+ */
+typedef void (*stream_chunk_cb)(int stream, const uint8_t *data, size_t len, void *ctx);
+
+/*
+ * receive_result_t - Receiveレスポンスの解析結果
+ *
+ * Stream要素の本文はレスポンス内の位置（オフセット）だけを保持し（コピーしない）、
+ * receive_emit() でデコードして渡す。完了判定とデコードを分けることで、
+ * 呼び出し元は次のリクエストを先に送ってから出力を処理できる。
+ */
+typedef struct {
+    size_t off, len;    /* Base64本文（レスポンス先頭からの位置） */
+    int stream;         /* 0 = stdout, 1 = stderr */
+} receive_chunk_t;
+
+typedef struct {
+    receive_chunk_t *chunks;  /* 出現順のStream要素 */
+    int count, cap;
+    bool done;                /* CommandState/Done を受信したか */
+    int exit_code;            /* rsp:ExitCode（done時） */
+    bool failed;              /* メモリ確保に失敗したか */
+} receive_result_t;
+
+/*
+ * receive_parser_t - Receiveレスポンスの逐次解析
+ *
+ * 本文を受信途中から receive_parser_feed() で渡していき、最後に final=true で
+ * 呼ぶと result が完成する。位置はオフセットで保持するため、受信バッファが
+ * 再確保されても構わない。
+ */
+typedef struct {
+    xml_reader_t xml;
+    char command_id[128];     /* 対象のCommandId（異なるCommandId属性の要素は無視する） */
+    int stream;               /* 対象のStream要素の種類 */
+    int stream_depth;         /* 対象のStream要素の中ならその深さ */
+    int state_depth;          /* 対象のCommandState要素の中ならその深さ */
+    int exit_depth;           /* その中のExitCode要素の中ならその深さ */
+    receive_result_t result;
+} receive_parser_t;
+
+/* xml_value_is - 属性値等が指定の文字列と一致するか（大文字小文字は区別しない） */
+static bool xml_value_is(const char *value, size_t len, const char *expected) {
+    return value && len == strlen(expected) && strncasecmp(value, expected, len) == 0;
+}
+
+/* receive_parser_init - 逐次解析を開始（以前の結果は receive_result_free() 済みであること） */
+static void receive_parser_init(receive_parser_t *p, const char *command_id) {
+    memset(p, 0, sizeof(*p));
+    snprintf(p->command_id, sizeof(p->command_id), "%s", command_id);
+    p->stream = -1;
+    xml_reader_init(&p->xml, "", 0, false);
+}
+
+/*
+ * receive_parser_feed - 受信済みの本文を解析
+ *
+ * @data:  本文の先頭（前回の呼び出しから再確保されていてもよい）
+ * @len:   受信済みの長さ（前回以上）
+ * @final: 本文の受信が完了したか
+ *
+ * XMLトークナイザで先頭から順にたどり、WinRS名前空間の Stream（複数。stdout/stderrが
+ * 交互に出現し得る）、CommandState、ExitCode を拾う。接頭辞は問わない。
+ * End="true" の空要素は本文を持たないので何も追加されない。
+ */
+static void receive_parser_feed(receive_parser_t *p, const char *data, size_t len, bool final) {
+    xml_reader_t *r = &p->xml;
+    receive_result_t *result = &p->result;
+
+    xml_reader_feed(r, data, len, final);
+    for (;;) {
+        xml_token_t t = xml_next(r);
+        if (t == XML_MORE || t == XML_EOF || t == XML_ERROR) break;
+
+        if (t == XML_END) {
+            if (r->depth < p->stream_depth) p->stream_depth = 0;
+            if (r->depth < p->state_depth) p->state_depth = 0;
+            if (r->depth < p->exit_depth) p->exit_depth = 0;
+        } else if (t == XML_TEXT) {
+            if (p->exit_depth && r->depth == p->exit_depth) {
+                char code[16];
+                xml_unescape(r->data + r->text_off, r->text_len, code, sizeof(code));
+                result->exit_code = atoi(code);
+            }
+            if (!p->stream_depth || r->depth != p->stream_depth || r->text_len == 0) continue;
+            if (result->count == result->cap) {
+                int cap = result->cap ? result->cap * 2 : 8;
+                receive_chunk_t *grown = realloc(result->chunks, cap * sizeof(*grown));
+                if (!grown) {
+                    result->failed = true;
+                    break;
+                }
+                result->chunks = grown;
+                result->cap = cap;
+            }
+            result->chunks[result->count++] = (receive_chunk_t){ r->text_off, r->text_len, p->stream };
+        } else if (t == XML_START && r->ns == XML_NS_SHELL) {
+            size_t id_len = 0, value_len = 0;
+            const char *id = xml_attr(r, "CommandId", &id_len);
+            bool matched = !id || xml_value_is(id, id_len, p->command_id);
+
+            if (xml_is(r, XML_NS_SHELL, "Stream")) {
+                const char *name = xml_attr(r, "Name", &value_len);
+                p->stream = xml_value_is(name, value_len, "stdout") ? 0 :
+                            xml_value_is(name, value_len, "stderr") ? 1 : -1;
+                p->stream_depth = matched && p->stream >= 0 ? r->depth : 0;
+            } else if (xml_is(r, XML_NS_SHELL, "CommandState")) {
+                const char *state = xml_attr(r, "State", &value_len);
+                p->state_depth = matched ? r->depth : 0;
+                if (matched && state && value_len >= 5 &&
+                    memcmp(state + value_len - 5, "/Done", 5) == 0) {
+                    result->done = true;
+                }
+            } else if (p->state_depth && xml_is(r, XML_NS_SHELL, "ExitCode")) {
+                p->exit_depth = r->depth;
+            }
+        }
+    }
+}
+
+/*
+ * receive_parse - Receiveレスポンス全体を1回の走査で解析
+ *
+ * @response:   Receiveレスポンス（SOAP XML）
+ * @len:        レスポンス長
+ * @command_id: 対象のCommandId
+ * @result:     解析結果の出力先（receive_result_free() で解放）
+ */
+static void receive_parse(const char *response, size_t len, const char *command_id,
+                          receive_result_t *result) {
+    receive_parser_t p;
+    receive_parser_init(&p, command_id);
+    receive_parser_feed(&p, response, len, true);
+    *result = p.result;
+}
+
+/*
+ * receive_emit - 解析したStream要素を出現順にデコードして渡す
+ *
+ * @response: 解析したレスポンス
+ * @cb:  チャンクごとに呼ばれるコールバック
+ * @ctx: コールバックに渡すコンテキスト
+ *
+ * デコード先のバッファは全要素で使い回す。
+ */
+static void receive_emit(const receive_result_t *result, const char *response,
+                         stream_chunk_cb cb, void *ctx) {
+    uint8_t *decoded = NULL;
+    size_t decoded_cap = 0;
+
+    for (int i = 0; i < result->count; i++) {
+        const receive_chunk_t *chunk = &result->chunks[i];
+        if (BASE64_DECODE_SIZE(chunk->len) + 1 > decoded_cap) {
+            free(decoded);
+            decoded_cap = BASE64_DECODE_SIZE(chunk->len) + 1;
+            decoded = malloc(decoded_cap);
+            if (!decoded) break;
+        }
+        base64_stream_t st = {0};
+        size_t decoded_len = base64_decode_update(&st, response + chunk->off, chunk->len, decoded);
+        decoded[decoded_len] = '\0';
+        if (decoded_len > 0) cb(chunk->stream, decoded, decoded_len, ctx);
+    }
+    free(decoded);
+}
+
+/* receive_result_free - 解析結果を解放 */
+static void receive_result_free(receive_result_t *result) {
+    free(result->chunks);
+    result->chunks = NULL;
+    result->count = result->cap = 0;
+}
+
+/*
+ * soap_fault_is_timeout - レスポンスが OperationTimeout 超過のFaultか判定
+ *
+ * @xml:    SOAPレスポンス
+ * @len:    レスポンス長
+ * @return: w:TimedOut（WSManFault Code 2150858793）の場合true
+ *
+ * Receiveのロングポーリングでは、待機時間内に出力がなかっただけの
+ * 正常な結果（まだ出力なし）として扱う。
+ */
+static bool soap_fault_is_timeout(const char *xml, size_t len) {
+    soap_fault_t fault;
+    if (!soap_fault_parse(xml, len, &fault)) return false;
+    return strcmp(fault.subcode, "TimedOut") == 0 || strcmp(fault.code, "2150858793") == 0;
+}
+
+/*
+ * log_soap_fault - SOAP Faultの内容をエラーとして表示
+ */
+static void log_soap_fault(const char *xml, size_t len) {
+    soap_fault_t fault;
+    if (!soap_fault_parse(xml, len, &fault)) return;
+
+    char msg[384];
+    snprintf(msg, sizeof(msg), "SOAP Fault: %s%s%s%s %s",
+             fault.subcode[0] ? fault.subcode : "(サブコードなし)",
+             fault.code[0] ? " (" : "", fault.code, fault.code[0] ? ")" : "", fault.reason);
+    log_error(msg);
+}
+
+/* ============================================================================
+ * SOAPパイプライン（1本の認証済み接続へ続けて送信）
+ * ============================================================================
+ *
+ * 前の応答を待たずに送れるリクエスト（Commandの直後のReceive、Done受信直後の
+ * Delete等）は、同じkeep-alive接続へHTTP/1.1パイプラインで続けて送信し、
+ * 応答は送信順に1つずつ受け取る。サーバーが前のリクエストを処理している間に
+ * 次のリクエストが届いているため、依存するリクエストごとの1往復の待ちがなくなる。
+ *
+ * - 応答待ちのリクエストは平文のまま保持し、接続が切れた・401が返った場合は
+ *   再認証してから応答待ちのものをすべて送り直す（1応答あたり1回まで）
+ * - Connection: close の応答を受けたら接続を閉じ、残りは次の受信時に送り直す
+ *   （サーバーは閉じると応答した後のリクエストを処理しない）
+ * - 重複すると困るリクエスト（Command・Send、once指定のパイプラインのすべて）は、
+ *   送信済みのまま応答なしで切断されたら送り直さずに失敗とする（処理済みのリクエストの
+ *   応答が切断で失われることがあるため）。401の応答はサーバーが処理していないため送り直す
+ * - 応答待ちを残したまま閉じた接続はプールへ戻さない
+ * ============================================================================ */
+
+#define PIPELINE_MAX_DEPTH 4
+
+#define SOAP_MAX_SLOTS 6                     /* テンプレート1つあたりのスロット数の上限 */
+#define SOAP_MAX_IOV (SOAP_MAX_SLOTS * 2 + 1)
+
+/*
+ * soap_message_t - 送信するSOAPリクエスト
+ *
+ * iov はテンプレートの固定部分と fields（このリクエストの値）を交互に指す。
+ * 再送に備えて応答を受け取るまで保持する。soap_message_free() で解放。
+ */
+typedef struct {
+    struct iovec iov[SOAP_MAX_IOV];
+    int iovcnt;              /* 0: リクエストなし */
+    size_t len;              /* 本文の長さ */
+    char *fields;            /* スロットの値（malloc） */
+    bool once;               /* 送信済みなら送り直さない（サーバー側で重複すると困る） */
+    bool sent;               /* サーバーが処理した可能性があるか（送信後、未処理と分かるまで） */
+} soap_message_t;
+
+/* soap_url - a:To に入れるエンドポイントURL */
+static void soap_url(char *url, size_t size, const char *host, int port) {
+    snprintf(url, size, "http://%s:%d/wsman", host, port);
+}
+
+/* soap_message_free - リクエストを解放 */
+static void soap_message_free(soap_message_t *m) {
+    free(m->fields);
+    memset(m, 0, sizeof(*m));
+}
+
+typedef struct {
+    winrm_conn_t *conn;                      /* チェックアウト中の接続 */
+    char url[MAX_URL_SIZE];                  /* a:To に入れるURL */
+    soap_message_t queue[PIPELINE_MAX_DEPTH]; /* 応答待ちのSOAP（送信順、再送用に平文で保持） */
+    int count;                               /* 応答待ちの数 */
+    bool retried;                            /* 先頭の応答について再送済みか */
+    bool once;                               /* 応答なしで切断されたリクエストを送り直さない */
+} soap_pipeline_t;
+
+/*
+ * pipeline_open - 接続をプールから取り出してパイプラインを開始
+ *
+ * @return: 成功時true（認証は最初の送信時に行う）
+ */
+static bool pipeline_open(soap_pipeline_t *pl, const char *host, int port) {
+    memset(pl, 0, sizeof(*pl));
+    soap_url(pl->url, sizeof(pl->url), host, port);
+    pl->conn = pool_checkout(host, port, g_user, g_domain);
+    return pl->conn != NULL;
+}
+
+/*
+ * pipeline_can_resend - 応答待ちのリクエストを送り直してよいか
+ *
+ * @return: 送り直すと重複しうるリクエスト（once かつ送信済み）がなければtrue
+ */
+static bool pipeline_can_resend(const soap_pipeline_t *pl) {
+    for (int i = 0; i < pl->count; i++) {
+        if (pl->queue[i].sent && pl->queue[i].once) return false;
+    }
+    return true;
+}
+
+/* pipeline_mark_unsent - 応答待ちのリクエストをサーバーが処理していないものとして扱う */
+static void pipeline_mark_unsent(soap_pipeline_t *pl) {
+    for (int i = 0; i < pl->count; i++) {
+        pl->queue[i].sent = false;
+    }
+}
+
+/*
+ * pipeline_resend - 接続・認証し直し、応答待ちのリクエストをすべて送信
+ */
+static bool pipeline_resend(soap_pipeline_t *pl) {
+    if (!pipeline_can_resend(pl)) {
+        log_error("応答のないまま接続が切断されたため、リクエストを送り直しません");
+        return false;
+    }
+    if (!conn_authenticate(pl->conn)) {
+        return false;
+    }
+    for (int i = 0; i < pl->count; i++) {
+        if (!conn_post_sealed(pl->conn, pl->queue[i].iov, pl->queue[i].iovcnt)) {
+            /* 送信できなかった分は、受信時の切断検出で再送される */
+            break;
+        }
+        pl->queue[i].sent = true;
+    }
+    return true;
+}
+
+/*
+ * pipeline_post - リクエストを送信し、応答待ちに加える
+ *
+ * @soap:   送信するリクエスト（所有権はパイプラインへ移る。失敗時も解放される）
+ * @return: 送信（または送信の予約）ができればtrue
+ */
+static bool pipeline_post(soap_pipeline_t *pl, soap_message_t *soap) {
+    if (pl->count >= PIPELINE_MAX_DEPTH) {
+        soap_message_free(soap);
+        log_error("パイプラインの応答待ちが多すぎます");
+        return false;
+    }
+    soap_message_t *queued = &pl->queue[pl->count++];
+    *queued = *soap;
+    queued->once |= pl->once;
+    memset(soap, 0, sizeof(*soap));
+
+    /* 応答待ちがない間にサーバーが閉じた接続は、送る前に閉じて認証し直す
+     * （送信後の切断と区別できず、Command等を送り直せなくなるため） */
+    if (pl->count == 1 && pl->conn->authenticated && !conn_is_healthy(pl->conn)) {
+        conn_close(pl->conn);
+    }
+
+    /* 未接続（初回・Connection: close の後）なら、応答待ちのものと一緒に送る */
+    if (!pl->conn->authenticated) {
+        if (pl->count > 1 && DEBUG) {
+            log_info("接続が切断されたため再認証します...");
+        }
+        return pipeline_resend(pl);
+    }
+    if (!conn_post_sealed(pl->conn, queued->iov, queued->iovcnt)) {
+        /* 切断されていれば受信時に再認証して送り直す（送信済みの once があれば失敗） */
+        conn_close(pl->conn);
+        if (!pipeline_can_resend(pl)) {
+            log_error("リクエストの送信中に接続が切断されました");
+            return false;
+        }
+        return true;
+    }
+    queued->sent = true;
+    return true;
+}
+
+/*
+ * pipeline_collect - 最も古いリクエストの応答を受信
+ *
+ * @response:  レスポンス本文の格納先（ヘッダを除いた本文のみ、サイズ上限なし）
+ * @http_code: HTTPステータスコードの出力先
+ * @return:    応答を受信できればtrue（ステータスコードの判定は呼び出し元）
+ */
+static bool pipeline_collect(soap_pipeline_t *pl, buf_t *response, int *http_code) {
+    bool keep_alive = false;
+
+    *http_code = 0;
+    /* 失敗時も呼び出し元が response->data を文字列として扱えるようにする */
+    buf_clear(response);
+    if (!buf_reserve(response, 0)) {
+        log_error("メモリ確保に失敗しました");
+        return false;
+    }
+    if (pl->count == 0) return false;
+
+    for (;;) {
+        if (!pl->conn->authenticated) {
+            if (DEBUG) {
+                log_info("接続が切断されたため再認証します...");
+            }
+            if (!pipeline_resend(pl)) return false;
+        }
+
+        size_t recv_len = conn_recv_sealed(pl->conn, response, http_code, &keep_alive);
+
+        /* 応答なしの切断（サーバー側のkeep-aliveタイムアウト等）または401は再認証 */
+        if (recv_len == 0 || *http_code == 0 || *http_code == 401) {
+            conn_close(pl->conn);
+            if (*http_code == 401) {
+                pipeline_mark_unsent(pl);
+            } else if (!pipeline_can_resend(pl)) {
+                *http_code = 0;
+                break;
+            }
+            if (!pl->retried) {
+                pl->retried = true;
+                continue;
+            }
+        }
+        break;
+    }
+    pl->retried = false;
+
+    /* 応答を受け取ったリクエストを取り除く（401・切断時も再送は1回まで） */
+    soap_message_free(&pl->queue[0]);
+    memmove(pl->queue, pl->queue + 1, (pl->count - 1) * sizeof(pl->queue[0]));
+    pl->count--;
+
+    if (!keep_alive) {
+        /* 残りのリクエストは次の受信時に接続し直して送る */
+        conn_close(pl->conn);
+        pipeline_mark_unsent(pl);
+    }
+
+    /* 本文はエラー時も残す（Faultの内容を呼び出し元で判定できるように） */
+    if (*http_code == 0) {
+        buf_clear(response);
+        log_error("暗号化SOAPリクエストの送受信に失敗しました（接続が切断されました）");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * pipeline_abandon - 応答待ちのリクエストを破棄（エラー時）
+ *
+ * 応答待ちが残っている接続は再利用できないため閉じる。
+ */
+static void pipeline_abandon(soap_pipeline_t *pl) {
+    if (pl->count > 0) {
+        conn_close(pl->conn);
+    }
+    for (int i = 0; i < pl->count; i++) {
+        soap_message_free(&pl->queue[i]);
+    }
+    pl->count = 0;
+    pl->retried = false;
+}
+
+/*
+ * pipeline_close - パイプラインを終了して接続をプールに戻す
+ */
+static void pipeline_close(soap_pipeline_t *pl) {
+    if (!pl->conn) return;
+    pipeline_abandon(pl);
+    pool_checkin(pl->conn, true);
+    pl->conn = NULL;
+}
+
+/*
+ * soap_collect - SOAPレスポンスを受信し、HTTPステータスを判定
+ *
+ * @response: レスポンス本文の格納先
+ * @return:   成功時true（ロングポーリングの待機時間切れも成功として扱う）
+ */
+static bool soap_collect(soap_pipeline_t *pl, buf_t *response) {
+    int http_code;
+
+    if (!pipeline_collect(pl, response, &http_code)) {
+        return false;
+    }
+
+    if (http_code == 401) {
+        log_error("暗号化リクエストで認証エラー (HTTP 401)");
+        return false;
+    } else if (http_code == 500 && soap_fault_is_timeout(response->data, response->len)) {
+        /* ロングポーリングの待機時間切れ: 呼び出し元が「出力なし」として扱う */
+    } else if (http_code == 500) {
+        log_error("サーバー内部エラーが発生しました (HTTP 500)");
+        log_soap_fault(response->data, response->len);
+        return false;
+    } else if (http_code != 200) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "予期しないHTTPステータスコード: %d", http_code);
+        log_warn(msg);
+    }
+
+    if (DEBUG) {
+        log_info("受信XML:");
+        fprintf(stderr, "%s\n", response->data);
+    }
+
+    return true;
+}
+
+/* ============================================================================
+ * ユーティリティ関数
+ * ============================================================================ */
+
+/* generate_uuid() 用に取り置いた乱数（g_uuid_pool_pos 以降が未使用） */
+static uint8_t g_uuid_pool[16 * 32];
+static size_t g_uuid_pool_pos = sizeof(g_uuid_pool);
+
+/*
+ * uuid_pool_fill - g_uuid_pool を乱数で満たす
+ *
+ * getrandom() は glibc 2.25 以降にしかないため（RHEL 7 は 2.17）、システムコールを
+ * 直接呼ぶ。ヘッダーやカーネルが対応していなければ /dev/urandom からまとめて読む。
+ *
+ * @return: プール全体を満たせればtrue
+ */
+static bool uuid_pool_fill(void) {
+#ifdef SYS_getrandom
+    if (syscall(SYS_getrandom, g_uuid_pool, sizeof(g_uuid_pool), 0) == (long)sizeof(g_uuid_pool)) {
+        return true;
+    }
+#endif
+    FILE *urandom = fopen("/dev/urandom", "re");
+    if (!urandom) return false;
+    bool filled = fread(g_uuid_pool, 1, sizeof(g_uuid_pool), urandom) == sizeof(g_uuid_pool);
+    fclose(urandom);
+    return filled;
+}
+
+/*
+ * generate_uuid - UUID（バージョン4）を生成
+ *
+ * @uuid: 出力バッファ
+ * @size: バッファサイズ
+ *
+ * WinRMのSOAPメッセージには各リクエストにユニークなMessageIDが必要。
+ * uuid_pool_fill() で取得した乱数を g_uuid_pool にまとめて保持し、リクエストごとに
+ * 16バイトずつ使う（ファイルのopen/readを毎回行わない）。fork した子プロセスは
+ * 親と同じ乱数を使わないよう g_uuid_pool_pos を末尾に戻して取り直す。
+ * 乱数を取得できなければ時刻とrand()で代用する。
+ */
+static void generate_uuid(char *uuid, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+    uint8_t bytes[16];
+
+    if (g_uuid_pool_pos == sizeof(g_uuid_pool)) {
+        if (!uuid_pool_fill()) {
+            for (size_t i = 0; i < sizeof(g_uuid_pool); i++) {
+                g_uuid_pool[i] = (uint8_t)(rand() ^ (time(NULL) >> (i % 16)));
+            }
+        }
+        g_uuid_pool_pos = 0;
+    }
+    memcpy(bytes, g_uuid_pool + g_uuid_pool_pos, 16);
+    g_uuid_pool_pos += 16;
+    bytes[6] = (bytes[6] & 0x0f) | 0x40;   /* バージョン4 */
+    bytes[8] = (bytes[8] & 0x3f) | 0x80;   /* RFC 4122 バリアント */
+
+    char text[37];
+    size_t n = 0;
+    for (int i = 0; i < 16; i++) {
+        if (i == 4 || i == 6 || i == 8 || i == 10) text[n++] = '-';
+        text[n++] = hex[bytes[i] >> 4];
+        text[n++] = hex[bytes[i] & 0x0f];
+    }
+    text[n] = '\0';
+    snprintf(uuid, size, "%s", text);
+}
+
+/*
+ * generate_command_id - クライアント側で割り当てるCommandIdを生成
+ *
+ * WinRMが返すCommandIdと同じく、大文字のUUID形式にする。
+ */
+static void generate_command_id(char *id, size_t size) {
+    generate_uuid(id, size);
+    for (char *p = id; *p; p++) {
+        if (*p >= 'a' && *p <= 'f') *p -= 32;
+    }
+}
+
+/*
+ * xml_escape - XML特殊文字をエスケープ
+ *
+ * @src:      入力文字列
+ * @dst:      出力バッファ
+ * @dst_size: バッファサイズ
+ *
+ * SOAPメッセージに含めるコマンド文字列内の特殊文字を
+ * XMLエンティティに変換（例: & → &amp;）
+ */
+static void xml_escape(const char *src, char *dst, size_t dst_size) {
+    size_t j = 0;
+    for (size_t i = 0; src[i] && j < dst_size - 6; i++) {
+        switch (src[i]) {
+            case '&':  j += snprintf(dst + j, dst_size - j, "&amp;"); break;
+            case '<':  j += snprintf(dst + j, dst_size - j, "&lt;"); break;
+            case '>':  j += snprintf(dst + j, dst_size - j, "&gt;"); break;
+            case '"':  j += snprintf(dst + j, dst_size - j, "&quot;"); break;
+            case '\'': j += snprintf(dst + j, dst_size - j, "&apos;"); break;
+            default:   dst[j++] = src[i]; break;
+        }
+    }
+    dst[j] = '\0';
+}
+
+/*
+ * str_replace - 文字列内のすべての出現箇所を置換
+ *
+ * @str:     置換対象の文字列（直接変更される）
+ * @old:     検索文字列
+ * @new_str: 置換文字列
+ *
+ * 【重要】whileループを使用しているため、{ENV}が複数箇所にあっても
+ * すべて置換される。
+ *
+ * 例: "C:\\{ENV}\\sub\\{ENV}\\test.bat" → "C:\\TST1T\\sub\\TST1T\\test.bat"
+ */
+static void str_replace(char *str, const char *old, const char *new_str) {
+    char buffer[MAX_BUFFER_SIZE];
+    char *pos;
+
+    while ((pos = strstr(str, old)) != NULL) {
+        size_t prefix_len = pos - str;
+        strncpy(buffer, str, prefix_len);
+        buffer[prefix_len] = '\0';
+        strcat(buffer, new_str);
+        strcat(buffer, pos + strlen(old));
+        strcpy(str, buffer);
+    }
+}
+
+/* ============================================================================
+ * WinRM操作
+ * ============================================================================
+ *
+ * 【WinRM (Windows Remote Management) とは】
+ * Microsoftが開発したリモート管理プロトコル。
+ * WS-Management（Web Services for Management）仕様に基づく。
+ *
+ * 【WinRMセッションの流れ】
+ * 1. Create: リモートシェル（cmd.exe）を作成
+ *    → ShellIdを取得
+ *
+ * 2. Command: シェル上でコマンドを実行
+ *    → CommandIdを取得
+ *
+ * 3. Receive: コマンドの出力（stdout/stderr）を取得
+ *    → 出力はBase64エンコードされて返される
+ *    → CommandState/Doneになるまでポーリング
+ *
+ * 4. Delete: シェルを削除（リソース解放）
+ *
+ * 【SOAPメッセージ形式】
+ * <?xml version="1.0" encoding="UTF-8"?>
+ * <s:Envelope xmlns:s="..." xmlns:a="..." ...>
+ *   <s:Header>
+ *     <a:Action>...</a:Action>
+ *     <w:ResourceURI>...</w:ResourceURI>
+ *     ...
+ *   </s:Header>
+ *   <s:Body>
+ *     ... 操作固有のXML ...
+ *   </s:Body>
+ * </s:Envelope>
+ * ============================================================================ */
+
+/*
+ * SOAPエンベロープのテンプレート
+ *
+ * エンベロープの大部分（名前空間宣言・ReplyTo・ResourceURI等）はリクエストごとに変わらない。
+ * 各操作のエンベロープを最初に1回だけ組み立て、リクエストごとに変わる値（a:To、MessageID、
+ * ShellId、CommandId、コマンド文字列）の位置をスロットとして記録しておく。
+ * リクエストは「固定部分とスロットの値」を交互に並べた iovec で表し、送信側が
+ * 暗号化時に順にたどる（エンベロープ全体を文字列として組み立て直さない）。
+ * ブロッキング実行（create_shell等）とイベントループ実行の両方から使用する。
+ */
+
+/* スロットの目印（テンプレートの組み立て時だけ使う。XML本文には現れない制御文字） */
+#define SOAP_SLOT_TO          "\x01"   /* a:To のURL */
+#define SOAP_SLOT_MESSAGE_ID  "\x02"   /* MessageID（リクエストごとに生成） */
+#define SOAP_SLOT_SHELL_ID    "\x03"   /* ShellId */
+#define SOAP_SLOT_COMMAND_ID  "\x04"   /* CommandId */
+#define SOAP_SLOT_COMMAND     "\x05"   /* コマンド文字列（XMLエスケープして埋め込む） */
+#define SOAP_SLOT_STREAM_END  "\x06"   /* 入力の最後のSendなら End="true" 属性 */
+#define SOAP_SLOT_STREAM      "\x07"   /* 入力データ（Base64エンコードして埋め込む） */
+#define SOAP_SLOT_LAST        7
+
+typedef enum {
+    SOAP_CREATE,     /* シェル作成（WS-Transfer Create） */
+    SOAP_COMMAND,    /* コマンド実行（WinRS Command） */
+    SOAP_RECEIVE,    /* 出力取得（WinRS Receive） */
+    SOAP_DELETE,     /* シェル削除（WS-Transfer Delete） */
+    SOAP_GET,        /* シェルの状態取得・生存確認（WS-Transfer Get） */
+    SOAP_SEND,       /* 標準入力の転送（WinRS Send） */
+    SOAP_KIND_COUNT
+} soap_kind_t;
+
+/*
+ * soap_template_t - 組み立て済みのエンベロープ
+ *
+ * text はスロットの目印を含んだままのエンベロープ。固定部分 i は
+ * text[seg_off[i]] から seg_len[i] バイトで、その後ろにスロット slot[i] が入る。
+ */
+typedef struct {
+    char *text;
+    size_t seg_off[SOAP_MAX_SLOTS + 1];
+    size_t seg_len[SOAP_MAX_SLOTS + 1];
+    uint8_t slot[SOAP_MAX_SLOTS];
+    int nslots;
+} soap_template_t;
+
+static soap_template_t g_soap_templates[SOAP_KIND_COUNT];
+
+/* build_create_envelope - シェル作成（WS-Transfer Create） */
+static void build_create_envelope(char *envelope, size_t size) {
+    snprintf(envelope, size,
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
+        "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
+        "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\"\n"
+        "            xmlns:rsp=\"http://schemas.microsoft.com/wbem/wsman/1/windows/shell\">\n"
+        "  <s:Header>\n"
+        "    <a:To>%s</a:To>\n"
+        "    <a:ReplyTo>\n"
+        "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
+        "    </a:ReplyTo>\n"
+        "    <a:Action s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/09/transfer/Create</a:Action>\n"
+        "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
+        "    <a:MessageID>uuid:%s</a:MessageID>\n"
+        "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
+        "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
+        "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
+        "    <w:OptionSet>\n"
+        "      <w:Option Name=\"WINRS_NOPROFILE\">FALSE</w:Option>\n"
+        "      <w:Option Name=\"WINRS_CODEPAGE\">65001</w:Option>\n"
+        "    </w:OptionSet>\n"
+        "  </s:Header>\n"
+        "  <s:Body>\n"
+        "    <rsp:Shell>\n"
+        "      <rsp:InputStreams>stdin</rsp:InputStreams>\n"
+        "      <rsp:OutputStreams>stdout stderr</rsp:OutputStreams>\n"
+        "    </rsp:Shell>\n"
+        "  </s:Body>\n"
+        "</s:Envelope>",
+        SOAP_SLOT_TO, SOAP_SLOT_MESSAGE_ID, TIMEOUT);
+}
+
+/*
+ * build_command_envelope - コマンド実行（WinRS Command）
+ *
+ * CommandIdをクライアントが指定しておくと（generate_command_id()）、Commandの応答を
+ * 待たずにそのCommandId宛てのReceiveを続けて送信できる。
+ */
+static void build_command_envelope(char *envelope, size_t size) {
+    snprintf(envelope, size,
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
         "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
         "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\"\n"
         "            xmlns:rsp=\"http://schemas.microsoft.com/wbem/wsman/1/windows/shell\">\n"
@@ -2557,266 +5405,4544 @@ static bool run_command(const char *shell_id, const char *command,
         "    </w:SelectorSet>\n"
         "  </s:Header>\n"
         "  <s:Body>\n"
-        "    <rsp:CommandLine>\n"
+        "    <rsp:CommandLine CommandId=\"%s\">\n"
         "      <rsp:Command>%s</rsp:Command>\n"
         "    </rsp:CommandLine>\n"
         "  </s:Body>\n"
         "</s:Envelope>",
-        url, uuid, TIMEOUT, shell_id, command_escaped);
+        SOAP_SLOT_TO, SOAP_SLOT_MESSAGE_ID, TIMEOUT, SOAP_SLOT_SHELL_ID, SOAP_SLOT_COMMAND_ID,
+        SOAP_SLOT_COMMAND);
+}
+
+/* build_receive_envelope - 出力取得（WinRS Receive） */
+static void build_receive_envelope(char *envelope, size_t size) {
+    snprintf(envelope, size,
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
+        "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
+        "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\"\n"
+        "            xmlns:rsp=\"http://schemas.microsoft.com/wbem/wsman/1/windows/shell\">\n"
+        "  <s:Header>\n"
+        "    <a:To>%s</a:To>\n"
+        "    <a:ReplyTo>\n"
+        "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
+        "    </a:ReplyTo>\n"
+        "    <a:Action s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Receive</a:Action>\n"
+        "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
+        "    <a:MessageID>uuid:%s</a:MessageID>\n"
+        "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
+        "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
+        "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
+        "    <w:SelectorSet>\n"
+        "      <w:Selector Name=\"ShellId\">%s</w:Selector>\n"
+        "    </w:SelectorSet>\n"
+        "  </s:Header>\n"
+        "  <s:Body>\n"
+        "    <rsp:Receive>\n"
+        "      <rsp:DesiredStream CommandId=\"%s\">stdout stderr</rsp:DesiredStream>\n"
+        "    </rsp:Receive>\n"
+        "  </s:Body>\n"
+        "</s:Envelope>",
+        SOAP_SLOT_TO, SOAP_SLOT_MESSAGE_ID, RECEIVE_TIMEOUT, SOAP_SLOT_SHELL_ID,
+        SOAP_SLOT_COMMAND_ID);
+}
+
+/*
+ * build_send_envelope - 標準入力の転送（WinRS Send）
+ *
+ * 入力の最後には End="true" を付けたStreamを送り、リモートプロセスに入力の終わり（EOF）を伝える。
+ */
+static void build_send_envelope(char *envelope, size_t size) {
+    snprintf(envelope, size,
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
+        "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
+        "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\"\n"
+        "            xmlns:rsp=\"http://schemas.microsoft.com/wbem/wsman/1/windows/shell\">\n"
+        "  <s:Header>\n"
+        "    <a:To>%s</a:To>\n"
+        "    <a:ReplyTo>\n"
+        "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
+        "    </a:ReplyTo>\n"
+        "    <a:Action s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Send</a:Action>\n"
+        "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
+        "    <a:MessageID>uuid:%s</a:MessageID>\n"
+        "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
+        "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
+        "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
+        "    <w:SelectorSet>\n"
+        "      <w:Selector Name=\"ShellId\">%s</w:Selector>\n"
+        "    </w:SelectorSet>\n"
+        "  </s:Header>\n"
+        "  <s:Body>\n"
+        "    <rsp:Send>\n"
+        "      <rsp:Stream Name=\"stdin\" CommandId=\"%s\"%s>%s</rsp:Stream>\n"
+        "    </rsp:Send>\n"
+        "  </s:Body>\n"
+        "</s:Envelope>",
+        SOAP_SLOT_TO, SOAP_SLOT_MESSAGE_ID, TIMEOUT, SOAP_SLOT_SHELL_ID, SOAP_SLOT_COMMAND_ID,
+        SOAP_SLOT_STREAM_END, SOAP_SLOT_STREAM);
+}
+
+/*
+ * build_shell_transfer_envelope - シェルに対するWS-Transfer操作（本文なし）
+ *
+ * @action: "Delete"（シェル削除）または "Get"（シェルの状態取得・生存確認）
+ */
+static void build_shell_transfer_envelope(char *envelope, size_t size, const char *action) {
+    snprintf(envelope, size,
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
+        "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
+        "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\">\n"
+        "  <s:Header>\n"
+        "    <a:To>%s</a:To>\n"
+        "    <a:ReplyTo>\n"
+        "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
+        "    </a:ReplyTo>\n"
+        "    <a:Action s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/09/transfer/%s</a:Action>\n"
+        "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
+        "    <a:MessageID>uuid:%s</a:MessageID>\n"
+        "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
+        "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
+        "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
+        "    <w:SelectorSet>\n"
+        "      <w:Selector Name=\"ShellId\">%s</w:Selector>\n"
+        "    </w:SelectorSet>\n"
+        "  </s:Header>\n"
+        "  <s:Body/>\n"
+        "</s:Envelope>",
+        SOAP_SLOT_TO, action, SOAP_SLOT_MESSAGE_ID, TIMEOUT, SOAP_SLOT_SHELL_ID);
+}
+
+/*
+ * soap_template_compile - 組み立てたエンベロープをスロットの位置で区切る
+ *
+ * @text: mallocしたエンベロープ（所有権はテンプレートへ移る）
+ */
+static bool soap_template_compile(soap_template_t *t, char *text) {
+    size_t start = 0;
+    t->text = text;
+    t->nslots = 0;
+    for (size_t i = 0; text[i]; i++) {
+        if ((uint8_t)text[i] > SOAP_SLOT_LAST) continue;
+        if (t->nslots == SOAP_MAX_SLOTS) return false;
+        t->seg_off[t->nslots] = start;
+        t->seg_len[t->nslots] = i - start;
+        t->slot[t->nslots++] = (uint8_t)text[i];
+        start = i + 1;
+    }
+    t->seg_off[t->nslots] = start;
+    t->seg_len[t->nslots] = strlen(text + start);
+    return true;
+}
+
+/*
+ * soap_templates_init - 全操作のテンプレートを組み立てる（最初の1回だけ）
+ *
+ * @return: 成功時true
+ */
+static bool soap_templates_init(void) {
+    if (g_soap_templates[0].text) return true;
+
+    for (int kind = 0; kind < SOAP_KIND_COUNT; kind++) {
+        char *text = malloc(MAX_ENVELOPE_SIZE);
+        if (!text) return false;
+        switch (kind) {
+        case SOAP_CREATE:  build_create_envelope(text, MAX_ENVELOPE_SIZE); break;
+        case SOAP_COMMAND: build_command_envelope(text, MAX_ENVELOPE_SIZE); break;
+        case SOAP_RECEIVE: build_receive_envelope(text, MAX_ENVELOPE_SIZE); break;
+        case SOAP_DELETE:  build_shell_transfer_envelope(text, MAX_ENVELOPE_SIZE, "Delete"); break;
+        case SOAP_SEND:    build_send_envelope(text, MAX_ENVELOPE_SIZE); break;
+        default:           build_shell_transfer_envelope(text, MAX_ENVELOPE_SIZE, "Get"); break;
+        }
+        if (!soap_template_compile(&g_soap_templates[kind], text)) {
+            free(text);
+            g_soap_templates[kind].text = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * soap_message_fill - テンプレートのスロットに値を入れてリクエストを作る
+ *
+ * @values:     スロットごとの値（SOAP_SLOT_MESSAGE_ID・SOAP_SLOT_STREAM は未使用）
+ * @stream:     入力データ（SOAP_SLOT_STREAM。Base64エンコードして埋め込む）
+ * @stream_len: 入力データの長さ
+ * @return:     成功時true（メモリ確保失敗時false）
+ *
+ * 値はまとめて1つのバッファ（fields）へコピーし、固定部分はテンプレートを直接指す。
+ * MessageIDはここで生成する。
+ */
+static bool soap_message_fill(soap_message_t *m, soap_kind_t kind,
+                              const char *const values[SOAP_SLOT_LAST + 1],
+                              const uint8_t *stream, size_t stream_len) {
+    const soap_template_t *t = &g_soap_templates[kind];
+
+    memset(m, 0, sizeof(*m));
+    if (!soap_templates_init()) return false;
+
+    /* 値の合計長（コマンドはすべて &quot; 等に置換された場合の長さ） */
+    size_t size = MAX_UUID_SIZE;
+    for (int i = 0; i < t->nslots; i++) {
+        uint8_t slot = t->slot[i];
+        if (slot == SOAP_SLOT_MESSAGE_ID[0]) continue;
+        if (slot == SOAP_SLOT_STREAM[0]) {
+            size += 4 * ((stream_len + 2) / 3) + 1;
+            continue;
+        }
+        size += strlen(values[slot]) * (slot == SOAP_SLOT_COMMAND[0] ? 6 : 1) + 7;
+    }
+    m->fields = malloc(size);
+    if (!m->fields) return false;
+
+    char *p = m->fields;
+    for (int i = 0; i <= t->nslots; i++) {
+        m->iov[m->iovcnt++] = (struct iovec){ t->text + t->seg_off[i], t->seg_len[i] };
+        m->len += t->seg_len[i];
+        if (i == t->nslots) break;
+
+        uint8_t slot = t->slot[i];
+        size_t room = m->fields + size - p;
+        size_t len;
+        if (slot == SOAP_SLOT_MESSAGE_ID[0]) {
+            generate_uuid(p, room);
+            len = strlen(p);
+        } else if (slot == SOAP_SLOT_STREAM[0]) {
+            len = base64_encode(stream, stream_len, p);
+        } else if (slot == SOAP_SLOT_COMMAND[0]) {
+            xml_escape(values[slot], p, room);
+            len = strlen(p);
+        } else {
+            len = strlen(values[slot]);
+            memcpy(p, values[slot], len + 1);
+        }
+        m->iov[m->iovcnt++] = (struct iovec){ p, len };
+        m->len += len;
+        p += len + 1;
+    }
+    /* Command・Sendはサーバーが処理済みなら送り直さない（実行・入力が重複するため） */
+    m->once = kind == SOAP_COMMAND || kind == SOAP_SEND;
+    return true;
+}
+
+/*
+ * soap_message_build - テンプレートからリクエストを作る
+ *
+ * @kind:       操作の種類（SOAP_SEND以外）
+ * @to:         a:To のURL（soap_url()）
+ * @shell_id:   ShellId（SOAP_CREATEでは未使用）
+ * @command_id: CommandId（SOAP_COMMAND / SOAP_RECEIVEのみ）
+ * @command:    コマンド文字列（SOAP_COMMANDのみ。XMLエスケープして埋め込む）
+ * @return:     成功時true（メモリ確保失敗時false）
+ */
+static bool soap_message_build(soap_message_t *m, soap_kind_t kind, const char *to,
+                               const char *shell_id, const char *command_id,
+                               const char *command) {
+    const char *values[SOAP_SLOT_LAST + 1] = {
+        NULL, to, NULL, shell_id ? shell_id : "", command_id ? command_id : "",
+        command ? command : "", "", NULL,
+    };
+    return soap_message_fill(m, kind, values, NULL, 0);
+}
+
+/*
+ * soap_send_build - 標準入力を転送するSendリクエストを作る
+ *
+ * @data: 転送するデータ（Base64エンコードしてStream要素に埋め込む）
+ * @len:  データの長さ（0も可）
+ * @end:  入力の最後か（End="true" を付ける）
+ * @return: 成功時true（メモリ確保失敗時false）
+ */
+static bool soap_send_build(soap_message_t *m, const char *to, const char *shell_id,
+                            const char *command_id, const uint8_t *data, size_t len, bool end) {
+    const char *values[SOAP_SLOT_LAST + 1] = {
+        NULL, to, NULL, shell_id, command_id, "", end ? " End=\"true\"" : "", NULL,
+    };
+    return soap_message_fill(m, SOAP_SEND, values, data, len);
+}
+
+/* soap_message_print - リクエスト本文を標準エラー出力へ表示（デバッグ用） */
+static void soap_message_print(const soap_message_t *m) {
+    for (int i = 0; i < m->iovcnt; i++) {
+        fwrite(m->iov[i].iov_base, 1, m->iov[i].iov_len, stderr);
+    }
+    fputs("\n\n", stderr);
+}
+
+/*
+ * post_soap_request - SOAPリクエストを送信（応答は soap_collect() で受け取る）
+ *
+ * @pl:     送信先のパイプライン
+ * @soap:   送信するリクエスト（所有権はパイプラインへ移る。失敗時も解放される）
+ * @return: 成功時true
+ */
+static bool post_soap_request(soap_pipeline_t *pl, soap_message_t *soap) {
+    if (DEBUG) {
+        log_info("送信XML:");
+        soap_message_print(soap);
+        char msg[512];
+        snprintf(msg, sizeof(msg), "接続先: http://%s:%d/wsman", g_host, g_port);
+        log_info(msg);
+        snprintf(msg, sizeof(msg), "ユーザー: %s", g_user);
+        log_info(msg);
+    }
+
+    return pipeline_post(pl, soap);
+}
+
+/*
+ * post_soap - テンプレートからリクエストを作って送信（応答は soap_collect() で受け取る）
+ *
+ * @kind:       操作の種類
+ * @shell_id:   ShellId（SOAP_CREATEではNULL）
+ * @command_id: CommandId（SOAP_COMMAND / SOAP_RECEIVE以外はNULL）
+ * @command:    コマンド文字列（SOAP_COMMAND以外はNULL）
+ * @return:     成功時true
+ */
+static bool post_soap(soap_pipeline_t *pl, soap_kind_t kind, const char *shell_id,
+                      const char *command_id, const char *command) {
+    soap_message_t soap;
+    if (!soap_message_build(&soap, kind, pl->url, shell_id, command_id, command)) {
+        log_error("メモリ確保に失敗しました");
+        return false;
+    }
+    return post_soap_request(pl, &soap);
+}
+
+/*
+ * create_shell - リモートシェル（cmd.exe）を作成
+ *
+ * @pl:            送信に使うパイプライン
+ * @shell_id:      ShellIdの出力バッファ
+ * @shell_id_size: バッファサイズ
+ * @return:        成功時true
+ *
+ * WS-Transfer Createアクションを使用してリモートシェルを作成。
+ * 成功すると、後続のコマンド実行に使用するShellIdが返される。
+ */
+static bool create_shell(soap_pipeline_t *pl, char *shell_id, size_t shell_id_size) {
+    buf_t response = {0};
+
+    log_info("シェル作成中...");
+
+    if (!post_soap(pl, SOAP_CREATE, NULL, NULL, NULL) || !soap_collect(pl, &response)) {
+        buf_free(&response);
+        log_error("シェル作成に失敗しました");
+        return false;
+    }
+
+    bool found = soap_find_text(response.data, response.len, XML_NS_SHELL, "ShellId",
+                                shell_id, shell_id_size);
+    buf_free(&response);
+    if (!found) {
+        log_error("ShellIDの取得に失敗しました");
+        return false;
+    }
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "シェル作成成功: %s", shell_id);
+    log_success(msg);
+
+    return true;
+}
+
+/*
+ * run_command - シェル上でコマンドを実行
+ *
+ * @pl:              送信に使うパイプライン
+ * @shell_id:        対象のShellId
+ * @command:         実行するコマンド文字列
+ * @command_id:      CommandIdの出力バッファ
+ * @command_id_size: バッファサイズ
+ * @receive_ahead:   最初のReceiveをCommandに続けて送るか
+ * @return:          成功時true
+ *
+ * WinRS Commandアクションを使用してコマンドを実行。
+ * CommandIdはクライアント側で割り当て、Commandの直後に最初のReceiveを
+ * 同じ接続へパイプライン送信する（応答は get_command_output() が受け取る）。
+ * サーバーが別のCommandIdを割り当てた場合は、先行送信したReceiveの応答を
+ * 読み捨て、サーバーのCommandIdで改めてReceiveを送る。
+ * 出力を取得する前に同じ接続で入力を送る場合（ファイル転送）は receive_ahead を
+ * falseにする（ロングポーリング中のReceiveの後ろにSendが並ばないように）。
+ */
+static bool run_command(soap_pipeline_t *pl, const char *shell_id, const char *command,
+                        char *command_id, size_t command_id_size, bool receive_ahead) {
+    buf_t response = {0};
+
+    generate_command_id(command_id, command_id_size);
+
+    log_info("コマンド実行中...");
+
+    bool posted = post_soap(pl, SOAP_COMMAND, shell_id, command_id, command) &&
+                  (!receive_ahead || post_soap(pl, SOAP_RECEIVE, shell_id, command_id, NULL));
+    if (!posted || !soap_collect(pl, &response)) {
+        buf_free(&response);
+        pipeline_abandon(pl);
+        log_error("コマンド実行に失敗しました");
+        return false;
+    }
+
+    char assigned_id[128];
+    bool found = soap_find_text(response.data, response.len, XML_NS_SHELL, "CommandId",
+                                assigned_id, sizeof(assigned_id));
+    if (!found) {
+        buf_free(&response);
+        pipeline_abandon(pl);
+        log_error("CommandIDの取得に失敗しました");
+        return false;
+    }
+
+    if (strcasecmp(assigned_id, command_id) != 0) {
+        /* クライアント指定のCommandIdが使われなかった: 先行送信したReceiveは無効 */
+        if (receive_ahead) {
+            int http_code;
+            if (DEBUG) {
+                log_info("サーバーがCommandIdを割り当てたため、Receiveを送り直します");
+            }
+            pipeline_collect(pl, &response, &http_code);
+        }
+        snprintf(command_id, command_id_size, "%s", assigned_id);
+    }
+    buf_free(&response);
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "コマンド実行開始: %s", command_id);
+    log_success(msg);
+
+    return true;
+}
+
+/*
+ * fork_sender - 別の接続でリクエストを送る子プロセスを作成
+ *
+ * @return: fork() の戻り値（子プロセスでは0）
+ *
+ * 子プロセスでは、親プロセスが使い続ける接続を閉じ（同じ接続を二重に使わない）、
+ * 親と同じMessageIDを使わないよう乱数を取り直す。子プロセスは fork_exit() で終了する。
+ */
+static pid_t fork_sender(void) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        g_uuid_pool_pos = sizeof(g_uuid_pool);
+        for (int i = 0; i < POOL_MAX_CONNS; i++) {
+            if (g_pool[i].allocated) {
+                pool_release_slot(&g_pool[i]);
+            }
+        }
+    }
+    return pid;
+}
+
+/*
+ * fork_exit - fork_sender() で作成した子プロセスを終了
+ *
+ * _exit() では atexit の ntlm_credential_wipe() が走らないため、
+ * 子プロセスが引き継いだ資格情報のコピーをここで消去してから終了する。
+ */
+__attribute__((noreturn))
+static void fork_exit(int code) {
+    ntlm_credential_wipe();
+    _exit(code);
+}
+
+/*
+ * 標準入力の転送（--stdin）
+ *
+ * ローカルの標準入力（またはファイル）を読んだそばから WinRS Send でリモートコマンドの
+ * 標準入力へ送る。送信は子プロセスが別の認証済み接続で行い、親プロセスは元の接続で
+ * Receiveのロングポーリングを続ける（同じ接続ではReceiveの応答待ちの後ろにSendが
+ * 並んでしまい、入力を読み切るまで出力しないコマンドでは双方が止まるため）。
+ *
+ * - Sendは最大 SEND_CHUNK_SIZE バイトずつ、PIPELINE_MAX_DEPTH 件まで応答を待たずに送る
+ * - 入力の終わりで End="true" のSendを送り、リモートプロセスにEOFを伝える
+ * - コマンドが入力を読み終える前に終了した場合、残りの入力は送らずに破棄する
+ * - 応答なしで接続が切れたSendは送り直さない（入力が重複・欠落したまま続けず、
+ *   実行全体を失敗として中断する）
+ */
+#define STDIN_SENDER_REJECTED 2   /* 転送プロセスの終了コード: サーバーがSendを拒否した（Fault） */
+
+typedef struct {
+    pid_t pid;      /* 転送プロセス（0: なし・回収済み） */
+    int status;     /* 回収した終了ステータス */
+} stdin_sender_t;
+
+/*
+ * stdin_sender_run - 入力を読み、Sendでリモートコマンドへ送る（転送プロセス本体）
+ *
+ * @fd:     入力のファイルディスクリプタ
+ * @return: すべて送信できれば0、Faultが返れば STDIN_SENDER_REJECTED、それ以外の失敗は1
+ */
+static int stdin_sender_run(int fd, const char *shell_id, const char *command_id) {
+    soap_pipeline_t pl;
+    buf_t response = {0};
+    uint64_t total = 0;
+    bool end = false, ok = true, rejected = false;
+
+    uint8_t *chunk = malloc(SEND_CHUNK_SIZE);
+    if (!chunk || !pipeline_open(&pl, g_host, g_port)) {
+        free(chunk);
+        log_error("標準入力の転送を開始できません");
+        return 1;
+    }
+    pl.once = true;
+
+    while (ok && (!end || pl.count > 0)) {
+        /* 応答待ちが上限に達したか、入力を送り終えたら、最も古いSendの応答を受け取る */
+        if (end || pl.count == PIPELINE_MAX_DEPTH) {
+            ok = soap_collect(&pl, &response);
+            /* Faultなら本文が残る（切断時は空） */
+            rejected = !ok && response.len > 0;
+            continue;
+        }
+
+        ssize_t n = read(fd, chunk, SEND_CHUNK_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_error("標準入力の読み込みに失敗しました");
+            ok = false;
+            break;
+        }
+        end = n == 0;
+        total += (uint64_t)n;
+        if (end) {
+            /* 入力はすべて読んだ: コマンド完了時の中止要求（SIGTERM）では止めない */
+            signal(SIGTERM, SIG_IGN);
+        }
+
+        soap_message_t soap;
+        if (!soap_send_build(&soap, pl.url, shell_id, command_id, chunk, (size_t)n, end)) {
+            log_error("メモリ確保に失敗しました");
+            ok = false;
+            break;
+        }
+        ok = post_soap_request(&pl, &soap);
+    }
+    buf_free(&response);
+    free(chunk);
+    pipeline_close(&pl);
+    pool_shutdown();
+
+    if (!ok) {
+        log_error("標準入力の転送に失敗しました");
+        return rejected ? STDIN_SENDER_REJECTED : 1;
+    }
+    char msg[128];
+    snprintf(msg, sizeof(msg), "標準入力の転送完了: %llu バイト", (unsigned long long)total);
+    log_success(msg);
+    return 0;
+}
+
+/*
+ * stdin_sender_start - 転送プロセスを起動
+ *
+ * @return: 起動できればtrue
+ */
+static bool stdin_sender_start(stdin_sender_t *snd, int fd, const char *shell_id,
+                               const char *command_id) {
+    snd->status = 0;
+    snd->pid = fork_sender();
+    if (snd->pid == 0) {
+        fork_exit(stdin_sender_run(fd, shell_id, command_id));
+    }
+    if (snd->pid < 0) {
+        snd->pid = 0;
+        log_error("標準入力の転送プロセスを作成できません");
+        return false;
+    }
+    return true;
+}
+
+/*
+ * stdin_sender_poll - 転送プロセスが失敗終了していないか確認（待たない）
+ *
+ * @return: 転送に失敗して出力の取得を中断すべきならfalse
+ *
+ * Faultで終了した場合は、コマンドがすでに終了しつつある（入力を受け付けなくなった）
+ * ことが多いため、警告だけ表示して出力の取得を続ける。
+ */
+static bool stdin_sender_poll(stdin_sender_t *snd) {
+    if (snd->pid <= 0 || waitpid(snd->pid, &snd->status, WNOHANG) != snd->pid) {
+        return true;
+    }
+    snd->pid = 0;
+    if (!WIFEXITED(snd->status) || WEXITSTATUS(snd->status) == 0) {
+        return true;
+    }
+    if (WEXITSTATUS(snd->status) == STDIN_SENDER_REJECTED) {
+        log_warn("サーバーが標準入力を受け付けませんでした（残りの入力は送信していません）");
+        return true;
+    }
+    log_error("標準入力の転送に失敗したため、コマンドの実行を中断します");
+    return false;
+}
+
+/*
+ * stdin_sender_finish - コマンドの完了後に転送プロセスを終了させて回収
+ *
+ * 入力をすべて読んだ後の転送プロセスはSIGTERMを無視して残りの応答を受け取り終える。
+ * まだ入力を読んでいる場合は、コマンドが入力を読み終える前に終了したので中止する。
+ */
+static void stdin_sender_finish(stdin_sender_t *snd) {
+    if (snd->pid <= 0) return;
+
+    kill(snd->pid, SIGTERM);
+    while (waitpid(snd->pid, &snd->status, 0) < 0 && errno == EINTR) {
+    }
+    snd->pid = 0;
+    if (WIFSIGNALED(snd->status)) {
+        log_warn("コマンドが標準入力を読み終える前に終了したため、残りの入力は送信しませんでした");
+    } else if (WEXITSTATUS(snd->status) != 0) {
+        log_warn("標準入力の転送が途中で終了しました");
+    }
+}
+
+/*
+ * output_capture_t / capture_chunk - 出力チャンクの書き出し先
+ *
+ * --stream 指定時は g_stream_fd（端末・パイプ・ファイル）へ即座に書き出し、
+ * 常駐モードのジョブではクライアントへフレームとして転送し、
+ * それ以外は capture_t に蓄積して実行結果としてまとめて表示する。
+ * どちらもバイト列のまま扱うため、NULを含むバイナリ出力も欠けない。
+ */
+typedef struct {
+    capture_t *out[2];  /* [0]: stdout, [1]: stderr */
+    bool failed;        /* 蓄積に失敗したか（一時ファイルの作成失敗等） */
+} output_capture_t;
+
+static void capture_chunk(int stream, const uint8_t *data, size_t len, void *ctx) {
+    output_capture_t *capture = ctx;
+
+    if (g_job_fd >= 0) {
+        /* 常駐モードのジョブ: クライアントへ転送（切断されたら中断） */
+        if (!capture->failed && !frame_write(g_job_fd, stream ? 'E' : 'O', data, len)) {
+            capture->failed = true;
+        }
+        return;
+    }
+    if (g_stream) {
+        write_all(g_stream_fd[stream], data, len);
+        return;
+    }
+    if (!capture->failed && !capture_append(capture->out[stream], data, len)) {
+        capture->failed = true;
+    }
+}
+
+/*
+ * get_command_output - コマンドの出力を取得
+ *
+ * @pl:          送信に使うパイプライン
+ * @shell_id:    対象のShellId
+ * @command_id:  対象のCommandId
+ * @out:         標準出力の格納先
+ * @err:         標準エラー出力の格納先
+ * @exit_code:   終了コードの出力先
+ * @delete_on_done: 完了時にシェルのDeleteを続けて送るか（同じシェルで次のコマンドを実行しない場合）
+ * @input:       標準入力の転送プロセス（--stdin。なければNULL）
+ * @return:      成功時true
+ *
+ * WinRS Receiveアクションを使用して出力を取得。
+ * CommandState/Doneになるまでポーリングを繰り返す。
+ * 出力はBase64エンコードされているためデコードが必要。
+ * 各レスポンスは receive_parse() で1回だけ走査し、対象のCommandIdの
+ * Stream要素（複数）・CommandState・ExitCode をまとめて拾う。
+ * --stream 指定時は、デコードしたチャンクをそのまま書き出す（バッファには残らない）。
+ *
+ * 【パイプライン】
+ * run_command() が先行送信したReceiveがあれば、その応答から受け取る。
+ * CommandState/Doneを受信したら（delete_on_done指定時）、出力をデコードする前に
+ * シェルのDeleteを送信し、その応答は delete_shell() が受け取る。
+ *
+ * 【ロングポーリング】
+ * サーバーはReceiveを出力が出るまで（最大 RECEIVE_TIMEOUT 秒）保持するため、
+ * クライアント側では待機せずに即座に再送する。待機時間内に出力がなければ
+ * w:TimedOut のFaultが返るが、これは「まだ出力なし」として扱う。
+ *
+ * 【タイムアウト】
+ * 完了まで最大 TIMEOUT 秒待ち、完了しなければ失敗とする。標準入力を転送中（input）は
+ * 入力の大きさで所要時間が決まるため、転送プロセスが動いている間と出力を受信するたびに
+ * 待機時間を延ばし、入力・出力とも TIMEOUT 秒途絶えた場合にだけ失敗とする。
+ */
+static bool get_command_output(soap_pipeline_t *pl, const char *shell_id, const char *command_id,
+                               capture_t *out, capture_t *err, int *exit_code, bool delete_on_done,
+                               stdin_sender_t *input) {
+    buf_t response = {0};
+    bool command_done = false;
+    uint64_t deadline = now_ms() + (uint64_t)TIMEOUT * 1000;
+    output_capture_t capture = { .out = { out, err } };
+
+    *exit_code = 0;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), input ? "コマンド出力取得中...（入出力が%d秒途絶えたら中断）"
+                                     : "コマンド出力取得中...（最大%d秒待機）", TIMEOUT);
+    log_info(msg);
+
+    while (!command_done && now_ms() < deadline) {
+        /* 入力の転送に失敗した: リモートコマンドは入力の終わりを待ち続けるため中断する */
+        if (input && !stdin_sender_poll(input)) {
+            buf_free(&response);
+            pipeline_abandon(pl);
+            return false;
+        }
+        if (input && input->pid > 0) {
+            deadline = now_ms() + (uint64_t)TIMEOUT * 1000;
+        }
+
+        /* 先行送信したReceiveがなければ送る */
+        bool ok = pl->count > 0;
+        if (!ok) {
+            ok = post_soap(pl, SOAP_RECEIVE, shell_id, command_id, NULL);
+        }
+        if (!ok || !soap_collect(pl, &response)) {
+            buf_free(&response);
+            pipeline_abandon(pl);
+            log_error("出力取得に失敗しました");
+            return false;
+        }
+
+        /* 待機時間内に出力がなかった: すぐに次のReceiveを送る */
+        if (soap_fault_is_timeout(response.data, response.len)) {
+            continue;
+        }
+
+        /* Stream要素・完了状態を1回の走査で拾う */
+        receive_result_t result;
+        receive_parse(response.data, response.len, command_id, &result);
+
+        /* コマンド完了チェック（完了なら出力の処理を待たずにDeleteを送っておく） */
+        if (result.done) {
+            command_done = true;
+            *exit_code = result.exit_code;
+            if (delete_on_done) {
+                log_info("シェル削除中...");
+                if (!post_soap(pl, SOAP_DELETE, shell_id, NULL, NULL)) {
+                    pipeline_abandon(pl);
+                }
+            }
+        }
+
+        if (input && result.count > 0) {
+            deadline = now_ms() + (uint64_t)TIMEOUT * 1000;
+        }
+
+        /* stdout/stderr抽出（--stream時は受信しだい書き出す） */
+        receive_emit(&result, response.data, capture_chunk, &capture);
+        if (result.failed) capture.failed = true;
+        receive_result_free(&result);
+        if (capture.failed) {
+            buf_free(&response);
+            log_error("コマンド出力の保存に失敗しました");
+            return false;
+        }
+    }
+    buf_free(&response);
+
+    if (!command_done) {
+        /* 終了コードが分からないため、成功（0）として扱わない */
+        log_error("コマンド完了待機がタイムアウトしました");
+        return false;
+    }
+
+    snprintf(msg, sizeof(msg), "コマンド完了 (終了コード: %d)", *exit_code);
+    log_success(msg);
+
+    return true;
+}
+
+/*
+ * delete_shell - リモートシェルを削除
+ *
+ * @pl:       送信に使うパイプライン
+ * @shell_id: 削除対象のShellId
+ *
+ * WS-Transfer Deleteアクションを使用してシェルを削除。
+ * リソース解放のため、コマンド完了後は必ず呼び出すこと。
+ * get_command_output() がDone受信時にDeleteを送信済みなら、その応答だけを受け取る。
+ */
+static void delete_shell(soap_pipeline_t *pl, const char *shell_id) {
+    buf_t response = {0};
+
+    if (pl->count == 0) {
+        log_info("シェル削除中...");
+        post_soap(pl, SOAP_DELETE, shell_id, NULL, NULL);
+    }
+    soap_collect(pl, &response);
+    buf_free(&response);
+    log_success("シェル削除完了");
+}
+
+/* ============================================================================
+ * メイン処理
+ * ============================================================================ */
+
+/*
+ * load_config - 設定を読み込み
+ *
+ * デフォルト値を設定し、環境変数があれば上書き。
+ * 環境変数: WINRM_HOST, WINRM_USER, WINRM_PASS, WINRM_DOMAIN, WINRM_PORT,
+ *           WINRM_POOL_MAX_PER_HOST, WINRM_POOL_IDLE_TIMEOUT, WINRM_PARALLEL,
+ *           WINRM_OUTPUT_MEMORY_LIMIT, WINRM_AUTH_CACHE, WINRM_STOP_ON_ERROR,
+ *           WINRM_DAEMON_SHELLS, WINRM_DAEMON_KEEPALIVE, WINRM_DAEMON_SHELL_MAX_AGE,
+ *           WINRM_DAEMON_SOCKET, WINRM_DAEMON_IDLE_TIMEOUT, WINRM_DAEMON_PREWARM_LEAD,
+ *           WINRM_USE_DAEMON, WINRM_SCRIPT_BUNDLE, WINRM_UPLOAD_PARALLEL
+ */
+static void load_config(void) {
+    const char *env;
+
+    env = getenv("WINRM_HOST");
+    strncpy(g_host, env ? env : DEFAULT_HOST, sizeof(g_host) - 1);
+
+    env = getenv("WINRM_USER");
+    strncpy(g_user, env ? env : DEFAULT_USER, sizeof(g_user) - 1);
+
+    env = getenv("WINRM_PASS");
+    strncpy(g_pass, env ? env : DEFAULT_PASS, sizeof(g_pass) - 1);
+
+    env = getenv("WINRM_DOMAIN");
+    strncpy(g_domain, env ? env : DEFAULT_DOMAIN, sizeof(g_domain) - 1);
+
+    env = getenv("WINRM_PORT");
+    g_port = env ? atoi(env) : DEFAULT_PORT;
+
+    env = getenv("BATCH_FILE_PATH");
+    strncpy(g_batch_path, env ? env : DEFAULT_BATCH_PATH, sizeof(g_batch_path) - 1);
+
+    env = getenv("WINRM_POOL_MAX_PER_HOST");
+    g_pool_max_per_host = env ? atoi(env) : POOL_MAX_PER_HOST;
+    if (g_pool_max_per_host < 1) g_pool_max_per_host = 1;
+
+    env = getenv("WINRM_POOL_IDLE_TIMEOUT");
+    g_pool_idle_timeout = env ? atoi(env) : POOL_IDLE_TIMEOUT;
+    if (g_pool_idle_timeout < 1) g_pool_idle_timeout = 1;
+
+    env = getenv("WINRM_PARALLEL");
+    g_parallel = env ? atoi(env) : FANOUT_PARALLEL;
+
+    env = getenv("WINRM_OUTPUT_MEMORY_LIMIT");
+    g_output_memory_limit = env ? strtoull(env, NULL, 10) : OUTPUT_MEMORY_LIMIT;
+
+    env = getenv("WINRM_AUTH_CACHE");
+    g_auth_cache_enabled = env ? atoi(env) != 0 : AUTH_CACHE_ENABLED;
+
+    env = getenv("WINRM_STOP_ON_ERROR");
+    g_stop_on_error = env ? atoi(env) != 0 : SCRIPT_STOP_ON_ERROR;
+
+    env = getenv("WINRM_SCRIPT_BUNDLE");
+    g_script_bundle = env ? atoi(env) != 0 : SCRIPT_BUNDLE;
+
+    env = getenv("WINRM_DAEMON_SHELLS");
+    g_daemon_shells = env ? atoi(env) : DAEMON_WARM_SHELLS;
+    if (g_daemon_shells < 0) g_daemon_shells = 0;
+    if (g_daemon_shells > POOL_MAX_CONNS / 2) g_daemon_shells = POOL_MAX_CONNS / 2;
+
+    env = getenv("WINRM_DAEMON_KEEPALIVE");
+    g_daemon_keepalive = env ? atoi(env) : DAEMON_KEEPALIVE;
+    if (g_daemon_keepalive < 1) g_daemon_keepalive = 1;
+
+    env = getenv("WINRM_DAEMON_SHELL_MAX_AGE");
+    g_daemon_shell_max_age = env ? atoi(env) : DAEMON_SHELL_MAX_AGE;
+
+    env = getenv("WINRM_DAEMON_SOCKET");
+    strncpy(g_daemon_socket, env ? env : DAEMON_SOCKET, sizeof(g_daemon_socket) - 1);
+
+    env = getenv("WINRM_DAEMON_IDLE_TIMEOUT");
+    g_daemon_idle_timeout = env ? atoi(env) : DAEMON_IDLE_TIMEOUT;
+
+    env = getenv("WINRM_DAEMON_PREWARM_LEAD");
+    g_daemon_prewarm_lead = env ? atoi(env) : DAEMON_PREWARM_LEAD;
+    if (g_daemon_prewarm_lead < 0) g_daemon_prewarm_lead = 0;
+
+    env = getenv("WINRM_USE_DAEMON");
+    g_use_daemon = env && atoi(env) != 0;
+
+    env = getenv("WINRM_UPLOAD_PARALLEL");
+    g_upload_parallel = env ? atoi(env) : UPLOAD_PARALLEL;
+    if (g_upload_parallel < 1) g_upload_parallel = 1;
+    if (g_upload_parallel > UPLOAD_MAX_PARALLEL) g_upload_parallel = UPLOAD_MAX_PARALLEL;
+
+    g_stream = false;
+    g_stream_fd[0] = STDOUT_FILENO;
+    g_stream_fd[1] = STDERR_FILENO;
+}
+
+/*
+ * print_help - 使い方を表示
+ *
+ * @prog_name: プログラム名（argv[0]）
+ */
+static void print_help(const char *prog_name) {
+    printf("使い方: %s ENV [オプション]\n\n", prog_name);
+    printf("引数:\n");
+    printf("  ENV    環境名 (");
+    for (int i = 0; ENVIRONMENTS[i]; i++) {
+        if (i > 0) printf(", ");
+        printf("%s", ENVIRONMENTS[i]);
+    }
+    printf(")\n\n");
+    printf("オプション:\n");
+    printf("  --hosts H1,H2,...   複数ホストで並列実行（HOST または HOST:PORT）\n");
+    printf("  --hosts-file FILE   ホスト一覧ファイル（1行1ホスト、#以降はコメント）\n");
+    printf("  --parallel N        同時実行数（デフォルト: %d）\n", FANOUT_PARALLEL);
+    printf("  --stream            出力を受信しだい表示（stdout→標準出力、stderr→標準エラー出力）\n");
+    printf("  --stdout-file FILE  stdoutを受信しだいFILEへ書き出す（--streamを含む）\n");
+    printf("  --stderr-file FILE  stderrを受信しだいFILEへ書き出す（--streamを含む）\n");
+    printf("  --script FILE       FILEの各行のコマンドを1つのシェルで順に実行（-: 標準入力）\n");
+    printf("  --stop-on-error     --script で失敗したコマンドがあれば残りを実行しない\n");
+    printf("  --bundle            --script の各行を1回のコマンド実行にまとめ、結果を行ごとに分けて表示\n");
+    printf("  --stdin FILE        FILEの内容をリモートコマンドの標準入力へ転送（-: 標準入力）\n");
+    printf("  --upload LOCAL REMOTE  ローカルのファイルLOCALをリモートのパスREMOTEへ書き込む\n");
+    printf("  --upload-parallel N    --upload でファイルをNパートに分けて並列に送る（最大%d）\n",
+           UPLOAD_MAX_PARALLEL);
+    printf("  --download REMOTE LOCAL  リモートのファイルREMOTEをローカルのファイルLOCALへ書き込む\n");
+    printf("  --resume            --download でLOCALの現在のサイズの位置から続きを受け取る\n");
+    printf("  --daemon            常駐してシェルを事前に作成し、ローカルソケットでジョブを受け付ける\n");
+    printf("  --use-daemon        常駐プロセス経由で実行（起動していなければ直接実行）\n");
+    printf("  --daemon-status     常駐プロセスの待機シェル数・ヒット/ミス数を表示\n\n");
+    printf("例:\n");
+    for (int i = 0; ENVIRONMENTS[i] && i < 2; i++) {
+        printf("  %s %s\n", prog_name, ENVIRONMENTS[i]);
+    }
+    if (ENVIRONMENTS[0]) {
+        printf("  %s %s --hosts-file hosts.txt --parallel 20\n", prog_name, ENVIRONMENTS[0]);
+        printf("  %s %s --script deploy.txt --stop-on-error\n", prog_name, ENVIRONMENTS[0]);
+        printf("  gzip -dc dump.sql.gz | %s %s --stdin -\n", prog_name, ENVIRONMENTS[0]);
+        printf("  %s %s --upload deploy.zip C:\\Work\\deploy.zip --upload-parallel 4\n",
+               prog_name, ENVIRONMENTS[0]);
+        printf("  %s %s --download C:\\Logs\\app.log app.log --resume\n",
+               prog_name, ENVIRONMENTS[0]);
+        printf("  %s %s --daemon &  %s %s --use-daemon\n", prog_name, ENVIRONMENTS[0],
+               prog_name, ENVIRONMENTS[0]);
+    }
+    printf("\n環境変数で設定を上書き可能:\n");
+    printf("  WINRM_HOST, WINRM_PORT, WINRM_USER, WINRM_PASS, WINRM_DOMAIN\n");
+    printf("  WINRM_POOL_MAX_PER_HOST, WINRM_POOL_IDLE_TIMEOUT, WINRM_PARALLEL,\n");
+    printf("  WINRM_OUTPUT_MEMORY_LIMIT, WINRM_AUTH_CACHE, WINRM_STOP_ON_ERROR,\n");
+    printf("  WINRM_DAEMON_SHELLS, WINRM_DAEMON_KEEPALIVE, WINRM_DAEMON_SHELL_MAX_AGE,\n");
+    printf("  WINRM_DAEMON_SOCKET, WINRM_DAEMON_IDLE_TIMEOUT, WINRM_DAEMON_PREWARM_LEAD,\n");
+    printf("  WINRM_USE_DAEMON, WINRM_SCRIPT_BUNDLE, WINRM_UPLOAD_PARALLEL\n");
+}
+
+/*
+ * execute_batch - 現在の接続先（g_host:g_port）でコマンドを実行し結果を表示
+ *
+ * @command: 実行するコマンドライン
+ * @return:  リモートコマンドの終了コード（接続・プロトコルエラー時は-1）
+ *
+ * シェル作成 → コマンド実行 → 出力取得 → シェル削除 を順に行う。
+ * すべてのリクエストは1本の認証済み接続（soap_pipeline_t）で送り、
+ * Command→Receive、Done→Delete は応答を待たずに続けて送信する。
+ * --stdin 指定時は、コマンド実行後に転送プロセスを起動して入力をSendで送る。
+ */
+static int execute_batch(const char *command) {
+    char msg[256];
+    soap_pipeline_t pl;
+
+    if (!pipeline_open(&pl, g_host, g_port)) {
+        log_error("処理を中断します");
+        return -1;
+    }
+
+    /* シェル作成 */
+    char shell_id[128];
+    if (!create_shell(&pl, shell_id, sizeof(shell_id))) {
+        pipeline_close(&pl);
+        pool_shutdown();
+        log_error("処理を中断します");
+        return -1;
+    }
+    printf("\n");
+
+    /* コマンド実行（最初のReceiveも続けて送信される） */
+    char command_id[128];
+    if (!run_command(&pl, shell_id, command, command_id, sizeof(command_id), true)) {
+        delete_shell(&pl, shell_id);
+        pipeline_close(&pl);
+        pool_shutdown();
+        log_error("処理を中断します");
+        return -1;
+    }
+    printf("\n");
+
+    /* 標準入力の転送（別の接続でSendを送り、こちらはReceiveを続ける） */
+    stdin_sender_t input = {0};
+    if (g_stdin_fd >= 0 && !stdin_sender_start(&input, g_stdin_fd, shell_id, command_id)) {
+        delete_shell(&pl, shell_id);
+        pipeline_close(&pl);
+        pool_shutdown();
+        log_error("処理を中断します");
+        return -1;
+    }
+
+    /* 出力取得（--stream時はここで受信しだい書き出される） */
+    fflush(stdout);
+    capture_t out = {0}, err = {0};
+    int exit_code = 0;
+
+    bool received = get_command_output(&pl, shell_id, command_id, &out, &err, &exit_code, true,
+                                       g_stdin_fd >= 0 ? &input : NULL);
+    stdin_sender_finish(&input);
+    if (!received) {
+        capture_free(&out);
+        capture_free(&err);
+        delete_shell(&pl, shell_id);
+        pipeline_close(&pl);
+        pool_shutdown();
+        log_error("処理を中断します");
+        return -1;
+    }
+    printf("\n");
+
+    /* シェル削除（Done受信時に送信済みのDeleteの応答を受け取る） */
+    delete_shell(&pl, shell_id);
+    pipeline_close(&pl);
+    pool_shutdown();
+
+    /* 結果表示 */
+    printf("\n");
+    printf("============================================================\n");
+    printf("実行結果\n");
+    printf("============================================================\n");
+
+    /* --stream時は受信しだい書き出し済み。出力はバイト列のまま書き出す */
+    int stdout_fd = STDOUT_FILENO;
+    if (out.total > 0) {
+        printf("\n[標準出力]\n");
+        fflush(stdout);
+        capture_replay(&out, capture_sink_fd, &stdout_fd);
+    }
+
+    if (err.total > 0) {
+        printf("\n[標準エラー出力]\n");
+        fflush(stdout);
+        capture_replay(&err, capture_sink_fd, &stdout_fd);
+    }
+    capture_free(&out);
+    capture_free(&err);
+
+    printf("\n終了コード: %d\n", exit_code);
+    printf("============================================================\n");
+
+    if (exit_code == 0) {
+        log_success("完了");
+    } else {
+        snprintf(msg, sizeof(msg), "コマンドが失敗しました (終了コード: %d)", exit_code);
+        log_error(msg);
+    }
+
+    return exit_code;
+}
+
+/* ============================================================================
+ * ファイル転送（--upload / --download）
+ * ============================================================================
+ *
+ * SMBを使わずに、WinRMの接続だけでローカルのファイルをリモートへ書き込む。
+ *
+ * 1. シェルを作成し、リモートのファイルを作成して最終的なサイズに伸ばす（UPLOAD_PREPARE）
+ * 2. ファイルをパートに分け、パートごとにリモートでデコーダ（UPLOAD_DECODER: 標準入力を
+ *    ファイルの指定位置へ書き込むPowerShell）を起動し、その標準入力へ Send で内容を送る
+ *    - ローカルのファイルは mmap し、Sendの本文へ直接Base64エンコードする
+ *      （読み込み用のバッファへコピーしない）
+ *    - Sendは最大 SEND_CHUNK_SIZE バイトずつ、PIPELINE_MAX_DEPTH 件まで応答を待たずに送る
+ *    - --upload-parallel N 指定時は、2番目以降のパートを子プロセスが別の接続・シェルで
+ *      並列に送る（1本の接続の往復待ちに律速されないように）
+ * 3. すべてのパートを書き込んだら、リモートでMD5を計算し（REMOTE_HASH_COMMAND）、
+ *    ローカルのMD5と比較する（ローカルの計算はリモートの計算を待つ間に行う）
+ *
+ * ダウンロードは逆向きに、リモートでリーダー（DOWNLOAD_READER: ファイルの指定位置から
+ * 末尾までを標準出力へそのまま書き出し、最後に先頭から書き出した位置までのMD5を標準エラー
+ * 出力へ書く）を実行し、Receiveで届いた標準出力をデコードしながらローカルのファイルへ追記する。
+ *    - MD5は書き出す内容と同じ読み込みから計算する（ファイルを2回読まない。書き込み中の
+ *      ログに追記があっても、書き出した範囲だけを比較する）
+ *    - 受信した内容は DOWNLOAD_WRITE_SIZE までまとめて書き込み、メモリ使用量は一定
+ *    - --resume 指定時は、ローカルのファイルの現在のサイズの位置から続きを受け取る
+ *      （中断時に書き込み済みの部分は、常にリモートのファイルの先頭部分と一致する）
+ * ============================================================================ */
+
+/* リモートで実行するコマンド（%s はPowerShellの単一引用符で囲んだパス） */
+#define UPLOAD_PREPARE \
+    "powershell.exe -NoProfile -NonInteractive -Command \"" \
+    "$f=[IO.File]::Open(%s,'Create','Write','ReadWrite');$f.SetLength(%llu);$f.Close()\""
+#define UPLOAD_DECODER \
+    "powershell.exe -NoProfile -NonInteractive -Command \"<#UPLOAD_DECODER path=%s offset=%llu#>" \
+    "$i=[Console]::OpenStandardInput();$f=[IO.File]::Open(%s,'Open','Write','ReadWrite');" \
+    "$f.Position=%llu;$i.CopyTo($f,1048576);$f.Close()\""
+#define DOWNLOAD_READER \
+    "powershell.exe -NoProfile -NonInteractive -Command \"<#DOWNLOAD_READER path=%s offset=%llu#>" \
+    "$f=[IO.File]::Open(%s,'Open','Read','ReadWrite');$m=[Security.Cryptography.MD5]::Create();" \
+    "$b=New-Object byte[] 1048576;$r=%llu;" \
+    "while($r -gt 0 -and ($n=$f.Read($b,0,[Math]::Min($r,$b.Length))) -gt 0)" \
+    "{[void]$m.TransformBlock($b,0,$n,$null,0);$r-=$n}" \
+    "$o=[Console]::OpenStandardOutput();" \
+    "while(($n=$f.Read($b,0,$b.Length)) -gt 0){[void]$m.TransformBlock($b,0,$n,$null,0);$o.Write($b,0,$n)}" \
+    "$o.Flush();[void]$m.TransformFinalBlock($b,0,0);$f.Close();" \
+    "[Console]::Error.Write('MD5:'+[BitConverter]::ToString($m.Hash).Replace('-',''))\""
+#define REMOTE_HASH_COMMAND \
+    "powershell.exe -NoProfile -NonInteractive -Command \"(Get-FileHash -Algorithm MD5 -LiteralPath %s).Hash\""
+
+/*
+ * ps_quote - パスをPowerShellの単一引用符の文字列にする（' は '' に）
+ *
+ * @return: 成功時true（" や制御文字を含むパスはcmd.exeのコマンドラインに入れられないためfalse）
+ */
+static bool ps_quote(const char *path, char *out, size_t size) {
+    size_t n = 0;
+    if (size < 3) return false;
+    out[n++] = '\'';
+    for (const char *p = path; *p; p++) {
+        if (*p == '"' || (uint8_t)*p < 0x20) return false;
+        if (n + 4 > size) return false;
+        if (*p == '\'') out[n++] = '\'';
+        out[n++] = *p;
+    }
+    out[n++] = '\'';
+    out[n] = '\0';
+    return true;
+}
+
+/*
+ * run_remote - シェル上でコマンドを実行し、出力を取り込む
+ *
+ * @out:    標準出力の格納先（NULL: 捨てる）
+ * @last:   シェルで最後のコマンドか（完了時にDeleteを続けて送る）
+ * @return: 終了コード0で完了すればtrue（失敗時は標準エラー出力を表示する）
+ */
+static bool run_remote(soap_pipeline_t *pl, const char *shell_id, const char *command,
+                       capture_t *out, bool last) {
+    char command_id[128];
+    capture_t discard = {0}, err = {0};
+    int exit_code = 0;
+
+    bool ok = run_command(pl, shell_id, command, command_id, sizeof(command_id), true) &&
+              get_command_output(pl, shell_id, command_id, out ? out : &discard, &err,
+                                 &exit_code, last, NULL);
+    if (ok && exit_code != 0) {
+        int fd = STDERR_FILENO;
+        capture_replay(&err, capture_sink_fd, &fd);
+        ok = false;
+    }
+    capture_free(&discard);
+    capture_free(&err);
+    return ok;
+}
+
+/*
+ * upload_part - パート1つ分をリモートのファイルへ書き込む
+ *
+ * @remote: リモートのパス（ps_quote() 済み）
+ * @data:   送る内容（mmapしたファイルの一部。len が0ならNULLも可）
+ * @offset: ファイル内の書き込み位置
+ * @last:   シェルで最後のコマンドか（完了時にDeleteを続けて送る）
+ * @return: 成功時true
+ *
+ * デコーダは入力を読み終えるまで何も出力しないため、Receiveは送らずにSendだけを
+ * パイプライン送信し、End="true" のSendの応答を受け取ってから完了を待つ。
+ */
+static bool upload_part(soap_pipeline_t *pl, const char *shell_id, const char *remote,
+                        const uint8_t *data, size_t len, uint64_t offset, bool last) {
+    char command[MAX_COMMAND_SIZE], command_id[128];
+    snprintf(command, sizeof(command), UPLOAD_DECODER, remote, (unsigned long long)offset,
+             remote, (unsigned long long)offset);
+    if (!run_command(pl, shell_id, command, command_id, sizeof(command_id), false)) {
+        return false;
+    }
+
+    /* 応答なしで切断されたSendは送り直さない（書き込み位置がずれないように） */
+    buf_t response = {0};
+    size_t pos = 0;
+    bool ok = true, end = false;
+    pl->once = true;
+    while (ok && (!end || pl->count > 0)) {
+        if (end || pl->count == PIPELINE_MAX_DEPTH) {
+            ok = soap_collect(pl, &response);
+            continue;
+        }
+        size_t n = len - pos < SEND_CHUNK_SIZE ? len - pos : SEND_CHUNK_SIZE;
+        end = pos + n == len;
+        soap_message_t soap;
+        if (!soap_send_build(&soap, pl->url, shell_id, command_id, data ? data + pos : NULL, n,
+                             end)) {
+            log_error("メモリ確保に失敗しました");
+            ok = false;
+            break;
+        }
+        ok = post_soap_request(pl, &soap);
+        pos += n;
+    }
+    pl->once = false;
+    buf_free(&response);
+    if (!ok) {
+        pipeline_abandon(pl);
+        log_error("ファイルの送信に失敗しました");
+        return false;
+    }
+
+    capture_t out = {0}, err = {0};
+    int exit_code = 0;
+    ok = get_command_output(pl, shell_id, command_id, &out, &err, &exit_code, last, NULL);
+    if (ok && exit_code != 0) {
+        int fd = STDERR_FILENO;
+        capture_replay(&err, capture_sink_fd, &fd);
+        log_error("リモートでのファイルの書き込みに失敗しました");
+        ok = false;
+    }
+    capture_free(&out);
+    capture_free(&err);
+    return ok;
+}
+
+/*
+ * upload_worker - 2番目以降のパートを別の接続・シェルで送る（子プロセス本体）
+ *
+ * @return: 成功時0
+ */
+static int upload_worker(const char *remote, const uint8_t *data, size_t len, uint64_t offset) {
+    soap_pipeline_t pl;
+    char shell_id[128];
+
+    if (!pipeline_open(&pl, g_host, g_port)) return 1;
+    bool ok = create_shell(&pl, shell_id, sizeof(shell_id));
+    if (ok) {
+        ok = upload_part(&pl, shell_id, remote, data, len, offset, true);
+        delete_shell(&pl, shell_id);
+    }
+    pipeline_close(&pl);
+    pool_shutdown();
+    return ok ? 0 : 1;
+}
+
+/*
+ * upload_wait_workers - パートを送る子プロセスの終了を待つ
+ *
+ * @abort:  trueなら終了を待たずに中止させる
+ * @return: すべて成功していればtrue
+ */
+static bool upload_wait_workers(pid_t *pids, int count, bool abort) {
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        if (pids[i] <= 0) continue;
+        if (abort) kill(pids[i], SIGTERM);
+        int status;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) {
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+        pids[i] = 0;
+    }
+    return ok;
+}
+
+/*
+ * execute_upload - ローカルのファイルをリモートへ書き込む
+ *
+ * @local:  ローカルのファイル
+ * @remote: リモートのパス（例: C:\Work\deploy.zip）
+ * @return: 成功時0、失敗時1
+ */
+static int execute_upload(const char *local, const char *remote_path) {
+    char msg[1024];
+    char remote[MAX_PATH_SIZE];
+
+    if (!ps_quote(remote_path, remote, sizeof(remote))) {
+        snprintf(msg, sizeof(msg), "リモートのパスに使用できない文字が含まれています: %s", remote_path);
+        log_error(msg);
+        return 1;
+    }
+
+    struct stat st;
+    int fd = open(local, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(msg, sizeof(msg), "ファイルを開けません: %s", local);
+        log_error(msg);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    size_t size = (size_t)st.st_size;
+    uint8_t *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            log_error("ファイルをメモリにマップできません");
+            return 1;
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    /* パート数（各パートが UPLOAD_MIN_PART 以上になるように） */
+    int parts = g_upload_parallel;
+    if ((uint64_t)parts > size / UPLOAD_MIN_PART) parts = (int)(size / UPLOAD_MIN_PART);
+    if (parts < 1) parts = 1;
+
+    snprintf(msg, sizeof(msg), "アップロード: %s → %s（%zu バイト、%d パート）",
+             local, remote_path, size, parts);
+    log_info(msg);
+    printf("\n");
+
+    uint64_t start = now_ms();
+    pid_t pids[UPLOAD_MAX_PARALLEL] = {0};
+    soap_pipeline_t pl;
+    char shell_id[128];
+    bool ok = pipeline_open(&pl, g_host, g_port);
+    bool shell = ok && create_shell(&pl, shell_id, sizeof(shell_id));
+    ok = shell;
+
+    /* リモートのファイルを最終的なサイズで作成（各パートは自分の位置へ書き込む） */
+    if (ok) {
+        char command[MAX_COMMAND_SIZE];
+        snprintf(command, sizeof(command), UPLOAD_PREPARE, remote, (unsigned long long)size);
+        ok = run_remote(&pl, shell_id, command, NULL, false);
+        if (!ok) log_error("リモートのファイルを作成できません");
+    }
+
+    /* 2番目以降のパートは子プロセスが並列に送り、最初のパートはこの接続で送る */
+    for (int i = 1; ok && i < parts; i++) {
+        size_t from = size / parts * i, to = i == parts - 1 ? size : size / parts * (i + 1);
+        pids[i] = fork_sender();
+        if (pids[i] == 0) {
+            fork_exit(upload_worker(remote, data + from, to - from, from));
+        }
+        if (pids[i] < 0) {
+            pids[i] = 0;
+            log_error("ファイル転送の子プロセスを作成できません");
+            ok = false;
+        }
+    }
+    if (ok) {
+        ok = upload_part(&pl, shell_id, remote, data, parts > 1 ? size / parts : size, 0, false);
+    }
+    if (!upload_wait_workers(pids, parts, !ok) && ok) {
+        log_error("並列に送ったパートの書き込みに失敗しました");
+        ok = false;
+    }
+    uint64_t elapsed = now_ms() - start;
+
+    /* リモートのMD5を計算させている間にローカルのMD5を計算して比較 */
+    char remote_md5[64] = "", local_md5[33];
+    if (ok) {
+        char command[MAX_COMMAND_SIZE], command_id[128];
+        capture_t out = {0}, err = {0};
+        int exit_code = 0;
+        snprintf(command, sizeof(command), REMOTE_HASH_COMMAND, remote);
+        ok = run_command(&pl, shell_id, command, command_id, sizeof(command_id), true);
+
+        uint8_t digest[16];
+        md5_hash(data ? data : (const uint8_t *)"", size, digest);
+        for (int i = 0; i < 16; i++) {
+            snprintf(local_md5 + i * 2, 3, "%02X", digest[i]);
+        }
+
+        ok = ok && get_command_output(&pl, shell_id, command_id, &out, &err, &exit_code, true,
+                                      NULL);
+        if (ok && !out.spilled) {
+            /* 出力は「32桁の16進数 + 改行」 */
+            size_t n = 0;
+            for (size_t i = 0; i < out.mem.len && n < sizeof(remote_md5) - 1; i++) {
+                if (isxdigit((uint8_t)out.mem.data[i])) remote_md5[n++] = out.mem.data[i];
+            }
+            remote_md5[n] = '\0';
+        }
+        capture_free(&out);
+        capture_free(&err);
+        if (ok && strcasecmp(remote_md5, local_md5) != 0) {
+            snprintf(msg, sizeof(msg), "MD5が一致しません（ローカル: %s / リモート: %s）",
+                     local_md5, remote_md5[0] ? remote_md5 : "取得できず");
+            log_error(msg);
+            ok = false;
+        }
+    }
+
+    if (shell) delete_shell(&pl, shell_id);
+    pipeline_close(&pl);
+    pool_shutdown();
+    if (data) munmap(data, size);
+
+    if (!ok) {
+        log_error("アップロードに失敗しました");
+        return 1;
+    }
+    printf("\n");
+    snprintf(msg, sizeof(msg), "アップロード完了: %zu バイト（%.1f秒、%.1f MB/s）、MD5: %s",
+             size, elapsed / 1000.0, elapsed ? size / 1048.576 / elapsed : 0.0, local_md5);
+    log_success(msg);
+    return 0;
+}
+
+/*
+ * download_t - ダウンロードの書き込み先
+ *
+ * 標準出力は buf にためて DOWNLOAD_WRITE_SIZE ごとにファイルへ書き込み、同時にMD5へ加える。
+ * 標準エラー出力（リモートのMD5・エラーメッセージ）は err に蓄積する。
+ */
+typedef struct {
+    int fd;             /* ローカルのファイル */
+    uint8_t *buf;       /* 書き込み待ちの内容（DOWNLOAD_WRITE_SIZE バイト） */
+    size_t len;         /* buf 内のバイト数 */
+    md_ctx_t md5;       /* ファイル先頭からのMD5 */
+    uint64_t received;  /* 今回受信したバイト数 */
+    uint64_t written;   /* 今回ファイルへ書き込んだバイト数 */
+    capture_t err;      /* 標準エラー出力 */
+    bool failed;        /* 書き込みに失敗したか */
+} download_t;
+
+/* download_flush - 書き込み待ちの内容をファイルへ書き込む */
+static bool download_flush(download_t *dl) {
+    if (dl->failed) return false;
+    if (dl->len > 0 && !write_all(dl->fd, dl->buf, dl->len)) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "ファイルへの書き込みに失敗しました: %s", strerror(errno));
+        log_error(msg);
+        dl->failed = true;
+        return false;
+    }
+    dl->written += dl->len;
+    dl->len = 0;
+    return true;
+}
+
+/* download_chunk - receive_emit用: デコードした出力をファイル・MD5へ渡す */
+static void download_chunk(int stream, const uint8_t *data, size_t len, void *ctx) {
+    download_t *dl = ctx;
+
+    if (stream != 0) {
+        if (!capture_append(&dl->err, data, len)) dl->failed = true;
+        return;
+    }
+    md5_update(&dl->md5, data, len);
+    dl->received += len;
+    while (len > 0 && !dl->failed) {
+        size_t n = DOWNLOAD_WRITE_SIZE - dl->len < len ? DOWNLOAD_WRITE_SIZE - dl->len : len;
+        memcpy(dl->buf + dl->len, data, n);
+        dl->len += n;
+        data += n;
+        len -= n;
+        if (dl->len == DOWNLOAD_WRITE_SIZE) download_flush(dl);
+    }
+}
+
+/*
+ * download_receive - リーダーの出力を受け取ってファイルへ書き込む
+ *
+ * @exit_code: 終了コードの出力先
+ * @return:    コマンドの完了まで受け取れればtrue
+ *
+ * get_command_output() と同じくReceiveを繰り返すが、出力は蓄積せずに download_chunk() へ渡す。
+ * 待機時間は転送全体ではなく、出力が途絶えてからの時間（DOWNLOAD_IDLE_TIMEOUT）で判定する。
+ * 完了を受信したら、出力の処理を待たずにシェルのDeleteを送っておく。
+ * 応答なしで切断されたReceiveは送り直さない（サーバーが出力を返し済みなら、その分が
+ * 欠けたまま続いてしまうため）。run_command() が先に送る最初のReceiveも対象にするため、
+ * pl->once は呼び出し元がコマンドの実行前に設定しておく。中断しても書き込み済みの部分は
+ * --resume で再開できる。
+ */
+static bool download_receive(soap_pipeline_t *pl, const char *shell_id, const char *command_id,
+                             download_t *dl, int *exit_code) {
+    buf_t response = {0};
+    bool done = false;
+    uint64_t deadline = now_ms() + (uint64_t)DOWNLOAD_IDLE_TIMEOUT * 1000;
+
+    *exit_code = 0;
+    while (!done) {
+        if (now_ms() >= deadline) {
+            log_error("リモートからの出力が途絶えたため中断しました");
+            break;
+        }
+        bool ok = pl->count > 0;
+        if (!ok) {
+            ok = post_soap(pl, SOAP_RECEIVE, shell_id, command_id, NULL);
+        }
+        if (!ok || !soap_collect(pl, &response)) {
+            log_error("出力取得に失敗しました");
+            break;
+        }
+        if (soap_fault_is_timeout(response.data, response.len)) {
+            continue;
+        }
+
+        receive_result_t result;
+        receive_parse(response.data, response.len, command_id, &result);
+        if (result.done) {
+            done = true;
+            *exit_code = result.exit_code;
+            if (!post_soap(pl, SOAP_DELETE, shell_id, NULL, NULL)) {
+                pipeline_abandon(pl);
+            }
+        }
+        if (result.count > 0) {
+            deadline = now_ms() + (uint64_t)DOWNLOAD_IDLE_TIMEOUT * 1000;
+        }
+        receive_emit(&result, response.data, download_chunk, dl);
+        if (result.failed) dl->failed = true;
+        receive_result_free(&result);
+        if (dl->failed) {
+            done = false;
+            break;
+        }
+    }
+    buf_free(&response);
+    pl->once = false;
+    if (!done) pipeline_abandon(pl);
+    return download_flush(dl) && done;
+}
+
+/*
+ * execute_download - リモートのファイルをローカルへ書き込む
+ *
+ * @remote_path: リモートのパス（例: C:\Logs\app.log）
+ * @local:       ローカルのファイル
+ * @resume:      ローカルのファイルの現在のサイズの位置から続きを受け取るか
+ * @return:      成功時0、失敗時1
+ */
+static int execute_download(const char *remote_path, const char *local, bool resume) {
+    char msg[1024];
+    char remote[MAX_PATH_SIZE];
+
+    if (!ps_quote(remote_path, remote, sizeof(remote))) {
+        snprintf(msg, sizeof(msg), "リモートのパスに使用できない文字が含まれています: %s", remote_path);
+        log_error(msg);
+        return 1;
+    }
+
+    struct stat st;
+    int fd = open(local, O_RDWR | O_CREAT | O_CLOEXEC | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        snprintf(msg, sizeof(msg), "ファイルを開けません: %s", local);
+        log_error(msg);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+    uint64_t offset = (uint64_t)st.st_size;
+    download_t dl = { .fd = fd, .buf = malloc(DOWNLOAD_WRITE_SIZE) };
+    if (!dl.buf || lseek(fd, (off_t)offset, SEEK_SET) < 0) {
+        log_error("メモリ確保に失敗しました");
+        free(dl.buf);
+        close(fd);
+        return 1;
+    }
+    md5_init(&dl.md5);
+
+    if (offset > 0) {
+        snprintf(msg, sizeof(msg), "ダウンロード: %s → %s（%llu バイト目から再開）",
+                 remote_path, local, (unsigned long long)offset);
+    } else {
+        snprintf(msg, sizeof(msg), "ダウンロード: %s → %s", remote_path, local);
+    }
+    log_info(msg);
+    printf("\n");
+
+    uint64_t start = now_ms();
+    soap_pipeline_t pl;
+    char shell_id[128], command_id[128];
+    int exit_code = 0;
+    bool ok = pipeline_open(&pl, g_host, g_port);
+    bool shell = ok && create_shell(&pl, shell_id, sizeof(shell_id));
+    ok = shell;
+    if (ok) {
+        char command[MAX_COMMAND_SIZE];
+        snprintf(command, sizeof(command), DOWNLOAD_READER, remote, (unsigned long long)offset,
+                 remote, (unsigned long long)offset);
+        /* 続けて送る最初のReceiveから、応答なしで切断されても送り直さない */
+        pl.once = true;
+        ok = run_command(&pl, shell_id, command, command_id, sizeof(command_id), true);
+    }
+
+    /* 再開時は、リーダーの起動を待つ間に受信済みの部分をMD5へ加える */
+    for (uint64_t pos = 0; ok && pos < offset;) {
+        ssize_t n = pread(fd, dl.buf, DOWNLOAD_WRITE_SIZE, (off_t)pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            log_error("受信済みの部分を読み込めません");
+            ok = false;
+            break;
+        }
+        md5_update(&dl.md5, dl.buf, (size_t)n);
+        pos += (uint64_t)n;
+    }
+
+    bool complete = ok && download_receive(&pl, shell_id, command_id, &dl, &exit_code);
+    ok = complete;
+    uint64_t elapsed = now_ms() - start;
+    if (ok && exit_code != 0) {
+        int err_fd = STDERR_FILENO;
+        capture_replay(&dl.err, capture_sink_fd, &err_fd);
+        fprintf(stderr, "\n");
+        log_error("リモートのファイルを読み込めません");
+        ok = false;
+    }
+
+    /* 標準エラー出力の「MD5:32桁の16進数」とローカルのMD5を比較 */
+    char remote_md5[64] = "", local_md5[33];
+    uint8_t digest[16];
+    md5_final(&dl.md5, digest);
+    for (int i = 0; i < 16; i++) {
+        snprintf(local_md5 + i * 2, 3, "%02X", digest[i]);
+    }
+    if (ok) {
+        const char *p = !dl.err.spilled && dl.err.mem.len > 0
+                            ? memmem(dl.err.mem.data, dl.err.mem.len, "MD5:", 4) : NULL;
+        size_t n = 0;
+        if (p) {
+            const char *end = dl.err.mem.data + dl.err.mem.len;
+            for (p += 4; p < end && isxdigit((uint8_t)*p) && n < sizeof(remote_md5) - 1; p++) {
+                remote_md5[n++] = *p;
+            }
+        }
+        remote_md5[n] = '\0';
+        if (strcasecmp(remote_md5, local_md5) != 0) {
+            snprintf(msg, sizeof(msg), "MD5が一致しません（ローカル: %s / リモート: %s）",
+                     local_md5, remote_md5[0] ? remote_md5 : "取得できず");
+            log_error(msg);
+            if (offset > 0) log_info("--resume を付けずに実行し直すと、先頭から受け取ります");
+            ok = false;
+        }
+    }
+
+    pl.once = false;   /* download_receive() まで進まなかった場合も、Deleteは送り直してよい */
+    if (shell) delete_shell(&pl, shell_id);
+    pipeline_close(&pl);
+    pool_shutdown();
+    capture_free(&dl.err);
+    free(dl.buf);
+    if (close(fd) < 0 && ok) {
+        snprintf(msg, sizeof(msg), "ファイルへの書き込みに失敗しました: %s", strerror(errno));
+        log_error(msg);
+        ok = false;
+    }
+
+    if (!ok) {
+        log_error("ダウンロードに失敗しました");
+        if (!complete && offset + dl.written > 0) {
+            snprintf(msg, sizeof(msg),
+                     "--resume を付けて実行し直すと、受信済みの %llu バイトの続きから再開します",
+                     (unsigned long long)(offset + dl.written));
+            log_info(msg);
+        }
+        return 1;
+    }
+    printf("\n");
+    snprintf(msg, sizeof(msg), "ダウンロード完了: %llu バイト（受信 %llu バイト、%.1f秒、%.1f MB/s）、MD5: %s",
+             (unsigned long long)(offset + dl.written), (unsigned long long)dl.received,
+             elapsed / 1000.0, elapsed ? dl.received / 1048.576 / elapsed : 0.0, local_md5);
+    log_success(msg);
+    return 0;
+}
+
+/* ============================================================================
+ * スクリプト実行（1つのシェルで複数のコマンドを順に実行）
+ * ============================================================================
+ *
+ * --script FILE（- で標準入力）に1行1コマンドで書いたコマンドを、ホストごとに
+ * 1回だけ作成したシェルの中で順に実行する。接続・認証とシェルの作成・削除は
+ * スクリプト全体で1回になり、コマンドごとのコストは Command/Receive のみになる。
+ *
+ * - 空行と、先頭（空白を除く）が # の行は無視する
+ * - 各行はそのままシェルのコマンドラインとして実行する（cmd.exeの内部コマンドも可）
+ * - コマンドごとに stdout / stderr / 終了コード / 所要時間 を表示する
+ * - --stop-on-error（WINRM_STOP_ON_ERROR=1）指定時は、最初に失敗したコマンドで
+ *   中断し、残りは未実行として扱う
+ * - 全体の終了コードは、最初に失敗したコマンドの終了コード（すべて成功なら0）
+ * --hosts と組み合わせた場合は、各ホストのセッションが同じ規則でスクリプトを実行する。
+ * ============================================================================ */
+
+typedef struct {
+    char **lines;   /* 実行するコマンドライン */
+    int count;      /* コマンド数 */
+} script_t;
+
+/* script_free - 読み込んだスクリプトを解放 */
+static void script_free(script_t *script) {
+    for (int i = 0; i < script->count; i++) {
+        free(script->lines[i]);
+    }
+    free(script->lines);
+    script->lines = NULL;
+    script->count = 0;
+}
+
+/*
+ * script_load - スクリプトファイルを読み込み
+ *
+ * @path:   ファイルパス（"-" の場合は標準入力）
+ * @return: 1つ以上のコマンドを読み込めればtrue
+ */
+static bool script_load(script_t *script, const char *path) {
+    bool from_stdin = strcmp(path, "-") == 0;
+    FILE *fp = from_stdin ? stdin : fopen(path, "r");
+    if (!fp) {
+        char msg[600];
+        snprintf(msg, sizeof(msg), "スクリプトファイルを開けません: %s", path);
+        log_error(msg);
+        return false;
+    }
+
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+    int line_no = 0;
+    bool ok = true;
+    while (ok && (n = getline(&line, &line_cap, fp)) >= 0) {
+        line_no++;
+        /* 前後の空白・改行を除去 */
+        char *start = line;
+        while (*start == ' ' || *start == '\t') start++;
+        size_t len = strlen(start);
+        while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t' ||
+                           start[len - 1] == '\r' || start[len - 1] == '\n')) {
+            len--;
+        }
+        start[len] = '\0';
+        if (len == 0 || start[0] == '#') continue;
+
+        if (len >= MAX_COMMAND_SIZE) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "スクリプトの%d行目が長すぎます（最大%dバイト）",
+                     line_no, MAX_COMMAND_SIZE - 1);
+            log_error(msg);
+            ok = false;
+            break;
+        }
+
+        char **grown = realloc(script->lines, (script->count + 1) * sizeof(*grown));
+        char *copy = grown ? strdup(start) : NULL;
+        if (grown) script->lines = grown;
+        if (!copy) {
+            log_error("メモリ確保に失敗しました");
+            ok = false;
+            break;
+        }
+        script->lines[script->count++] = copy;
+    }
+    free(line);
+    if (!from_stdin) fclose(fp);
+
+    if (ok && script->count == 0) {
+        log_error("スクリプトに実行するコマンドがありません");
+        ok = false;
+    }
+    if (!ok) script_free(script);
+    return ok;
+}
+
+/* ============================================================================
+ * まとめ実行（--bundle）
+ * ============================================================================
+ *
+ * ver / hostname / ipconfig のような短いコマンドを多数実行する場合、1行ずつの
+ * Command/Receive の往復が実行時間のほとんどを占める。--bundle 指定時は
+ * --script の各行を1つのコマンドラインに連結して1回の Command で実行し、
+ * 出力をクライアント側で行ごとの stdout / stderr / 終了コードに振り分ける。
+ *
+ * WinRSはコマンドラインを cmd.exe で実行するため、各行を次の形に展開して & で連結する
+ * （T は __WB_<ノンス>_<行番号>__、ノンスは実行ごとの乱数）。
+ *
+ *   echo TB&(echo TB)1>&2&(コマンド)&call echo TE %^ERRORLEVEL%&(echo TE)1>&2
+ *
+ * - 開始・終了マーカーを stdout と stderr の両方に出力し、マーカーを境に出力を
+ *   振り分ける（bundle_demux_t）。stdout の終了マーカーにはその行の終了コードが付く
+ * - 1つのコマンドラインは実行前に全体が展開されるため、%ERRORLEVEL% は call で
+ *   実行時に展開させる（!ERRORLEVEL! の遅延展開はコマンド中の ! を壊すため使わない）
+ * - --stop-on-error 時は、コマンドの直後に errorlevel を判定し、失敗していれば
+ *   終了マーカーを出力してから exit する
+ * - 連結後が BUNDLE_MAX_LENGTH を超える場合は複数回に分け、同じシェルで順に実行する
+ * - 括弧の対応が取れていない行と、rem / ラベル（:）の行は連結できないためエラーとする
+ * - 行ごとの所要時間は計測できない（まとめて実行した単位でのみ分かる）
+ * ============================================================================ */
+
+#define BUNDLE_MARKER_MAX 48    /* マーカー（__WB_<ノンス>_<行番号>__）の最大長 */
+
+typedef struct {
+    char *const *commands;  /* 元の各行（script_t から借用） */
+    int lines;           /* まとめる行数（script_t の count） */
+    char nonce[17];      /* マーカーのノンス（16進16桁） */
+    char **bundles;      /* 連結したコマンドライン */
+    int *first;          /* bundles[i] に含まれる最初の行（first[count] は lines） */
+    int count;           /* まとめた回数 */
+} bundle_plan_t;
+
+/* --hosts と組み合わせた場合のまとめ方（セッション終了時の振り分けに使用） */
+static const bundle_plan_t *g_bundle;
+
+/*
+ * bundle_line_ok - 行を ( ) で囲んで & で連結しても意味が変わらないか
+ *
+ * 引用符の外の括弧が対応していない行は、囲んだ括弧を閉じてしまう。
+ * rem は行末までをコメントにし、ラベルは cmd.exe の1行コマンドでは使えない。
+ */
+static bool bundle_line_ok(const char *line) {
+    if (line[0] == ':' || (strncasecmp(line, "rem", 3) == 0 &&
+                           (line[3] == '\0' || line[3] == ' ' || line[3] == '\t'))) {
+        return false;
+    }
+    int depth = 0;
+    bool quoted = false;
+    for (const char *p = line; *p; p++) {
+        if (*p == '"') {
+            quoted = !quoted;
+        } else if (quoted) {
+            continue;
+        } else if (*p == '^' && p[1]) {
+            p++;    /* エスケープされた文字 */
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth < 0) {
+            return false;
+        }
+    }
+    return depth == 0;
+}
+
+/*
+ * bundle_format_line - 1行分の展開結果を作成
+ *
+ * @return: 展開後の長さ（バッファに収まらない場合は size 以上）
+ */
+static int bundle_format_line(char *dst, size_t size, const char *nonce, int index,
+                              const char *line, bool stop_on_error) {
+    char tag[BUNDLE_MARKER_MAX];
+    char end[BUNDLE_MARKER_MAX * 2 + 64];
+    snprintf(tag, sizeof(tag), "__WB_%s_%d__", nonce, index);
+    snprintf(end, sizeof(end), "call echo %sE %%^ERRORLEVEL%%&(echo %sE)1>&2", tag, tag);
+
+    if (!stop_on_error) {
+        return snprintf(dst, size, "echo %sB&(echo %sB)1>&2&(%s)&%s", tag, tag, line, end);
+    }
+    /* errorlevel 1 は1以上、not errorlevel 0 は負の値（例外終了のNTSTATUS等） */
+    return snprintf(dst, size,
+                    "echo %sB&(echo %sB)1>&2&(%s)&(if errorlevel 1 (%s&exit))"
+                    "&(if not errorlevel 0 (%s&exit))&%s",
+                    tag, tag, line, end, end, end);
+}
+
+/* bundle_plan_free - まとめ方を解放 */
+static void bundle_plan_free(bundle_plan_t *plan) {
+    for (int i = 0; i < plan->count; i++) {
+        free(plan->bundles[i]);
+    }
+    free(plan->bundles);
+    free(plan->first);
+    memset(plan, 0, sizeof(*plan));
+}
+
+/*
+ * bundle_plan_build - スクリプトの各行を BUNDLE_MAX_LENGTH 以内のコマンドラインに連結
+ *
+ * @return: 成功時true（連結できない行・長すぎる行があればエラーを表示してfalse）
+ */
+static bool bundle_plan_build(bundle_plan_t *plan, const script_t *script) {
+    char uuid[MAX_UUID_SIZE];
+    char msg[256];
+
+    memset(plan, 0, sizeof(*plan));
+    plan->commands = script->lines;
+    plan->lines = script->count;
+
+    /* ノンス: UUIDの16進部分（出力中の文字列とマーカーが一致しないように実行ごとに変える） */
+    generate_uuid(uuid, sizeof(uuid));
+    size_t n = 0;
+    for (const char *p = uuid; *p && n < sizeof(plan->nonce) - 1; p++) {
+        if (*p != '-') plan->nonce[n++] = *p;
+    }
+    plan->nonce[n] = '\0';
+
+    plan->bundles = calloc(script->count, sizeof(*plan->bundles));
+    plan->first = calloc(script->count + 1, sizeof(*plan->first));
+    char *step = malloc(BUNDLE_MAX_LENGTH + 1);
+    buf_t line = {0};
+    bool ok = plan->bundles && plan->first && step;
+    if (!ok) log_error("メモリ確保に失敗しました");
+
+    for (int i = 0; ok && i < script->count; i++) {
+        if (!bundle_line_ok(script->lines[i])) {
+            snprintf(msg, sizeof(msg),
+                     "スクリプトの%d番目のコマンドはまとめて実行できません"
+                     "（括弧の対応が取れていないか、rem・ラベルの行です）", i + 1);
+            log_error(msg);
+            ok = false;
+            break;
+        }
+        int len = bundle_format_line(step, BUNDLE_MAX_LENGTH + 1, plan->nonce, i,
+                                     script->lines[i], g_stop_on_error);
+        if (len > BUNDLE_MAX_LENGTH) {
+            snprintf(msg, sizeof(msg), "スクリプトの%d番目のコマンドが長すぎるため、"
+                     "まとめて実行できません", i + 1);
+            log_error(msg);
+            ok = false;
+            break;
+        }
+
+        /* 連結すると上限を超える場合は、ここまでを1回分として確定 */
+        if (line.len > 0 && line.len + 1 + len > BUNDLE_MAX_LENGTH) {
+            plan->bundles[plan->count++] = strndup(line.data, line.len);
+            plan->first[plan->count] = i;
+            buf_clear(&line);
+        }
+        if (line.len > 0) ok = buf_append(&line, "&", 1);
+        ok = ok && buf_append(&line, step, len);
+    }
+    if (ok) {
+        plan->bundles[plan->count++] = strndup(line.data, line.len);
+        plan->first[plan->count] = script->count;
+        for (int i = 0; i < plan->count; i++) {
+            if (!plan->bundles[i]) ok = false;
+        }
+    }
+    buf_free(&line);
+    free(step);
+    if (!ok) bundle_plan_free(plan);
+    return ok;
+}
+
+/*
+ * bundle_step_t - まとめて実行した1行分の結果
+ */
+typedef struct {
+    capture_t out[2];   /* [0]: stdout, [1]: stderr */
+    int exit_code;
+    bool began;         /* 開始マーカーを受信したか（実行されたか） */
+    bool ended;         /* 終了マーカー（終了コード）を受信したか */
+} bundle_step_t;
+
+/*
+ * bundle_demux_t - まとめて実行した出力を行ごとに振り分ける
+ *
+ * 出力はチャンク単位で届くため、マーカーの途中で途切れた分は pending に残して
+ * 次のチャンクとつなげてから判定する。マーカーは改行で終わるが、直前の出力が
+ * 改行で終わっていなければ行の途中から始まる。
+ */
+typedef struct {
+    char marker[BUNDLE_MARKER_MAX];  /* "__WB_<ノンス>_" */
+    size_t marker_len;
+    bundle_step_t *steps;            /* 全行分の結果（マーカーの行番号で参照） */
+    int count;
+    int current[2];                  /* 出力の振り分け先の行（stream別） */
+    buf_t pending[2];                /* 判定待ちの出力 */
+    bool failed;                     /* 出力の蓄積に失敗したか */
+} bundle_demux_t;
+
+/*
+ * bundle_demux_init - 振り分けを開始
+ *
+ * @first: 今回まとめて実行した最初の行（最初のマーカーより前の出力の振り分け先）
+ */
+static void bundle_demux_init(bundle_demux_t *d, const bundle_plan_t *plan,
+                              bundle_step_t *steps, int first) {
+    memset(d, 0, sizeof(*d));
+    d->marker_len = snprintf(d->marker, sizeof(d->marker), "__WB_%s_", plan->nonce);
+    d->steps = steps;
+    d->count = plan->lines;
+    d->current[0] = d->current[1] = first;
+}
+
+static void bundle_demux_emit(bundle_demux_t *d, int stream, const char *data, size_t len) {
+    capture_t *c = &d->steps[d->current[stream]].out[stream];
+    if (len > 0 && !d->failed && !capture_append(c, data, len)) {
+        d->failed = true;
+    }
+}
+
+/*
+ * bundle_demux_marker - マーカー（"<行番号>__B" / "<行番号>__E [終了コード]"）を処理
+ *
+ * @p:      マーカーの接頭辞（__WB_<ノンス>_）の直後
+ * @end:    行末の '\n'
+ * @return: マーカーとして処理したらtrue（形式が違えば出力として扱う）
+ */
+static bool bundle_demux_marker(bundle_demux_t *d, int stream, const char *p, const char *end) {
+    int index = 0;
+    const char *q = p;
+    while (q < end && *q >= '0' && *q <= '9' && index < d->count) {
+        index = index * 10 + (*q++ - '0');
+    }
+    if (q == p || index >= d->count || end - q < 3 || memcmp(q, "__", 2) != 0) {
+        return false;
+    }
+
+    bundle_step_t *step = &d->steps[index];
+    if (q[2] == 'B') {
+        d->current[stream] = index;
+        step->began = true;
+        return true;
+    }
+    if (q[2] == 'E') {
+        /* 終了コードは stdout 側のマーカーにのみ付く */
+        if (stream == 0) {
+            step->exit_code = atoi(q + 3);
+            step->ended = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* bundle_demux_feed - stdout / stderr のチャンクを振り分ける */
+static void bundle_demux_feed(bundle_demux_t *d, int stream, const char *data, size_t len) {
+    buf_t *p = &d->pending[stream];
+    if (!buf_append(p, data, len)) {
+        d->failed = true;
+        return;
+    }
+
+    size_t pos = 0;
+    while (pos < p->len) {
+        const char *at = memmem(p->data + pos, p->len - pos, d->marker, d->marker_len);
+        if (!at) {
+            /* 末尾がマーカーの途中かもしれない分だけ残す */
+            size_t keep = d->marker_len - 1 < p->len - pos ? d->marker_len - 1 : p->len - pos;
+            while (keep > 0 && memcmp(p->data + p->len - keep, d->marker, keep) != 0) keep--;
+            bundle_demux_emit(d, stream, p->data + pos, p->len - keep - pos);
+            pos = p->len - keep;
+            break;
+        }
+        size_t off = at - p->data;
+        bundle_demux_emit(d, stream, p->data + pos, off - pos);
+        pos = off;
+
+        const char *nl = memchr(at, '\n', p->len - off);
+        if (!nl) break;     /* マーカーの行の残りを待つ */
+        size_t next = nl - p->data + 1;
+        if (!bundle_demux_marker(d, stream, at + d->marker_len, nl)) {
+            bundle_demux_emit(d, stream, at, next - off);
+        }
+        pos = next;
+    }
+
+    memmove(p->data, p->data + pos, p->len - pos);
+    p->len -= pos;
+}
+
+/* bundle_demux_sink_out / bundle_demux_sink_err - capture_replay用 */
+static void bundle_demux_sink_out(const char *data, size_t len, void *ctx) {
+    bundle_demux_feed(ctx, 0, data, len);
+}
+
+static void bundle_demux_sink_err(const char *data, size_t len, void *ctx) {
+    bundle_demux_feed(ctx, 1, data, len);
+}
+
+/*
+ * bundle_demux_run - 蓄積したまとめ実行の出力を行ごとに振り分ける
+ *
+ * @first:     振り分ける出力に含まれる最初の行
+ * @exit_code: 最後に実行したまとまりの終了コード（終了マーカーのない行に使う）
+ * @return:    成功時true（出力の蓄積に失敗した場合false）
+ */
+static bool bundle_demux_run(const bundle_plan_t *plan, bundle_step_t *steps, int first,
+                             capture_t *out, capture_t *err, int exit_code) {
+    bundle_demux_t d;
+    bundle_demux_init(&d, plan, steps, first);
+    capture_replay(out, bundle_demux_sink_out, &d);
+    capture_replay(err, bundle_demux_sink_err, &d);
+    for (int i = 0; i < 2; i++) {
+        bundle_demux_emit(&d, i, d.pending[i].data, d.pending[i].len);
+        buf_free(&d.pending[i]);
+    }
+
+    /* 途中で終了した行（exit・異常終了）にはまとまり全体の終了コードを使う */
+    for (int i = first; i < plan->lines; i++) {
+        if (steps[i].began && !steps[i].ended) steps[i].exit_code = exit_code;
+    }
+    return !d.failed;
+}
+
+/* bundle_steps_free - 行ごとの結果を解放 */
+static void bundle_steps_free(bundle_step_t *steps, int count) {
+    for (int i = 0; steps && i < count; i++) {
+        capture_free(&steps[i].out[0]);
+        capture_free(&steps[i].out[1]);
+    }
+    free(steps);
+}
+
+/*
+ * script_print_header - 実行するコマンドの見出しを表示
+ */
+static void script_print_header(const script_t *script, int i) {
+    printf("------------------------------------------------------------\n");
+    printf("[%d/%d] %s\n", i + 1, script->count, script->lines[i]);
+    printf("------------------------------------------------------------\n");
+    fflush(stdout);
+}
+
+/*
+ * script_print_result - コマンドの出力と終了コードを表示
+ *
+ * @elapsed_ms: 所要時間（UINT64_MAX: 計測していない）
+ */
+static void script_print_result(capture_t *out, capture_t *err, int exit_code,
+                                uint64_t elapsed_ms) {
+    /* --stream時は受信しだい書き出し済み */
+    int stdout_fd = STDOUT_FILENO;
+    if (out->total > 0) {
+        printf("[標準出力]\n");
+        fflush(stdout);
+        capture_replay(out, capture_sink_fd, &stdout_fd);
+    }
+    if (err->total > 0) {
+        printf("\n[標準エラー出力]\n");
+        fflush(stdout);
+        capture_replay(err, capture_sink_fd, &stdout_fd);
+    }
+    if (elapsed_ms == UINT64_MAX) {
+        printf("\n終了コード: %d\n\n", exit_code);
+    } else {
+        printf("\n終了コード: %d  (%.1f秒)\n\n", exit_code, elapsed_ms / 1000.0);
+    }
+    fflush(stdout);
+}
+
+/*
+ * script_run_each - スクリプトの各行を1つずつ Command で実行
+ *
+ * @return: 実行したコマンド数（*aborted: 接続・プロトコルエラーで中断したか）
+ */
+static int script_run_each(soap_pipeline_t *pl, const char *shell_id, const script_t *script,
+                           int *exit_codes, uint64_t *elapsed, bool *aborted) {
+    int executed = 0;
+
+    for (int i = 0; i < script->count; i++) {
+        bool last = i == script->count - 1;
+        uint64_t start = now_ms();
+
+        script_print_header(script, i);
+
+        char command_id[128];
+        capture_t out = {0}, err = {0};
+        int exit_code = 0;
+        if (!run_command(pl, shell_id, script->lines[i], command_id, sizeof(command_id), true) ||
+            !get_command_output(pl, shell_id, command_id, &out, &err, &exit_code, last, NULL)) {
+            capture_free(&out);
+            capture_free(&err);
+            *aborted = true;
+            break;
+        }
+        exit_codes[i] = exit_code;
+        elapsed[i] = now_ms() - start;
+        executed++;
+
+        script_print_result(&out, &err, exit_code, elapsed[i]);
+        capture_free(&out);
+        capture_free(&err);
+
+        if (exit_code != 0 && g_stop_on_error && !last) {
+            log_warn("コマンドが失敗したため、残りのコマンドを中断します（--stop-on-error）");
+            break;
+        }
+    }
+    return executed;
+}
+
+/*
+ * script_run_bundled - スクリプトをまとめて実行し、行ごとに振り分けて表示（--bundle）
+ *
+ * @return: 先頭から続けて実行されたコマンド数（*aborted: 接続・プロトコルエラーで中断したか）
+ */
+static int script_run_bundled(soap_pipeline_t *pl, const char *shell_id, const script_t *script,
+                              const bundle_plan_t *plan, int *exit_codes, bool *aborted) {
+    char msg[160];
+    bundle_step_t *steps = calloc(script->count, sizeof(*steps));
+    if (!steps) {
+        log_error("メモリ確保に失敗しました");
+        *aborted = true;
+        return 0;
+    }
+
+    for (int b = 0; b < plan->count; b++) {
+        bool last = b == plan->count - 1;
+        int first = plan->first[b], end = plan->first[b + 1];
+
+        snprintf(msg, sizeof(msg), "%d〜%d番目のコマンドをまとめて実行中... (%d/%d)",
+                 first + 1, end, b + 1, plan->count);
+        log_info(msg);
+
+        char command_id[128];
+        capture_t out = {0}, err = {0};
+        int exit_code = 0;
+        bool ok = run_command(pl, shell_id, plan->bundles[b], command_id, sizeof(command_id), true) &&
+                  get_command_output(pl, shell_id, command_id, &out, &err, &exit_code, last, NULL);
+        if (ok && !bundle_demux_run(plan, steps, first, &out, &err, exit_code)) {
+            log_error("コマンド出力の保存に失敗しました");
+            ok = false;
+        }
+        capture_free(&out);
+        capture_free(&err);
+        if (!ok) {
+            *aborted = true;
+            break;
+        }
+        printf("\n");
+
+        bool failed = false;
+        for (int i = first; i < end; i++) {
+            if (!steps[i].began) continue;
+            script_print_header(script, i);
+            script_print_result(&steps[i].out[0], &steps[i].out[1], steps[i].exit_code,
+                                UINT64_MAX);
+            if (steps[i].exit_code != 0) failed = true;
+        }
+        if (failed && g_stop_on_error && !last) {
+            log_warn("コマンドが失敗したため、残りのコマンドを中断します（--stop-on-error）");
+            break;
+        }
+    }
+
+    int executed = 0;
+    while (executed < script->count && steps[executed].began) {
+        exit_codes[executed] = steps[executed].exit_code;
+        executed++;
+    }
+    bundle_steps_free(steps, script->count);
+    return executed;
+}
+
+/*
+ * execute_script - 現在の接続先（g_host:g_port）でスクリプトを実行し結果を表示
+ *
+ * @script: 実行するコマンド一覧
+ * @plan:   まとめ方（--bundle 時。NULLなら1行ずつ実行）
+ * @return: 最初に失敗したコマンドの終了コード（すべて成功なら0、接続・プロトコルエラー時は-1）
+ *
+ * シェル作成 →（コマンド実行 → 出力取得）×N → シェル削除。
+ * 最後のコマンドの完了時にDeleteを続けて送る点は execute_batch() と同じ。
+ */
+static int execute_script(const script_t *script, const bundle_plan_t *plan) {
+    char msg[256];
+    soap_pipeline_t pl;
+    uint64_t script_start = now_ms();
+
+    int *exit_codes = malloc(script->count * sizeof(int));
+    uint64_t *elapsed = malloc(script->count * sizeof(uint64_t));
+    if (!exit_codes || !elapsed || !pipeline_open(&pl, g_host, g_port)) {
+        free(exit_codes);
+        free(elapsed);
+        log_error("処理を中断します");
+        return -1;
+    }
+
+    /* シェル作成（スクリプト全体で1回） */
+    char shell_id[128];
+    if (!create_shell(&pl, shell_id, sizeof(shell_id))) {
+        pipeline_close(&pl);
+        pool_shutdown();
+        free(exit_codes);
+        free(elapsed);
+        log_error("処理を中断します");
+        return -1;
+    }
+    printf("\n");
+
+    bool aborted = false;
+    int executed = plan ? script_run_bundled(&pl, shell_id, script, plan, exit_codes, &aborted)
+                        : script_run_each(&pl, shell_id, script, exit_codes, elapsed, &aborted);
+
+    /* シェル削除（最後のコマンドの完了時に送信済みなら応答を受け取るだけ） */
+    delete_shell(&pl, shell_id);
+    pipeline_close(&pl);
+    pool_shutdown();
+
+    /* 結果一覧（まとめて実行した場合、行ごとの所要時間はない） */
+    int succeeded = 0, failed = 0, result = 0;
+    printf("\n");
+    printf("============================================================\n");
+    printf("スクリプト実行結果\n");
+    printf("============================================================\n");
+    for (int i = 0; i < script->count; i++) {
+        if (i >= executed) {
+            printf("  [%3d] %s未実行%s        %s%s\n", i + 1, COLOR_YELLOW, COLOR_RESET,
+                   plan ? "" : "            ", script->lines[i]);
+            continue;
+        }
+        printf("  [%3d] %s終了コード: %3d%s  ", i + 1,
+               exit_codes[i] != 0 ? COLOR_RED : COLOR_GREEN, exit_codes[i], COLOR_RESET);
+        if (!plan) printf("(%6.1f秒)  ", elapsed[i] / 1000.0);
+        printf("%s\n", script->lines[i]);
+        if (exit_codes[i] != 0) failed++; else succeeded++;
+        if (exit_codes[i] != 0 && result == 0) result = exit_codes[i];
+    }
+    printf("------------------------------------------------------------\n");
+    printf("  成功: %d / 失敗: %d / 未実行: %d  （合計 %d コマンド、%.1f秒）\n",
+           succeeded, failed, script->count - executed, script->count,
+           (now_ms() - script_start) / 1000.0);
+    printf("============================================================\n");
+    fflush(stdout);
+    free(exit_codes);
+    free(elapsed);
+
+    if (aborted) {
+        log_error("処理を中断します");
+        return -1;
+    }
+    if (result == 0) {
+        log_success("全コマンド完了");
+    } else {
+        snprintf(msg, sizeof(msg), "失敗したコマンドがあります (終了コード: %d)", result);
+        log_error(msg);
+    }
+    return result;
+}
+
+/* ============================================================================
+ * 常駐モード（--daemon / --use-daemon）
+ * ============================================================================
+ *
+ * 起動のたびに DNS・TCP接続・NTLMハンドシェイク・シェル作成（WINRS_NOPROFILE=FALSE
+ * のためユーザープロファイルの読み込みを伴う）を行うと、短いジョブでも数百ms〜数秒かかる。
+ * JP1やcronから1日に数千回呼ばれる用途では、このコストが実行時間のほとんどを占める。
+ *
+ * --daemon で起動すると、現在の接続先（WINRM_HOST:WINRM_PORT）に対して
+ * 「認証済み接続 + シェル」の組を WINRM_DAEMON_SHELLS 個作成して保持し、
+ * Unixドメインソケットでジョブを待ち受ける。
+ *
+ * - 待機シェルは1つずつ子プロセス（fork）が保持する。接続・NTLM認証・シェル作成・
+ *   生存確認・作り直しはすべてその子プロセスで行い、親プロセスはネットワークを待たずに
+ *   待ち受けと子プロセスからの通知（制御用ソケット）の処理だけを行う。
+ *   ホストが遅い・到達できない場合でも、ジョブの受け付けは止まらない。
+ * - ジョブを受け付けると、待機中の子プロセスへクライアント接続を渡し（SCM_RIGHTS）、
+ *   子プロセスはそのシェルの接続でコマンドを実行して出力を受信しだいクライアントへ転送する。
+ *   認証済み接続をそのまま使うため、ジョブあたりの待ち時間はほぼ Command
+ *   （+最初のReceive）1往復になる。シェルはジョブ終了時に削除する。
+ * - 親プロセスは使われた分のシェルを、新しい子プロセスを起動して補充する。
+ *   待機中のシェルがなければ、ジョブ用の子プロセスがシェルを作成してから実行する（ミス）。
+ * - 待機シェルの数は到着状況から決める（後述の arrival_stats_t）。最後のジョブから
+ *   WINRM_DAEMON_IDLE_TIMEOUT 秒以内、または過去の到着パターンから
+ *   WINRM_DAEMON_PREWARM_LEAD 秒以内の到着が見込まれる間は WINRM_DAEMON_SHELLS 個を保ち、
+ *   それ以外は削除してサーバーの MaxShellsPerUser を空ける。事前の作成も子プロセスで
+ *   行うため、作成中に来たジョブは待たされない（待機シェルがなければミスとして実行する）。
+ * - 待機中のシェルは WINRM_DAEMON_KEEPALIVE 秒ごとに WS-Transfer Get で生存を確認し
+ *   （接続のkeep-aliveタイムアウト対策を兼ねる）、失われていれば作り直す。
+ *   作成から WINRM_DAEMON_SHELL_MAX_AGE 秒経ったシェルは、サーバーの
+ *   アイドルタイムアウトより前に削除して作り直す。
+ * - ソケットは所有者のみ接続可能（0600）で、接続元のUIDも確認する。既定のパスは
+ *   接続先ごとに $XDG_RUNTIME_DIR/winrm_exec-HOST-PORT.sock
+ *   （未設定時は /tmp/winrm_exec-UID-HOST-PORT.sock）。
+ * - SIGTERM / SIGINT で待機中のシェルを削除して終了する（実行中のジョブは最後まで続く）。
+ *   シェルを保持する子プロセスはシグナルを無視し、親プロセスの指示（または親プロセスの
+ *   終了による制御用ソケットの切断）でシェルを削除して終了する。
+ *
+ * --use-daemon（WINRM_USE_DAEMON=1）のクライアントはジョブを常駐プロセスへ渡し、
+ * 出力を --stream と同様に受信しだい書き出す。常駐プロセスに接続できなければ直接実行する。
+ * ============================================================================ */
+
+#define DAEMON_UNAVAILABLE (-2)     /* daemon_submit(): 常駐プロセスに接続できなかった */
+#define DAEMON_PENDING_MAX 64       /* 最初のフレームを待つ接続の上限（超えたら受け付けを待たせる） */
+#define DAEMON_PENDING_TIMEOUT 10   /* 最初のフレームを待つ秒数（ジョブの受信と同じ） */
+
+/* 待機シェル（保持する子プロセス側） */
+typedef struct {
+    soap_pipeline_t pl;          /* このシェル専用の認証済み接続 */
+    char shell_id[128];
+    uint64_t created_ms;         /* 作成時刻 */
+    uint64_t checked_ms;         /* 最後に生存を確認した時刻 */
+} warm_shell_t;
+
+/* 待機シェルの枠（親プロセス側）。シェルは枠ごとの子プロセスが保持する */
+typedef struct {
+    pid_t pid;                   /* シェルを保持する子プロセス（0: なし） */
+    int ctl;                     /* 子プロセスとの制御用ソケット */
+    bool ready;                  /* ジョブに割り当て可能か */
+    bool created;                /* シェルの作成を集計済みか */
+    uint64_t retry_ms;           /* 作成に失敗した場合、次に試す時刻 */
+} warm_slot_t;
+
+/* 制御用ソケットの通知（1バイト） */
+#define WARM_READY  'R'             /* 子→親: ジョブを受け付けられる */
+#define WARM_BUSY   'B'             /* 子→親: 生存確認・作り直し中（ジョブを割り当てない） */
+#define WARM_FAILED 'F'             /* 子→親: シェルを作成できなかった（終了する） */
+#define WARM_AGED   'A'             /* 子→親: 作成から一定時間経ったシェルを削除した */
+#define WARM_LOST   'L'             /* 子→親: シェルが失われていた */
+#define WARM_JOB    'J'             /* 親→子: ジョブ（クライアント接続を添付） */
+#define WARM_QUIT   'Q'             /* 親→子: シェルを削除して終了（WARM_AGED / WARM_LOST への応答を兼ねる） */
+
+/* 受け付けたが最初のフレーム（'S': 状態の問い合わせ / 'H': ジョブ）が届いていない接続 */
+typedef struct {
+    int fd;
+    uint64_t accepted_ms;        /* 受け付けた時刻 */
+} daemon_pending_t;
+
+static daemon_pending_t g_daemon_pending[DAEMON_PENDING_MAX];
+static int g_daemon_pending_count;
+
+static volatile sig_atomic_t g_daemon_stop;
+
+/* daemon_on_signal - SIGTERM / SIGINT: 待ち受けを終了する */
+static void daemon_on_signal(int sig) {
+    (void)sig;
+    g_daemon_stop = 1;
+}
+
+/*
+ * daemon_socket_path - 待ち受けソケットのパスを決定
+ *
+ * @return: パスが sockaddr_un に収まればtrue
+ */
+static bool daemon_socket_path(char *path, size_t size) {
+    int n;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (g_daemon_socket[0]) {
+        n = snprintf(path, size, "%s", g_daemon_socket);
+    } else if (dir && dir[0]) {
+        n = snprintf(path, size, "%s/winrm_exec-%s-%d.sock", dir, g_host, g_port);
+    } else {
+        n = snprintf(path, size, "/tmp/winrm_exec-%u-%s-%d.sock", (unsigned)getuid(), g_host, g_port);
+    }
+    if (n < 0 || (size_t)n >= size) {
+        log_error("常駐モードのソケットのパスが長すぎます（WINRM_DAEMON_SOCKET で指定してください）");
+        return false;
+    }
+    return true;
+}
+
+/* daemon_identity - クライアントと常駐プロセスで一致を確認する接続先・資格情報 */
+static void daemon_identity(char *id, size_t size) {
+    snprintf(id, size, "%s\n%d\n%s\n%s", g_host, g_port, g_user, g_domain);
+}
+
+/*
+ * daemon_connect - 常駐プロセスのソケットへ接続
+ *
+ * @return: ソケット（自分が所有するソケットでない・接続できない場合は-1）
+ */
+static int daemon_connect(const char *path) {
+    struct stat st;
+    if (lstat(path, &st) < 0 || !S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * arrival_stats_t - ジョブの到着状況と待機シェルの利用状況
+ *
+ * 到着時刻は「分」単位で、毎時パターン（直近24時間の各時の何分に来たか）と
+ * 毎日パターン（直近8日の各日の何時何分に来たか）をビットマスクで保持する。
+ * 同じ分に2回以上（2時間以上・2日以上）到着があれば、次の同じ時刻にも来るとみなす。
+ * JP1の毎時・毎日のジョブのように、決まった時刻に集中する呼び出しを想定している。
+ * 時刻はローカル時刻（ジョブスケジューラの設定と同じ）で扱う。
+ */
+typedef struct {
+    time_t last_arrival;         /* 最後のジョブの到着時刻（起動時刻で初期化） */
+    long hour_base;              /* hour_mask の bit0 に対応する時（ローカル時刻、1970年からの時間数） */
+    long day_base;               /* day_mask の bit0 に対応する日（ローカル時刻、1970年からの日数） */
+    uint32_t hour_mask[60];      /* 分（0〜59）ごと: 直近24時間で到着があった時（bit n = n時間前） */
+    uint8_t day_mask[24 * 60];   /* 時刻（分単位）ごと: 直近8日で到着があった日（bit n = n日前） */
+    unsigned long hits;          /* 待機シェルで実行したジョブ数 */
+    unsigned long misses;        /* シェルを作成してから実行したジョブ数 */
+    unsigned long created;       /* 待機シェルの作成数 */
+    unsigned long idle_deleted;  /* ジョブがないため削除した待機シェルの数 */
+} arrival_stats_t;
+
+static arrival_stats_t g_arrivals;
+
+/* local_minutes - ローカル時刻での1970年からの経過分数 */
+static long local_minutes(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return (long)((t + tm.tm_gmtoff) / 60);
+}
+
+/* arrivals_advance - 時・日が進んだ分だけビットマスクをずらす */
+static void arrivals_advance(long minutes) {
+    long hour = minutes / 60, day = minutes / (24 * 60);
+
+    if (hour > g_arrivals.hour_base) {
+        long shift = hour - g_arrivals.hour_base;
+        for (int i = 0; i < 60; i++) {
+            g_arrivals.hour_mask[i] = shift >= 32 ? 0 : g_arrivals.hour_mask[i] << shift;
+        }
+        g_arrivals.hour_base = hour;
+    }
+    if (day > g_arrivals.day_base) {
+        long shift = day - g_arrivals.day_base;
+        for (int i = 0; i < 24 * 60; i++) {
+            g_arrivals.day_mask[i] = shift >= 8 ? 0 : (uint8_t)(g_arrivals.day_mask[i] << shift);
+        }
+        g_arrivals.day_base = day;
+    }
+}
+
+/* arrivals_record - ジョブの到着を記録 */
+static void arrivals_record(time_t now) {
+    long minutes = local_minutes(now);
+    arrivals_advance(minutes);
+    g_arrivals.hour_mask[minutes % 60] |= 1;
+    g_arrivals.day_mask[minutes % (24 * 60)] |= 1;
+    g_arrivals.last_arrival = now;
+}
+
+/*
+ * arrivals_expected - 今から lead 秒以内にジョブの到着が見込まれるか
+ *
+ * 毎時パターンは直近24時間のうち2時間以上、毎日パターンは直近7日のうち
+ * 2日以上、同じ分に到着があった場合に到着が見込まれるとする。
+ */
+static bool arrivals_expected(time_t now, int lead) {
+    long start = local_minutes(now);
+    arrivals_advance(start);
+
+    for (long m = start; m <= start + lead / 60; m++) {
+        uint32_t hours = g_arrivals.hour_mask[m % 60] & 0x00FFFFFF;
+        uint8_t days = g_arrivals.day_mask[m % (24 * 60)] & 0x7F;
+        if (__builtin_popcount(hours) >= 2 || __builtin_popcount(days) >= 2) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * daemon_target_shells - 現在保持しておく待機シェルの数
+ */
+static int daemon_target_shells(time_t now) {
+    if (g_daemon_idle_timeout <= 0 ||
+        now - g_arrivals.last_arrival < g_daemon_idle_timeout ||
+        arrivals_expected(now, g_daemon_prewarm_lead)) {
+        return g_daemon_shells;
+    }
+    return 0;
+}
+
+/*
+ * warm_shell_create - 認証済み接続とシェルを作成して待機状態にする
+ */
+static bool warm_shell_create(warm_shell_t *ws) {
+    if (!pipeline_open(&ws->pl, g_host, g_port)) {
+        return false;
+    }
+    if (!create_shell(&ws->pl, ws->shell_id, sizeof(ws->shell_id))) {
+        pipeline_close(&ws->pl);
+        return false;
+    }
+    ws->created_ms = ws->checked_ms = now_ms();
+    return true;
+}
+
+/*
+ * warm_shell_discard - 待機中のシェルを破棄
+ *
+ * @delete: サーバー側のシェルを削除するか（失われたシェルではfalse）
+ */
+static void warm_shell_discard(warm_shell_t *ws, bool delete) {
+    if (delete) {
+        delete_shell(&ws->pl, ws->shell_id);
+    }
+    pipeline_close(&ws->pl);
+}
+
+/*
+ * warm_shell_alive - 待機中のシェルが使えるか確認（WS-Transfer Get）
+ *
+ * サーバーが接続を閉じていれば、pipeline_collect() が再認証して送り直すため、
+ * 確認と同時に接続も使える状態に戻る。
+ */
+static bool warm_shell_alive(warm_shell_t *ws) {
+    buf_t response = {0};
+    int http_code = 0;
+    char shell_id[128];
+
+    bool alive = post_soap(&ws->pl, SOAP_GET, ws->shell_id, NULL, NULL) &&
+                 pipeline_collect(&ws->pl, &response, &http_code) &&
+                 http_code == 200 &&
+                 soap_find_text(response.data, response.len, XML_NS_SHELL, "ShellId",
+                                shell_id, sizeof(shell_id)) &&
+                 strcasecmp(shell_id, ws->shell_id) == 0;
+    buf_free(&response);
+    if (!alive) {
+        pipeline_abandon(&ws->pl);
+    }
+    return alive;
+}
+
+/*
+ * daemon_run_job - ジョブを受信して実行（子プロセス）
+ *
+ * @client: クライアント接続
+ * @ws:     割り当てたシェル（NULL: シェルを作成してから実行）
+ * @return: プロセスの終了コード
+ */
+static int daemon_run_job(int client, warm_shell_t *ws) {
+    char identity[1024];
+    char **commands = NULL;
+    int count = 0;
+    bool identified = false, started = false, stop_on_error = false;
+    const char *error = NULL;
+    buf_t payload = {0};
+    char type;
+
+    /* ジョブの受信（クライアントは接続直後に送る） */
+    struct timeval tv = { .tv_sec = 10, .tv_usec = 0 };
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    daemon_identity(identity, sizeof(identity));
+    while (!started && !error) {
+        if (!frame_read(client, &type, &payload)) {
+            error = "ジョブの受信に失敗しました";
+            break;
+        }
+        if (type == 'H') {
+            identified = strcmp(payload.data, identity) == 0;
+            if (!identified) error = "接続先・ユーザーが常駐プロセスの設定と一致しません";
+        } else if (type == 'C' && payload.len > 0 && payload.len < MAX_COMMAND_SIZE) {
+            char **grown = realloc(commands, (count + 1) * sizeof(*grown));
+            char *copy = grown ? strdup(payload.data) : NULL;
+            if (grown) commands = grown;
+            if (!copy) error = "メモリ確保に失敗しました";
+            else commands[count++] = copy;
+        } else if (type == 'R' && identified && count > 0) {
+            stop_on_error = payload.len > 0 && (payload.data[0] & 1);
+            started = true;
+        } else {
+            error = "不正なジョブです";
+        }
+    }
+    buf_free(&payload);
+
+    /* シェルの準備（割り当てがなければここで作成） */
+    soap_pipeline_t cold;
+    soap_pipeline_t *pl = ws ? &ws->pl : &cold;
+    char shell_id[128] = "";
+    if (!error) {
+        if (ws) {
+            snprintf(shell_id, sizeof(shell_id), "%s", ws->shell_id);
+        } else if (!pipeline_open(&cold, g_host, g_port)) {
+            error = "接続できません";
+        } else if (!create_shell(&cold, shell_id, sizeof(shell_id))) {
+            pipeline_close(&cold);
+            error = "シェル作成に失敗しました";
+        }
+    }
+
+    /* コマンドを順に実行し、出力は capture_chunk() が g_job_fd へ転送する */
+    int result = 0;
+    if (!error) {
+        g_job_fd = client;
+        for (int i = 0; i < count; i++) {
+            char command_id[128];
+            capture_t out = {0}, err = {0};
+            int exit_code = 0;
+            if (!run_command(pl, shell_id, commands[i], command_id, sizeof(command_id), true) ||
+                !get_command_output(pl, shell_id, command_id, &out, &err, &exit_code,
+                                    i == count - 1, NULL)) {
+                error = "コマンドの実行に失敗しました";
+                break;
+            }
+            frame_write_int(client, 'X', exit_code);
+            if (exit_code != 0 && result == 0) result = exit_code;
+            if (exit_code != 0 && stop_on_error) break;
+        }
+        g_job_fd = -1;
+    }
+
+    /* 結果を返してからシェルを削除（クライアントは削除を待たない） */
+    if (error) {
+        frame_write(client, 'F', error, strlen(error));
+    } else {
+        frame_write_int(client, 'D', result);
+    }
+    close(client);
+    if (shell_id[0]) {
+        delete_shell(pl, shell_id);
+        pipeline_close(pl);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(commands[i]);
+    }
+    free(commands);
+    return error ? 1 : 0;
+}
+
+/*
+ * daemon_peek_type - 接続の最初のフレームの種類を覗き見る（待たない）
+ *
+ * クライアントは接続直後に最初のフレームを送る。状態の問い合わせ（'S'）かジョブかを
+ * 先頭1バイトで判別し、ジョブであれば読まずに子プロセスへ渡す。待ち受けのループが
+ * 接続の読み込み可能を poll() で確認してから呼ぶ。
+ *
+ * @return: フレームの種類。まだ届いていなければ-1、切断・エラーは0
+ */
+static int daemon_peek_type(int client) {
+    unsigned char type;
+    ssize_t n = recv(client, &type, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 1) return type;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -1 : 0;
+}
+
+/*
+ * warm_notify - 制御用ソケットで通知を送る
+ *
+ * @fd: 添付する接続（SCM_RIGHTS。-1: なし）
+ */
+static bool warm_notify(int ctl, char type, int fd) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { .iov_base = &type, .iov_len = 1 };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(ctl, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/*
+ * warm_receive - 制御用ソケットから通知を1つ受け取る
+ *
+ * @fd:     添付されていた接続（なければ-1）
+ * @flags:  MSG_DONTWAIT なら届いていなくても待たない
+ * @return: 通知の種類。相手が閉じた・エラーは0、まだ届いていなければ-1
+ */
+static int warm_receive(int ctl, int *fd, int flags) {
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char type;
+    struct iovec iov = { .iov_base = &type, .iov_len = 1 };
+    struct msghdr msg;
+
+    *fd = -1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(ctl, &msg, flags | MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return -1;
+    }
+    if (n != 1) {
+        return 0;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    return (unsigned char)type;
+}
+
+/*
+ * warm_holder_job - 渡されたジョブを実行（待機シェルを保持していた子プロセス）
+ *
+ * @ws: 使用するシェル（NULL: シェルを作成してから実行）
+ */
+static int warm_holder_job(int client, warm_shell_t *ws) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    return daemon_run_job(client, ws);
+}
+
+/*
+ * warm_holder_run - 待機シェルを1つ保持する（子プロセス）
+ *
+ * シェルを作成して親プロセスへ WARM_READY を通知し、ジョブが渡されるまで待つ。
+ * 生存確認・作り直しの時刻になれば WARM_BUSY を通知してから行う（行き違いで届いた
+ * ジョブも実行する）。シェルを作り直す・失われた場合は親プロセスの WARM_QUIT を
+ * 待って終了し、親プロセスが新しい子プロセスで補充する。
+ *
+ * @ctl:    親プロセスとの制御用ソケット
+ * @return: プロセスの終了コード
+ */
+static int warm_holder_run(int ctl) {
+    warm_shell_t ws;
+    int client, type;
+
+    memset(&ws, 0, sizeof(ws));
+    if (!warm_shell_create(&ws)) {
+        warm_notify(ctl, WARM_FAILED, -1);
+        return 1;
+    }
+    warm_notify(ctl, WARM_READY, -1);
+
+    for (;;) {
+        uint64_t due = ws.checked_ms + (uint64_t)g_daemon_keepalive * 1000;
+        bool aged = false;
+        if (g_daemon_shell_max_age > 0 &&
+            ws.created_ms + (uint64_t)g_daemon_shell_max_age * 1000 <= due) {
+            due = ws.created_ms + (uint64_t)g_daemon_shell_max_age * 1000;
+            aged = true;
+        }
+
+        /* ジョブ・終了の指示を次の保守時刻まで待つ（長い待ちは分けて待つ） */
+        uint64_t now = now_ms();
+        struct pollfd pfd = { .fd = ctl, .events = POLLIN };
+        int ret = poll(&pfd, 1, due <= now ? 0 : due - now < 60000 ? (int)(due - now) : 60000);
+        if (ret != 0) {
+            if (ret < 0 && errno == EINTR) continue;
+            type = warm_receive(ctl, &client, 0);
+            if (type == WARM_JOB) return warm_holder_job(client, &ws);
+            warm_shell_discard(&ws, true);      /* WARM_QUIT または親プロセスの終了 */
+            return 0;
+        }
+        if (now_ms() < due) continue;
+
+        /* 保守の間はジョブを割り当てないよう通知（既に届いていたジョブは今のシェルで実行） */
+        warm_notify(ctl, WARM_BUSY, -1);
+        type = warm_receive(ctl, &client, MSG_DONTWAIT);
+        if (type == WARM_JOB) return warm_holder_job(client, &ws);
+        if (type >= 0) {
+            warm_shell_discard(&ws, true);
+            return 0;
+        }
+
+        char reason;
+        if (aged) {
+            warm_shell_discard(&ws, true);
+            reason = WARM_AGED;
+        } else if (warm_shell_alive(&ws)) {
+            ws.checked_ms = now_ms();
+            warm_notify(ctl, WARM_READY, -1);
+            continue;
+        } else {
+            warm_shell_discard(&ws, false);
+            reason = WARM_LOST;
+        }
+
+        /* 親プロセスの応答を待って終了（それまでに届いたジョブはシェルを作成して実行） */
+        warm_notify(ctl, reason, -1);
+        if (warm_receive(ctl, &client, 0) == WARM_JOB) return warm_holder_job(client, NULL);
+        return 0;
+    }
+}
+
+/*
+ * daemon_close_inherited - 子プロセスが親プロセスから引き継いだ待ち受け・制御用ソケットと
+ *                          振り分け前の接続を閉じる
+ *
+ * 他の待機シェルの制御用ソケットを子プロセスが持ち続けると、親プロセスの終了が
+ * その待機シェルの子プロセスに伝わらなくなる。
+ */
+static void daemon_close_inherited(int listener, const warm_slot_t *slots, int count) {
+    close(listener);
+    for (int i = 0; i < count; i++) {
+        if (slots[i].pid > 0) close(slots[i].ctl);
+    }
+    for (int i = 0; i < g_daemon_pending_count; i++) {
+        close(g_daemon_pending[i].fd);
+    }
+}
+
+/*
+ * warm_slot_spawn - 待機シェルを保持する子プロセスを起動（シェルの作成は待たない）
+ */
+static void warm_slot_spawn(warm_slot_t *slot, int listener, const warm_slot_t *slots, int count) {
+    int pair[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        log_error("待機シェルの制御用ソケットを作成できません");
+        slot->retry_ms = now_ms() + (uint64_t)g_daemon_keepalive * 1000;
+        return;
+    }
+    pid_t pid = fork_sender();
+    if (pid == 0) {
+        /* 終了は親プロセスの指示で行い、サーバー側のシェルを削除する */
+        signal(SIGTERM, SIG_IGN);
+        signal(SIGINT, SIG_IGN);
+        close(pair[0]);
+        daemon_close_inherited(listener, slots, count);
+        fork_exit(warm_holder_run(pair[1]));
+    }
+    close(pair[1]);
+    if (pid < 0) {
+        close(pair[0]);
+        log_error("待機シェルの子プロセスを作成できません");
+        slot->retry_ms = now_ms() + (uint64_t)g_daemon_keepalive * 1000;
+        return;
+    }
+    slot->pid = pid;
+    slot->ctl = pair[0];
+    slot->ready = false;
+    slot->created = false;
+}
+
+/*
+ * warm_slot_release - 枠を空ける（子プロセスは終了済み、またはジョブを渡した後）
+ *
+ * @quit: 子プロセスへ WARM_QUIT を送る（シェルを削除して終了させる）
+ */
+static void warm_slot_release(warm_slot_t *slot, bool quit) {
+    if (quit) {
+        warm_notify(slot->ctl, WARM_QUIT, -1);
+    }
+    close(slot->ctl);
+    slot->pid = 0;
+    slot->ready = false;
+}
+
+/*
+ * warm_slot_read - 待機シェルの子プロセスからの通知を処理
+ */
+static void warm_slot_read(warm_slot_t *slot) {
+    int type, fd;
+
+    while ((type = warm_receive(slot->ctl, &fd, MSG_DONTWAIT)) > 0) {
+        if (fd >= 0) close(fd);
+        if (type == WARM_READY) {
+            slot->ready = true;
+            if (!slot->created) g_arrivals.created++;
+            slot->created = true;
+        } else if (type == WARM_BUSY) {
+            slot->ready = false;
+        } else if (type == WARM_FAILED) {
+            slot->retry_ms = now_ms() + (uint64_t)g_daemon_keepalive * 1000;
+            warm_slot_release(slot, false);
+            return;
+        } else if (type == WARM_AGED) {
+            log_info("作成から一定時間経過したシェルを作り直します");
+            warm_slot_release(slot, true);
+            return;
+        } else if (type == WARM_LOST) {
+            log_warn("待機中のシェルが使えなくなったため作り直します");
+            warm_slot_release(slot, true);
+            return;
+        }
+    }
+    if (type == 0) {
+        warm_slot_release(slot, false);         /* 子プロセスが終了した */
+    }
+}
+
+/*
+ * daemon_maintain - 待機シェルの数を目標に合わせる（補充・削除）
+ *
+ * 子プロセスの起動と終了の指示だけを行い、ネットワークは待たない。
+ *
+ * @target: 保持する待機シェルの数（slots[0]〜slots[target - 1] を使用）
+ */
+static void daemon_maintain(int listener, warm_slot_t *slots, int count, int target) {
+    uint64_t now = now_ms();
+
+    /* ジョブが来ない間は待機シェルを削除 */
+    for (int i = target; i < count; i++) {
+        if (slots[i].pid > 0) {
+            if (slots[i].ready) g_arrivals.idle_deleted++;
+            warm_slot_release(&slots[i], true);
+        }
+    }
+    for (int i = 0; i < target; i++) {
+        if (slots[i].pid == 0 && now >= slots[i].retry_ms) {
+            warm_slot_spawn(&slots[i], listener, slots, count);
+        }
+    }
+}
+
+/*
+ * daemon_format_status - 待機シェルとジョブの状況をテキストにする
+ */
+static void daemon_format_status(char *text, size_t size, const warm_slot_t *slots, int target) {
+    time_t now = time(NULL);
+    int ready = 0, creating = 0;
+    for (int i = 0; i < g_daemon_shells; i++) {
+        if (slots[i].ready) ready++;
+        else if (slots[i].pid > 0 && !slots[i].created) creating++;
+    }
+    unsigned long jobs = g_arrivals.hits + g_arrivals.misses;
+
+    snprintf(text, size,
+             "待機シェル: %d（作成中: %d、目標: %d / 上限: %d）\n"
+             "ジョブ: %lu（ヒット: %lu / ミス: %lu、ヒット率: %.1f%%）\n"
+             "最後のジョブ（または起動）から: %ld 秒\n"
+             "%d 秒以内の到着見込み: %s\n"
+             "シェル作成: %lu / アイドル削除: %lu\n",
+             ready, creating, target, g_daemon_shells,
+             jobs, g_arrivals.hits, g_arrivals.misses,
+             jobs ? 100.0 * g_arrivals.hits / jobs : 0.0,
+             (long)(now - g_arrivals.last_arrival),
+             g_daemon_prewarm_lead, arrivals_expected(now, g_daemon_prewarm_lead) ? "あり" : "なし",
+             g_arrivals.created, g_arrivals.idle_deleted);
+}
+
+/*
+ * daemon_start_job - 待機シェルがないジョブを子プロセスで実行（シェルを作成してから実行）
+ */
+static void daemon_start_job(int listener, const warm_slot_t *slots, int count, int client) {
+    pid_t pid = fork_sender();
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        daemon_close_inherited(listener, slots, count);
+        fork_exit(daemon_run_job(client, NULL));
+    }
+    close(client);
+    if (pid < 0) {
+        log_error("ジョブの子プロセスを作成できません");
+    }
+}
+
+/*
+ * daemon_dispatch_job - ジョブの接続を待機シェルの子プロセスへ渡す（なければシェルを作成して実行）
+ */
+static void daemon_dispatch_job(int listener, warm_slot_t *slots, int count, int client) {
+    warm_slot_t *slot = NULL;
+    for (int i = 0; i < count && !slot; i++) {
+        if (slots[i].ready) slot = &slots[i];
+    }
+    arrivals_record(time(NULL));
+    if (slot) {
+        /* 接続を待機シェルの子プロセスへ渡し、そのシェルで実行させる（枠は次の周回で補充） */
+        bool handed = warm_notify(slot->ctl, WARM_JOB, client);
+        warm_slot_release(slot, false);
+        if (handed) {
+            close(client);
+            g_arrivals.hits++;
+            return;
+        }
+    }
+    g_arrivals.misses++;
+    daemon_start_job(listener, slots, count, client);
+}
+
+/*
+ * daemon_serve - 常駐モード: シェルを保持してジョブを待ち受ける（終了シグナルまで戻らない）
+ *
+ * @return: プロセスの終了コード
+ */
+static int daemon_serve(void) {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char msg[320];
+    struct stat st;
+
+    if (!daemon_socket_path(path, sizeof(path))) {
+        return 1;
+    }
+
+    /* 既に起動中でなければ、前回残ったソケットファイルを削除 */
+    int probe = daemon_connect(path);
+    if (probe >= 0) {
+        close(probe);
+        snprintf(msg, sizeof(msg), "常駐プロセスは既に起動しています: %s", path);
+        log_error(msg);
+        return 1;
+    }
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+            snprintf(msg, sizeof(msg), "ソケットのパスに別のファイルがあります: %s", path);
+            log_error(msg);
+            return 1;
+        }
+        unlink(path);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    mode_t old_mask = umask(077);
+    bool listening = listener >= 0 &&
+                     bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+                     listen(listener, 128) == 0;
+    umask(old_mask);
+    if (!listening) {
+        snprintf(msg, sizeof(msg), "ソケットで待ち受けできません: %s (%s)", path, strerror(errno));
+        log_error(msg);
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_on_signal;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    warm_slot_t *slots = calloc(g_daemon_shells > 0 ? g_daemon_shells : 1, sizeof(warm_slot_t));
+    struct pollfd *pfds = calloc(1 + g_daemon_shells + DAEMON_PENDING_MAX, sizeof(struct pollfd));
+    if (!slots || !pfds) {
+        free(slots);
+        free(pfds);
+        log_error("メモリ確保に失敗しました");
+        close(listener);
+        unlink(path);
+        return 1;
+    }
+
+    snprintf(msg, sizeof(msg), "常駐モードで待ち受け中: %s（待機シェル: %d）", path, g_daemon_shells);
+    log_success(msg);
+
+    /* 起動直後はジョブが来る前提でシェルを用意する（以後は到着状況に従う） */
+    memset(&g_arrivals, 0, sizeof(g_arrivals));
+    g_arrivals.last_arrival = time(NULL);
+    int target = g_daemon_shells;
+
+    while (!g_daemon_stop) {
+        /* 終了したジョブを回収 */
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+
+        time_t now = time(NULL);
+        int next_target = daemon_target_shells(now);
+        if (next_target < target) {
+            log_info("ジョブがないため待機シェルを削除します");
+        } else if (next_target > target) {
+            log_info(now - g_arrivals.last_arrival < g_daemon_idle_timeout
+                     ? "ジョブが到着したため待機シェルを用意します"
+                     : "ジョブの到着が見込まれるため待機シェルを事前に用意します");
+        }
+        target = next_target;
+
+        /* 待機シェルの補充・削除は子プロセスが行うため、待ち受けは止まらない */
+        daemon_maintain(listener, slots, g_daemon_shells, target);
+
+        /* 待ち受け・子プロセスからの通知・最初のフレームを待つ接続をまとめて待つ */
+        int pending = g_daemon_pending_count, base = 1 + g_daemon_shells;
+        pfds[0].fd = listener;
+        pfds[0].events = pending < DAEMON_PENDING_MAX ? POLLIN : 0;
+        for (int i = 0; i < g_daemon_shells; i++) {
+            pfds[i + 1].fd = slots[i].pid > 0 ? slots[i].ctl : -1;
+            pfds[i + 1].events = POLLIN;
+        }
+        for (int i = 0; i < pending; i++) {
+            pfds[base + i].fd = g_daemon_pending[i].fd;
+            pfds[base + i].events = POLLIN;
+        }
+        if (poll(pfds, base + pending, 1000) < 0) {
+            continue;
+        }
+        for (int i = 0; i < g_daemon_shells; i++) {
+            if (pfds[i + 1].fd >= 0 && pfds[i + 1].revents && slots[i].pid > 0) {
+                warm_slot_read(&slots[i]);
+            }
+        }
+
+        /* 最初のフレームが届いた接続を振り分ける（後ろから処理し、空いた所へ末尾を詰める） */
+        uint64_t now_msec = now_ms();
+        for (int i = pending - 1; i >= 0; i--) {
+            int client = g_daemon_pending[i].fd;
+            int type = pfds[base + i].revents ? daemon_peek_type(client) : -1;
+            if (type < 0 &&
+                now_msec - g_daemon_pending[i].accepted_ms < (uint64_t)DAEMON_PENDING_TIMEOUT * 1000) {
+                continue;
+            }
+            g_daemon_pending[i] = g_daemon_pending[--g_daemon_pending_count];
+            if (type == 'S') {
+                char text[1024];
+                daemon_format_status(text, sizeof(text), slots, target);
+                frame_write(client, 'S', text, strlen(text));
+                close(client);
+            } else if (type > 0) {
+                daemon_dispatch_job(listener, slots, g_daemon_shells, client);
+            } else {
+                close(client);          /* 切断された・最初のフレームが届かない */
+            }
+        }
+
+        /* 新しい接続は最初のフレームが届くまで保留する（ここでは待たない） */
+        while ((pfds[0].revents & POLLIN) && g_daemon_pending_count < DAEMON_PENDING_MAX) {
+            int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (client < 0) {
+                break;
+            }
+            struct ucred cred;
+            socklen_t cred_len = sizeof(cred);
+            if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+                cred.uid != getuid()) {
+                close(client);
+                continue;
+            }
+            g_daemon_pending[g_daemon_pending_count].fd = client;
+            g_daemon_pending[g_daemon_pending_count].accepted_ms = now_msec;
+            g_daemon_pending_count++;
+        }
+    }
+
+    char text[1024];
+    daemon_format_status(text, sizeof(text), slots, target);
+    log_info("常駐モードを終了します...");
+    fprintf(stderr, "%s", text);
+    close(listener);
+    unlink(path);
+    for (int i = 0; i < g_daemon_pending_count; i++) {
+        close(g_daemon_pending[i].fd);
+    }
+    g_daemon_pending_count = 0;
+
+    /* 待機シェルの子プロセスにシェルを削除させ、終了を待つ（削除は並行して行われる）。
+     * 作成中の子プロセスは待たない（作成を終えたところで指示を読み、削除して終了する） */
+    for (int i = 0; i < g_daemon_shells; i++) {
+        if (slots[i].pid > 0) warm_notify(slots[i].ctl, WARM_QUIT, -1);
+    }
+    for (int i = 0; i < g_daemon_shells; i++) {
+        if (slots[i].pid > 0) {
+            if (slots[i].ready) waitpid(slots[i].pid, NULL, 0);
+            warm_slot_release(&slots[i], false);
+        }
+    }
+    free(pfds);
+    free(slots);
+    pool_shutdown();
+    log_success("常駐モードを終了しました");
+    return 0;
+}
+
+/*
+ * daemon_status - 常駐プロセスの状態（待機シェル数・ヒット/ミス数）を表示
+ *
+ * @return: プロセスの終了コード
+ */
+static int daemon_status(void) {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char msg[320];
+
+    if (!daemon_socket_path(path, sizeof(path))) {
+        return 1;
+    }
+    int fd = daemon_connect(path);
+    if (fd < 0) {
+        snprintf(msg, sizeof(msg), "常駐プロセスは起動していません: %s", path);
+        log_error(msg);
+        return 1;
+    }
+
+    struct timeval tv = { .tv_sec = 10, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    buf_t payload = {0};
+    char type = 0;
+    bool ok = frame_write(fd, 'S', NULL, 0) && frame_read(fd, &type, &payload) && type == 'S';
+    close(fd);
+    if (!ok) {
+        buf_free(&payload);
+        log_error("常駐プロセスの状態を取得できませんでした");
+        return 1;
+    }
+
+    snprintf(msg, sizeof(msg), "常駐プロセス: %s", path);
+    log_info(msg);
+    printf("%s", payload.data);
+    buf_free(&payload);
+    return 0;
+}
 
-    log_info("コマンド実行中...");
+/*
+ * daemon_submit - 常駐プロセスへジョブを渡し、結果を受け取って表示
+ *
+ * @commands: 実行するコマンドライン（同じシェルで順に実行）
+ * @count:    コマンド数
+ * @return:   最初に失敗したコマンドの終了コード（すべて成功なら0、エラー時-1）、
+ *            常駐プロセスに接続できなければ DAEMON_UNAVAILABLE
+ *
+ * 出力は受信しだい g_stream_fd（既定: stdout→標準出力、stderr→標準エラー出力）へ書き出す。
+ */
+static int daemon_submit(const char *const *commands, int count) {
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char msg[320];
 
-    if (!send_soap_request(envelope, response, sizeof(response))) {
-        log_error("コマンド実行に失敗しました");
+    if (!daemon_socket_path(path, sizeof(path))) {
+        return DAEMON_UNAVAILABLE;
+    }
+    int fd = daemon_connect(path);
+    if (fd < 0) {
+        return DAEMON_UNAVAILABLE;
+    }
+    snprintf(msg, sizeof(msg), "常駐プロセス経由で実行: %s", path);
+    log_info(msg);
+
+    /* ジョブ送信 */
+    char identity[1024];
+    uint8_t flags = g_stop_on_error ? 1 : 0;
+    daemon_identity(identity, sizeof(identity));
+    bool ok = frame_write(fd, 'H', identity, strlen(identity));
+    for (int i = 0; ok && i < count; i++) {
+        ok = frame_write(fd, 'C', commands[i], strlen(commands[i]));
+    }
+    ok = ok && frame_write(fd, 'R', &flags, 1);
+    if (!ok) {
+        close(fd);
+        log_error("常駐プロセスへのジョブ送信に失敗しました");
+        return -1;
+    }
+
+    /* 結果受信（各コマンドは最大 TIMEOUT 秒で完了する） */
+    struct timeval tv = { .tv_sec = TIMEOUT + 60, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    fflush(stdout);
+
+    buf_t payload = {0};
+    char type;
+    int result = 0, index = 0;
+    bool finished = false, completed = false;
+    while (!finished && frame_read(fd, &type, &payload)) {
+        switch (type) {
+        case 'O':
+        case 'E':
+            write_all(g_stream_fd[type == 'E'], payload.data, payload.len);
+            break;
+        case 'X':
+            index++;
+            if (count > 1) {
+                snprintf(msg, sizeof(msg), "[%d/%d] 終了コード: %d  %.200s",
+                         index, count, frame_int(&payload), commands[index - 1]);
+                log_info(msg);
+            }
+            break;
+        case 'F':
+            snprintf(msg, sizeof(msg), "常駐プロセス: %s", payload.data);
+            log_error(msg);
+            finished = true;
+            break;
+        case 'D':
+            result = frame_int(&payload);
+            finished = completed = true;
+            break;
+        default:
+            break;
+        }
+    }
+    buf_free(&payload);
+    close(fd);
+    if (!finished) {
+        log_error("常駐プロセスとの接続が切断されました");
+    }
+    if (!completed) {
+        log_error("処理を中断します");
+        return -1;
+    }
+
+    printf("\n終了コード: %d\n", result);
+    fflush(stdout);
+    if (result == 0) {
+        log_success("完了");
+    } else {
+        snprintf(msg, sizeof(msg), "コマンドが失敗しました (終了コード: %d)", result);
+        log_error(msg);
+    }
+    return result;
+}
+
+/* ============================================================================
+ * ファンアウト実行（複数ホストへの並列実行）
+ * ============================================================================
+ *
+ * 同じバッチを複数のWindowsサーバーで同時に実行する。
+ * 1プロセス・1スレッドのepollイベントループが、ホストごとのWinRMセッションを
+ * 「再開可能な状態機械」として並行に進める（後述の winrm_session_t）。
+ *
+ * - 同時実行数は --parallel / WINRM_PARALLEL で制限
+ * - ホストが完了するたびに、その出力を行ごとに [ホスト] を付けて表示
+ * - 全ホスト完了後、ホスト別の終了コードと集計結果を表示
+ *
+ * ブロッキングI/O + プロセス/スレッドでは、ホストごとに64KBバッファを複数
+ * 抱えたスタックが必要になり、数百台規模では破綻する。イベントループでは
+ * 常駐メモリはホストあたり約7KB（winrm_session_t と fanout_host_t。実行待ちの
+ * ホストの分も開始時にまとめて確保する）+ 実行中のセッションの受信中データのみで、
+ * 500台でも4MB程度で扱える。全体の所要時間は「最も遅いホスト」程度になる。
+ * ============================================================================ */
+
+typedef struct {
+    char host[256];              /* 接続先ホスト */
+    int port;                    /* 接続先ポート */
+    char label[264];             /* 表示名（HOST または HOST:PORT） */
+    int exit_code;               /* リモートの終了コード（切り詰めずにそのまま保持） */
+    bool error;                  /* 接続・プロトコルエラーで終了したか */
+    bool done;                   /* 完了したか */
+    int commands_run;            /* 完了したコマンド数（--script時） */
+    uint64_t start_ms;           /* 開始時刻 */
+    uint64_t elapsed_ms;         /* 所要時間 */
+} fanout_host_t;
+
+/*
+ * fanout_add_host - ホスト一覧に1件追加（"HOST" または "HOST:PORT"）
+ */
+static bool fanout_add_host(fanout_host_t **hosts, int *count, const char *spec) {
+    /* 前後の空白を除去 */
+    while (*spec == ' ' || *spec == '\t') spec++;
+    size_t len = strlen(spec);
+    while (len > 0 && (spec[len - 1] == ' ' || spec[len - 1] == '\t' ||
+                       spec[len - 1] == '\r' || spec[len - 1] == '\n')) {
+        len--;
+    }
+    if (len == 0) return true;
+    if (len >= sizeof((*hosts)->host)) {
+        log_error("ホスト名が長すぎます");
         return false;
     }
 
-    if (!extract_xml_value(response, "rsp:CommandId", command_id, command_id_size)) {
-        log_error("CommandIDの取得に失敗しました");
+    fanout_host_t *grown = realloc(*hosts, sizeof(fanout_host_t) * (*count + 1));
+    if (!grown) {
+        log_error("メモリ確保に失敗しました");
+        return false;
+    }
+    *hosts = grown;
+
+    fanout_host_t *h = &(*hosts)[*count];
+    memset(h, 0, sizeof(*h));
+    memcpy(h->host, spec, len);
+    h->host[len] = '\0';
+    memcpy(h->label, spec, len);
+    h->label[len] = '\0';
+    h->port = g_port;
+
+    char *colon = strrchr(h->host, ':');
+    if (colon) {
+        *colon = '\0';
+        h->port = atoi(colon + 1);
+        if (h->port <= 0 || h->port > 65535) {
+            char msg[320];
+            snprintf(msg, sizeof(msg), "無効なポート番号: %.*s", (int)len, spec);
+            log_error(msg);
+            return false;
+        }
+    }
+
+    (*count)++;
+    return true;
+}
+
+/*
+ * fanout_parse_list - カンマ区切りのホスト一覧を解析
+ */
+static bool fanout_parse_list(fanout_host_t **hosts, int *count, const char *list) {
+    char *copy = strdup(list);
+    if (!copy) return false;
+
+    bool ok = true;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok && ok;
+         tok = strtok_r(NULL, ",", &saveptr)) {
+        ok = fanout_add_host(hosts, count, tok);
+    }
+    free(copy);
+    return ok;
+}
+
+/*
+ * fanout_load_file - ホスト一覧ファイルを読み込み（1行1ホスト、#以降はコメント）
+ */
+static bool fanout_load_file(fanout_host_t **hosts, int *count, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        char msg[600];
+        snprintf(msg, sizeof(msg), "ホスト一覧ファイルを開けません: %s", path);
+        log_error(msg);
         return false;
     }
 
-    char msg[256];
-    snprintf(msg, sizeof(msg), "コマンド実行開始: %s", command_id);
-    log_success(msg);
+    char line[512];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp)) {
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        ok = fanout_add_host(hosts, count, line);
+    }
+    fclose(fp);
+    return ok;
+}
+
+/*
+ * fanout_print_output - ホストの出力を行ごとに [ホスト] 付きで書き出す
+ *
+ * @fd:     書き出し先
+ * @label:  表示名
+ * @tag:    行頭に付ける追加の見出し（NULL可）
+ * @data:   出力データ
+ * @len:    データ長
+ */
+static void fanout_print_output(int fd, const char *label, const char *tag,
+                                const char *data, size_t len) {
+    buf_t line = {0};
+    size_t start = 0;
+
+    while (start < len) {
+        const char *nl = memchr(data + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - data) : len;
+        size_t line_len = end - start;
+        if (line_len > 0 && data[start + line_len - 1] == '\r') line_len--;
+
+        line.len = 0;
+        buf_append(&line, "[", 1);
+        buf_append(&line, label, strlen(label));
+        buf_append(&line, "] ", 2);
+        if (tag) buf_append(&line, tag, strlen(tag));
+        buf_append(&line, data + start, line_len);
+        buf_append(&line, "\n", 1);
+        write_all(fd, line.data, line.len);
+        start = end + 1;
+    }
+    buf_free(&line);
+}
+
+/*
+ * line_writer_t - チャンク単位で届く出力を行に組み立てて [ホスト] 付きで書き出す
+ *
+ * 改行までそろった行だけを fanout_print_output() に渡し、行の途中は pending に残す。
+ * チャンクの区切りが行の途中にあっても、1行が複数の [ホスト] 行に割れない。
+ */
+typedef struct {
+    int fd;           /* 書き出し先 */
+    const char *label;
+    const char *tag;  /* 行頭の追加見出し（NULL可） */
+    buf_t pending;    /* 改行で終わっていない行 */
+} line_writer_t;
+
+static void line_writer_feed(line_writer_t *w, const char *data, size_t len) {
+    /* 新しいデータ内だけを探す（長い行が続いても全体を再走査しない） */
+    const char *last_nl = memrchr(data, '\n', len);
+    if (!last_nl) {
+        buf_append(&w->pending, data, len);
+        return;
+    }
+    size_t head = last_nl - data + 1;
+    if (w->pending.len > 0) {
+        buf_append(&w->pending, data, head);
+        fanout_print_output(w->fd, w->label, w->tag, w->pending.data, w->pending.len);
+        buf_clear(&w->pending);
+    } else {
+        fanout_print_output(w->fd, w->label, w->tag, data, head);
+    }
+    buf_append(&w->pending, data + head, len - head);
+}
+
+/* line_writer_sink - capture_replay用 */
+static void line_writer_sink(const char *data, size_t len, void *ctx) {
+    line_writer_feed(ctx, data, len);
+}
+
+/* line_writer_flush - 改行で終わっていない残りを書き出して解放 */
+static void line_writer_flush(line_writer_t *w) {
+    fanout_print_output(w->fd, w->label, w->tag, w->pending.data, w->pending.len);
+    buf_free(&w->pending);
+}
+
+/* ============================================================================
+ * タイマーホイール
+ * ============================================================================
+ *
+ * 接続・送信・受信の期限を管理する（ハッシュ型タイマーホイール）。
+ * ソケットオプション（SO_RCVTIMEO等）の代わりに使用し、
+ * 追加・削除はO(1)、1ティックごとに1スロットだけを走査する。
+ * スロット数 × ティック幅より先の期限は、同じスロットに入れて周回ごとに判定する。
+ * ============================================================================ */
+
+typedef struct timer_node {
+    struct timer_node *next;
+    struct timer_node **pprev;   /* 前ノードのnext（またはスロット先頭）へのポインタ */
+    uint64_t expires_tick;       /* 期限（ティック番号） */
+    void *owner;                 /* 期限切れ時に渡すセッション */
+} timer_node_t;
+
+typedef struct {
+    timer_node_t *slots[WHEEL_SLOTS];
+    uint64_t tick;               /* 処理済みのティック番号 */
+} timer_wheel_t;
+
+static void wheel_init(timer_wheel_t *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->tick = now / WHEEL_TICK_MS;
+}
+
+static void wheel_del(timer_node_t *node) {
+    if (!node->pprev) return;
+    *node->pprev = node->next;
+    if (node->next) node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+/*
+ * wheel_add - タイマーを登録（登録済みなら付け替え）
+ *
+ * @expires_ms: 期限（now_ms()基準）
+ */
+static void wheel_add(timer_wheel_t *w, timer_node_t *node, uint64_t expires_ms) {
+    wheel_del(node);
+    uint64_t tick = (expires_ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    if (tick <= w->tick) tick = w->tick + 1;
+    node->expires_tick = tick;
+
+    timer_node_t **head = &w->slots[tick % WHEEL_SLOTS];
+    node->next = *head;
+    node->pprev = head;
+    if (*head) (*head)->pprev = &node->next;
+    *head = node;
+}
+
+/*
+ * wheel_advance - 現在時刻までティックを進め、期限切れのタイマーを処理
+ */
+static void wheel_advance(timer_wheel_t *w, uint64_t now, void (*expire)(void *owner)) {
+    uint64_t target = now / WHEEL_TICK_MS;
+    while (w->tick < target) {
+        w->tick++;
+        timer_node_t *node = w->slots[w->tick % WHEEL_SLOTS];
+        while (node) {
+            timer_node_t *next = node->next;
+            if (node->expires_tick <= w->tick) {
+                wheel_del(node);
+                expire(node->owner);
+            }
+            node = next;
+        }
+    }
+}
+
+/* ============================================================================
+ * イベントループ実行エンジン（epoll）
+ * ============================================================================
+ *
+ * 1ホスト分のWinRMセッションを、以下のステップを順に進める状態機械として表現する。
+ *
+ *   接続 → NTLM Type 1 → Type 3 → Create →
+ *     { Command → Receive（完了まで繰り返し）}（--script時はコマンドごとに繰り返し）→ Delete
+ *
+ * 各ステップは「リクエストを送信 → レスポンス全体を受信 → 次のステップを決定」の
+ * 単位で、ソケットが書き込み/読み込み可能になるたびにepollから再開される。
+ * ブロッキング版（conn_authenticate / soap_pipeline_t）と同じ規則で動作する:
+ * - 直接NTLMでチャレンジが返らなければSPNEGOで接続し直す
+ * - SOAPリクエストが応答なしで切断された・401の場合は、再認証して1回だけ再送
+ * - Connection: close の応答後は、次のリクエストで接続・認証し直す
+ * - Commandには最初のReceiveを続けてパイプライン送信し（CommandIdはクライアントで割り当て）、
+ *   次のReceive・Deleteは受信した出力をデコードする前に送信する
+ * ============================================================================ */
+
+typedef enum {
+    STEP_AUTH_NEGOTIATE,   /* Type 1送信 → Type 2（401）待ち */
+    STEP_AUTH_COMPLETE,    /* Type 3送信 → 200待ち */
+    STEP_CREATE,           /* シェル作成 */
+    STEP_COMMAND,          /* コマンド実行 */
+    STEP_RECEIVE,          /* 出力取得 */
+    STEP_DELETE            /* シェル削除 */
+} sess_step_t;
+
+typedef enum {
+    IO_IDLE,               /* ソケットなし（未開始・完了） */
+    IO_CONNECTING,         /* 非ブロッキングconnect中 */
+    IO_SENDING,            /* リクエスト送信中 */
+    IO_RECEIVING           /* レスポンス受信中 */
+} sess_io_t;
+
+struct winrm_engine;
+
+typedef struct {
+    struct winrm_engine *engine;
+    fanout_host_t *target;       /* 対象ホスト（結果の書き込み先） */
+    const char *const *commands; /* 実行するコマンドライン（同じシェルで順に実行） */
+    int command_count;
+    int command_index;           /* 実行中のコマンド */
+    uint32_t index;              /* engine->sessions内の位置 */
+    uint32_t gen;                /* ソケットの世代（古いイベントの識別用） */
+    struct sockaddr_in addr;
+    bool resolved;               /* addr を解決できたか（engine_run() の開始前に解決） */
+    int sock;
+    sess_step_t step;            /* 送信中のリクエストの種類 */
+    sess_io_t io;
+    bool use_spnego;
+    bool authenticated;
+    bool retried;                /* 切断・401による再送を行ったか */
+    bool mech_switched;          /* 認証方式を切り替えて再接続したか */
+    bool failed;                 /* エラーで終了するか（Delete後に接続エラー扱い） */
+    ntlm_session_t ntlm;
+    uint8_t type1[64];           /* MIC計算用に保持するType 1 */
+    size_t type1_len;
+    char url[MAX_URL_SIZE];      /* a:To に入れるURL */
+    soap_message_t soap;         /* 送信するSOAP（再送に備えて応答まで保持） */
+    sess_step_t soap_step;
+    soap_message_t soap_next;    /* soapに続けてパイプライン送信するReceive（応答待ちの2件目） */
+    bool stale_receive;          /* 先行送信したReceiveが無効（サーバーが別のCommandIdを割り当てた） */
+    char *tx;                    /* 送信中の認証リクエスト */
+    sealed_request_t sealed[2];  /* 送信中のSOAP（soap と soap_next を暗号化したもの） */
+    struct iovec tx_iov[SEALED_REQUEST_IOV * 2];  /* 送信する断片の並び */
+    int tx_iovcnt, tx_iovpos;    /* 断片の数・未送信の最初の断片 */
+    http_parser_t http;          /* 受信中のレスポンスのパーサ */
+    ntlm_unseal_t unseal;        /* 暗号化レスポンスの復号状態 */
+    buf_t rx;                    /* 受信中のレスポンス本文（復号済み） */
+    receive_parser_t receive;    /* 受信中のReceiveレスポンスの逐次解析 */
+    buf_t ahead;                 /* 受信済みで未処理のバイト（パイプライン送信した次の応答の先頭） */
+    bool rx_eof;                 /* レスポンス受信後にサーバーが接続を閉じたか */
+    char shell_id[128];
+    char command_id[128];
+    capture_t out[2];            /* 蓄積した出力（[0]: stdout, [1]: stderr） */
+    line_writer_t line[2];       /* --stream時の行組み立て */
+    bool capture_failed;         /* 出力の蓄積に失敗したか */
+    int exit_code;
+    uint64_t command_start_ms;
+    timer_node_t timer;
+} winrm_session_t;
+
+typedef struct winrm_engine {
+    int epfd;
+    timer_wheel_t wheel;
+    winrm_session_t *sessions;
+    int running;                 /* 実行中のセッション数 */
+} winrm_engine_t;
+
+static void sess_connect(winrm_session_t *s);
+static void sess_send_soap(winrm_session_t *s);
+static void sess_on_writable(winrm_session_t *s);
+static void sess_on_readable(winrm_session_t *s);
+
+/*
+ * sess_watch - ソケットの監視イベントを設定
+ *
+ * epoll_event.data には (セッション番号, ソケット世代) を格納し、
+ * 閉じたソケット宛ての古いイベントを無視できるようにする。
+ */
+static void sess_watch(winrm_session_t *s, uint32_t events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = ((uint64_t)s->index << 32) | s->gen;
+    if (epoll_ctl(s->engine->epfd, EPOLL_CTL_MOD, s->sock, &ev) < 0 && errno == ENOENT) {
+        epoll_ctl(s->engine->epfd, EPOLL_CTL_ADD, s->sock, &ev);
+    }
+}
+
+/* sess_arm - 現在のI/Oの期限を設定 */
+static void sess_arm(winrm_session_t *s, uint64_t delay_ms) {
+    wheel_add(&s->engine->wheel, &s->timer, now_ms() + delay_ms);
+}
+
+/* sess_tx_free - 送信中のリクエストを解放 */
+static void sess_tx_free(winrm_session_t *s) {
+    free(s->tx);
+    s->tx = NULL;
+    sealed_request_free(&s->sealed[0]);
+    sealed_request_free(&s->sealed[1]);
+    s->tx_iovcnt = s->tx_iovpos = 0;
+}
+
+/* sess_close_socket - ソケットを閉じる（次のリクエストで接続・認証し直す） */
+static void sess_close_socket(winrm_session_t *s) {
+    if (s->sock >= 0) {
+        epoll_ctl(s->engine->epfd, EPOLL_CTL_DEL, s->sock, NULL);
+        close(s->sock);
+    }
+    s->sock = -1;
+    s->authenticated = false;
+    s->io = IO_IDLE;
+    sess_tx_free(s);
+    buf_clear(&s->ahead);
+}
+
+/* sess_log_error - [ホスト] 付きでエラーを表示 */
+static void sess_log_error(winrm_session_t *s, const char *what) {
+    char msg[512];
+    snprintf(msg, sizeof(msg), "[%s] %s", s->target->label, what);
+    log_error(msg);
+}
+
+/*
+ * sess_print_bundled - まとめて実行した出力を行ごとに振り分けて表示（--bundle）
+ *
+ * ホストの終了コードは最初に失敗した行のもの、完了数は実行された行数にする。
+ */
+static void sess_print_bundled(winrm_session_t *s) {
+    fanout_host_t *h = s->target;
+    const bundle_plan_t *plan = g_bundle;
+    bundle_step_t *steps = calloc(plan->lines, sizeof(*steps));
+    if (!steps || !bundle_demux_run(plan, steps, 0, &s->out[0], &s->out[1], s->exit_code)) {
+        s->capture_failed = true;
+    }
+
+    int ran = 0, result = 0;
+    for (int i = 0; steps && i < plan->lines; i++) {
+        bundle_step_t *step = &steps[i];
+        if (!step->began) continue;
+        ran++;
+
+        char tag[64];
+        snprintf(tag, sizeof(tag), "[%d/%d] ", i + 1, plan->lines);
+        fanout_print_output(STDOUT_FILENO, h->label, tag,
+                            plan->commands[i], strlen(plan->commands[i]));
+        for (int k = 0; k < 2; k++) {
+            line_writer_t w = { STDOUT_FILENO, h->label, k ? "[標準エラー出力] " : NULL, {0} };
+            capture_replay(&step->out[k], line_writer_sink, &w);
+            line_writer_flush(&w);
+        }
+        snprintf(tag, sizeof(tag), "終了コード: %d", step->exit_code);
+        fanout_print_output(STDOUT_FILENO, h->label, NULL, tag, strlen(tag));
+        if (step->exit_code != 0 && result == 0) result = step->exit_code;
+    }
+    bundle_steps_free(steps, plan->lines);
+
+    if (!s->failed && ran > 0) {
+        h->exit_code = result;
+    }
+    h->commands_run = ran;
+}
+
+/*
+ * sess_finish - セッションを終了し、結果を記録して出力を表示
+ */
+static void sess_finish(winrm_session_t *s) {
+    wheel_del(&s->timer);
+    sess_close_socket(s);
+    soap_message_free(&s->soap);
+    soap_message_free(&s->soap_next);
+    buf_free(&s->rx);
+    buf_free(&s->ahead);
+    receive_result_free(&s->receive.result);
+    http_parser_free(&s->http);
+
+    fanout_host_t *h = s->target;
+    h->done = true;
+    h->error = s->failed;
+    h->exit_code = s->exit_code;
+    h->commands_run = s->command_index;
+    h->elapsed_ms = now_ms() - h->start_ms;
+
+    /* 出力（--stream時は改行で終わっていない残りのみ） */
+    fflush(stdout);
+    if (g_stream) {
+        line_writer_flush(&s->line[0]);
+        line_writer_flush(&s->line[1]);
+    } else if (g_bundle) {
+        sess_print_bundled(s);
+        capture_free(&s->out[0]);
+        capture_free(&s->out[1]);
+    } else {
+        for (int i = 0; i < 2; i++) {
+            line_writer_t w = { STDOUT_FILENO, h->label, i ? "[標準エラー出力] " : NULL, {0} };
+            capture_replay(&s->out[i], line_writer_sink, &w);
+            line_writer_flush(&w);
+            capture_free(&s->out[i]);
+        }
+    }
+    if (s->capture_failed) {
+        sess_log_error(s, "コマンド出力の保存に失敗しました（一部が欠けています）");
+    }
+
+    s->engine->running--;
+}
+
+/*
+ * sess_request - SOAPリクエストを送信（未認証なら接続・認証してから送信）
+ *
+ * リクエストはテンプレートにセッションの値（ShellId・CommandId・実行中のコマンド）を
+ * 入れて作る。
+ */
+static void sess_request(winrm_session_t *s, sess_step_t step) {
+    static const soap_kind_t kinds[] = {
+        [STEP_CREATE] = SOAP_CREATE, [STEP_COMMAND] = SOAP_COMMAND,
+        [STEP_RECEIVE] = SOAP_RECEIVE, [STEP_DELETE] = SOAP_DELETE,
+    };
+    soap_message_free(&s->soap);
+    s->soap_step = step;
+    if (!soap_message_build(&s->soap, kinds[step], s->url, s->shell_id, s->command_id,
+                            step == STEP_COMMAND ? s->commands[s->command_index] : NULL)) {
+        sess_log_error(s, "メモリ確保に失敗しました");
+        s->failed = true;
+        sess_finish(s);
+        return;
+    }
+
+    /* 応答待ちがない間にサーバーが閉じた接続は、送る前に閉じて接続し直す
+     * （送信後の切断と区別できず、Commandを送り直せなくなるため） */
+    if (s->authenticated && s->sock >= 0 && (s->ahead.len > 0 || !sock_is_idle(s->sock))) {
+        sess_close_socket(s);
+    }
+    if (s->authenticated && s->sock >= 0) {
+        sess_send_soap(s);
+    } else {
+        sess_connect(s);
+    }
+}
+
+/*
+ * sess_fail - エラー終了
+ *
+ * コマンド実行後のエラーであれば、シェルを残さないようDeleteを試みてから終了する。
+ */
+static void sess_fail(winrm_session_t *s, const char *what) {
+    sess_log_error(s, what);
+    bool try_delete = !s->failed && s->shell_id[0] &&
+                      (s->soap_step == STEP_COMMAND || s->soap_step == STEP_RECEIVE);
+    s->failed = true;
+    if (s->soap_next.iovcnt > 0) {
+        /* パイプライン送信したReceiveの応答が残る接続では、Deleteの応答と区別できない */
+        soap_message_free(&s->soap_next);
+        sess_close_socket(s);
+    }
+
+    if (try_delete) {
+        s->retried = false;
+        sess_request(s, STEP_DELETE);
+        return;
+    }
+    sess_finish(s);
+}
+
+/*
+ * sess_expect - 次のレスポンスの受信に備えてパーサと復号状態を初期化
+ */
+static void sess_expect(winrm_session_t *s, sess_step_t step) {
+    s->step = step;
+    buf_clear(&s->rx);
+    if (step == STEP_RECEIVE) {
+        receive_result_free(&s->receive.result);
+        receive_parser_init(&s->receive, s->command_id);
+    }
+    ntlm_unseal_reset(&s->unseal, s->authenticated ? &s->ntlm : NULL, &s->http, &s->rx);
+    http_parser_reset(&s->http, ntlm_unseal_body, &s->unseal);
+    s->rx_eof = false;
+}
+
+/*
+ * sess_start_tx - tx_iov に用意したリクエストの送信を開始
+ *
+ * 送信バッファに空きがあればその場で書き込み、残りだけをepollに任せる。
+ */
+static void sess_start_tx(winrm_session_t *s, sess_step_t step) {
+    s->tx_iovpos = 0;
+    s->io = IO_SENDING;
+    buf_clear(&s->ahead);
+    sess_expect(s, step);
+    sess_arm(s, (uint64_t)TIMEOUT * 1000);
+    sess_on_writable(s);
+}
+
+/* sess_send_auth - 認証ヘッダ付きの空POSTを送信 */
+static void sess_send_auth(winrm_session_t *s, sess_step_t step, const char *token) {
+    size_t size = strlen(token) + 512;
+    sess_tx_free(s);
+    s->tx = malloc(size);
+    if (!s->tx) {
+        sess_fail(s, "メモリ確保に失敗しました");
+        return;
+    }
+    size_t len = build_auth_request(s->tx, size, s->target->host, s->target->port,
+                                    s->use_spnego ? "Negotiate" : "NTLM", token);
+    s->tx_iov[0] = (struct iovec){ s->tx, len };
+    s->tx_iovcnt = 1;
+    sess_start_tx(s, step);
+}
+
+/*
+ * sess_send_soap - 保持しているSOAPを暗号化して送信
+ *
+ * soap_next があれば続けて暗号化し、同じ sendmsg() の断片の並びに加えてパイプライン送信する
+ * （シーケンス番号は送信順に進むので、サーバーもこの順に検証・処理する）。
+ */
+static void sess_send_soap(winrm_session_t *s) {
+    const soap_message_t *soap[2] = { &s->soap, &s->soap_next };
+
+    sess_tx_free(s);
+    for (int i = 0; i < 2 && soap[i]->iovcnt > 0; i++) {
+        if (!seal_request(&s->sealed[i], &s->ntlm, s->target->host, s->target->port,
+                          soap[i]->iov, soap[i]->iovcnt)) {
+            sess_fail(s, "メモリ確保に失敗しました");
+            return;
+        }
+        memcpy(s->tx_iov + s->tx_iovcnt, s->sealed[i].iov, sizeof(s->sealed[i].iov));
+        s->tx_iovcnt += SEALED_REQUEST_IOV;
+    }
+    sess_start_tx(s, s->soap_step);
+}
+
+/*
+ * sess_connect - 非ブロッキング接続を開始
+ */
+static void sess_connect(winrm_session_t *s) {
+    sess_close_socket(s);
+    s->gen++;
+
+    s->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->sock < 0) {
+        sess_fail(s, "ソケット作成に失敗しました");
+        return;
+    }
+    set_tcp_nodelay(s->sock);
+
+    int ret = connect(s->sock, (struct sockaddr *)&s->addr, sizeof(s->addr));
+    if (ret < 0 && errno != EINPROGRESS) {
+        char msg[320];
+        snprintf(msg, sizeof(msg), "接続に失敗しました: %s", strerror(errno));
+        sess_close_socket(s);
+        sess_fail(s, msg);
+        return;
+    }
+
+    s->io = IO_CONNECTING;
+    sess_watch(s, EPOLLOUT);
+    sess_arm(s, (uint64_t)TIMEOUT * 1000);
+}
+
+/*
+ * sess_on_connected - 接続完了: NTLM Type 1を送信
+ */
+static void sess_on_connected(winrm_session_t *s) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        char msg[320];
+        snprintf(msg, sizeof(msg), "接続に失敗しました: %s", strerror(err ? err : errno));
+        sess_close_socket(s);
+        sess_fail(s, msg);
+        return;
+    }
+
+    char token[8192];
+    ntlm_negotiate_token(s->use_spnego, s->type1, &s->type1_len, token);
+    sess_send_auth(s, STEP_AUTH_NEGOTIATE, token);
+}
+
+/*
+ * sess_on_conn_lost - レスポンス完了前に接続が切れた
+ *
+ * SOAPリクエストであれば、ブロッキング版と同様に再認証して1回だけ再送する。
+ * ただし送信を始めたCommandは、サーバーが実行済みで応答だけが失われた可能性があるため
+ * 送り直さずに失敗とする（同じコマンドが2回実行されないように）。
+ */
+static void sess_on_conn_lost(winrm_session_t *s) {
+    bool command_sent = s->step == STEP_COMMAND && (s->io != IO_SENDING || s->tx_iovpos > 0);
+    sess_close_socket(s);
+    if (command_sent) {
+        sess_fail(s, "コマンドの応答を受け取る前にサーバーが接続を閉じました");
+        return;
+    }
+    if (s->step >= STEP_CREATE && !s->retried) {
+        s->retried = true;
+        sess_connect(s);
+        return;
+    }
+    sess_fail(s, "サーバーが接続を閉じました");
+}
+
+/*
+ * sess_on_chunk - 出力チャンクを受信
+ *
+ * --stream 指定時は、改行までそろった行を [ホスト] 付きで即座に書き出し、
+ * 行の途中だけを残す。それ以外は capture_t に蓄積して完了時にまとめて表示する。
+ */
+static void sess_on_chunk(int stream, const uint8_t *data, size_t len, void *ctx) {
+    winrm_session_t *s = ctx;
+
+    if (g_stream) {
+        line_writer_feed(&s->line[stream], (const char *)data, len);
+    } else if (!s->capture_failed && !capture_append(&s->out[stream], data, len)) {
+        s->capture_failed = true;
+    }
+}
+
+/*
+ * sess_start_command - 次のコマンド（commands[command_index]）の実行を開始
+ *
+ * CommandIdをクライアントで割り当て、最初のReceiveをCommandに続けて送る。
+ */
+static void sess_start_command(winrm_session_t *s) {
+    generate_command_id(s->command_id, sizeof(s->command_id));
+    /* 先行送信するReceive（作れなければCommandの応答を待ってから送る） */
+    soap_message_free(&s->soap_next);
+    soap_message_build(&s->soap_next, SOAP_RECEIVE, s->url, s->shell_id, s->command_id, NULL);
+    sess_request(s, STEP_COMMAND);
+}
+
+/*
+ * sess_on_soap_response - SOAPレスポンスを処理し、次のステップへ進める
+ */
+static void sess_on_soap_response(winrm_session_t *s, int http_code, const char *body,
+                                  size_t body_len) {
+    fanout_host_t *h = s->target;
+    char msg[320];
+
+    /* 先行送信したReceiveが別のCommandId宛てだった: 応答は捨てて送り直す */
+    if (s->soap_step == STEP_RECEIVE && s->stale_receive) {
+        s->stale_receive = false;
+        sess_request(s, STEP_RECEIVE);
+        return;
+    }
+
+    /* ロングポーリングの待機時間切れ（まだ出力なし）: すぐに次のReceiveを送る */
+    if (http_code == 500 && s->soap_step == STEP_RECEIVE && soap_fault_is_timeout(body, body_len)) {
+        http_code = 200;
+    }
+
+    if (http_code != 200) {
+        if (s->soap_step == STEP_DELETE) {
+            /* 削除の失敗は結果に影響させない（ブロッキング版と同じ） */
+            sess_finish(s);
+            return;
+        }
+        soap_fault_t fault;
+        if (soap_fault_parse(body, body_len, &fault)) {
+            snprintf(msg, sizeof(msg), "SOAPリクエストが失敗しました (HTTP %d, %s): %.200s",
+                     http_code, fault.subcode[0] ? fault.subcode : fault.code, fault.reason);
+        } else {
+            snprintf(msg, sizeof(msg), "SOAPリクエストが失敗しました (HTTP %d)", http_code);
+        }
+        sess_fail(s, msg);
+        return;
+    }
+
+    switch (s->soap_step) {
+    case STEP_CREATE:
+        if (!soap_find_text(body, body_len, XML_NS_SHELL, "ShellId",
+                            s->shell_id, sizeof(s->shell_id))) {
+            sess_fail(s, "ShellIDの取得に失敗しました");
+            return;
+        }
+        sess_start_command(s);
+        break;
+
+    case STEP_COMMAND: {
+        char assigned_id[128];
+        if (!soap_find_text(body, body_len, XML_NS_SHELL, "CommandId",
+                            assigned_id, sizeof(assigned_id))) {
+            sess_fail(s, "CommandIDの取得に失敗しました");
+            return;
+        }
+        if (strcasecmp(assigned_id, s->command_id) != 0) {
+            snprintf(s->command_id, sizeof(s->command_id), "%s", assigned_id);
+            s->stale_receive = true;
+        }
+        s->command_start_ms = now_ms();
+
+        if (s->soap_next.iovcnt > 0 && s->sock >= 0) {
+            /* 先行送信したReceiveの応答を同じ接続で待つ（受信済みの分はここで処理） */
+            soap_message_free(&s->soap);
+            s->soap = s->soap_next;
+            memset(&s->soap_next, 0, sizeof(s->soap_next));
+            s->soap_step = STEP_RECEIVE;
+            s->io = IO_RECEIVING;
+            sess_expect(s, STEP_RECEIVE);
+            sess_watch(s, EPOLLIN);
+            sess_arm(s, (uint64_t)TIMEOUT * 1000);
+            sess_on_readable(s);
+            break;
+        }
+        /* Connection: close で先行送信分が捨てられた: 接続し直して送る */
+        soap_message_free(&s->soap_next);
+        s->stale_receive = false;
+        sess_request(s, STEP_RECEIVE);
+        break;
+    }
+
+    case STEP_RECEIVE: {
+        /*
+         * 次のリクエスト（ReceiveまたはDelete）を先に送り、サーバーがそれを処理している間に
+         * この応答の出力をデコードする。送信でrxが再利用されるため本文は切り離しておく。
+         * 本文の大部分は受信中に sess_on_readable() で解析済みで、ここでは残りだけをたどる。
+         */
+        buf_t last = s->rx;
+        s->rx = (buf_t){0};
+        receive_parser_feed(&s->receive, last.data ? last.data : "", last.len, true);
+        receive_result_t result = s->receive.result;
+        s->receive.result = (receive_result_t){0};
+
+        if (result.done) {
+            int exit_code = result.exit_code;
+            /* ホストの終了コードは最初に失敗したコマンドのもの */
+            if (s->exit_code == 0) {
+                s->exit_code = exit_code;
+            }
+            s->command_index++;
+            if (s->command_index < s->command_count && !(exit_code != 0 && g_stop_on_error)) {
+                sess_start_command(s);
+            } else {
+                sess_request(s, STEP_DELETE);
+            }
+        } else if (now_ms() - s->command_start_ms < (uint64_t)TIMEOUT * 1000) {
+            /* 次のReceiveを即座に送る（サーバー側で出力が出るまで保持される） */
+            sess_request(s, STEP_RECEIVE);
+        } else {
+            sess_log_error(s, "コマンド完了待機がタイムアウトしました");
+            s->failed = true;
+            sess_request(s, STEP_DELETE);
+        }
+
+        /* 送信エラーでセッションが終了していなければ出力を取り込む */
+        if (!h->done) {
+            receive_emit(&result, last.data, sess_on_chunk, s);
+            if (result.failed) s->capture_failed = true;
+        }
+        receive_result_free(&result);
+        buf_free(&last);
+        break;
+    }
+
+    case STEP_DELETE:
+        sess_finish(s);
+        break;
 
-    return true;
+    default:
+        break;
+    }
 }
 
 /*
- * get_command_output - コマンドの出力を取得
- *
- * @shell_id:    対象のShellId
- * @command_id:  対象のCommandId
- * @stdout_buf:  標準出力の格納バッファ
- * @stdout_size: 標準出力バッファサイズ
- * @stderr_buf:  標準エラー出力の格納バッファ
- * @stderr_size: 標準エラーバッファサイズ
- * @exit_code:   終了コードの出力先
- * @return:      成功時true
- *
- * WinRS Receiveアクションを使用して出力を取得。
- * CommandState/Doneになるまでポーリングを繰り返す。
- * 出力はBase64エンコードされているためデコードが必要。
+ * sess_on_response - レスポンス全体を受信した
  */
-static bool get_command_output(const char *shell_id, const char *command_id,
-                               char *stdout_buf, size_t stdout_size,
-                               char *stderr_buf, size_t stderr_size,
-                               int *exit_code) {
-    char url[MAX_URL_SIZE];
-    char envelope[MAX_ENVELOPE_SIZE];
-    char response[MAX_BUFFER_SIZE];
-    bool command_done = false;
-    int max_attempts = TIMEOUT * 2;
-
-    snprintf(url, sizeof(url), "http://%s:%d/wsman", g_host, g_port);
+static void sess_on_response(winrm_session_t *s) {
+    int http_code = s->http.http_code;
+    const char *auth_header = s->http.auth_token.len > 0 ? s->http.auth_token.data : "";
+    bool keep_alive = http_parser_keep_alive(&s->http) && !s->rx_eof;
+    const char *body = s->rx.data ? s->rx.data : "";
+    s->io = IO_IDLE;
+
+    switch (s->step) {
+    case STEP_AUTH_NEGOTIATE:
+        /* チャレンジを受信できなかった場合、もう一方の方式（NTLM⇔SPNEGO）で接続し直す */
+        if (http_code == 401 && auth_header[0] == '\0' && !s->mech_switched) {
+            s->mech_switched = true;
+            s->use_spnego = !s->use_spnego;
+            sess_connect(s);
+            return;
+        }
+        if (http_code != 401 || auth_header[0] == '\0') {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "認証のチャレンジ応答を受信できませんでした (HTTP %d)", http_code);
+            sess_close_socket(s);
+            sess_fail(s, msg);
+            return;
+        }
+        {
+            char *auth_b64 = malloc(16384);
+            if (!auth_b64 ||
+                !ntlm_authenticate_token(auth_header, s->use_spnego, s->type1, s->type1_len,
+                                         g_cred, &s->ntlm, auth_b64)) {
+                free(auth_b64);
+                sess_close_socket(s);
+                sess_fail(s, "NTLM認証メッセージの生成に失敗しました");
+                return;
+            }
+            sess_send_auth(s, STEP_AUTH_COMPLETE, auth_b64);
+            free(auth_b64);
+        }
+        return;
+
+    case STEP_AUTH_COMPLETE:
+        if (http_code != 200 || !keep_alive) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), http_code == 401 ? "認証に失敗しました (HTTP %d)"
+                                                         : "認証後にサーバーが接続を閉じました (HTTP %d)",
+                     http_code);
+            sess_close_socket(s);
+            sess_fail(s, msg);
+            return;
+        }
+        s->authenticated = true;
+        auth_cache_store(s->target->host, s->target->port, s->use_spnego);
+        sess_send_soap(s);
+        return;
 
-    stdout_buf[0] = '\0';
-    stderr_buf[0] = '\0';
-    *exit_code = 0;
+    default:
+        break;
+    }
 
-    char msg[128];
-    snprintf(msg, sizeof(msg), "コマンド出力取得中...（最大%d秒待機）", TIMEOUT);
-    log_info(msg);
+    /* 認証コンテキストの失効: 再認証して1回だけ再送 */
+    if (http_code == 401 && !s->retried) {
+        s->retried = true;
+        sess_connect(s);
+        return;
+    }
+    s->retried = false;
 
-    for (int attempt = 0; attempt < max_attempts && !command_done; attempt++) {
-        char uuid[MAX_UUID_SIZE];
-        generate_uuid(uuid, sizeof(uuid));
-
-        snprintf(envelope, sizeof(envelope),
-            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-            "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
-            "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
-            "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\"\n"
-            "            xmlns:rsp=\"http://schemas.microsoft.com/wbem/wsman/1/windows/shell\">\n"
-            "  <s:Header>\n"
-            "    <a:To>%s</a:To>\n"
-            "    <a:ReplyTo>\n"
-            "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
-            "    </a:ReplyTo>\n"
-            "    <a:Action s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/Receive</a:Action>\n"
-            "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
-            "    <a:MessageID>uuid:%s</a:MessageID>\n"
-            "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
-            "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
-            "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
-            "    <w:SelectorSet>\n"
-            "      <w:Selector Name=\"ShellId\">%s</w:Selector>\n"
-            "    </w:SelectorSet>\n"
-            "  </s:Header>\n"
-            "  <s:Body>\n"
-            "    <rsp:Receive>\n"
-            "      <rsp:DesiredStream CommandId=\"%s\">stdout stderr</rsp:DesiredStream>\n"
-            "    </rsp:Receive>\n"
-            "  </s:Body>\n"
-            "</s:Envelope>",
-            url, uuid, TIMEOUT, shell_id, command_id);
-
-        if (!send_soap_request(envelope, response, sizeof(response))) {
-            log_error("出力取得に失敗しました");
-            return false;
-        }
+    if (!keep_alive) {
+        /* 本文はrxに残っているので、ソケットだけを閉じる */
+        sess_close_socket(s);
+    }
+    sess_on_soap_response(s, http_code, body, s->rx.len);
+}
 
-        /* stdout抽出 */
-        char *stdout_start = strstr(response, "<rsp:Stream Name=\"stdout\">");
-        if (stdout_start) {
-            stdout_start += strlen("<rsp:Stream Name=\"stdout\">");
-            char *stdout_end = strstr(stdout_start, "</rsp:Stream>");
-            if (stdout_end) {
-                size_t b64_len = stdout_end - stdout_start;
-                char *b64_buf = malloc(b64_len + 1);
-                strncpy(b64_buf, stdout_start, b64_len);
-                b64_buf[b64_len] = '\0';
-
-                uint8_t decoded[MAX_BUFFER_SIZE];
-                size_t decoded_len = base64_decode(b64_buf, decoded, sizeof(decoded));
-                decoded[decoded_len] = '\0';
-                strncat(stdout_buf, (char *)decoded, stdout_size - strlen(stdout_buf) - 1);
-                free(b64_buf);
+/*
+ * sess_on_writable - 送信を進める
+ */
+static void sess_on_writable(winrm_session_t *s) {
+    while (s->tx_iovpos < s->tx_iovcnt) {
+        struct msghdr msg = {
+            .msg_iov = s->tx_iov + s->tx_iovpos,
+            .msg_iovlen = s->tx_iovcnt - s->tx_iovpos,
+        };
+        ssize_t n = sendmsg(s->sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                sess_watch(s, EPOLLOUT);
+                return;
             }
+            sess_on_conn_lost(s);
+            return;
         }
+        iov_advance(s->tx_iov, s->tx_iovcnt, &s->tx_iovpos, n);
+    }
 
-        /* stderr抽出 */
-        char *stderr_start = strstr(response, "<rsp:Stream Name=\"stderr\">");
-        if (stderr_start) {
-            stderr_start += strlen("<rsp:Stream Name=\"stderr\">");
-            char *stderr_end = strstr(stderr_start, "</rsp:Stream>");
-            if (stderr_end) {
-                size_t b64_len = stderr_end - stderr_start;
-                char *b64_buf = malloc(b64_len + 1);
-                strncpy(b64_buf, stderr_start, b64_len);
-                b64_buf[b64_len] = '\0';
-
-                uint8_t decoded[MAX_BUFFER_SIZE];
-                size_t decoded_len = base64_decode(b64_buf, decoded, sizeof(decoded));
-                decoded[decoded_len] = '\0';
-                strncat(stderr_buf, (char *)decoded, stderr_size - strlen(stderr_buf) - 1);
-                free(b64_buf);
-            }
-        }
+    sess_tx_free(s);
+    s->io = IO_RECEIVING;
+    sess_watch(s, EPOLLIN);
+    sess_arm(s, (uint64_t)TIMEOUT * 1000);
+}
 
-        /* コマンド完了チェック */
-        if (strstr(response, "CommandState/Done")) {
-            command_done = true;
-            char exit_code_str[16];
-            if (extract_xml_value(response, "rsp:ExitCode", exit_code_str, sizeof(exit_code_str))) {
-                *exit_code = atoi(exit_code_str);
-            }
-        }
+/*
+ * sess_on_readable - 受信を進め、レスポンスが揃ったら処理する
+ */
+static void sess_on_readable(winrm_session_t *s) {
+    bool eof = false;
 
-        if (!command_done) {
-            usleep(500000); /* 0.5秒 */
-        }
+    char block[16384];
+
+    /* 前のレスポンスと一緒に受信していた、パイプライン送信分の応答から処理する */
+    if (s->ahead.len > 0) {
+        buf_consume(&s->ahead, http_parser_feed(&s->http, s->ahead.data, s->ahead.len));
     }
 
-    if (!command_done) {
-        log_warn("コマンド完了待機がタイムアウトしました");
+    while (s->http.state != HP_DONE && s->http.state != HP_ERROR) {
+        ssize_t n = recv(s->sock, block, sizeof(block), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            sess_on_conn_lost(s);
+            return;
+        }
+        if (n == 0) {
+            /* 応答を送り終えてから閉じた場合もあるので、先に完了を確認 */
+            eof = true;
+            http_parser_finish(&s->http);
+            break;
+        }
+        size_t used = http_parser_feed(&s->http, block, n);
+        if (used < (size_t)n && !buf_append(&s->ahead, block + used, n - used)) {
+            s->http.state = HP_ERROR;
+        }
     }
 
-    snprintf(msg, sizeof(msg), "コマンド完了 (終了コード: %d)", *exit_code);
-    log_success(msg);
+    /* Receiveの本文は届いた分から解析しておく（Streamの位置・完了状態を拾う） */
+    if (s->step == STEP_RECEIVE && s->http.state != HP_DONE && s->http.state != HP_ERROR &&
+        s->rx.len > 0) {
+        receive_parser_feed(&s->receive, s->rx.data, s->rx.len, false);
+    }
 
-    return true;
+    if (s->http.state == HP_ERROR ||
+        (s->http.state == HP_DONE && !ntlm_unseal_complete(&s->unseal))) {
+        sess_close_socket(s);
+        sess_fail(s, "不正なHTTPレスポンスを受信しました");
+    } else if (s->http.state == HP_DONE) {
+        s->rx_eof = eof;
+        sess_on_response(s);
+    } else if (eof) {
+        sess_on_conn_lost(s);
+    }
 }
 
 /*
- * delete_shell - リモートシェルを削除
- *
- * @shell_id: 削除対象のShellId
- *
- * WS-Transfer Deleteアクションを使用してシェルを削除。
- * リソース解放のため、コマンド完了後は必ず呼び出すこと。
+ * sess_on_timer - タイマー期限切れ
  */
-static void delete_shell(const char *shell_id) {
-    char url[MAX_URL_SIZE];
-    char uuid[MAX_UUID_SIZE];
-    char envelope[MAX_ENVELOPE_SIZE];
-    char response[MAX_BUFFER_SIZE];
+static void sess_on_timer(void *owner) {
+    winrm_session_t *s = owner;
+    const char *what = s->io == IO_CONNECTING ? "接続がタイムアウトしました"
+                     : s->io == IO_SENDING    ? "送信がタイムアウトしました"
+                                              : "応答待ちがタイムアウトしました";
+    sess_close_socket(s);
+    sess_fail(s, what);
+}
 
-    snprintf(url, sizeof(url), "http://%s:%d/wsman", g_host, g_port);
-    generate_uuid(uuid, sizeof(uuid));
+/*
+ * sess_start - 1ホスト分のセッションを開始
+ */
+static void sess_start(winrm_session_t *s) {
+    fanout_host_t *h = s->target;
+    h->start_ms = now_ms();
+    s->engine->running++;
+    s->use_spnego = auth_cache_lookup(h->host, h->port);
+    for (int i = 0; i < 2; i++) {
+        s->line[i].fd = g_stream_fd[i];
+        s->line[i].label = h->label;
+    }
 
-    snprintf(envelope, sizeof(envelope),
-        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-        "<s:Envelope xmlns:s=\"http://www.w3.org/2003/05/soap-envelope\"\n"
-        "            xmlns:a=\"http://schemas.xmlsoap.org/ws/2004/08/addressing\"\n"
-        "            xmlns:w=\"http://schemas.dmtf.org/wbem/wsman/1/wsman.xsd\">\n"
-        "  <s:Header>\n"
-        "    <a:To>%s</a:To>\n"
-        "    <a:ReplyTo>\n"
-        "      <a:Address s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/08/addressing/role/anonymous</a:Address>\n"
-        "    </a:ReplyTo>\n"
-        "    <a:Action s:mustUnderstand=\"true\">http://schemas.xmlsoap.org/ws/2004/09/transfer/Delete</a:Action>\n"
-        "    <w:MaxEnvelopeSize s:mustUnderstand=\"true\">153600</w:MaxEnvelopeSize>\n"
-        "    <a:MessageID>uuid:%s</a:MessageID>\n"
-        "    <w:Locale xml:lang=\"ja-JP\" s:mustUnderstand=\"false\"/>\n"
-        "    <w:OperationTimeout>PT%dS</w:OperationTimeout>\n"
-        "    <w:ResourceURI s:mustUnderstand=\"true\">http://schemas.microsoft.com/wbem/wsman/1/windows/shell/cmd</w:ResourceURI>\n"
-        "    <w:SelectorSet>\n"
-        "      <w:Selector Name=\"ShellId\">%s</w:Selector>\n"
-        "    </w:SelectorSet>\n"
-        "  </s:Header>\n"
-        "  <s:Body/>\n"
-        "</s:Envelope>",
-        url, uuid, TIMEOUT, shell_id);
+    if (!s->resolved) {
+        s->failed = true;
+        sess_log_error(s, "ホスト名の解決に失敗しました");
+        sess_finish(s);
+        return;
+    }
 
-    log_info("シェル削除中...");
-    send_soap_request(envelope, response, sizeof(response));
-    log_success("シェル削除完了");
+    soap_url(s->url, sizeof(s->url), h->host, h->port);
+    sess_request(s, STEP_CREATE);
 }
 
-/* ============================================================================
- * メイン処理
- * ============================================================================ */
+/*
+ * raise_fd_limit - 同時接続数に合わせてファイルディスクリプタの上限を引き上げる
+ */
+static void raise_fd_limit(int parallel) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) return;
+
+    /* セッションごとにソケット1つ + 出力の退避用一時ファイル最大2つ */
+    rlim_t want = (rlim_t)parallel * 3 + 64;
+    if (rl.rlim_cur >= want) return;
+    rl.rlim_cur = (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < want) ? rl.rlim_max : want;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
 
 /*
- * load_config - 設定を読み込み
+ * engine_run - すべてのホストでコマンドを実行（完了するまで戻らない）
  *
- * デフォルト値を設定し、環境変数があれば上書き。
- * 環境変数: WINRM_HOST, WINRM_USER, WINRM_PASS, WINRM_DOMAIN, WINRM_PORT
+ * @hosts:    ホスト一覧（結果が書き込まれる）
+ * @count:    ホスト数
+ * @commands: 実行するコマンドライン（ホストごとに1つのシェルで順に実行）
+ * @ncommands: コマンド数
+ * @parallel: 同時実行数
+ * @return:   イベントループを開始できればtrue
  */
-static void load_config(void) {
-    const char *env;
+static bool engine_run(fanout_host_t *hosts, int count, const char *const *commands, int ncommands,
+                       int parallel) {
+    winrm_engine_t engine;
+    memset(&engine, 0, sizeof(engine));
+
+    raise_fd_limit(parallel);
+
+    engine.epfd = epoll_create1(EPOLL_CLOEXEC);
+    engine.sessions = calloc(count, sizeof(winrm_session_t));
+    if (engine.epfd < 0 || !engine.sessions) {
+        log_error("イベントループの初期化に失敗しました");
+        if (engine.epfd >= 0) close(engine.epfd);
+        free(engine.sessions);
+        return false;
+    }
+    wheel_init(&engine.wheel, now_ms());
+
+    for (int i = 0; i < count; i++) {
+        winrm_session_t *s = &engine.sessions[i];
+        s->engine = &engine;
+        s->commands = commands;
+        s->command_count = ncommands;
+        s->target = &hosts[i];
+        s->index = i;
+        s->sock = -1;
+        s->timer.owner = s;
+    }
 
-    env = getenv("WINRM_HOST");
-    strncpy(g_host, env ? env : DEFAULT_HOST, sizeof(g_host) - 1);
+    /* 名前解決（gethostbyname はブロックするため、イベントループの開始前にまとめて行う。
+     * ループ内で待つと実行中のすべてのセッションが止まり、タイマーが誤って期限切れになる） */
+    for (int i = 0; i < count; i++) {
+        engine.sessions[i].resolved = resolve_host(hosts[i].host, hosts[i].port,
+                                                   &engine.sessions[i].addr);
+    }
 
-    env = getenv("WINRM_USER");
-    strncpy(g_user, env ? env : DEFAULT_USER, sizeof(g_user) - 1);
+    struct epoll_event events[ENGINE_MAX_EVENTS];
+    int next = 0;
 
-    env = getenv("WINRM_PASS");
-    strncpy(g_pass, env ? env : DEFAULT_PASS, sizeof(g_pass) - 1);
+    while (next < count || engine.running > 0) {
+        /* 空きがあれば次のホストを開始 */
+        while (next < count && engine.running < parallel) {
+            sess_start(&engine.sessions[next++]);
+        }
+        if (engine.running == 0) continue;
 
-    env = getenv("WINRM_DOMAIN");
-    strncpy(g_domain, env ? env : DEFAULT_DOMAIN, sizeof(g_domain) - 1);
+        int n = epoll_wait(engine.epfd, events, ENGINE_MAX_EVENTS, WHEEL_TICK_MS);
+        if (n < 0 && errno != EINTR) {
+            log_error("epoll_waitに失敗しました");
+            break;
+        }
 
-    env = getenv("WINRM_PORT");
-    g_port = env ? atoi(env) : DEFAULT_PORT;
+        for (int i = 0; i < n; i++) {
+            winrm_session_t *s = &engine.sessions[events[i].data.u64 >> 32];
+            if ((uint32_t)events[i].data.u64 != s->gen || s->sock < 0) {
+                continue;   /* 閉じたソケット宛ての古いイベント */
+            }
+            switch (s->io) {
+            case IO_CONNECTING:
+                sess_on_connected(s);
+                break;
+            case IO_SENDING:
+                sess_on_writable(s);
+                break;
+            case IO_RECEIVING:
+                sess_on_readable(s);
+                break;
+            default:
+                break;
+            }
+        }
 
-    env = getenv("BATCH_FILE_PATH");
-    strncpy(g_batch_path, env ? env : DEFAULT_BATCH_PATH, sizeof(g_batch_path) - 1);
+        wheel_advance(&engine.wheel, now_ms(), sess_on_timer);
+    }
+
+    close(engine.epfd);
+    free(engine.sessions);
+    return true;
 }
 
 /*
- * print_help - 使い方を表示
+ * fanout_execute - 複数ホストでコマンドを並列実行
  *
- * @prog_name: プログラム名（argv[0]）
+ * @hosts:   ホスト一覧
+ * @count:   ホスト数
+ * @commands: 実行するコマンドライン（--script時は複数、--bundle時はまとめたもの）
+ * @ncommands: コマンド数
+ * @return:  全ホスト成功時0、いずれかが失敗した場合1
  */
-static void print_help(const char *prog_name) {
-    printf("使い方: %s ENV\n\n", prog_name);
-    printf("引数:\n");
-    printf("  ENV    環境名 (");
-    for (int i = 0; ENVIRONMENTS[i]; i++) {
-        if (i > 0) printf(", ");
-        printf("%s", ENVIRONMENTS[i]);
+static int fanout_execute(fanout_host_t *hosts, int count, const char *const *commands,
+                          int ncommands) {
+    int parallel = g_parallel > 0 ? g_parallel : 1;
+    int total = g_bundle ? g_bundle->lines : ncommands;  /* --bundle 時はまとめる前の行数 */
+    uint64_t start = now_ms();
+
+    char msg[256];
+    snprintf(msg, sizeof(msg), "ファンアウト実行: %d ホスト（同時実行数: %d）", count, parallel);
+    log_info(msg);
+    printf("\n");
+
+    if (!engine_run(hosts, count, commands, ncommands, parallel)) {
+        return 1;
     }
-    printf(")\n\n");
-    printf("例:\n");
-    for (int i = 0; ENVIRONMENTS[i] && i < 2; i++) {
-        printf("  %s %s\n", prog_name, ENVIRONMENTS[i]);
+
+    /* 集計結果 */
+    int succeeded = 0, failed = 0, errors = 0;
+    printf("\n");
+    printf("============================================================\n");
+    printf("ファンアウト実行結果\n");
+    printf("============================================================\n");
+    for (int i = 0; i < count; i++) {
+        fanout_host_t *h = &hosts[i];
+        if (h->error) {
+            printf("  %-30s  %s接続エラー%s        (%6.1f秒)\n", h->label,
+                   COLOR_RED, COLOR_RESET, h->elapsed_ms / 1000.0);
+            errors++;
+        } else {
+            printf("  %-30s  %s終了コード: %3d%s  (%6.1f秒)", h->label,
+                   h->exit_code != 0 ? COLOR_RED : COLOR_GREEN, h->exit_code, COLOR_RESET,
+                   h->elapsed_ms / 1000.0);
+            if (total > 1) {
+                printf("  [%d/%d コマンド]", h->commands_run, total);
+            }
+            printf("\n");
+            if (h->exit_code != 0) failed++; else succeeded++;
+        }
     }
-    printf("\n環境変数で設定を上書き可能:\n");
-    printf("  WINRM_HOST, WINRM_PORT, WINRM_USER, WINRM_PASS, WINRM_DOMAIN\n");
+    printf("------------------------------------------------------------\n");
+    printf("  成功: %d / 失敗: %d / 接続エラー: %d  （合計 %d ホスト、%.1f秒）\n",
+           succeeded, failed, errors, count, (now_ms() - start) / 1000.0);
+    printf("============================================================\n");
+    fflush(stdout);
+
+    if (failed == 0 && errors == 0) {
+        log_success("全ホストで完了");
+        return 0;
+    }
+    snprintf(msg, sizeof(msg), "%d ホストで失敗しました", failed + errors);
+    log_error(msg);
+    return 1;
 }
 
 /*
@@ -2826,8 +9952,8 @@ static void print_help(const char *prog_name) {
  * 1. 引数チェック（環境名の指定が必須）
  * 2. 設定読み込み（デフォルト値 + 環境変数）
  * 3. 環境名の有効性チェック
- * 4. バッチファイルパスの{ENV}プレースホルダ置換
- * 5. WinRM接続・コマンド実行
+ * 4. バッチファイルパスの{ENV}プレースホルダ置換（--script指定時はスクリプトを読み込み）
+ * 5. WinRM接続・コマンド実行（--hosts指定時は複数ホストへ並列実行）
  * 6. 結果表示
  *
  * @argc: 引数の数
@@ -2856,6 +9982,19 @@ int main(int argc, char *argv[]) {
     /* 設定読み込み */
     load_config();
 
+    /* 認証方式キャッシュは終了時にまとめてファイルへ書き戻す */
+    atexit(auth_cache_flush);
+
+    /*
+     * NT/NTLMv2ハッシュを一度だけ導出してロック済みメモリに保持。
+     * 以降パスワード自体は不要なので、平文のコピーはここで消去する。
+     */
+    if (!ntlm_credential_init(g_user, g_pass, g_domain)) {
+        return 1;
+    }
+    atexit(ntlm_credential_wipe);
+    secure_wipe(g_pass, sizeof(g_pass));
+
     /* 環境の有効性チェック */
     bool valid = false;
     for (int i = 0; ENVIRONMENTS[i]; i++) {
@@ -2880,11 +10019,172 @@ int main(int argc, char *argv[]) {
 
     strncpy(g_env_folder, argv[1], sizeof(g_env_folder) - 1);
 
+    /* オプション解析（ファンアウト実行・スクリプト実行） */
+    fanout_host_t *hosts = NULL;
+    int host_count = 0;
+    const char *script_path = NULL, *stdin_path = NULL;
+    const char *upload_local = NULL, *upload_remote = NULL;
+    const char *download_remote = NULL, *download_local = NULL;
+    bool download_resume = false;
+    bool daemon_mode = false, daemon_query = false;
+    for (int i = 2; i < argc; i++) {
+        bool ok;
+        if (strcmp(argv[i], "--hosts") == 0 && i + 1 < argc) {
+            ok = fanout_parse_list(&hosts, &host_count, argv[++i]);
+        } else if (strcmp(argv[i], "--hosts-file") == 0 && i + 1 < argc) {
+            ok = fanout_load_file(&hosts, &host_count, argv[++i]);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            g_stream = true;
+            ok = true;
+        } else if ((strcmp(argv[i], "--stdout-file") == 0 ||
+                    strcmp(argv[i], "--stderr-file") == 0) && i + 1 < argc) {
+            int stream = strcmp(argv[i], "--stdout-file") == 0 ? 0 : 1;
+            int fd = open(argv[++i], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            ok = fd >= 0;
+            if (ok) {
+                g_stream_fd[stream] = fd;
+                g_stream = true;
+            } else {
+                char msg[600];
+                snprintf(msg, sizeof(msg), "出力ファイルを開けません: %s", argv[i]);
+                log_error(msg);
+            }
+        } else if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+            g_parallel = atoi(argv[++i]);
+            ok = g_parallel > 0;
+            if (!ok) log_error("--parallel には1以上の数値を指定してください");
+        } else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) {
+            script_path = argv[++i];
+            ok = true;
+        } else if (strcmp(argv[i], "--stop-on-error") == 0) {
+            g_stop_on_error = true;
+            ok = true;
+        } else if (strcmp(argv[i], "--bundle") == 0) {
+            g_script_bundle = true;
+            ok = true;
+        } else if (strcmp(argv[i], "--stdin") == 0 && i + 1 < argc) {
+            stdin_path = argv[++i];
+            g_stdin_fd = strcmp(stdin_path, "-") == 0
+                             ? STDIN_FILENO : open(stdin_path, O_RDONLY | O_CLOEXEC);
+            ok = g_stdin_fd >= 0;
+            if (!ok) {
+                char msg[600];
+                snprintf(msg, sizeof(msg), "入力ファイルを開けません: %s", stdin_path);
+                log_error(msg);
+            }
+        } else if (strcmp(argv[i], "--upload") == 0 && i + 2 < argc) {
+            upload_local = argv[++i];
+            upload_remote = argv[++i];
+            ok = true;
+        } else if (strcmp(argv[i], "--upload-parallel") == 0 && i + 1 < argc) {
+            g_upload_parallel = atoi(argv[++i]);
+            ok = g_upload_parallel >= 1 && g_upload_parallel <= UPLOAD_MAX_PARALLEL;
+            if (!ok) {
+                char msg[128];
+                snprintf(msg, sizeof(msg), "--upload-parallel には1〜%dの数値を指定してください",
+                         UPLOAD_MAX_PARALLEL);
+                log_error(msg);
+            }
+        } else if (strcmp(argv[i], "--download") == 0 && i + 2 < argc) {
+            download_remote = argv[++i];
+            download_local = argv[++i];
+            ok = true;
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            download_resume = true;
+            ok = true;
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            daemon_mode = true;
+            ok = true;
+        } else if (strcmp(argv[i], "--use-daemon") == 0) {
+            g_use_daemon = true;
+            ok = true;
+        } else if (strcmp(argv[i], "--daemon-status") == 0) {
+            daemon_query = true;
+            ok = true;
+        } else {
+            char msg[256];
+            snprintf(msg, sizeof(msg), "不明なオプション: %s", argv[i]);
+            log_error(msg);
+            ok = false;
+        }
+        if (!ok) {
+            free(hosts);
+            return 1;
+        }
+    }
+
+    /* 常駐プロセスの状態表示（ヘッダーなし） */
+    if (daemon_query) {
+        free(hosts);
+        return daemon_status();
+    }
+
+    if (daemon_mode && (host_count > 0 || script_path)) {
+        log_error("--daemon は --hosts / --hosts-file / --script と同時に指定できません");
+        free(hosts);
+        return 1;
+    }
+
+    /* 標準入力の転送は、単一ホストで1つのコマンドを直接実行する場合のみ */
+    if (stdin_path && (host_count > 0 || script_path || daemon_mode)) {
+        log_error("--stdin は --hosts / --hosts-file / --script / --daemon と同時に指定できません");
+        free(hosts);
+        return 1;
+    }
+    if (stdin_path && g_use_daemon) {
+        log_warn("--stdin では常駐プロセスを使わずに直接実行します");
+        g_use_daemon = false;
+    }
+
+    /* ファイル転送は単一ホストへ直接行う */
+    if (upload_local && (host_count > 0 || script_path || daemon_mode || stdin_path)) {
+        log_error("--upload は --hosts / --hosts-file / --script / --daemon / --stdin と同時に指定できません");
+        free(hosts);
+        return 1;
+    }
+    if (download_remote &&
+        (host_count > 0 || script_path || daemon_mode || stdin_path || upload_local)) {
+        log_error("--download は --hosts / --hosts-file / --script / --daemon / --stdin / --upload と同時に指定できません");
+        free(hosts);
+        return 1;
+    }
+    if (download_resume && !download_remote) {
+        log_error("--resume は --download と組み合わせて指定してください");
+        free(hosts);
+        return 1;
+    }
+
+    script_t script = {0};
+    if (script_path && !script_load(&script, script_path)) {
+        free(hosts);
+        return 1;
+    }
+
+    /* まとめ実行（出力は完了後に振り分けるため、受信しだいの書き出しとは併用できない） */
+    bundle_plan_t plan = {0};
+    if (script.count > 0 && g_script_bundle) {
+        if (g_stream) {
+            log_error("--bundle は --stream / --stdout-file / --stderr-file と同時に指定できません");
+            script_free(&script);
+            free(hosts);
+            return 1;
+        }
+        if (!bundle_plan_build(&plan, &script)) {
+            script_free(&script);
+            free(hosts);
+            return 1;
+        }
+        if (g_use_daemon) {
+            log_warn("--bundle では常駐プロセスを使わずに直接実行します");
+            g_use_daemon = false;
+        }
+    }
+
     /* ヘッダー表示 */
     printf("\n");
     printf("========================================================================\n");
     printf("  WinRM Remote Batch Executor (C言語版)\n");
-    printf("  標準ライブラリのみ - NTLM認証\n");
+    printf("  外部ライブラリ不要 - NTLM認証\n");
     printf("========================================================================\n");
     printf("\n");
 
@@ -2893,79 +10193,107 @@ int main(int argc, char *argv[]) {
     log_success(msg);
     printf("\n");
 
-    snprintf(msg, sizeof(msg), "接続先: http://%s:%d/wsman", g_host, g_port);
+    if (host_count > 0) {
+        snprintf(msg, sizeof(msg), "接続先: %d ホスト", host_count);
+    } else {
+        snprintf(msg, sizeof(msg), "接続先: http://%s:%d/wsman", g_host, g_port);
+    }
     log_info(msg);
     snprintf(msg, sizeof(msg), "ユーザー: %s", g_user);
     log_info(msg);
 
-    /* バッチファイルパスの{ENV}を置換 */
-    str_replace(g_batch_path, "{ENV}", g_env_folder);
-    snprintf(msg, sizeof(msg), "バッチファイル実行: %s", g_batch_path);
-    log_info(msg);
-    printf("\n");
-
-    /* コマンド構築 */
-    char command[1024];
-    snprintf(command, sizeof(command), "cmd.exe /c \"%s\"", g_batch_path);
-
-    /* シェル作成 */
-    char shell_id[128];
-    if (!create_shell(shell_id, sizeof(shell_id))) {
-        log_error("処理を中断します");
-        return 1;
+    /* 常駐モード（シェルを保持してローカルソケットでジョブを受け付ける） */
+    if (daemon_mode) {
+        printf("\n");
+        return daemon_serve();
     }
-    printf("\n");
 
-    /* コマンド実行 */
-    char command_id[128];
-    if (!run_command(shell_id, command, command_id, sizeof(command_id))) {
-        delete_shell(shell_id);
-        log_error("処理を中断します");
-        return 1;
+    /* ファイル転送 */
+    if (upload_local) {
+        if (g_use_daemon) log_warn("--upload では常駐プロセスを使わずに直接実行します");
+        printf("\n");
+        return execute_upload(upload_local, upload_remote);
     }
-    printf("\n");
-
-    /* 出力取得 */
-    char stdout_buf[MAX_BUFFER_SIZE];
-    char stderr_buf[MAX_BUFFER_SIZE];
-    int exit_code = 0;
-
-    if (!get_command_output(shell_id, command_id,
-                            stdout_buf, sizeof(stdout_buf),
-                            stderr_buf, sizeof(stderr_buf),
-                            &exit_code)) {
-        delete_shell(shell_id);
-        log_error("処理を中断します");
-        return 1;
+    if (download_remote) {
+        if (g_use_daemon) log_warn("--download では常駐プロセスを使わずに直接実行します");
+        printf("\n");
+        return execute_download(download_remote, download_local, download_resume);
     }
-    printf("\n");
 
-    /* シェル削除 */
-    delete_shell(shell_id);
+    /* スクリプト実行（1つのシェルで順に実行） */
+    if (script.count > 0) {
+        snprintf(msg, sizeof(msg), "スクリプト実行: %s（%d コマンド%s%s）",
+                 strcmp(script_path, "-") == 0 ? "標準入力" : script_path, script.count,
+                 g_stop_on_error ? "、失敗時に中断" : "",
+                 plan.count > 0 ? "、まとめて実行" : "");
+        log_info(msg);
+        if (plan.count > 0) {
+            snprintf(msg, sizeof(msg), "まとめ実行: %d コマンドを %d 回のコマンド実行にまとめます",
+                     script.count, plan.count);
+            log_info(msg);
+        }
+        printf("\n");
+
+        /* --bundle 時は、まとめたコマンドラインを1つずつ実行する */
+        const char *const *commands = (const char *const *)script.lines;
+        int ncommands = script.count;
+        if (plan.count > 0) {
+            commands = (const char *const *)plan.bundles;
+            ncommands = plan.count;
+            g_bundle = &plan;
+        }
+        int rc;
+        if (host_count > 0) {
+            rc = fanout_execute(hosts, host_count, commands, ncommands);
+        } else {
+            /* 常駐プロセス経由（起動していなければ直接実行） */
+            rc = g_use_daemon ? daemon_submit(commands, ncommands) : DAEMON_UNAVAILABLE;
+            if (rc == DAEMON_UNAVAILABLE) {
+                if (g_use_daemon) log_warn("常駐プロセスに接続できないため直接実行します");
+                rc = execute_script(&script, plan.count > 0 ? &plan : NULL);
+            }
+            rc = rc < 0 ? 1 : rc;
+        }
+        g_bundle = NULL;
+        bundle_plan_free(&plan);
+        script_free(&script);
+        free(hosts);
+        return rc;
+    }
 
-    /* 結果表示 */
+    /* バッチファイルパスの{ENV}を置換 */
+    str_replace(g_batch_path, "{ENV}", g_env_folder);
+    snprintf(msg, sizeof(msg), "バッチファイル実行: %s", g_batch_path);
+    log_info(msg);
+    if (stdin_path) {
+        snprintf(msg, sizeof(msg), "標準入力の転送: %s",
+                 strcmp(stdin_path, "-") == 0 ? "標準入力" : stdin_path);
+        log_info(msg);
+    }
     printf("\n");
-    printf("============================================================\n");
-    printf("実行結果\n");
-    printf("============================================================\n");
 
-    if (strlen(stdout_buf) > 0) {
-        printf("\n[標準出力]\n%s", stdout_buf);
-    }
+    /* コマンド構築 */
+    char command[MAX_COMMAND_SIZE];
+    snprintf(command, sizeof(command), "cmd.exe /c \"%s\"", g_batch_path);
 
-    if (strlen(stderr_buf) > 0) {
-        printf("\n[標準エラー出力]\n%s", stderr_buf);
+    /* ファンアウト実行（複数ホスト指定時） */
+    if (host_count > 0) {
+        const char *commands[] = { command };
+        int rc = fanout_execute(hosts, host_count, commands, 1);
+        free(hosts);
+        return rc;
     }
 
-    printf("\n終了コード: %d\n", exit_code);
-    printf("============================================================\n");
-
-    if (exit_code == 0) {
-        log_success("完了");
-    } else {
-        snprintf(msg, sizeof(msg), "コマンドが失敗しました (終了コード: %d)", exit_code);
-        log_error(msg);
+    /* 常駐プロセス経由（起動していなければ直接実行） */
+    if (g_use_daemon) {
+        const char *commands[] = { command };
+        int rc = daemon_submit(commands, 1);
+        if (rc != DAEMON_UNAVAILABLE) {
+            return rc < 0 ? 1 : rc;
+        }
+        log_warn("常駐プロセスに接続できないため直接実行します");
     }
 
-    return exit_code;
+    int exit_code = execute_batch(command);
+    return exit_code < 0 ? 1 : exit_code;
 }